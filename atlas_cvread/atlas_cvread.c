@@ -0,0 +1,177 @@
+/*
+	Atlas Project - Current-Value Table Reader
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Maps the DAQ's shared current-value table read-only, and copies slots
+	out of it by their seqlock: a copy is only kept if the slot's seq was
+	even, and unchanged, on both sides of it. A reader never writes to the
+	segment, so it can't hold up or upset the daemon.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "atlas_cvread.h"
+
+// Wall clock, in milliseconds (as the table's timestamps)
+long long atlas_cvr_now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * atlas_cvr_open
+ *	Maps a current-value table, read-only.
+ *	Args:
+ *		cvr*			Reader, filled in
+ *		name			shm_open() name of the table; NULL for the default
+ *	Returns:
+ *		0 on success, -1 on failure (errno set; EPROTO if the segment isn't
+ *		a table this reader understands)
+ */
+int atlas_cvr_open(ATLAS_CVR* cvr, const char* name) {
+	const ATLAS_CVSHM_HDR* hdr;
+	struct stat st;
+	int err;
+
+	memset(cvr, 0, sizeof(ATLAS_CVR));
+	cvr->fd = -1;
+
+	if((cvr->fd = shm_open(name ? name : ATLAS_CVSHM_NAME, O_RDONLY, 0)) < 0) return -1;
+	if(fstat(cvr->fd, &st)) {
+		err = errno;
+		goto fail;
+	}
+	err = EPROTO;
+	if((size_t)st.st_size < sizeof(ATLAS_CVSHM_HDR)) goto fail;
+
+	cvr->size = st.st_size;
+	if((cvr->base = mmap(NULL, cvr->size, PROT_READ, MAP_SHARED, cvr->fd, 0)) == MAP_FAILED) {
+		err = errno;
+		cvr->base = NULL;
+		goto fail;
+	}
+
+	// the daemon sets the magic number last, once the rest of the header is filled in
+	hdr = cvr->base;
+	if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != ATLAS_CVSHM_MAGIC || hdr->version != ATLAS_CVSHM_VERSION) goto fail;
+	if(hdr->hdr_size != sizeof(ATLAS_CVSHM_HDR) || hdr->slot_size != sizeof(ATLAS_CVSHM_SLOT)) goto fail;
+	if(!hdr->index_size || (hdr->index_size & (hdr->index_size - 1))) goto fail;
+	if(hdr->index_off + sizeof(int32_t) * hdr->index_size > cvr->size ||
+	   hdr->slots_off + sizeof(ATLAS_CVSHM_SLOT) * (uint64_t)hdr->slots > cvr->size) goto fail;
+
+	cvr->hdr = hdr;
+	cvr->index = (const int32_t*)((const char*)cvr->base + hdr->index_off);
+	cvr->slots = (const ATLAS_CVSHM_SLOT*)((const char*)cvr->base + hdr->slots_off);
+
+	return 0;
+
+fail:
+	atlas_cvr_close(cvr);
+	errno = err;
+	return -1;
+}
+
+// Unmaps a table
+void atlas_cvr_close(ATLAS_CVR* cvr) {
+
+	if(cvr->base) munmap(cvr->base, cvr->size);
+	if(cvr->fd >= 0) close(cvr->fd);
+	memset(cvr, 0, sizeof(ATLAS_CVR));
+	cvr->fd = -1;
+}
+
+/*
+ * atlas_cvr_alive
+ *	Returns:
+ *		1 if the daemon is running, and has stamped the table within the
+ *		last max_age_ms milliseconds; 0 if not
+ */
+int atlas_cvr_alive(ATLAS_CVR* cvr, long long max_age_ms) {
+
+	if(__atomic_load_n(&cvr->hdr->state, __ATOMIC_ACQUIRE) != ATLAS_CVSHM_RUNNING) return 0;
+	return atlas_cvr_now() - __atomic_load_n(&cvr->hdr->alive_ms, __ATOMIC_RELAXED) <= max_age_ms;
+}
+
+// Slots assigned to tags (atlas_cvr_slot() reads slots 0 to this, less one)
+int atlas_cvr_count(ATLAS_CVR* cvr) {
+	uint32_t used = __atomic_load_n(&cvr->hdr->used, __ATOMIC_ACQUIRE);
+
+	return used > cvr->hdr->slots ? (int)cvr->hdr->slots : (int)used;
+}
+
+// Copies a slot by its seqlock; retried while a write is under way, up to ATLAS_CVR_RETRIES times
+static int atlas_cvr_copy(const ATLAS_CVSHM_SLOT* cv, ATLAS_CVR_VALUE* out) {
+	ATLAS_CVSHM_SLOT copy;
+	uint32_t seq;
+
+	for(int i = 0; i < ATLAS_CVR_RETRIES; i++) {
+		seq = __atomic_load_n(&cv->seq, __ATOMIC_ACQUIRE);
+		if(!(seq & 1)) {
+			memcpy(&copy, cv, sizeof(ATLAS_CVSHM_SLOT));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&cv->seq, __ATOMIC_RELAXED) == seq) {
+				out->tag_id = copy.tag_id;
+				out->target_id = copy.target_id;
+				out->dtype = copy.dtype;
+				out->quality = copy.quality;
+				out->v_int = copy.v_int;
+				out->v_float = copy.v_float;
+				out->tread_ms = copy.tread_ms;
+				out->tchange_ms = copy.tchange_ms;
+				memcpy(out->v_str, copy.v_str, sizeof(out->v_str));
+				out->v_str[sizeof(out->v_str) - 1] = 0;
+				return ATLAS_CVR_OK;
+			}
+		}
+		sched_yield();
+	}
+
+	return ATLAS_CVR_BUSY;
+}
+
+/*
+ * atlas_cvr_slot
+ *	Copies a slot's value, consistently.
+ *	Returns:
+ *		ATLAS_CVR_OK, ATLAS_CVR_NOTFOUND if there's no such slot, or
+ *		ATLAS_CVR_BUSY if it was being written for every retry
+ */
+int atlas_cvr_slot(ATLAS_CVR* cvr, int slot, ATLAS_CVR_VALUE* out) {
+
+	if(slot < 0 || slot >= atlas_cvr_count(cvr)) return ATLAS_CVR_NOTFOUND;
+	return atlas_cvr_copy(&cvr->slots[slot], out);
+}
+
+/*
+ * atlas_cvr_get
+ *	Copies a tag's value, looked up by its id.
+ *	Returns:
+ *		ATLAS_CVR_OK, ATLAS_CVR_NOTFOUND if the tag isn't in the table, or
+ *		ATLAS_CVR_BUSY if its slot was being written for every retry
+ */
+int atlas_cvr_get(ATLAS_CVR* cvr, int tag_id, ATLAS_CVR_VALUE* out) {
+	uint32_t mask = cvr->hdr->index_size - 1;
+	int32_t slot;
+
+	// a slot is filled in before its index entry is set, and never moves
+	for(uint32_t h = ATLAS_CVSHM_HASH(tag_id) & mask, n = 0; n <= mask; h = (h + 1) & mask, n++) {
+		slot = __atomic_load_n(&cvr->index[h], __ATOMIC_ACQUIRE);
+		if(slot < 0) break;
+		if(slot < (int32_t)cvr->hdr->slots && cvr->slots[slot].tag_id == tag_id) return atlas_cvr_copy(&cvr->slots[slot], out);
+	}
+
+	return ATLAS_CVR_NOTFOUND;
+}
@@ -0,0 +1,57 @@
+/*
+	Atlas Project - Current-Value Table Reader
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Reads tags' current values from the DAQ's shared current-value table
+	(see atlas_daq/atlas_cvshm.h), without the database. Link with
+	libatlas_cvread.a and -lrt.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#ifndef ATLAS_CVREAD_H
+#define ATLAS_CVREAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "atlas_cvshm.h"
+
+#define ATLAS_CVR_RETRIES	1000	// seqlock retries before a slot is reported busy
+
+// Return values of atlas_cvr_get() & atlas_cvr_slot()
+#define ATLAS_CVR_OK		0
+#define ATLAS_CVR_NOTFOUND	-1	// no such tag (or slot)
+#define ATLAS_CVR_BUSY		-2	// the slot was being written for every retry
+
+typedef struct {
+	int fd;
+	void* base;			// mapping of the segment
+	size_t size;
+	const ATLAS_CVSHM_HDR* hdr;
+	const int32_t* index;
+	const ATLAS_CVSHM_SLOT* slots;
+} ATLAS_CVR;
+
+typedef struct {
+	int tag_id;
+	int target_id;
+	int dtype;			// ATLAS_CVSHM_INT, _FLOAT, _STR or _BOOL
+	int quality;			// ATLAS_CVSHM_GOOD, _BAD or _NONE
+	int v_int;			// value: int & bool
+	double v_float;			// value: float
+	long long tread_ms;		// time of the last read (wall clock, in milliseconds)
+	long long tchange_ms;		// time the value last changed
+	char v_str[256];		// value: string
+} ATLAS_CVR_VALUE;
+
+// atlas_cvread.c
+int atlas_cvr_open(ATLAS_CVR* cvr, const char* name);
+void atlas_cvr_close(ATLAS_CVR* cvr);
+int atlas_cvr_alive(ATLAS_CVR* cvr, long long max_age_ms);
+int atlas_cvr_count(ATLAS_CVR* cvr);
+int atlas_cvr_get(ATLAS_CVR* cvr, int tag_id, ATLAS_CVR_VALUE* out);
+int atlas_cvr_slot(ATLAS_CVR* cvr, int slot, ATLAS_CVR_VALUE* out);
+long long atlas_cvr_now();
+
+#endif
@@ -0,0 +1,111 @@
+/*
+	Atlas Project - Current-Value Table Reader
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	atlas_cvread - dumps the DAQ's shared current-value table
+
+	usage: atlas_cvread [-s name] [-i interval_ms] [tag_id ...]
+
+		-s name		shm_open() name of the table (default /atlas_cvt)
+		-i ms		dump again every ms milliseconds, until interrupted
+		tag_id		only dump these tags (default: every tag)
+
+	Each line is a tag's id, target id, type, quality, value, and how long
+	ago (in ms) it was last read & last changed.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "atlas_cvread.h"
+
+static const char* cvdump_dtype[] = { "?", "int", "float", "str", "bool" };
+static const char* cvdump_quality[] = { "none", "good", "bad" };
+
+static void cvdump_usage(char* argv0) {
+
+	fprintf(stderr,"usage: %s [-s name] [-i interval_ms] [tag_id ...]\n",argv0);
+	exit(1);
+}
+
+// Prints one tag's value
+static void cvdump_value(ATLAS_CVR_VALUE* val, long long now) {
+
+	printf("%8i %6i %-5s %-4s ",val->tag_id,val->target_id,
+	       cvdump_dtype[val->dtype >= 0 && val->dtype <= ATLAS_CVSHM_BOOL ? val->dtype : 0],
+	       cvdump_quality[val->quality >= 0 && val->quality <= ATLAS_CVSHM_BAD ? val->quality : 0]);
+
+	if(val->quality == ATLAS_CVSHM_NONE) printf("%-24s %10s %10s\n","-","-","-");
+	else if(val->dtype == ATLAS_CVSHM_FLOAT) printf("%-24g %10lli %10lli\n",val->v_float,now - val->tread_ms,now - val->tchange_ms);
+	else if(val->dtype == ATLAS_CVSHM_STR) printf("%-24s %10lli %10lli\n",val->v_str,now - val->tread_ms,now - val->tchange_ms);
+	else printf("%-24i %10lli %10lli\n",val->v_int,now - val->tread_ms,now - val->tchange_ms);
+}
+
+// Prints the table's header, then the tags asked for (or all of them)
+static void cvdump(ATLAS_CVR* cvr, int* tag_ids, int tag_count) {
+	ATLAS_CVR_VALUE val;
+	long long now = atlas_cvr_now();
+	int count = atlas_cvr_count(cvr);
+	int rv;
+
+	printf("# pid %i, %s, stamped %lli ms ago; %i/%u tags\n",cvr->hdr->pid,
+	       cvr->hdr->state == ATLAS_CVSHM_RUNNING ? "running" : "stopped",
+	       now - cvr->hdr->alive_ms, count, cvr->hdr->slots);
+	printf("# %6s %6s %-5s %-4s %-24s %10s %10s\n","tag","target","type","qual","value","read_ms","change_ms");
+
+	if(!tag_count) {
+		for(int i = 0; i < count; i++) {
+			if(atlas_cvr_slot(cvr, i, &val) == ATLAS_CVR_OK) cvdump_value(&val, now);
+			else printf("%8s slot %i busy\n","-",i);
+		}
+		return;
+	}
+
+	for(int i = 0; i < tag_count; i++) {
+		if((rv = atlas_cvr_get(cvr, tag_ids[i], &val)) == ATLAS_CVR_OK) cvdump_value(&val, now);
+		else printf("%8i %s\n",tag_ids[i],rv == ATLAS_CVR_BUSY ? "busy" : "not found");
+	}
+}
+
+int main(int argc, char** argv) {
+	ATLAS_CVR cvr;
+	char* name = NULL;
+	int interval = 0;
+	int* tag_ids;
+	int tag_count = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:i:h")) != -1) {
+		switch(opt) {
+			case 's': name = optarg; break;
+			case 'i': interval = atoi(optarg); break;
+			default: cvdump_usage(argv[0]);
+		}
+	}
+
+	if((tag_ids = malloc(sizeof(int) * (argc - optind + 1))) == NULL) return 1;
+	for(int i = optind; i < argc; i++) tag_ids[tag_count++] = atoi(argv[i]);
+
+	if(atlas_cvr_open(&cvr, name)) {
+		fprintf(stderr,"%s: Unable to open current-value table %s: %s\n",argv[0],name ? name : ATLAS_CVSHM_NAME,
+			errno == EPROTO ? "not a current-value table (or a different version)" : strerror(errno));
+		return 1;
+	}
+
+	for(;;) {
+		cvdump(&cvr, tag_ids, tag_count);
+		fflush(stdout);
+		if(interval <= 0) break;
+		usleep(interval * 1000);
+		printf("\n");
+	}
+
+	atlas_cvr_close(&cvr);
+	free(tag_ids);
+	return 0;
+}
@@ -55,52 +55,6 @@ ATLAS_ALARM* atlas_alarm_add(int* newdex) {
 	return atx_aldex[new_index];
 }
 
-int atlas_alarm_read(ATLAS_TARGET* cur_target, ATLAS_ALARM* cur_alarm) {
-	char *daq_val;
-	int daq_bool;
-
-	ATLAS_TAG* curtag = &cur_alarm->tag;
-
-	// acquire using appropriate target driver
-	switch(cur_target->target_type) {
-		case TARGET_LGX:
-		case TARGET_SLC:
-		case TARGET_PLC:
-			daq_val = eip_readtag(curtag->tagname, cur_target, NULL);
-			break;
-		case TARGET_MC:
-			if(curtag->dtypei == DTYPE_RET_BOOL) daq_bool = mc_readbit(curtag->tagname, cur_target);
-			else daq_val = mc_readword(curtag->tagname, cur_target);
-
-			break;
-	}
-
-	// detect errors from protocol tag/register reads
-	if(daq_val == -1) {
-		zlog_debug("* atlas_readtag(): Driver returned -1 indiciating read failure!\n");
-		return -1;
-	} else {
-		if(curtag->dtypei == DTYPE_RET_INT) {
-			curtag->v_int = p2int(daq_val);
-			zlog_debug("\t>> v_int = %i\n",curtag->v_int);
-		} else if(curtag->dtypei == DTYPE_RET_FLOAT) {
-			curtag->v_float = p2float(daq_val);
-			zlog_debug("\t>> v_float = %f\n",curtag->v_float);
-		} else if(curtag->dtypei == DTYPE_RET_BOOL) {
-			curtag->v_int = daq_bool;
-			zlog_debug("\t>> v_int (BOOL) = %i\n",curtag->v_int);
-		} else {
-			strcpy(curtag->v_str, daq_val);
-			zlog_debug("\t>> v_str = \"%s\"\n",curtag->v_str);
-		}
-	}
-
-	if(eip_readerr && cur_target->target_type != TARGET_MC) {
-		zlog_debug("\t>>> EIP read error detected!\n");
-		return -1;
-	}
-}
-
 /*
 typedef struct {
 	int id;				// id number from database
@@ -141,35 +95,26 @@ mysql> describe alarm_list;
 
 */
 
-int get_target_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
+/*
+ * atlas_load_alarms
+ *	Retrieves the alarm list for a target from the database.
+ *	Args:
+ *		cur_db*			Database connection
+ *		cur_target*		Target to retrieve alarms for
+ *		alarms_out**		Set to newly allocated array of alarms (caller must free)
+ *	Returns:
+ *		Number of alarms in array, or -1 on failure
+ */
+int atlas_load_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_ALARM** alarms_out) {
 	MYSQL_RES* resultx;
 	MYSQL_ROW  rowx;
 	char qq[512];
-	char datasetter[280];
-	char datasetsu[280];
-	char escaper[300];
-	char dtx[8];
-	time_t tstampx;
-	int tdelta;
-	ATLAS_ALARM cur_alarm;
-
-	// break out the tag data seperately for easy access
-	ATLAS_TAG* curtag = &cur_alarm.tag;
-
-	// Ensure mySQL connection is OK
-	if(cur_db->status != STATUS_READY) {
-		zlog_error("get_target_alarms: mySQL connection not established! Cannot get target list.\n");
-		return -1;
-	}
+	ATLAS_ALARM* alarms;
+	ATLAS_ALARM* cur_alarm;
+	ATLAS_TAG* curtag;
+	int alarm_count = 0;
 
-	tstampx = time(NULL);
-	tdelta = tstampx - cur_target->last_update;
-	if(!cur_target->last_update) {
-		tdelta = -1;
-		zlog_debug("get_target_alarms: Performing initial polling round for target [%s]...\n",cur_target->sname);
-	} else {
-		zlog_debug("get_target_alarms: Begin new target update round for [%s]. Last update = %d [%i seconds ago].\n",cur_target->sname,cur_target->last_update,tdelta);
-	}
+	(*alarms_out) = NULL;
 
 	// Query alarm list for cur_target...
 	sprintf(qq,"SELECT * FROM %s WHERE target_id = %i",cur_db->tables.alarm_list, cur_target->id);
@@ -178,13 +123,28 @@ int get_target_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
 		cur_db->status = STATUS_NOTREADY;
 		cur_db->last_error = mysql_errno(cur_db->conx);
 		// log the error
-		zlog_error("get_target_alarms: Query failed! %i - %s [%s]\n",cur_db->last_error,mysql_error(cur_db->conx),qq);
+		zlog_error("atlas_load_alarms: Query failed! %i - %s [%s]\n",cur_db->last_error,mysql_error(cur_db->conx),qq);
 		return -1;
 	}
 	resultx = mysql_store_result(cur_db->conx);
+	if(!resultx) {
+		zlog_error("atlas_load_alarms: Failed to store result! [%s]\n",mysql_error(cur_db->conx));
+		return -1;
+	}
+
+	if((alarms = malloc(sizeof(ATLAS_ALARM) * (mysql_num_rows(resultx) + 1))) == NULL) {
+		zlog_error("atlas_load_alarms(): malloc() failed when creating alarm list!\n");
+		mysql_free_result(resultx);
+		return -1;
+	}
 
-	// enumerate the tags...
+	// enumerate the alarms...
 	while((rowx = mysql_fetch_row(resultx))) {
+		cur_alarm = &alarms[alarm_count++];
+		memset(cur_alarm,0,sizeof(ATLAS_ALARM));
+
+		// break out the tag data seperately for easy access
+		curtag = &cur_alarm->tag;
 
 		// populate tag info from database...
 		curtag->id = atoi(rowx[0]);
@@ -197,45 +157,42 @@ int get_target_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
 		if(!strcmp("int",rowx[8])) curtag->dtypei = DTYPE_RET_INT;
 		else curtag->dtypei = DTYPE_RET_BOOL;
 
-		// now, retrieve the tag's value from the target device...
-		zlog_debug("get_target_alarms: Retrieving tag [%s] from target device [%s]...\n",curtag->tagname,cur_target->sname);
-
-		// check to see if it's disabled
-		if(cur_target->status == STATUS_DISABLED) {
-			zlog_debug("get_target_alarms: Target disabled. Skipping.\n");
-			set_target_msg(cur_target,"Disabled");
-			continue;
-		}
-
-		// read tag using driver
-		atlas_alarm_read(cur_target, &cur_alarm);
-
-		// get current time for timestamp
-		tstampx = time(NULL);
-
-		// add new entry to history table
-		zlog_debug(">> Writing to %s table...\n",cur_db->tables.alarm_history);
-		sprintf(qq,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate) "
-					 "VALUES(%i,    %i,      \'%s\',%s                 ,%d) ",
-					    cur_db->tables.alarm_history,
-                        curtag->id, cur_target->id, dtx, atlas_gen_sqlargs(cur_db, curtag, datasetsu, GENARG_INSERT), tstampx);
-                if(mysql_query(cur_db->conx,qq)) {
-			// change db status to NOTREADY
-			cur_db->status = STATUS_NOTREADY;
-			cur_db->last_error = mysql_errno(cur_db->conx);
-			// log the error msg
-			zlog_error("get_target_alarms: Query failed! %i - %s [%s]\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),qq);
-			return -1;
-		}
-
-		zlog_debug("get_target_alarms: Update round for tag [%s -> %s] is complete. (timestamp = %d)\n\n",cur_target->sname,curtag->tagname,tstampx);
+		curtag->read_status = -1;
+		curtag->cv_slot = -1;
 
+		atlas_compile_tag(cur_target, curtag);
 	}
 
 	mysql_free_result(resultx);
-	tstampx = time(NULL);
-	zlog_debug("get_target_alarms: Update round for target [%s] has completed successfully! (timestamp = %d)\n\n",cur_target->sname,tstampx);
-	cur_target->last_update = (double)tstampx;
 
-	return 0;
+	(*alarms_out) = alarms;
+	return alarm_count;
+}
+
+/*
+ * atlas_store_alarms
+ *	Queues the values of a target's alarm tags, read with its tags in the
+ *	acquisition round (see atlas_poll_group), for the alarm history table:
+ *	the same way atlas_store_tags() queues tag values. Alarms whose read
+ *	failed are skipped.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_store_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG* tags, int tag_count) {
+	ATLAS_SAMPLE sample;
+	time_t tstampx = time(NULL);
+	int rv = 0;
+
+	for(int i = 0; i < tag_count; i++) {
+		// don't store values from failed reads
+		if(tags[i].read_status) continue;
+
+		atlas_dbw_sample(&sample, cur_target, &tags[i], tstampx);
+		sample.flags = SAMPLE_ALARM;
+		if(atlas_store_sample(cur_db, &sample)) rv = -1;
+	}
+
+	zlog_debug("atlas_store_alarms: Queued alarms for target [%s]. (timestamp = %li)\n",cur_target->sname,(long)tstampx);
+
+	return rv;
 }
@@ -0,0 +1,208 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	History Compression
+
+	Each tag's compression is set in the taglist, by the optional columns
+	comp_mode ('none', 'deadband' or 'swingdoor'), comp_dev (deviation, in
+	the tag's units) and comp_max (heartbeat, in seconds). Every value read
+	still goes to the realtime table; only the values needed to draw the
+	signal back within comp_dev go to history:
+
+	deadband	A value is written when it moves more than comp_dev from
+			the last one written. The value before it is written too,
+			so a step isn't drawn as a ramp.
+	swingdoor	A value is held back as long as a straight line from the
+			last value written to it passes within comp_dev of every
+			value in between. When one can't, the value held back is
+			written, and a new line starts from it.
+
+	With comp_max set, a value is written at least every comp_max seconds.
+	Strings and bools are written when they change, whatever the mode.
+	A failed read ends the line: the value held back is written, and the
+	next value read starts a new one.
+
+	A tag's state is only used by the thread storing its target's values.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "atlas_daq.h"
+
+// Compression mode from the taglist's comp_mode column; -1 if unknown
+int atlas_comp_mode(char* mode) {
+
+	if(!mode || !mode[0] || !strcmp(mode,"none")) return COMP_NONE;
+	if(!strcmp(mode,"deadband")) return COMP_DEADBAND;
+	if(!strcmp(mode,"swingdoor")) return COMP_SWINGDOOR;
+	if(mode[0] >= '0' && mode[0] <= '9' && atoi(mode) <= COMP_SWINGDOOR) return atoi(mode);
+
+	return -1;
+}
+
+// Tag's value, as compared by the compressor (strings: a hash of the text)
+static double atlas_comp_value(ATLAS_TAG* curtag) {
+	unsigned long long hash = 14695981039346656037ULL;
+
+	if(curtag->dtypei == DTYPE_RET_INT || curtag->dtypei == DTYPE_RET_BOOL) return curtag->v_int;
+	if(curtag->dtypei == DTYPE_RET_FLOAT) return curtag->v_float;
+
+	for(char* c = curtag->v_str; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	return (double)(hash >> 11);
+}
+
+// Marks a value as written to history, starting a new line from it
+static void atlas_comp_archive(ATLAS_COMP* comp, long long t, double v) {
+
+	comp->started = 1;
+	comp->arch_t = t;
+	comp->arch_v = v;
+	comp->held = 0;
+	comp->slope_hi = HUGE_VAL;
+	comp->slope_lo = -HUGE_VAL;
+	comp->out++;
+}
+
+// Fills in a history sample for the value held back, and starts a new line from it
+static void atlas_comp_release(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, ATLAS_SAMPLE* held) {
+	ATLAS_COMP* comp = &curtag->comp;
+
+	held->tag_id = curtag->id;
+	held->target_id = cur_target->id;
+	held->dtypei = curtag->dtypei;
+	held->v_int = (int)comp->held_v;
+	held->v_float = (float)comp->held_v;
+	held->v_str[0] = 0;
+	held->tstamp = comp->held_t / 1000;
+	held->queued = atlas_evloop_now();
+	held->flags = SAMPLE_HISTORY;
+
+	atlas_comp_archive(comp, comp->held_t, comp->held_v);
+}
+
+// Narrows the door to the slopes from the last value written that pass within dev of (t,v)
+static void atlas_comp_door(ATLAS_COMP* comp, long long t, double v) {
+	long long dt = t - comp->arch_t;
+	double hi, lo;
+
+	if(dt < 1) dt = 1;
+	hi = (v + comp->dev - comp->arch_v) / dt;
+	lo = (v - comp->dev - comp->arch_v) / dt;
+	if(hi < comp->slope_hi) comp->slope_hi = hi;
+	if(lo > comp->slope_lo) comp->slope_lo = lo;
+}
+
+/*
+ * atlas_comp_tag
+ *	Runs a tag's value, just read, through its history compression.
+ *	Args:
+ *		cur_target*		Target the tag belongs to
+ *		curtag*			Tag, with its new value
+ *		now_ms			Time of the read (wall clock, in milliseconds)
+ *		held*			Set to a history sample (flags = SAMPLE_HISTORY) if
+ *					a value held back must be written first; flags = 0 if not
+ *	Returns:
+ *		1 if the new value is to be written to history, 0 if not
+ */
+int atlas_comp_tag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, long long now_ms, ATLAS_SAMPLE* held) {
+	ATLAS_COMP* comp = &curtag->comp;
+	unsigned long long out = comp->out;
+	double v = atlas_comp_value(curtag);
+	int numeric = (curtag->dtypei == DTYPE_RET_INT || curtag->dtypei == DTYPE_RET_FLOAT);
+	long long dt;
+	double slope;
+	int store = 0;
+
+	held->flags = 0;
+	comp->in++;
+
+	if(comp->mode == COMP_NONE || !comp->started) {
+		store = 1;
+	} else if(!numeric) {
+		store = (v != comp->arch_v);
+	} else if(comp->mode == COMP_DEADBAND) {
+		store = (fabs(v - comp->arch_v) > comp->dev);
+		if(store && comp->held) atlas_comp_release(cur_target, curtag, held);
+	} else {
+		// the line to this value must pass within dev of those held back since the last written
+		dt = now_ms - comp->arch_t;
+		slope = (v - comp->arch_v) / (dt < 1 ? 1 : dt);
+		if(comp->held && (slope > comp->slope_hi || slope < comp->slope_lo)) {
+			atlas_comp_release(cur_target, curtag, held);
+		}
+		atlas_comp_door(comp, now_ms, v);
+	}
+
+	// heartbeat
+	if(!store && comp->max_ms > 0 && now_ms - comp->arch_t >= comp->max_ms) store = 1;
+
+	if(store) {
+		atlas_comp_archive(comp, now_ms, v);
+	} else if(numeric) {
+		comp->held = 1;
+		comp->held_t = now_ms;
+		comp->held_v = v;
+	}
+
+	cur_target->comp_in++;
+	cur_target->comp_out += comp->out - out;
+
+	return store;
+}
+
+/*
+ * atlas_comp_end
+ *	Ends a tag's line, when its read failed (or at shutdown): the next
+ *	value read starts a new one.
+ *	Returns:
+ *		1 if held was set to a value held back, to be written to history; 0 if not
+ */
+int atlas_comp_end(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, ATLAS_SAMPLE* held) {
+	ATLAS_COMP* comp = &curtag->comp;
+	int rv = 0;
+
+	held->flags = 0;
+	if(comp->started && comp->held) {
+		atlas_comp_release(cur_target, curtag, held);
+		cur_target->comp_out++;
+		rv = 1;
+	}
+	comp->started = 0;
+
+	return rv;
+}
+
+/*
+ * atlas_comp_carry
+ *	Carries compression state over from a target's old tag list to a newly
+ *	loaded one, for tags which are still in it. Counters are always kept;
+ *	the line is only kept if the tag's type & compression are unchanged.
+ */
+void atlas_comp_carry(ATLAS_TAG* old_tags, int old_count, ATLAS_TAG* tags, int tag_count) {
+	ATLAS_COMP comp;
+	int j = 0;
+	int k;
+
+	if(!old_count) return;
+
+	for(int i = 0; i < tag_count; i++) {
+		// both lists are usually in id order, so start looking after the last match
+		for(k = 0; k < old_count && old_tags[j].id != tags[i].id; k++) j = (j + 1) % old_count;
+		if(k == old_count) continue;
+
+		comp = old_tags[j].comp;
+		if(old_tags[j].dtypei == tags[i].dtypei && comp.mode == tags[i].comp.mode &&
+		   comp.dev == tags[i].comp.dev && comp.max_ms == tags[i].comp.max_ms) {
+			tags[i].comp = comp;
+		} else {
+			tags[i].comp.in = comp.in;
+			tags[i].comp.out = comp.out;
+		}
+	}
+}
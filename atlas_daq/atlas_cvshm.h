@@ -0,0 +1,95 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Shared Current-Value Table - Layout
+
+	The daemon's current-value table (atlas_cvt.c) lives in a POSIX shared
+	memory segment (/dev/shm/atlas_cvt by default, --cvt-shm), so local
+	programs can read every tag's current value without the database. This
+	header is the whole contract between the daemon and its readers (see
+	atlas_cvread/), and is kept free of the daemon's own headers.
+
+	The segment is laid out as:
+
+		ATLAS_CVSHM_HDR			at 0
+		int32_t index[index_size]	at hdr.index_off
+		ATLAS_CVSHM_SLOT slots[slots]	at hdr.slots_off
+
+	The index maps tag ids to slots by open addressing: start at
+	ATLAS_CVSHM_HASH(tag_id) & (index_size - 1) and step by one until the
+	slot's tag_id matches, or the entry is -1 (no such tag). Slots are
+	assigned once and never move; hdr.used counts them.
+
+	Each slot is written by one daemon thread at a time, as a seqlock: seq
+	is odd while the slot is being written. A reader copies the slot between
+	two reads of seq, and retries if seq was odd or moved. Readers never
+	write to the segment, and never hold up the daemon.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#ifndef ATLAS_CVSHM_H
+#define ATLAS_CVSHM_H
+
+#include <stdint.h>
+
+#define ATLAS_CVSHM_NAME	"/atlas_cvt"	// default shm_open() name (/dev/shm/atlas_cvt)
+#define ATLAS_CVSHM_MAGIC	0x4d485643	// "CVHM"
+#define ATLAS_CVSHM_VERSION	1
+
+#define ATLAS_CVSHM_HASH(tag_id)	((uint32_t)(tag_id) * 2654435761u)
+
+// ATLAS_CVSHM_HDR.state
+#define ATLAS_CVSHM_RUNNING	1	// daemon is running
+#define ATLAS_CVSHM_STOPPED	2	// daemon has stopped; values are the last it had
+
+// ATLAS_CVSHM_SLOT.dtype (same as the daemon's DTYPE_RET_*)
+#define ATLAS_CVSHM_INT		1
+#define ATLAS_CVSHM_FLOAT	2
+#define ATLAS_CVSHM_STR		3
+#define ATLAS_CVSHM_BOOL	4
+
+// ATLAS_CVSHM_SLOT.quality
+#define ATLAS_CVSHM_NONE	0	// not read yet
+#define ATLAS_CVSHM_GOOD	1	// last read succeeded
+#define ATLAS_CVSHM_BAD		2	// last read failed; the value is the last good one
+
+typedef struct {
+	uint32_t magic;			// ATLAS_CVSHM_MAGIC
+	uint32_t version;		// ATLAS_CVSHM_VERSION
+	uint32_t hdr_size;		// sizeof(ATLAS_CVSHM_HDR)
+	uint32_t slot_size;		// sizeof(ATLAS_CVSHM_SLOT)
+	uint32_t slots;			// slots in the table
+	uint32_t index_size;		// entries in the index (a power of 2)
+	uint32_t used;			// slots assigned
+	uint32_t state;			// ATLAS_CVSHM_RUNNING or ATLAS_CVSHM_STOPPED
+	int32_t pid;			// daemon's process id
+	uint32_t reserved;
+	int64_t started_ms;		// time the segment was created (wall clock, in milliseconds)
+	int64_t alive_ms;		// updated by the daemon every second or so, while it runs
+	uint64_t index_off;		// offset of the index, in bytes
+	uint64_t slots_off;		// offset of the slots, in bytes
+	char pad[56];
+} ATLAS_CVSHM_HDR;
+
+typedef struct {
+	uint32_t seq;			// odd while the slot is being written
+	int32_t tag_id;			// 0 = free
+	int32_t target_id;
+	int32_t dtype;			// ATLAS_CVSHM_INT, _FLOAT, _STR or _BOOL
+	int32_t quality;		// ATLAS_CVSHM_GOOD, _BAD or _NONE
+	int32_t v_int;			// value: int & bool
+	double v_float;			// value: float
+	int64_t tread_ms;		// time of the last read (wall clock, in milliseconds)
+	int64_t tchange_ms;		// time the value last changed
+	char v_str[256];		// value: string
+	char pad[16];
+} ATLAS_CVSHM_SLOT;
+
+// sizes are part of the layout
+typedef char atlas_cvshm_hdr_size_check[sizeof(ATLAS_CVSHM_HDR) == 128 ? 1 : -1];
+typedef char atlas_cvshm_slot_size_check[sizeof(ATLAS_CVSHM_SLOT) == 320 ? 1 : -1];
+
+#endif
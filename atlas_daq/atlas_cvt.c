@@ -0,0 +1,464 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Current-Value Table
+
+	The realtime table only needs each tag's latest value, so instead of an
+	upsert per tag per round, acquisition keeps every tag's current value
+	in memory, one slot per tag, and marks the slot in a dirty bitmap when
+	the value changes. A write-behind flusher thread, on its own database
+	connection, writes the dirty slots every --rt-flush ms, as multi-row
+	upserts (atlas_dbwrite.c). A value which doesn't change isn't written
+	again, so the realtime row's tupdate is the time of the last change.
+	If a flush fails, its slots are marked dirty again and written once the
+	connection is back.
+
+	The table, and its tag id index, live in a POSIX shared memory segment
+	(--cvt-shm, laid out as in atlas_cvshm.h), so local programs can read
+	current values, their quality & timestamps straight from memory, without
+	the database (see atlas_cvread/). The flusher also stamps the segment's
+	header every second, so readers can tell the daemon is alive. The
+	segment is left behind at exit, marked stopped, with the last values.
+	If it can't be created, the table is kept in private memory.
+
+	Slots are assigned to tags when their lists are loaded (main thread),
+	and never move. A slot is written by the thread storing its target's
+	values, as a seqlock, so the flusher & readers can copy it without a lock.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "atlas_daq.h"
+
+static ATLAS_CVSHM_HDR* cvt_hdr = NULL;		// the table: header, index & slots (NULL = not running)
+static ATLAS_CVSHM_SLOT* cvt = NULL;
+static int32_t* cvt_index = NULL;		// tag id -> slot
+static size_t cvt_map_size = 0;			// size of the shared memory mapping (0 = not shared)
+static int cvt_size = 0;			// slots in the table
+static int cvt_used = 0;			// slots assigned (main thread)
+static int cvt_index_mask;
+static unsigned long long* cvt_dirty = NULL;	// one bit per slot, set when its value changes
+static int cvt_words;
+static int* cvt_batch = NULL;			// slots of the rows being written
+
+static pthread_t cvt_thread;
+static int cvt_started = 0;
+static int cvt_shutdown = 0;
+static pthread_mutex_t cvt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cvt_wake = PTHREAD_COND_INITIALIZER;
+static ATLAS_DB cvt_db;				// the flusher's own connection
+static ATLAS_DBW cvt_dbw;
+static long long cvt_next_connect = 0;
+
+static unsigned long long cvt_changes = 0;	// stats
+static unsigned long long cvt_written = 0;
+static unsigned long long cvt_flushes = 0;
+static long long cvt_flush_ms = 0;
+static int cvt_db_status = 0;
+
+// Wall clock, in milliseconds
+static long long atlas_cvt_clock() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Seqlock: a slot's seq is odd from atlas_cvt_begin() to atlas_cvt_end()
+static void atlas_cvt_begin(ATLAS_CVSHM_SLOT* cv, uint32_t seq) {
+
+	__atomic_store_n(&cv->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void atlas_cvt_end(ATLAS_CVSHM_SLOT* cv, uint32_t seq) {
+
+	__atomic_store_n(&cv->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// Copies a slot, consistently: retried while a write is under way
+static void atlas_cvt_read(int slot, ATLAS_CVSHM_SLOT* out) {
+	ATLAS_CVSHM_SLOT* cv = &cvt[slot];
+	uint32_t seq;
+
+	for(;;) {
+		seq = __atomic_load_n(&cv->seq, __ATOMIC_ACQUIRE);
+		if(!(seq & 1)) {
+			memcpy(out, cv, sizeof(ATLAS_CVSHM_SLOT));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(&cv->seq, __ATOMIC_RELAXED) == seq) return;
+		}
+		sched_yield();
+	}
+}
+
+// Marks a slot as changed since the last flush
+static void atlas_cvt_mark(int slot) {
+
+	__atomic_fetch_or(&cvt_dirty[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELEASE);
+}
+
+/*
+ * atlas_cvt_slot
+ *	Returns a tag's slot in the current-value table, assigning one the
+ *	first time the tag is seen (main thread).
+ *	Returns:
+ *		Slot number, or -1 if the table isn't running or is full
+ */
+int atlas_cvt_slot(int tag_id, int target_id) {
+	static int full_logged = 0;
+	uint32_t h;
+
+	if(!cvt) return -1;
+
+	for(h = ATLAS_CVSHM_HASH(tag_id) & cvt_index_mask; cvt_index[h] >= 0; h = (h + 1) & cvt_index_mask) {
+		if(cvt[cvt_index[h]].tag_id == tag_id) return cvt_index[h];
+	}
+
+	if(cvt_used == cvt_size) {
+		if(!full_logged) zlog_error("atlas_cvt_slot(): Current-value table is full (%i tags)! Values of further tags are written to realtime every round, and aren't shared. See --cvt-size.\n",cvt_size);
+		full_logged = 1;
+		return -1;
+	}
+
+	// readers find the slot through the index, so fill it in first
+	cvt[cvt_used].tag_id = tag_id;
+	cvt[cvt_used].target_id = target_id;
+	__atomic_store_n(&cvt_index[h], cvt_used, __ATOMIC_RELEASE);
+	__atomic_store_n(&cvt_hdr->used, cvt_used + 1, __ATOMIC_RELEASE);
+
+	return cvt_used++;
+}
+
+/*
+ * atlas_cvt_put
+ *	Stores a tag's value, just read, in its slot, marking it for the next
+ *	flush if it has changed.
+ *	Args:
+ *		slot			Tag's slot
+ *		sample*			Tag's value
+ *		now_ms			Time of the read (wall clock, in milliseconds)
+ *	Returns:
+ *		1 if the value changed, 0 if not
+ */
+int atlas_cvt_put(int slot, ATLAS_SAMPLE* sample, long long now_ms) {
+	ATLAS_CVSHM_SLOT* cv = &cvt[slot];
+	uint32_t seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+	int changed = 1;
+
+	// quality is ATLAS_CVSHM_NONE until the first value
+	if(cv->quality != ATLAS_CVSHM_NONE && cv->dtype == sample->dtypei) {
+		if(sample->dtypei == DTYPE_RET_INT || sample->dtypei == DTYPE_RET_BOOL) {
+			changed = (cv->v_int != sample->v_int);
+		} else if(sample->dtypei == DTYPE_RET_FLOAT) {
+			changed = (cv->v_float != (double)sample->v_float);
+		} else {
+			changed = strcmp(cv->v_str, sample->v_str) != 0;
+		}
+	}
+
+	atlas_cvt_begin(cv, seq);
+	cv->target_id = sample->target_id;
+	cv->quality = ATLAS_CVSHM_GOOD;
+	cv->tread_ms = now_ms;
+	if(changed) {
+		cv->dtype = sample->dtypei;
+		cv->v_int = sample->v_int;
+		cv->v_float = sample->v_float;
+		strcpy(cv->v_str, sample->v_str);
+		cv->tchange_ms = now_ms;
+	}
+	atlas_cvt_end(cv, seq);
+
+	if(!changed) return 0;
+
+	if(global_config.rt_flush > 0) atlas_cvt_mark(slot);
+	__atomic_fetch_add(&cvt_changes, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/*
+ * atlas_cvt_bad
+ *	Marks a tag's value as bad, when its read failed: the slot keeps the
+ *	last good value.
+ */
+void atlas_cvt_bad(int slot, long long now_ms) {
+	ATLAS_CVSHM_SLOT* cv = &cvt[slot];
+	uint32_t seq = __atomic_load_n(&cv->seq, __ATOMIC_RELAXED);
+
+	atlas_cvt_begin(cv, seq);
+	cv->quality = ATLAS_CVSHM_BAD;
+	cv->tread_ms = now_ms;
+	atlas_cvt_end(cv, seq);
+}
+
+// Writes the values of count slots as realtime upserts; marks them dirty again if that failed
+static int atlas_cvt_write(int count) {
+	unsigned long long written = cvt_dbw.written;
+	ATLAS_SAMPLE sample;
+	ATLAS_CVSHM_SLOT cv;
+
+	for(int i = 0; i < count; i++) {
+		atlas_cvt_read(cvt_batch[i], &cv);
+		sample.tag_id = cv.tag_id;
+		sample.target_id = cv.target_id;
+		sample.dtypei = cv.dtype;
+		sample.v_int = cv.v_int;
+		sample.v_float = (float)cv.v_float;
+		strcpy(sample.v_str, cv.v_str);
+		sample.tstamp = cv.tchange_ms / 1000;
+		sample.queued = atlas_evloop_now();
+		sample.flags = SAMPLE_REALTIME;
+		atlas_dbw_add(&cvt_dbw, &cvt_db, &sample);
+	}
+	atlas_dbw_flush(&cvt_dbw, &cvt_db, 1);
+	cvt_dbw.dropped = 0;
+
+	if(cvt_dbw.written - written == (unsigned long long)count) return 0;
+
+	for(int i = 0; i < count; i++) atlas_cvt_mark(cvt_batch[i]);
+	return -1;
+}
+
+// Writes every dirty slot, global_config.db_batch rows at a time
+static int atlas_cvt_flush() {
+	long long start = atlas_evloop_now();
+	unsigned long long bits;
+	int count = 0;
+
+	for(int w = 0; w < cvt_words; w++) {
+		if(!__atomic_load_n(&cvt_dirty[w], __ATOMIC_RELAXED)) continue;
+
+		bits = __atomic_exchange_n(&cvt_dirty[w], 0, __ATOMIC_ACQUIRE);
+		while(bits) {
+			cvt_batch[count++] = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if(count < global_config.db_batch) continue;
+
+			if(atlas_cvt_write(count)) {
+				// the rest of this word waits for the next flush too
+				__atomic_fetch_or(&cvt_dirty[w], bits, __ATOMIC_RELEASE);
+				return -1;
+			}
+			count = 0;
+		}
+	}
+	if(count && atlas_cvt_write(count)) return -1;
+
+	__atomic_store_n(&cvt_flush_ms, atlas_evloop_now() - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cvt_flushes, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Flusher thread: writes the dirty slots every global_config.rt_flush ms (if set), and stamps the header
+static void* atlas_cvt_run(void* arg) {
+	int period = global_config.rt_flush > 0 && global_config.rt_flush < ATLAS_CVT_ALIVE ? global_config.rt_flush : ATLAS_CVT_ALIVE;
+	long long next_flush = 0;
+	struct timespec ts;
+	int stopping;
+
+	mysql_thread_init();
+
+	for(;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += period / 1000;
+		ts.tv_nsec += (period % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&cvt_lock);
+		if(!cvt_shutdown) pthread_cond_timedwait(&cvt_wake, &cvt_lock, &ts);
+		stopping = cvt_shutdown;
+		pthread_mutex_unlock(&cvt_lock);
+
+		__atomic_store_n(&cvt_hdr->alive_ms, atlas_cvt_clock(), __ATOMIC_RELAXED);
+		if(global_config.rt_flush <= 0 || (!stopping && atlas_evloop_now() < next_flush)) {
+			if(stopping) break;
+			continue;
+		}
+		next_flush = atlas_evloop_now() + global_config.rt_flush;
+
+		if(cvt_db.status != STATUS_READY && atlas_evloop_now() >= cvt_next_connect) {
+			if(cvt_db.conx) mysql_close(cvt_db.conx);
+			cvt_db.conx = NULL;
+			cvt_next_connect = atlas_evloop_now() + ATLAS_WRITER_RETRY;
+			if(atlas_mysql_init(&cvt_db) == STATUS_READY) zlog_info("atlas_cvt(): Connected to mySQL.\n");
+		}
+		if(cvt_db.status == STATUS_READY) atlas_cvt_flush();
+
+		__atomic_store_n(&cvt_written, cvt_dbw.written, __ATOMIC_RELAXED);
+		__atomic_store_n(&cvt_db_status, cvt_db.status, __ATOMIC_RELAXED);
+
+		if(stopping) break;
+	}
+
+	if(cvt_db.conx) mysql_close(cvt_db.conx);
+	cvt_db.conx = NULL;
+	mysql_thread_end();
+	return NULL;
+}
+
+// Creates the table's block (header, index & slots): in shared memory if global_config.cvt_shm is set, else private
+static int atlas_cvt_map(int index_size) {
+	size_t slots_off = (sizeof(ATLAS_CVSHM_HDR) + sizeof(int32_t) * index_size + 63) & ~(size_t)63;
+	size_t size = slots_off + sizeof(ATLAS_CVSHM_SLOT) * cvt_size;
+	void* base = NULL;
+	int fd;
+
+	if(global_config.cvt_shm[0]) {
+		// a new segment every run: readers still mapping the last one see it stopped
+		shm_unlink(global_config.cvt_shm);
+		if((fd = shm_open(global_config.cvt_shm, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+			zlog_error("atlas_cvt_start(): Unable to create shared memory segment %s: %s. Current values won't be shared.\n",global_config.cvt_shm,strerror(errno));
+		} else if(ftruncate(fd, size) || (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			zlog_error("atlas_cvt_start(): Unable to map shared memory segment %s: %s. Current values won't be shared.\n",global_config.cvt_shm,strerror(errno));
+			base = NULL;
+			shm_unlink(global_config.cvt_shm);
+		} else {
+			cvt_map_size = size;
+		}
+		if(fd >= 0) close(fd);
+	}
+	if(!base && (base = calloc(1, size)) == NULL) return -1;
+
+	cvt_hdr = base;
+	cvt_index = (int32_t*)((char*)base + sizeof(ATLAS_CVSHM_HDR));
+	cvt = (ATLAS_CVSHM_SLOT*)((char*)base + slots_off);
+	memset(cvt_index, 0xff, sizeof(int32_t) * index_size);
+
+	cvt_hdr->version = ATLAS_CVSHM_VERSION;
+	cvt_hdr->hdr_size = sizeof(ATLAS_CVSHM_HDR);
+	cvt_hdr->slot_size = sizeof(ATLAS_CVSHM_SLOT);
+	cvt_hdr->slots = cvt_size;
+	cvt_hdr->index_size = index_size;
+	cvt_hdr->used = 0;
+	cvt_hdr->state = ATLAS_CVSHM_RUNNING;
+	cvt_hdr->pid = getpid();
+	cvt_hdr->started_ms = atlas_cvt_clock();
+	cvt_hdr->alive_ms = cvt_hdr->started_ms;
+	cvt_hdr->index_off = sizeof(ATLAS_CVSHM_HDR);
+	cvt_hdr->slots_off = slots_off;
+	// readers check the magic number before anything else
+	__atomic_store_n(&cvt_hdr->magic, ATLAS_CVSHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * atlas_cvt_start
+ *	Creates the current-value table (global_config.cvt_size slots), shared
+ *	as global_config.cvt_shm if set, and starts its flusher, with its own
+ *	connection to the database given.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_cvt_start(ATLAS_DB* cur_db) {
+	int index_size = 2;
+
+	if(cvt || global_config.cvt_size <= 0) return 0;
+	if(global_config.rt_flush <= 0 && !global_config.cvt_shm[0]) return 0;
+
+	while(index_size < global_config.cvt_size * 2) index_size <<= 1;
+
+	cvt_size = global_config.cvt_size;
+	cvt_words = (cvt_size + 63) / 64;
+	cvt_index_mask = index_size - 1;
+	if(atlas_cvt_map(index_size) ||
+	   (cvt_dirty = calloc(cvt_words, sizeof(unsigned long long))) == NULL ||
+	   (cvt_batch = malloc(sizeof(int) * global_config.db_batch)) == NULL) {
+		zlog_error("atlas_cvt_start(): Memory allocation failed!\n");
+		atlas_cvt_stop();
+		return -1;
+	}
+	cvt_used = 0;
+
+	cvt_db = *cur_db;
+	cvt_db.conx = NULL;
+	cvt_db.status = STATUS_NOTREADY;
+	cvt_next_connect = 0;
+	cvt_shutdown = 0;
+
+	if(pthread_create(&cvt_thread, NULL, atlas_cvt_run, NULL)) {
+		zlog_error("atlas_cvt_start(): Failed to start the flusher!\n");
+		atlas_cvt_stop();
+		return -1;
+	}
+	cvt_started = 1;
+
+	if(global_config.rt_flush > 0) zlog_info("atlas_cvt_start(): Current-value table started (%i slots, flushed every %i ms).\n",cvt_size,global_config.rt_flush);
+	else zlog_info("atlas_cvt_start(): Current-value table started (%i slots, not flushed; values are written to realtime every round).\n",cvt_size);
+	if(cvt_map_size) zlog_info("atlas_cvt_start(): Current values are shared as %s (%lu KB).\n",global_config.cvt_shm,(unsigned long)(cvt_map_size / 1024));
+
+	return 0;
+}
+
+// Stops the flusher, once it has written the values changed since the last flush; a shared table is left for its readers, marked stopped
+void atlas_cvt_stop() {
+
+	if(cvt_started) {
+		pthread_mutex_lock(&cvt_lock);
+		cvt_shutdown = 1;
+		pthread_cond_signal(&cvt_wake);
+		pthread_mutex_unlock(&cvt_lock);
+		pthread_join(cvt_thread, NULL);
+		cvt_started = 0;
+	}
+
+	if(cvt_hdr) {
+		__atomic_store_n(&cvt_hdr->state, ATLAS_CVSHM_STOPPED, __ATOMIC_RELEASE);
+		if(cvt_map_size) munmap(cvt_hdr, cvt_map_size);
+		else free(cvt_hdr);
+	}
+
+	atlas_dbw_free(&cvt_dbw);
+	free(cvt_dirty);
+	free(cvt_batch);
+	cvt_hdr = NULL;
+	cvt = NULL;
+	cvt_index = NULL;
+	cvt_map_size = 0;
+	cvt_dirty = NULL;
+	cvt_batch = NULL;
+	cvt_size = 0;
+	cvt_used = 0;
+}
+
+/*
+ * atlas_cvt_stats
+ *	Fills in the current-value table's statistics.
+ *	Returns:
+ *		0 on success, -1 if the table isn't running
+ */
+int atlas_cvt_stats(ATLAS_CVT_STATS* stats) {
+
+	if(!cvt) return -1;
+
+	stats->slots = cvt_used;
+	stats->size = cvt_size;
+	stats->dirty = 0;
+	for(int w = 0; w < cvt_words; w++) stats->dirty += __builtin_popcountll(__atomic_load_n(&cvt_dirty[w], __ATOMIC_RELAXED));
+	stats->changes = __atomic_load_n(&cvt_changes, __ATOMIC_RELAXED);
+	stats->written = __atomic_load_n(&cvt_written, __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&cvt_flushes, __ATOMIC_RELAXED);
+	stats->flush_ms = __atomic_load_n(&cvt_flush_ms, __ATOMIC_RELAXED);
+	stats->db_status = __atomic_load_n(&cvt_db_status, __ATOMIC_RELAXED);
+	stats->shared = (cvt_map_size != 0);
+
+	return 0;
+}
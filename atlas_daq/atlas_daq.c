@@ -37,6 +37,9 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,12 +49,18 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "atlas_daq.h"
 
 ATLAS_DB *global_db = NULL;
 ATLAS_FTRACER tstack[128];
 int tstack_dex = -1;
 
+// serializes use of the mySQL connection between threads (recursive, so that logging
+// from a thread which already holds it is fine)
+pthread_mutex_t atlas_db_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
 // data type to string array
 char dtype_str[][6] = {"","int","float","str","int"};
 
@@ -80,7 +89,9 @@ void log_mysql(int llevel, char* srcname, int srcline, int event_id, char* fmt,
 				event_id,srcname,srcline,llevel,tt_clock,escaper
 		       );
 
+		pthread_mutex_lock(&atlas_db_lock);
 		mysql_query(global_db->conx,qq);
+		pthread_mutex_unlock(&atlas_db_lock);
 	}
 }
 
@@ -249,40 +260,156 @@ void atlas_trace_pop(char *xfunc, char *xfile, int xline) {
 // Socket Functions
 ///////////////////////////////////////////////////////////////////////////////
 
-int atlas_sock_connect(ATLAS_MCS* condata) {
+/*
+ * atlas_sock_open
+ *	Connects to a host on the first of several candidate ports to answer.
+ *	A non-blocking connect is started on every port at once, and the first
+ *	to complete within timeout_ms is kept; the rest are abandoned. The
+ *	returned socket is left non-blocking.
+ *	Args:
+ *		ip_addr: host address (dotted quad)
+ *		ports: candidate ports, in order of preference
+ *		port_count: number of ports (max ATLAS_SOCK_MAX_PORTS)
+ *		timeout_ms: time to wait for a connection, in milliseconds
+ *		port_dex: set to the index of the port connected (may be NULL)
+ *	Returns:
+ *		Connected socket, or -1 on failure
+ */
+int atlas_sock_open(char* ip_addr, int* ports, int port_count, int timeout_ms, int* port_dex) {
+	struct pollfd pfd[ATLAS_SOCK_MAX_PORTS];
+	struct sockaddr_in servaddr;
+	long long deadline;
+	long long now;
+	int pending = 0;
+	int won = -1;
+	int soerr;
+	socklen_t soerr_sz;
+
+	if(port_count > ATLAS_SOCK_MAX_PORTS) port_count = ATLAS_SOCK_MAX_PORTS;
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = inet_addr(ip_addr);
+
+	for(int i = 0; i < port_count; i++) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLOUT;
+		pfd[i].revents = 0;
+	}
 
-	if((condata->sock_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		zlog_error("atlas_sock_connect(): Failed to create socket!\n");
-		return 0;
+	for(int i = 0; i < port_count; i++) {
+		if((pfd[i].fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)) < 0) {
+			zlog_error("atlas_sock_open(): Failed to create socket!\n");
+			continue;
+		}
+
+		servaddr.sin_port = htons(ports[i]);
+		if(!connect(pfd[i].fd, (struct sockaddr*) &servaddr, sizeof(servaddr))) {
+			won = i;
+			break;
+		}
+		if(errno != EINPROGRESS) {
+			zlog_debug("atlas_sock_open(): Connection to %s:%u refused [%s]\n",ip_addr,ports[i],strerror(errno));
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			continue;
+		}
+		pending++;
+	}
+
+	// wait for the first connection to complete
+	deadline = atlas_evloop_now() + timeout_ms;
+	while(won == -1 && pending && (now = atlas_evloop_now()) < deadline) {
+		if(poll(pfd, port_count, deadline - now) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+
+		for(int i = 0; i < port_count && won == -1; i++) {
+			if(pfd[i].fd < 0 || !pfd[i].revents) continue;
+
+			soerr = 0;
+			soerr_sz = sizeof(soerr);
+			getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &soerr_sz);
+			if(!soerr) {
+				won = i;
+				break;
+			}
+
+			zlog_debug("atlas_sock_open(): Connection to %s:%u failed [%s]\n",ip_addr,ports[i],strerror(soerr));
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+
+	// abandon the rest
+	for(int i = 0; i < port_count; i++) {
+		if(i != won && pfd[i].fd >= 0) close(pfd[i].fd);
 	}
 
-	zlog_debug("atlas_sock_connect(): Socket created OK!\n");
+	if(won == -1) return -1;
+
+	if(port_dex) *port_dex = won;
+	return pfd[won].fd;
+}
+
+/*
+ * atlas_sock_connect_any
+ *	Connects a session to the first of several candidate ports to answer
+ *	(see atlas_sock_open()), within global_config.connect_timeout.
+ *	condata->port_num is set to the port connected.
+ *	Returns:
+ *		1 if connected, 0 if not
+ */
+int atlas_sock_connect_any(ATLAS_MCS* condata, int* ports, int port_count) {
+	int nodelay = 1;
+	int port_dex;
+
+	if((condata->sock_fd = atlas_sock_open(condata->ip_addr, ports, port_count, global_config.connect_timeout, &port_dex)) < 0) {
+		if(port_count > 1) zlog_error("atlas_sock_connect(): Failed to connect to %s on ports %u-%u :(\n",condata->ip_addr,ports[0],ports[port_count - 1]);
+		else zlog_error("atlas_sock_connect(): Failed to connect to %s:%u :(\n",condata->ip_addr,ports[0]);
+		return 0;
+	}
+	condata->port_num = ports[port_dex];
 
 	condata->servaddr.sin_family = AF_INET;
 	condata->servaddr.sin_addr.s_addr = inet_addr(condata->ip_addr);
 	condata->servaddr.sin_port = htons(condata->port_num);
 
-	if(connect(condata->sock_fd, (struct sockaddr*) &condata->servaddr, sizeof(condata->servaddr)) < 0) {
-		zlog_error("atlas_sock_connect(): Failed to connect to %s:%u :(\n",condata->ip_addr,condata->port_num);
-		return 0;
-	}
+	// from here on the connection is driven by the event loop; pipelined
+	// requests go out as soon as they are queued, rather than waiting on Nagle
+	setsockopt(condata->sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
 	zlog_debug("atlas_sock_connect(): Successfully connected to %s:%u :)\n",condata->ip_addr,condata->port_num);
 	return 1;
 }
 
+int atlas_sock_connect(ATLAS_MCS* condata) {
+	int port = condata->port_num;
+
+	return atlas_sock_connect_any(condata, &port, 1);
+}
+
 void atlas_sock_close(ATLAS_MCS* condata) {
 
 	close(condata->sock_fd);
 	zlog_debug("atlas_sock_close(): Connection closed.\n");
 }
 
+/*
+ * atlas_sock_send
+ *	Sends as much of txdata as the (non-blocking) socket will take.
+ *	Returns:
+ *		Number of bytes sent, 0 if the socket is full, or -1 on failure
+ */
 int atlas_sock_send(ATLAS_MCS* condata, char* txdata, int data_sz) {
 	int tx_len;
 
-	// Send data using send()
-	if((tx_len = send(condata->sock_fd, txdata, data_sz, 0)) != data_sz) {
-		zlog_error("atlas_sock_send(): Transmit size mismatch!\n");
+	if((tx_len = send(condata->sock_fd, txdata, data_sz, MSG_NOSIGNAL)) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+		zlog_error("atlas_sock_send(): Failed to send data to target! [%s]\n",strerror(errno));
+		return -1;
 	}
 
 	return tx_len;
@@ -301,6 +428,111 @@ int atlas_sock_recv(ATLAS_MCS* condata, char* rxdata, int buf_sz) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+///////////////////////////////////////////////////////////////////////////////
+
+static double atlas_bench_secs() {
+	struct timespec ttx;
+
+	clock_gettime(CLOCK_MONOTONIC, &ttx);
+	return ttx.tv_sec + (ttx.tv_nsec / 1000000000.0);
+}
+
+/*
+ * atlas_bench_decode
+ *	Compares per-read string decoding of tag names against reading from
+ *	compiled tag descriptors, across tag_count MC & Logix tags. (--bench-decode)
+ */
+void atlas_bench_decode(int tag_count) {
+	ATLAS_TARGET bt_mc, bt_lgx;
+	ATLAS_TAG scratch;
+	ATLAS_TAGDESC* descs;
+	char (*names)[48];
+	char* mc_devs[] = { "D", "W", "M", "X", "ZR", "SD", "B", "R" };
+	unsigned char hdr[16];
+	unsigned char cip_rq[ATLAS_CIP_PATH_MAX];
+	unsigned char dcode;
+	int dnum;
+	unsigned int csum_str = 0, csum_desc = 0;
+	double t_str, t_desc;
+	int loglevel = global_config.loglevel;
+
+	if(tag_count < 1) tag_count = 100000;
+
+	descs = malloc(sizeof(ATLAS_TAGDESC) * tag_count);
+	names = malloc(48 * tag_count);
+	if(!descs || !names) {
+		zlog_error("atlas_bench_decode(): Memory allocation failed!\n");
+		return;
+	}
+
+	memset(&bt_mc, 0, sizeof(ATLAS_TARGET));
+	memset(&bt_lgx, 0, sizeof(ATLAS_TARGET));
+	bt_mc.target_type = TARGET_MC;
+	strcpy(bt_mc.sname, "bench_mc");
+	strcpy(bt_mc.path_str, "0-255-0-1023");
+	bt_lgx.target_type = TARGET_LGX;
+	strcpy(bt_lgx.sname, "bench_lgx");
+
+	// keep per-call debug logging out of the timings
+	global_config.loglevel = 1;
+
+	// half MC devices, half Logix symbols
+	memset(&scratch, 0, sizeof(ATLAS_TAG));
+	scratch.dtypei = DTYPE_RET_INT;
+	for(int i = 0; i < tag_count; i++) {
+		if(i & 1) sprintf(names[i], "Line%i.Station[%i].Count", i % 17, i % 250);
+		else sprintf(names[i], "%s%i", mc_devs[(i >> 1) % 8], (i * 7) % 8192);
+		strcpy(scratch.tagname, names[i]);
+		atlas_compile_tag((i & 1) ? &bt_lgx : &bt_mc, &scratch);
+		descs[i] = scratch.desc;
+	}
+	mc_compile_station(&bt_mc);
+
+	// string path: what each read did before tags were compiled
+	t_str = atlas_bench_secs();
+	for(int i = 0; i < tag_count; i++) {
+		if(i & 1) {
+			strcpy(scratch.tagname, names[i]);
+			eip_compile_tag(&bt_lgx, &scratch);
+			csum_str += scratch.desc.cip_path_sz;
+		} else {
+			mc_decode_device(names[i], &dcode, &dnum);
+			mc_compile_station(&bt_mc);
+			csum_str += dcode + dnum;
+		}
+	}
+	t_str = atlas_bench_secs() - t_str;
+
+	// descriptor path: fixed-size fields only
+	t_desc = atlas_bench_secs();
+	for(int i = 0; i < tag_count; i++) {
+		if(i & 1) {
+			memcpy(cip_rq, descs[i].cip_path, descs[i].cip_path_sz);
+			csum_desc += descs[i].cip_path_sz + cip_rq[0];
+		} else {
+			memcpy(hdr, bt_mc.mc_station, 5);
+			hdr[5] = descs[i].dev_num & 0xFF;
+			hdr[6] = (descs[i].dev_num >> 8) & 0xFF;
+			hdr[7] = (descs[i].dev_num >> 16) & 0xFF;
+			hdr[8] = descs[i].dev_code;
+			csum_desc += descs[i].dev_code + descs[i].dev_num + hdr[0];
+		}
+	}
+	t_desc = atlas_bench_secs() - t_desc;
+
+	global_config.loglevel = loglevel;
+
+	printf("decode benchmark: %i tags (%i MC, %i Logix)\n", tag_count, (tag_count + 1) / 2, tag_count / 2);
+	printf("\tstring decode:     %10.3f ms  %8.1f ns/tag  [%u]\n", t_str * 1000.0, t_str * 1e9 / tag_count, csum_str);
+	printf("\tcompiled desc:     %10.3f ms  %8.1f ns/tag  [%u]\n", t_desc * 1000.0, t_desc * 1e9 / tag_count, csum_desc);
+	if(t_desc > 0) printf("\tspeedup:           %10.1fx\n", t_str / t_desc);
+
+	free(descs);
+	free(names);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Data Conversion
 ///////////////////////////////////////////////////////////////////////////////
@@ -339,6 +571,7 @@ void set_target_msg(ATLAS_TARGET* cur_target, char* fmt, ...) {
 }
 
 int atlas_mysql_init(ATLAS_DB* target_db) {
+	unsigned int connect_timeout;
 
 	// set default port number if not set
 	if(!target_db->portnum) target_db->portnum = 3306;
@@ -355,9 +588,13 @@ int atlas_mysql_init(ATLAS_DB* target_db) {
 		zlog_debug("atlas_mysql_init: mysql_init() OK!\n");
 	}
 
+	// don't wait on an unreachable server for long (acquisition carries on without it)
+	connect_timeout = (global_config.connect_timeout + 999) / 1000;
+	mysql_options(target_db->conx, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
+
 	// Connect...
 	if(!mysql_real_connect(target_db->conx,target_db->hostname,target_db->username,target_db->password,target_db->db,target_db->portnum, NULL /*socket*/, 0 /*client flags*/)) {
-		zlog_error("atlas_mysql_init: mysql_real_connect() failed! Err %u - %s\n",mysql_errno(target_db->conx),mysql_errno(target_db->conx));
+		zlog_error("atlas_mysql_init: mysql_real_connect() failed! Err %u - %s\n",mysql_errno(target_db->conx),mysql_error(target_db->conx));
 		target_db->status = STATUS_INITFAIL;
 		return target_db->status;
 	} else {
@@ -395,8 +632,8 @@ int session_share_setup(ATLAS_TARGET* child_t) {
 	}
 
 	// AB session sharing is not supported due to TuxEip
-	if(parent_t->target_type < 4) {
-		zlog_error("session_share_setup(): [%s] Session sharing is not supported for Allen-Bradley targets! Target disabled.\n",child_t->sname);
+	if(!atlas_driver_get(parent_t->target_type) || !(atlas_driver_get(parent_t->target_type)->caps & DCAP_SHARE)) {
+		zlog_error("session_share_setup(): [%s] Session sharing is not supported for this target type! Target disabled.\n",child_t->sname);
 		child_t->status = STATUS_DISABLED;
 		return -1;
 	}
@@ -408,17 +645,18 @@ int session_share_setup(ATLAS_TARGET* child_t) {
 		return -1;
 	}
 
-	// Parent must already be connected and initialized before this function is called!
-	// Otherwise the mc_session pointer will be null and useless
-	if(!parent_t->mc_session) {
-		zlog_error("session_share_setup(): Target parent session has not been initialized! This target will be disabled.\n");
+	// A parent can't share a session it borrows itself
+	if(parent_t->flags & TFLAG_CSESSION) {
+		zlog_error("session_share_setup(): [%s] Parent session target [%s] shares a session itself! Target disabled.\n",child_t->sname,parent_t->sname);
 		child_t->status = STATUS_DISABLED;
 		return -1;
 	}
 
-	// duplicate mc_session pointer and set parent pointer
+	// duplicate mc_session pointer and set parent pointer; if the parent isn't
+	// connected yet, the session is handed over when it is (see atlas_rcx.c)
 	child_t->mc_session = parent_t->mc_session;
 	child_t->parent = parent_t;
+	child_t->status = parent_t->status;
 
 	zlog_debug("session_share_setup(): Successfully associated [%s] to parent connection [%s].\n",child_t->sname,parent_t->sname);
 	return tid;
@@ -431,6 +669,7 @@ int get_target_list(ATLAS_DB* dbconx) {
 	ATLAS_TARGET* cur_target;
 	int pathsz_t;
 	char mquery[256];
+	int fx_mc_window;
 
 	// ensure we've established a connection...
 	if(dbconx->status != STATUS_READY) {
@@ -449,11 +688,13 @@ int get_target_list(ATLAS_DB* dbconx) {
 		return -1;
 	}
 
+	// optional columns
+	fx_mc_window = atlas_mysql_field(resultx, "mc_window");
 
 	// enumerate the targets...
 	while((rowx = mysql_fetch_row(resultx))) {
 		// allocate memory for new target data
-		if((atx_tgdex[atx_targets] = malloc(sizeof(ATLAS_TARGET))) == NULL) {
+		if((atx_tgdex[atx_targets] = calloc(1, sizeof(ATLAS_TARGET))) == NULL) {
 			zlog_error("CRITICAL: get_target_list: Memory allocation error!\n");
 			exit(1);
 		}
@@ -473,6 +714,8 @@ int get_target_list(ATLAS_DB* dbconx) {
 		else        cur_target->flags = 0;
 		if(rowx[9]) cur_target->session_target = atoi(rowx[9]);
 		else        cur_target->session_target = 0;
+		if(fx_mc_window >= 0 && rowx[fx_mc_window]) cur_target->mc_window = atoi(rowx[fx_mc_window]);
+		else        cur_target->mc_window = 0;
 
 		// parse path...
 		if(rowx[4]) {
@@ -501,6 +744,9 @@ int get_target_list(ATLAS_DB* dbconx) {
 		cur_target->eip_session = NULL;
 		cur_target->eip_con = NULL;
 		cur_target->mc_session = NULL;
+		memset(&cur_target->tagset, 0, sizeof(ATLAS_TAGSET));
+		memset(&cur_target->alarmset, 0, sizeof(ATLAS_TAGSET));
+		cur_target->mc_station_ok = 0;
 
 		// other param defaults...
 		cur_target->status = STATUS_NOTREADY;
@@ -522,6 +768,24 @@ int get_target_list(ATLAS_DB* dbconx) {
 }
 
 
+/*
+ * atlas_mysql_field
+ *	Looks up a column index by name, for optional columns which may not
+ *	exist in older table layouts.
+ *	Returns:
+ *		Column index, or -1 if the result has no such column
+ */
+int atlas_mysql_field(MYSQL_RES* resultx, char* fieldname) {
+	MYSQL_FIELD* fields = mysql_fetch_fields(resultx);
+	int field_count = mysql_num_fields(resultx);
+
+	for(int i = 0; i < field_count; i++) {
+		if(!strcmp(fields[i].name, fieldname)) return i;
+	}
+
+	return -1;
+}
+
 char* atlas_gen_sqlargs(ATLAS_DB* curdb, ATLAS_TAG* curtag, char* outstr, int argtype) {
 	char escaper[512];
 
@@ -548,73 +812,87 @@ char* atlas_gen_sqlargs(ATLAS_DB* curdb, ATLAS_TAG* curtag, char* outstr, int ar
 	return outstr;
 }
 
+/*
+ * atlas_compile_tag
+ *	Compiles a tag's name into its descriptor (device code & number for MC,
+ *	CIP symbolic path for Logix), once when the tag is loaded.
+ *	Tags that can't be compiled are still read by name.
+ *	Returns:
+ *		0 if compiled, -1 if not
+ */
+int atlas_compile_tag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag) {
+	ATLAS_DRIVER* drv = atlas_driver_get(cur_target->target_type);
+	int rv = -1;
+
+	memset(&curtag->desc, 0, sizeof(ATLAS_TAGDESC));
+	curtag->desc.cip_bit = -1;
+
+	if(drv && drv->compile_tag) rv = drv->compile_tag(cur_target, curtag);
+
+	if(rv) zlog_debug("atlas_compile_tag(): [%s] Tag \"%s\" not compiled. It will be read by name.\n",cur_target->sname,curtag->tagname);
+
+	return rv;
+}
+
+/*
+ * atlas_readtag
+ *	Reads a single tag with the target's driver, as a tag set of one.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
 int atlas_readtag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag) {
+	ATLAS_TAGSET set;
 
-	char *daq_val;
+	memset(&set, 0, sizeof(ATLAS_TAGSET));
+	set.tags = curtag;
+	set.tag_count = 1;
 
-	// acquire using appropriate target driver
-	switch(cur_target->target_type) {
-		case TARGET_LGX:
-		case TARGET_SLC:
-		case TARGET_PLC:
-			daq_val = eip_readtag(curtag->tagname, cur_target, NULL);
-			break;
-		case TARGET_MC:
-			daq_val = mc_readword(curtag->tagname, cur_target);
-			break;
-	}
+	curtag->read_status = -1;
+	atlas_read_tagset(cur_target, &set);
+	atlas_free_tagset(cur_target, &set);
 
-	// detect errors from protocol tag/register reads
-	if(daq_val == -1) {
-		zlog_debug("* atlas_readtag(): Driver returned -1 indiciating read failure!\n");
-		return -1;
-	} else {
-		if(curtag->dtypei == DTYPE_RET_INT || curtag->dtypei == DTYPE_RET_BOOL) {
-			curtag->v_int = p2int(daq_val);
-			zlog_debug("\t>> v_int = %i\n",curtag->v_int);
-		} else if(curtag->dtypei == DTYPE_RET_FLOAT) {
-			curtag->v_float = p2float(daq_val);
-			zlog_debug("\t>> v_float = %f\n",curtag->v_float);
-		} else {
-			strcpy(curtag->v_str, daq_val);
-			zlog_debug("\t>> v_str = \"%s\"\n",curtag->v_str);
-		}
-	}
+	return curtag->read_status ? -1 : 0;
+}
 
-	if(eip_readerr && cur_target->target_type != TARGET_MC) {
-		zlog_debug("\t>>> EIP read error detected!\n");
-		return -1;
+/*
+ * atlas_tag_setval
+ *	Stores a value read by a driver in a tag, converted to the tag's data type.
+ */
+void atlas_tag_setval(ATLAS_TAG* curtag, ATLAS_VALUE* val) {
+
+	if(curtag->dtypei == DTYPE_RET_INT || curtag->dtypei == DTYPE_RET_BOOL) {
+		curtag->v_int = (val->dtype == DTYPE_RET_FLOAT) ? (int)val->v_float : val->v_int;
+		zlog_debug("\t>> v_int = %i\n",curtag->v_int);
+	} else if(curtag->dtypei == DTYPE_RET_FLOAT) {
+		curtag->v_float = val->v_float;
+		zlog_debug("\t>> v_float = %f\n",curtag->v_float);
+	} else {
+		if(val->dtype == DTYPE_RET_FLOAT) sprintf(curtag->v_str,"%f",val->v_float);
+		else sprintf(curtag->v_str,"%d",val->v_int);
+		zlog_debug("\t>> v_str = \"%s\"\n",curtag->v_str);
 	}
-
-	return 0;
 }
 
-int get_target_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
+/*
+ * atlas_load_tags
+ *	Retrieves the tag list for a target from the database.
+ *	Args:
+ *		cur_db*			Database connection
+ *		cur_target*		Target to retrieve tags for
+ *		tags_out**		Set to newly allocated array of tags (caller must free)
+ *	Returns:
+ *		Number of tags in array, or -1 on failure
+ */
+int atlas_load_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out) {
 	MYSQL_RES* resultx;
 	MYSQL_ROW  rowx;
-	ATLAS_TAG  curtag;
+	ATLAS_TAG* tags;
+	ATLAS_TAG* curtag;
+	int tag_count = 0;
 	char qq[512];
-	char datasetter[280];
-	char datasetsu[280];
-	char escaper[300];
-	//char dtx[8];
-	time_t tstampx;
-	int tdelta;
-
-	// Ensure mySQL connection is OK
-	if(cur_db->status != STATUS_READY) {
-		zlog_error("get_target_tags: mySQL connection not established! Cannot get target list.\n");
-		return -1;
-	}
+	int fx_comp_mode, fx_comp_dev, fx_comp_max;
 
-	tstampx = time(NULL);
-	tdelta = tstampx - cur_target->last_update;
-	if(!cur_target->last_update) {
-		tdelta = -1;
-		zlog_debug("get_target_tags: Performing initial polling round for target [%s]...\n",cur_target->sname);
-	} else {
-		zlog_debug("get_target_tags: Begin new target update round for [%s]. Last update = %i [%i seconds ago].\n",cur_target->sname,cur_target->last_update,tdelta);
-	}
+	(*tags_out) = NULL;
 
 	// Query taglist for cur_target...
 	sprintf(qq,"SELECT * FROM %s WHERE target_id = %i",cur_db->tables.tag_list, cur_target->id);
@@ -623,99 +901,419 @@ int get_target_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
 		cur_db->status = STATUS_NOTREADY;
 		cur_db->last_error = mysql_errno(cur_db->conx);
 		// log the error
-		zlog_error("get_target_tags: Query failed! %i - %s [%s]\n",cur_db->last_error,mysql_error(cur_db->conx),qq);
+		zlog_error("atlas_load_tags: Query failed! %i - %s [%s]\n",cur_db->last_error,mysql_error(cur_db->conx),qq);
 		return -1;
 	}
 	resultx = mysql_store_result(cur_db->conx);
+	if(!resultx) {
+		zlog_error("atlas_load_tags: Failed to store result! [%s]\n",mysql_error(cur_db->conx));
+		return -1;
+	}
+
+	// allocate the tag array
+	if((tags = malloc(sizeof(ATLAS_TAG) * (mysql_num_rows(resultx) + 1))) == NULL) {
+		zlog_error("CRITICAL: atlas_load_tags: Memory allocation error!\n");
+		mysql_free_result(resultx);
+		return -1;
+	}
+
+	// optional columns: history compression
+	fx_comp_mode = atlas_mysql_field(resultx, "comp_mode");
+	fx_comp_dev = atlas_mysql_field(resultx, "comp_dev");
+	fx_comp_max = atlas_mysql_field(resultx, "comp_max");
 
 	// enumerate the tags...
 	while((rowx = mysql_fetch_row(resultx))) {
+		curtag = &tags[tag_count++];
 
 		// populate tag info from database...
-		curtag.id = atoi(rowx[0]);
-		curtag.target_id = cur_target->id;
-		if(rowx[2]) strcpy(curtag.tagname,rowx[2]);
-		else curtag.tagname[0] = 0;
+		curtag->id = atoi(rowx[0]);
+		curtag->target_id = cur_target->id;
+		if(rowx[2]) strcpy(curtag->tagname,rowx[2]);
+		else curtag->tagname[0] = 0;
 
 		// determine datatype from enum and convert to localized enum...
-		strcpy(curtag.dtype,rowx[8]);
-		if(!strcmp("int",rowx[8])) curtag.dtypei = DTYPE_RET_INT;
-		else if(!strcmp("float",rowx[8])) curtag.dtypei = DTYPE_RET_FLOAT;
-		else curtag.dtypei = DTYPE_RET_STR;
+		strcpy(curtag->dtype,rowx[8]);
+		if(!strcmp("int",rowx[8])) curtag->dtypei = DTYPE_RET_INT;
+		else if(!strcmp("float",rowx[8])) curtag->dtypei = DTYPE_RET_FLOAT;
+		else curtag->dtypei = DTYPE_RET_STR;
+
+		curtag->v_int = 0;
+		curtag->v_float = 0.0f;
+		curtag->v_str[0] = 0;
+		curtag->read_status = -1;
+
+		curtag->cv_slot = -1;
+
+		// history compression settings
+		memset(&curtag->comp, 0, sizeof(ATLAS_COMP));
+		if(fx_comp_mode >= 0 && (curtag->comp.mode = atlas_comp_mode(rowx[fx_comp_mode])) < 0) {
+			zlog_error("atlas_load_tags(): [%s] Tag \"%s\" has an unknown comp_mode \"%s\". Not compressed.\n",cur_target->sname,curtag->tagname,rowx[fx_comp_mode]);
+			curtag->comp.mode = COMP_NONE;
+		}
+		if(fx_comp_dev >= 0 && rowx[fx_comp_dev] && atof(rowx[fx_comp_dev]) > 0) curtag->comp.dev = atof(rowx[fx_comp_dev]);
+		if(fx_comp_max >= 0 && rowx[fx_comp_max] && atof(rowx[fx_comp_max]) > 0) curtag->comp.max_ms = atof(rowx[fx_comp_max]) * 1000;
 
-		// now, retrieve the tag's value from the target device...
-		zlog_debug("get_target_tags: Retrieving tag [%s] from target device [%s]...\n",curtag.tagname,cur_target->sname);
+		atlas_compile_tag(cur_target, curtag);
+	}
 
-		// check to see if it's disabled
-		if(cur_target->status == STATUS_DISABLED) {
-			zlog_debug("get_target_tags: Target disabled. Skipping.\n");
-			set_target_msg(cur_target,"Disabled");
+	mysql_free_result(resultx);
+
+	(*tags_out) = tags;
+	return tag_count;
+}
+
+// Values queued for the database when there are no persistence writers (main thread; see atlas_dbwrite.c)
+static ATLAS_DBW db_queue;
+
+// Queues a sample: to the persistence writers, or without them, to db_queue
+int atlas_store_sample(ATLAS_DB* cur_db, ATLAS_SAMPLE* sample) {
+
+	if(atlas_writer_count()) return atlas_writer_push(sample);
+	return atlas_dbw_add(&db_queue, cur_db, sample);
+}
+
+/*
+ * atlas_store_tags
+ *	Queues the values of a target's tags for the realtime & history tables:
+ *	to the persistence writers (atlas_writer.c), or without them, to
+ *	db_queue, written by the next atlas_dbw_flush() (atlas_db_lock held).
+ *	History only gets the values its compression keeps (atlas_compress.c).
+ *	Realtime values go to the current-value table (atlas_cvt.c), for tags
+ *	which have a slot in it.
+ *	Tags whose read failed are skipped.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_store_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG* tags, int tag_count) {
+	ATLAS_TAG* curtag;
+	ATLAS_SAMPLE sample;
+	ATLAS_SAMPLE held;
+	struct timespec now;
+	long long now_ms;
+	time_t tstampx;
+	int rv = 0;
+
+	// get current time for timestamp
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	tstampx = now.tv_sec;
+
+	for(int i = 0; i < tag_count; i++) {
+		curtag = &tags[i];
+
+		// don't store values from failed reads; the history line ends at the last good one
+		if(curtag->read_status) {
+			zlog_debug("atlas_store_tags: Read failed for tag [%s -> %s]. Skipping.\n",cur_target->sname,curtag->tagname);
+			if(atlas_comp_end(cur_target, curtag, &held) && atlas_store_sample(cur_db, &held)) rv = -1;
+			if(curtag->cv_slot >= 0) atlas_cvt_bad(curtag->cv_slot, now_ms);
 			continue;
 		}
 
-		// read tag using driver
-		atlas_readtag(cur_target, &curtag);
+		atlas_dbw_sample(&sample, cur_target, curtag, tstampx);
+		if(!atlas_comp_tag(cur_target, curtag, now_ms, &held)) sample.flags &= ~SAMPLE_HISTORY;
+		if(curtag->cv_slot >= 0) {
+			atlas_cvt_put(curtag->cv_slot, &sample, now_ms);
+			if(global_config.rt_flush) sample.flags &= ~SAMPLE_REALTIME;
+		}
+
+		if(held.flags && atlas_store_sample(cur_db, &held)) rv = -1;
+		if(sample.flags && atlas_store_sample(cur_db, &sample)) rv = -1;
+	}
+
+	tstampx = time(NULL);
+	zlog_debug("atlas_store_tags: Update round for target [%s] has completed successfully! (timestamp = %li)\n\n",cur_target->sname,(long)tstampx);
+	cur_target->last_update = tstampx;
+
+	return rv;
+}
+
+/*
+ * atlas_store_end
+ *	Queues the values history compression is holding back for a target's
+ *	tags, so that history runs to the last value read (at shutdown).
+ */
+void atlas_store_end(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target) {
+	ATLAS_SAMPLE held;
+
+	for(int i = 0; i < cur_target->cfg_tag_count; i++) {
+		if(atlas_comp_end(cur_target, &cur_target->cfg_tags[i], &held)) atlas_store_sample(cur_db, &held);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Acquisition rounds
+///////////////////////////////////////////////////////////////////////////////
+
+// Per-target state for the current round
+static ATLAS_TAG* poll_tags[ATLAS_MAX_TARGETS];		// tag list (cached; see atlas_tagcache.c)
+static int poll_tag_count[ATLAS_MAX_TARGETS];		// number of tags, or -1 if the load failed
+static ATLAS_TAG* poll_alarms[ATLAS_MAX_TARGETS];	// alarm tags (cached)
+static int poll_alarm_count[ATLAS_MAX_TARGETS];		// number of alarms, or -1 if the load failed
+static int poll_next[ATLAS_MAX_TARGETS];		// next target in the same session group, or -1
+
+// A target's tag set for this round: its tags, or its alarms; NULL if it has none to read
+static ATLAS_TAGSET* atlas_poll_set(int tgi, int alarms) {
+	ATLAS_TARGET* cur_target = atx_tgdex[tgi];
+
+	if(alarms) {
+		if(poll_alarm_count[tgi] <= 0) return NULL;
+		cur_target->alarmset.tags = poll_alarms[tgi];
+		cur_target->alarmset.tag_count = poll_alarm_count[tgi];
+		return &cur_target->alarmset;
+	}
+
+	if(poll_tag_count[tgi] <= 0) return NULL;
+	cur_target->tagset.tags = poll_tags[tgi];
+	cur_target->tagset.tag_count = poll_tag_count[tgi];
+	return &cur_target->tagset;
+}
 
-		// get current time for timestamp
-		tstampx = time(NULL);
+/*
+ * atlas_poll_group
+ *	Reads the tags, then the alarms, of a group of targets, starting from
+ *	the target at job->home and following poll_next[]. A group is a target
+ *	plus any that share its session (TFLAG_CSESSION), so it is always read
+ *	by one thread. Each target's whole tag set goes to its driver's
+ *	read_batch. Event loop drivers are started first and run together by
+ *	this thread's loop; blocking drivers are then read one after another.
+ *	Targets whose connection has been lost are skipped, and left to the
+ *	reconnect thread.
+ */
+static void atlas_poll_group(ATLAS_JOB* job) {
+	ATLAS_TARGET* cur_target;
+	ATLAS_TAGSET* set;
+	ATLAS_DRIVER* drv;
+	int queued;
+
+	// tags, then alarms; each in pass 0: event loop drivers, pass 1: blocking drivers
+	for(int alarms = 0; alarms < 2; alarms++) {
+		queued = 0;
+		for(int pass = 0; pass < 2; pass++) {
+			for(int tgi = job->home; tgi != -1; tgi = poll_next[tgi]) {
+				cur_target = atx_tgdex[tgi];
+				if(!(set = atlas_poll_set(tgi, alarms)) || !(drv = atlas_driver_get(cur_target->target_type))) continue;
+				if(((drv->caps & DCAP_EVLOOP) ? 0 : 1) != pass) continue;
+
+				// connection lost: the tags stay failed until it is re-established
+				if(atlas_rcx_open(cur_target)) {
+					zlog_debug("atlas_poll_group: Target [%s] is reconnecting. Skipping.\n",cur_target->sname);
+					continue;
+				}
+
+				zlog_debug("atlas_poll_group: Retrieving %i %s from target device [%s]...\n",set->tag_count,alarms ? "alarms" : "tags",cur_target->sname);
+				if(drv->plan && drv->plan(cur_target, set)) continue;
+				drv->read_batch(cur_target, set);
+				if(drv->caps & DCAP_EVLOOP) queued = 1;
+			}
 
-		// now, write to the realtime table. update if it exists, otherwise create it...
-		zlog_debug(">> Writing to '%s' table...\n", cur_db->tables.tag_realtime);
-		sprintf(qq,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate,flags) "
-					  "VALUES(%i,    %i,      \'%s\',%s                 ,%d     , 0) "
-					  "ON DUPLICATE KEY UPDATE %s, tupdate = %d",
-			cur_db->tables.tag_realtime,
-			curtag.id, cur_target->id, get_dtype_str(curtag.dtypei), atlas_gen_sqlargs(cur_db, &curtag, datasetsu, GENARG_INSERT), tstampx, atlas_gen_sqlargs(cur_db, &curtag, datasetter, GENARG_UPDATE), tstampx);
-		if(mysql_query(cur_db->conx,qq)) {
-			zlog_error("get_target_tags: Query failed! %i - %s [%s]\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),qq);
-			return -1;
+			if(!pass && queued) {
+				atlas_evloop_run(0);
+				for(int tgi = job->home; tgi != -1; tgi = poll_next[tgi]) {
+					cur_target = atx_tgdex[tgi];
+					if(!(set = atlas_poll_set(tgi, alarms)) || !(drv = atlas_driver_get(cur_target->target_type))) continue;
+					if(atlas_rcx_open(cur_target)) continue;
+					if(drv->caps & DCAP_EVLOOP) drv->read_done(cur_target, set);
+				}
+			}
+		}
+	}
+
+	// hand any target which lost its connection to the reconnect thread
+	for(int tgi = job->home; tgi != -1; tgi = poll_next[tgi]) {
+		if(poll_tag_count[tgi] > 0 || poll_alarm_count[tgi] > 0) atlas_rcx_check(atx_tgdex[tgi]);
+	}
+
+	// with persistence writers, values are handed over from here, not the main thread
+	if(atlas_writer_count()) {
+		for(int tgi = job->home; tgi != -1; tgi = poll_next[tgi]) {
+			if(poll_tag_count[tgi] >= 0) atlas_store_tags(job->arg, atx_tgdex[tgi], poll_tags[tgi], poll_tag_count[tgi]);
+			if(poll_alarm_count[tgi] > 0) atlas_store_alarms(job->arg, atx_tgdex[tgi], poll_alarms[tgi], poll_alarm_count[tgi]);
+		}
+	}
+}
+
+// Stores a finished group's values, and updates the targets' status (main thread)
+static void atlas_poll_store(ATLAS_JOB* job) {
+	ATLAS_DB* cur_db = job->arg;
+
+	pthread_mutex_lock(&atlas_db_lock);
+	for(int tgi = job->home; tgi != -1; tgi = poll_next[tgi]) {
+		if(poll_tag_count[tgi] >= 0) {
+			if(!atlas_writer_count() && cur_db->status == STATUS_READY) atlas_store_tags(cur_db, atx_tgdex[tgi], poll_tags[tgi], poll_tag_count[tgi]);
+			poll_tags[tgi] = NULL;
+			atx_tgdex[tgi]->tagset.tags = NULL;
+		}
+		if(poll_alarm_count[tgi] >= 0) {
+			if(!atlas_writer_count() && cur_db->status == STATUS_READY) atlas_store_alarms(cur_db, atx_tgdex[tgi], poll_alarms[tgi], poll_alarm_count[tgi]);
+			poll_alarms[tgi] = NULL;
+			atx_tgdex[tgi]->alarmset.tags = NULL;
+		}
+
+		update_cstat(cur_db, atx_tgdex[tgi]);		// update status
+	}
+	pthread_mutex_unlock(&atlas_db_lock);
+}
+
+/*
+ * atlas_poll_targets
+ *	Runs one acquisition round across all targets. Each session group is
+ *	one job; with a worker pool (--workers) the groups are read concurrently,
+ *	and stored by this thread as they finish. Without one, every target is
+ *	put in a single group, so all MC targets still run together in this
+ *	thread's event loop and the round takes as long as the slowest of them.
+ */
+void atlas_poll_targets(ATLAS_DB* cur_db) {
+	ATLAS_JOB jobs[ATLAS_MAX_TARGETS];
+	ATLAS_TARGET* cur_target;
+	int job_count = 0;
+	int leader[ATLAS_MAX_TARGETS];
+	int last = -1;
+
+	// Ensure mySQL connection is OK; without it, targets are still read from
+	// the cached tag lists if the writers can spool the values
+	if(cur_db->status != STATUS_READY && !(atlas_writer_count() && global_config.spool_dir[0])) {
+		zlog_error("atlas_poll_targets: mySQL connection not established! Cannot get tag lists.\n");
+		return;
+	}
+
+	// get the tag & alarm lists, reloading any which have changed
+	pthread_mutex_lock(&atlas_db_lock);
+	atlas_tagcache_probe(cur_db);
+	for(int tgi = 0; tgi < atx_targets; tgi++) {
+		cur_target = atx_tgdex[tgi];
+		poll_next[tgi] = -1;
+		leader[tgi] = 1;
+		poll_tag_count[tgi] = atlas_tagcache_tags(cur_db, cur_target, &poll_tags[tgi]);
+		poll_alarm_count[tgi] = atlas_tagcache_alarms(cur_db, cur_target, &poll_alarms[tgi]);
+
+		// check to see if it's disabled
+		if(cur_target->status == STATUS_DISABLED) {
+			zlog_debug("atlas_poll_targets: Target [%s] disabled. Skipping.\n",cur_target->sname);
+			set_target_msg(cur_target,"Disabled");
+			if(poll_tag_count[tgi] > 0) poll_tag_count[tgi] = 0;
+			if(poll_alarm_count[tgi] > 0) poll_alarm_count[tgi] = 0;
+		}
+	}
+	pthread_mutex_unlock(&atlas_db_lock);
+
+	if(!atx_targets) return;
+
+	if(atlas_pool_size()) {
+		// targets sharing a session follow their parent
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(!(atx_tgdex[tgi]->flags & TFLAG_CSESSION) || !atx_tgdex[tgi]->parent) continue;
+			for(int p = 0; p < atx_targets; p++) {
+				if(atx_tgdex[p] != atx_tgdex[tgi]->parent) continue;
+				poll_next[tgi] = poll_next[p];
+				poll_next[p] = tgi;
+				leader[tgi] = 0;
+				break;
+			}
 		}
 
-		// next, add new entry to history table...
-		zlog_debug(">> Writing to '%s' table...\n", cur_db->tables.tag_history);
-		sprintf(qq,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate) "
-					 "VALUES(%i,    %i,      \'%s\',%s                 ,%i) ",
-			cur_db->tables.tag_history,
-                        curtag.id, cur_target->id, get_dtype_str(curtag.dtypei), atlas_gen_sqlargs(cur_db, &curtag, datasetsu, GENARG_INSERT), tstampx);
-                if(mysql_query(cur_db->conx,qq)) {
-			// change db status to NOTREADY
-			cur_db->status = STATUS_NOTREADY;
-			cur_db->last_error = mysql_errno(cur_db->conx);
-			// log the error msg
-			zlog_error("get_target_tags: Query failed! %i - %s [%s]\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),qq);
-			return -1;
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(!leader[tgi]) continue;
+			memset(&jobs[job_count], 0, sizeof(ATLAS_JOB));
+			jobs[job_count].run = atlas_poll_group;
+			jobs[job_count].arg = cur_db;
+			jobs[job_count].home = tgi;
+			job_count++;
 		}
 
-		zlog_debug("get_target_tags: Update round for tag [%s -> %s] is complete. (timestamp = %i)\n\n",cur_target->sname,curtag.tagname,tstampx);
+		atlas_pool_run(jobs, job_count, atlas_poll_store);
+	} else {
+		// one group of everything, read from this thread
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(last != -1) poll_next[last] = tgi;
+			last = tgi;
+		}
 
+		memset(&jobs[0], 0, sizeof(ATLAS_JOB));
+		jobs[0].arg = cur_db;
+		jobs[0].home = 0;
+		atlas_poll_group(&jobs[0]);
+		atlas_poll_store(&jobs[0]);
 	}
 
+	// write the round's values (see atlas_dbwrite.c)
+	pthread_mutex_lock(&atlas_db_lock);
+	atlas_dbw_flush(&db_queue, cur_db, 0);
+	pthread_mutex_unlock(&atlas_db_lock);
+}
+
+// Checks once whether the status table has the reconnection columns (rcx_state, rcx_count, rcx_ms)
+static int cstat_has_rcx(ATLAS_DB *cur_db) {
+	static int has_rcx = -1;
+	MYSQL_RES* resultx;
+	char qq[256];
+
+	if(has_rcx != -1) return has_rcx;
+
+	sprintf(qq,"SELECT * FROM %s LIMIT 0",cur_db->tables.status);
+	if(mysql_query(cur_db->conx,qq) || !(resultx = mysql_store_result(cur_db->conx))) return 0;
+
+	has_rcx = (atlas_mysql_field(resultx, "rcx_state") != -1 &&
+		   atlas_mysql_field(resultx, "rcx_count") != -1 &&
+		   atlas_mysql_field(resultx, "rcx_ms") != -1);
 	mysql_free_result(resultx);
-	tstampx = time(NULL);
-	zlog_debug("get_target_tags: Update round for target [%s] has completed successfully! (timestamp = %i)\n\n",cur_target->sname,tstampx);
-	cur_target->last_update = tstampx;
 
-	return 0;
+	if(!has_rcx) zlog_debug("update_cstat(): No rcx_state/rcx_count/rcx_ms columns in the status table. Reconnection state is only shown in st_msg.\n");
+	return has_rcx;
 }
 
 // update status information in database...
 int update_cstat(ATLAS_DB *cur_db, ATLAS_TARGET *cur_target) {
 	char qq[2048];
+	char rcx_cols[64] = "";
+	char rcx_vals[64] = "";
+	char rcx_upd[128] = "";
+	char st_msg[600];
 	time_t tt_clock;
+	int rcx_state;
+	int rcx_count;
+	long long rcx_ms;
+	unsigned long long sum = 14695981039346656037ULL;
 
-	zlog_debug("Updating connection status info...\n");
+	if(cur_db->status != STATUS_READY) return -1;
+
+	// circuit breaker state
+	atlas_rcx_info(cur_target, &rcx_state, &rcx_count, &rcx_ms);
 
+	// only write the row when the state or message has changed (or every ATLAS_CSTAT_HEARTBEAT seconds)
 	tt_clock = time(NULL);
-	sprintf(qq,"INSERT INTO %s (sname,descx,tupdate,st_msg,statx,supdate) "
-		   "VALUES(\"%s\",\"%s\",%i,\"%s\",%i,%i) "
-		   "ON DUPLICATE KEY UPDATE tupdate = %i, st_msg = \"%s\", statx = %i, supdate = %i",
-		   	cur_db->tables.status,
-			cur_target->sname, cur_target->descx, cur_target->last_update,
-			cur_target->err_msg, cur_target->status, tt_clock, cur_target->last_update,
-			cur_target->err_msg, cur_target->status, tt_clock
+	sum = (sum ^ cur_target->status) * 1099511628211ULL;
+	sum = (sum ^ rcx_state) * 1099511628211ULL;
+	sum = (sum ^ rcx_count) * 1099511628211ULL;
+	for(char* c = cur_target->err_msg; *c; c++) sum = (sum ^ (unsigned char)*c) * 1099511628211ULL;
+	if(sum == cur_target->cstat_sum && tt_clock - cur_target->cstat_time < ATLAS_CSTAT_HEARTBEAT) return 0;
+
+	zlog_debug("Updating connection status info...\n");
+
+	if(rcx_state == RCX_OPEN) {
+		snprintf(st_msg,sizeof(st_msg),"[RECONNECTING, down %lli s] %s",rcx_ms / 1000,cur_target->err_msg);
+	} else {
+		snprintf(st_msg,sizeof(st_msg),"%s",cur_target->err_msg);
+	}
+	if(cstat_has_rcx(cur_db)) {
+		sprintf(rcx_cols,",rcx_state,rcx_count,rcx_ms");
+		sprintf(rcx_vals,",%i,%i,%lli",rcx_state,rcx_count,rcx_ms);
+		sprintf(rcx_upd,", rcx_state = %i, rcx_count = %i, rcx_ms = %lli",rcx_state,rcx_count,rcx_ms);
+	}
+
+	sprintf(qq,"INSERT INTO %s (sname,descx,tupdate,st_msg,statx,supdate%s) "
+		   "VALUES(\"%s\",\"%s\",%li,\"%s\",%i,%li%s) "
+		   "ON DUPLICATE KEY UPDATE tupdate = %li, st_msg = \"%s\", statx = %i, supdate = %li%s",
+		   	cur_db->tables.status, rcx_cols,
+			cur_target->sname, cur_target->descx, (long)cur_target->last_update,
+			st_msg, cur_target->status, (long)tt_clock, rcx_vals, (long)cur_target->last_update,
+			st_msg, cur_target->status, (long)tt_clock, rcx_upd
 	       );
 
-	mysql_query(cur_db->conx,qq);
+	if(!mysql_query(cur_db->conx,qq)) {
+		cur_target->cstat_sum = sum;
+		cur_target->cstat_time = tt_clock;
+	}
 
 	return 0;
 }
@@ -745,11 +1343,21 @@ void signal_exc(int sig) {
 }
 
 void atlas_shutdown(int errval) {
+	ATLAS_DRIVER* drv;
 	int mysql_alive = 0;
 
 	zlog_error("atlas_shutdown(): Shutting down. Disconnecting targets...\n");
 
 	atlas_mgmt_fifo_close();
+	atlas_pool_stop();
+	atlas_rcx_stop();
+
+	// values held back by history compression
+	if(global_db) {
+		for(int tgi = 0; tgi < atx_targets; tgi++) atlas_store_end(global_db, atx_tgdex[tgi]);
+	}
+	atlas_writer_stop();		// writes out everything queued
+	atlas_cvt_stop();		// writes out the current values changed since the last flush
 
 	if(global_db) {
 		if(global_db->conx) {
@@ -766,31 +1374,27 @@ void atlas_shutdown(int errval) {
 			update_cstat(global_db, atx_tgdex[tgi]);
 		}
 
-		if(!(atx_tgdex[tgi]->flags & TFLAG_CSESSION)) {
-			// Call the stop function for the appropriate target driver
-			switch(atx_tgdex[tgi]->target_type) {
-				case TARGET_LGX:
-				case TARGET_SLC:
-				case TARGET_PLC:
-					eip_stop(atx_tgdex[tgi]);
-					break;
-				case TARGET_MC:
-					mc_stop(atx_tgdex[tgi]);
-					break;
-				default:
-					break;
-			}
-		}
+		// Call the stop function for the target's driver
+		drv = atlas_driver_get(atx_tgdex[tgi]->target_type);
+		if(drv && !(atx_tgdex[tgi]->flags & TFLAG_CSESSION)) drv->stop(atx_tgdex[tgi]);
 
 		// Free this target's memory
+		atlas_free_tagset(atx_tgdex[tgi], &atx_tgdex[tgi]->tagset);
+		atlas_free_tagset(atx_tgdex[tgi], &atx_tgdex[tgi]->alarmset);
+		atlas_tagcache_free(atx_tgdex[tgi]);
 		free(atx_tgdex[tgi]);
 	}
 
+	atlas_evloop_close();
+
 	if(mysql_alive) {
+		// write any values still queued
+		atlas_dbw_flush(&db_queue, global_db, 1);
 		zlog_error("atlas_shutdown(): Closing mySQL connections.\n");
 		mysql_close(global_db->conx);
 		global_db->status = STATUS_SHUTDOWN;
 	}
+	atlas_dbw_free(&db_queue);
 
 	zlog_error("Farewell! :)\n\n");
 	exit(errval);
@@ -798,13 +1402,12 @@ void atlas_shutdown(int errval) {
 
 int main(int argc, char** argv) {
 
-	int ic_attempts;
-	int ic_attempts_max = 3;
 	int tgi;
 	int fpid;
 	int pgid;
 	int forkmode = 0;
 	int solo_driver = 0;
+	ATLAS_DRIVER* drv;
 	
 	ATLAS_DB daqdb = {
 		"localhost", "atlas_daq", "atlas", "booboocat20", 3306, 0, 0, NULL,
@@ -814,12 +1417,28 @@ int main(int argc, char** argv) {
 
 	// Global Config Default setup
 	global_config.wait_interval = 10;
-
-	// Initialize EIP error globals
-	eip_readerr = 0;    // global error indicator
-	eip_autorcx = 1;    // auto-reconnect upon failed/timed-out read
-	eip_rcxattempt = 0; // reconnect attempt counter
-	eip_maxattempts = 3;
+	global_config.mc_rtt_cost = MC_PLAN_RTT_COST;
+	global_config.mc_window = MC_PIPELINE_WINDOW;
+	global_config.mc_timeout = MC_REQUEST_TIMEOUT;
+	global_config.workers = 0;
+	global_config.connect_timeout = ATLAS_CONNECT_TIMEOUT;
+	global_config.cfg_probe = ATLAS_CFG_PROBE;
+	global_config.db_batch = ATLAS_DBW_BATCH;
+	global_config.db_flush = 0;
+	global_config.writers = ATLAS_WRITERS;
+	global_config.writer_ring = ATLAS_WRITER_RING;
+	global_config.writer_wait = ATLAS_WRITER_WAIT;
+
+	global_config.rcx_backoff_min = RCX_BACKOFF_MIN;
+	global_config.rcx_backoff_max = RCX_BACKOFF_MAX;
+	strcpy(global_config.eip_cache_dir,".");
+	strcpy(global_config.spool_dir,".");
+	global_config.spool_segment = ATLAS_SPOOL_SEGMENT;
+	global_config.spool_sync = ATLAS_SPOOL_SYNC;
+	global_config.spool_rate = ATLAS_SPOOL_RATE;
+	global_config.cvt_size = ATLAS_CVT_SIZE;
+	strcpy(global_config.cvt_shm, ATLAS_CVSHM_NAME);
+	global_config.rt_flush = ATLAS_CVT_FLUSH;
 
 	// Setup logging params
 	global_config.trace_enable = 0;
@@ -841,6 +1460,9 @@ int main(int argc, char** argv) {
 	printf("Copyright (c) 2012-2013 Jacob Hipps/Nichiha USA, Inc., all rights reserved.\n");
 	printf("Version %s (compiled %s %s)\n\n",ATLASDAQ_VERSION,__DATE__,__TIME__);
 
+	// register the built-in target drivers
+	atlas_driver_init();
+
 	// process command line params
 	char* thisarg;
 	for(int ci = 1; ci < argc; ci++) {
@@ -864,6 +1486,217 @@ int main(int argc, char** argv) {
 			global_config.db_log = 9;
 		} else if(!strcmp(thisarg,"--trace")) {
 			global_config.trace_enable = 1;
+		} else if(!strcmp(thisarg,"--mc-rttcost")) {
+			// MC read planner: cost of one round trip, in bytes
+			if(argc <= ci+1) {
+				zlog_error("error: mc-rttcost requires argument!\n");
+				exit(1);
+			}
+			global_config.mc_rtt_cost = atoi(argv[ci+1]);
+			if(global_config.mc_rtt_cost < 0) global_config.mc_rtt_cost = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--mc-window")) {
+			// MC: default number of requests in flight on 4E targets
+			if(argc <= ci+1) {
+				zlog_error("error: mc-window requires argument!\n");
+				exit(1);
+			}
+			global_config.mc_window = atoi(argv[ci+1]);
+			if(global_config.mc_window < 1) global_config.mc_window = 1;
+			if(global_config.mc_window > MC_PIPELINE_MAX_WINDOW) global_config.mc_window = MC_PIPELINE_MAX_WINDOW;
+			ci++;
+		} else if(!strcmp(thisarg,"--mc-timeout")) {
+			// MC: time to wait for each response, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: mc-timeout requires argument!\n");
+				exit(1);
+			}
+			global_config.mc_timeout = atoi(argv[ci+1]);
+			if(global_config.mc_timeout < 100) global_config.mc_timeout = 100;
+			ci++;
+		} else if(!strcmp(thisarg,"--workers")) {
+			// number of acquisition worker threads (0 = poll from the main thread)
+			if(argc <= ci+1) {
+				zlog_error("error: workers requires argument!\n");
+				exit(1);
+			}
+			global_config.workers = atoi(argv[ci+1]);
+			if(global_config.workers < 0) global_config.workers = 0;
+			if(global_config.workers > ATLAS_MAX_TARGETS) global_config.workers = ATLAS_MAX_TARGETS;
+			ci++;
+		} else if(!strcmp(thisarg,"--writers")) {
+			// number of persistence writer threads (0 = write from the main thread)
+			if(argc <= ci+1) {
+				zlog_error("error: writers requires argument!\n");
+				exit(1);
+			}
+			global_config.writers = atoi(argv[ci+1]);
+			if(global_config.writers < 0) global_config.writers = 0;
+			if(global_config.writers > ATLAS_MAX_TARGETS) global_config.writers = ATLAS_MAX_TARGETS;
+			ci++;
+		} else if(!strcmp(thisarg,"--writer-ring")) {
+			// samples each writer can hold (rounded up to a power of 2)
+			if(argc <= ci+1) {
+				zlog_error("error: writer-ring requires argument!\n");
+				exit(1);
+			}
+			global_config.writer_ring = atoi(argv[ci+1]);
+			if(global_config.writer_ring < 64) global_config.writer_ring = 64;
+			ci++;
+		} else if(!strcmp(thisarg,"--writer-wait")) {
+			// time acquisition waits for room in a full writer ring, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: writer-wait requires argument!\n");
+				exit(1);
+			}
+			global_config.writer_wait = atoi(argv[ci+1]);
+			if(global_config.writer_wait < 0) global_config.writer_wait = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--spool-dir")) {
+			// directory for the writers' store-and-forward spools ("" = don't spool)
+			if(argc <= ci+1) {
+				zlog_error("error: spool-dir requires argument!\n");
+				exit(1);
+			}
+			strncpy(global_config.spool_dir,argv[ci+1],sizeof(global_config.spool_dir)-1);
+			ci++;
+		} else if(!strcmp(thisarg,"--spool-segment")) {
+			// samples per spool segment file
+			if(argc <= ci+1) {
+				zlog_error("error: spool-segment requires argument!\n");
+				exit(1);
+			}
+			global_config.spool_segment = atoi(argv[ci+1]);
+			if(global_config.spool_segment < 1024) global_config.spool_segment = 1024;
+			ci++;
+		} else if(!strcmp(thisarg,"--spool-sync")) {
+			// time between spool syncs, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: spool-sync requires argument!\n");
+				exit(1);
+			}
+			global_config.spool_sync = atoi(argv[ci+1]);
+			if(global_config.spool_sync < 0) global_config.spool_sync = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--spool-rate")) {
+			// most samples replayed from each spool per second (0 = no limit)
+			if(argc <= ci+1) {
+				zlog_error("error: spool-rate requires argument!\n");
+				exit(1);
+			}
+			global_config.spool_rate = atoi(argv[ci+1]);
+			if(global_config.spool_rate < 0) global_config.spool_rate = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--rt-flush")) {
+			// time between realtime table flushes, in milliseconds (0 = write every value)
+			if(argc <= ci+1) {
+				zlog_error("error: rt-flush requires argument!\n");
+				exit(1);
+			}
+			global_config.rt_flush = atoi(argv[ci+1]);
+			if(global_config.rt_flush < 0) global_config.rt_flush = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--cvt-size")) {
+			// slots in the current-value table (one per tag)
+			if(argc <= ci+1) {
+				zlog_error("error: cvt-size requires argument!\n");
+				exit(1);
+			}
+			global_config.cvt_size = atoi(argv[ci+1]);
+			if(global_config.cvt_size < 0) global_config.cvt_size = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--cvt-shm")) {
+			// shared memory name of the current-value table ("none" = don't share)
+			if(argc <= ci+1) {
+				zlog_error("error: cvt-shm requires argument!\n");
+				exit(1);
+			}
+			if(!strcmp(argv[ci+1],"none")) global_config.cvt_shm[0] = 0;
+			else snprintf(global_config.cvt_shm, sizeof(global_config.cvt_shm), "%s%s", argv[ci+1][0] == '/' ? "" : "/", argv[ci+1]);
+			ci++;
+		} else if(!strcmp(thisarg,"--db-batch")) {
+			// most rows written by one multi-row INSERT
+			if(argc <= ci+1) {
+				zlog_error("error: db-batch requires argument!\n");
+				exit(1);
+			}
+			global_config.db_batch = atoi(argv[ci+1]);
+			if(global_config.db_batch < 1) global_config.db_batch = 1;
+			ci++;
+		} else if(!strcmp(thisarg,"--db-flush")) {
+			// seconds between writes of queued values (0 = every round)
+			if(argc <= ci+1) {
+				zlog_error("error: db-flush requires argument!\n");
+				exit(1);
+			}
+			global_config.db_flush = atoi(argv[ci+1]);
+			if(global_config.db_flush < 0) global_config.db_flush = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--cfg-probe")) {
+			// seconds between checks for tag configuration changes (0 = reload every round)
+			if(argc <= ci+1) {
+				zlog_error("error: cfg-probe requires argument!\n");
+				exit(1);
+			}
+			global_config.cfg_probe = atoi(argv[ci+1]);
+			if(global_config.cfg_probe < 0) global_config.cfg_probe = 0;
+			ci++;
+		} else if(!strcmp(thisarg,"--connect-timeout")) {
+			// time to wait for each TCP connection to a target, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: connect-timeout requires argument!\n");
+				exit(1);
+			}
+			global_config.connect_timeout = atoi(argv[ci+1]);
+			if(global_config.connect_timeout < 100) global_config.connect_timeout = 100;
+			ci++;
+		} else if(!strcmp(thisarg,"--rcx-min")) {
+			// first reconnect delay after a target's connection is lost, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: rcx-min requires argument!\n");
+				exit(1);
+			}
+			global_config.rcx_backoff_min = atoi(argv[ci+1]);
+			if(global_config.rcx_backoff_min < 100) global_config.rcx_backoff_min = 100;
+			ci++;
+		} else if(!strcmp(thisarg,"--rcx-max")) {
+			// longest reconnect delay, in milliseconds
+			if(argc <= ci+1) {
+				zlog_error("error: rcx-max requires argument!\n");
+				exit(1);
+			}
+			global_config.rcx_backoff_max = atoi(argv[ci+1]);
+			ci++;
+		} else if(!strcmp(thisarg,"--eip-cache")) {
+			// EIP: directory for Logix symbol cache files ("" = don't cache)
+			if(argc <= ci+1) {
+				zlog_error("error: eip-cache requires argument!\n");
+				exit(1);
+			}
+			snprintf(global_config.eip_cache_dir,sizeof(global_config.eip_cache_dir),"%s",argv[ci+1]);
+			ci++;
+		} else if(!strcmp(thisarg,"--driver")) {
+			// load a target driver from a shared object
+			if(argc <= ci+1) {
+				zlog_error("error: driver requires argument!\n");
+				exit(1);
+			}
+			if(atlas_driver_load(argv[ci+1])) exit(1);
+			ci++;
+		} else if(!strcmp(thisarg,"--bench-pool")) {
+			// measure cycle time against worker pool size with simulated PLCs, then exit
+			atlas_pool_bench((argc > ci+1) ? atoi(argv[ci+1]) : 48);
+			exit(0);
+		} else if(!strcmp(thisarg,"--bench-decode")) {
+			// compare tag name decoding with compiled tag descriptors, then exit
+			atlas_bench_decode((argc > ci+1) ? atoi(argv[ci+1]) : 100000);
+			exit(0);
+		} else if(!strcmp(thisarg,"--selftest-framing")) {
+			// feed fragmented & coalesced frames through the framing reader, then exit
+			exit(atlas_framer_selftest() ? 1 : 0);
+		} else if(!strcmp(thisarg,"--selftest-pccc")) {
+			// check SLC 500 & PLC-5 address compiling, typed read encoding & reply parsing, then exit
+			exit(eip_pccc_selftest() ? 1 : 0);
 		} else if(!strcmp(thisarg,"--solo")) {
 			if(argc <= ci+1) {
 				zlog_error("error: solo requires argument!\n");
@@ -877,6 +1710,8 @@ int main(int argc, char** argv) {
 		}
 	}
 	
+	if(global_config.rcx_backoff_max < global_config.rcx_backoff_min) global_config.rcx_backoff_max = global_config.rcx_backoff_min;
+
 	// XXX-DEBUG FIXME
 	melsec_read_wcd("comment_test.wcd");
 
@@ -897,9 +1732,10 @@ int main(int argc, char** argv) {
 
 	if(solo_driver) zlog_warn("[SOLO MODE ACTIVE] Target = %i",solo_driver);
 
-	// Initialize the connection to the target devices
+	// Initialize the connection to the target devices. Each is handed to the
+	// reconnect thread, which connects them all concurrently; acquisition of
+	// each target begins with the first round after it is connected.
 	for(tgi = 0; tgi < atx_targets; tgi++) {
-		ic_attempts = 0;
 
 		// set all other targets to "disabled" in solo mode
 		if(solo_driver && tgi != (solo_driver - 1)) {
@@ -913,43 +1749,40 @@ int main(int argc, char** argv) {
 		// Check for and handle shared sessions
 		if(atx_tgdex[tgi]->flags & TFLAG_CSESSION) {
 			if(session_share_setup(atx_tgdex[tgi]) != -1) {
-				zlog_debug("[%i]** Shared session setup completed successfully! Target ready.\n");
-				atx_tgdex[tgi]->status = STATUS_READY;
+				zlog_debug("[%i]** Shared session setup completed successfully! Waiting on [%s].\n",tgi,atx_tgdex[tgi]->parent->sname);
 			}
+		} else if((drv = atlas_driver_get(atx_tgdex[tgi]->target_type)) != NULL) {
+			zlog_debug("[%i]** Using driver [%s]\n",tgi,drv->name);
+			atx_tgdex[tgi]->status = STATUS_NOTREADY;
+			atlas_rcx_connect(atx_tgdex[tgi]);
 		} else {
-			switch(atx_tgdex[tgi]->target_type) {
-				case TARGET_LGX:
-				case TARGET_SLC:
-				case TARGET_PLC:
-					while(atx_tgdex[tgi]->status != STATUS_READY && ic_attempts < ic_attempts_max) {
-						eip_start(atx_tgdex[tgi]);
-						ic_attempts++;
-					}
-					break;
-				case TARGET_MC:
-					// Mitsubishi Q - MC Protocol (ミツビシ MC プロトコル)
-					while(atx_tgdex[tgi]->status != STATUS_READY && ic_attempts < ic_attempts_max) {
-						mc_start(atx_tgdex[tgi]);
-						ic_attempts++;
-					}
-					break;
-				case TARGET_KEY:
-					// TODO - Keyence EtherNet/IP Protocol.
-					//        Should (maybe? hopefully!?) be able to use
-					//        eip_start() and TuxEip library for Keyence stuff!
-					break;
-				default:
-					zlog_error("ERROR: Unhandled target device type [%i]! This target will be disabled.\n",atx_tgdex[tgi]->target_type);
-					atx_tgdex[tgi]->status = STATUS_DISABLED;
-			}
-		}
-
-		if(atx_tgdex[tgi]->status == STATUS_READY) {
-			if(atx_tgdex[tgi]->flags & TFLAG_CSESSION) zlog_info("[INIT] Successfully associated [%s] to parent connection [%s]\n",atx_tgdex[tgi]->sname,atx_tgdex[tgi]->parent->sname);
-			else zlog_info("[INIT] Successfully connected to %s [%02i/%s] at %s\n",atx_tgdex[tgi]->descx,atx_tgdex[tgi]->id,atx_tgdex[tgi]->sname,atx_tgdex[tgi]->ip_addr);
+			// TODO - Keyence EtherNet/IP Protocol (TARGET_KEY) has no driver yet.
+			//        Should (maybe? hopefully!?) be able to use
+			//        eip_start() and TuxEip library for Keyence stuff!
+			zlog_error("ERROR: Unhandled target device type [%i]! This target will be disabled.\n",atx_tgdex[tgi]->target_type);
+			atx_tgdex[tgi]->status = STATUS_DISABLED;
 		}
 	}
 
+	// start connecting, and reconnecting lost targets, in the background
+	if(atlas_rcx_start()) {
+		zlog_error("[INIT] Unable to start the reconnect thread! Targets will not be connected.\n");
+	}
+
+	// start the acquisition workers
+	if(global_config.workers && atlas_pool_start(global_config.workers)) {
+		zlog_error("[INIT] Unable to start acquisition workers! Polling from the main thread.\n");
+	}
+
+	// start the persistence writers
+	if(global_config.writers && atlas_writer_start(&daqdb, global_config.writers)) {
+		zlog_error("[INIT] Unable to start persistence writers! Writing from the main thread.\n");
+	}
+
+	// start the current-value table (shared with local readers), and its write-behind flusher for the realtime table
+	if((global_config.rt_flush || global_config.cvt_shm[0]) && atlas_cvt_start(&daqdb)) {
+		zlog_error("[INIT] Unable to start the current-value table! Writing every value to the realtime table.\n");
+	}
 
 	eip_enum_taglist(atx_tgdex[solo_driver]);
 	atlas_shutdown(0);
@@ -973,14 +1806,12 @@ int main(int argc, char** argv) {
 	// Main acquisition loop
 	zlog_info("[INIT] Startup complete! Entering main acquisition loop. Cycle time is %i seconds.\n",global_config.wait_interval);
 	while(1) {
-		for(tgi = 0; tgi < atx_targets; tgi++) {
-			get_target_tags(&daqdb, atx_tgdex[tgi]);	// update tags
-			update_cstat(&daqdb, atx_tgdex[tgi]);		// update status
-		}
+		atlas_poll_targets(&daqdb);			// update tags & status
 		// check to ensure mySQL connection is still up...
 		if(daqdb.status != STATUS_READY) {
 			zlog_error("[mySQL] mySQL connection is NOT ready! Attempting to re-establish connectivity...\n");
-			//mysql_close(&daqdb);
+			if(daqdb.conx) mysql_close(daqdb.conx);
+			daqdb.conx = NULL;
 			if(atlas_mysql_init(&daqdb) == STATUS_READY) {
 				zlog_error("[mySQL] Connection re-established OK! :)\n");
 			}
@@ -9,8 +9,10 @@
 
 */
 
+#include <pthread.h>
 #include <mysql.h>
 #include "../tuxeip/tuxeip/src/TuxEip.h"
+#include "atlas_cvshm.h"
 
 // Compile-time Defines /////////////////////////////////////////////
 #define ATLASDAQ_VERSION "0.04"
@@ -25,9 +27,19 @@
 #define TARGET_PLC	1	// PLC5 E/IP
 #define TARGET_MC	4	// Mitsubishi - MC Protocol, Type 3E, Binary
 #define TARGET_KEY	5	// Keyence E/IP
+#define TARGET_MAXNUM	15	// highest target type a driver can be registered for
+
+// Driver API (ATLAS_DRIVER)
+#define ATLAS_DRIVER_API	1	// version of ATLAS_DRIVER; bumped when its layout changes
+#define DCAP_BATCH	1	// read_batch packs several tags into each request
+#define DCAP_EVLOOP	2	// read_batch queues requests on the thread's event loop; finish with read_done
+#define DCAP_SHARE	4	// targets may share a connection session (TFLAG_CSESSION)
+#define DCAP_WRITE	8	// write_batch is implemented
 
 // Target flags
 #define TFLAG_CSESSION	1 	// Share a connection session with another target
+#define TFLAG_MC_4E	2	// MC: use 4E framing (serial numbers), allowing several requests in flight
+#define TFLAG_MC_MONITOR 4	// MC: register scattered tags as a monitor set [0801] and read them with Monitor [0802]
 
 // Status
 #define STATUS_NOTREADY	0	// Not Ready/Uninitialized
@@ -37,11 +49,17 @@
 #define STATUS_SHUTDOWN 254	// Shutdown
 #define STATUS_DISABLED 255	// Disabled
 
+// Connection circuit breaker states (see atlas_rcx.c)
+#define RCX_CLOSED	0	// connected; the target is read each round
+#define RCX_OPEN	1	// connection lost; skipped while the reconnect thread retries it
+
 // EIP data types
 #define EIP_DTYPE_BOOL	193	// Bit/Boolean (BOOL)
 #define EIP_DTYPE_ASC	194	// ASCII/Byte (SINT)
+#define EIP_DTYPE_SINT16 195	// Integer (INT)
 #define EIP_DTYPE_INT	196	// Integer (DINT)
 #define EIP_DTYPE_FLP	202	// Float (REAL)
+#define EIP_DTYPE_DWORD	211	// Bit array (DWORD)
 
 // Data types
 #define DTYPE_RET_INT	1
@@ -50,6 +68,13 @@
 #define DTYPE_RET_BOOL	4
 #define DTYPE_MAXNUM	4 	// max dtype index value
 
+// Driver read result codes (ATLAS_RSTATUS.code)
+#define RSTAT_OK	0	// value read
+#define RSTAT_NOTREADY	1	// target not connected (left to the reconnect thread)
+#define RSTAT_COMFAIL	2	// communication failure (the connection has been dropped)
+#define RSTAT_PROTO	3	// target refused the request (see proto_err)
+#define RSTAT_DTYPE	4	// target returned a data type which can't be converted
+
 // Data class types
 #define DCLASS_STATS	1
 #define DCLASS_ALARMS	2
@@ -70,6 +95,59 @@
 
 // Fixed limits
 #define ATLAS_MAX_TARGETS	128	// Size of atx_tgdex[] array
+#define ATLAS_CIP_PATH_MAX	128	// Max size of a compiled CIP symbolic path, in bytes
+
+// MC read planner defaults
+#define MC_PLAN_RTT_COST	256	// cost of one round trip, in equivalent data bytes
+#define MC_PIPELINE_WINDOW	4	// default number of MC requests in flight per connection (4E only)
+#define MC_PIPELINE_MAX_WINDOW	32	// max MC requests in flight per connection
+#define MC_SESSION_RXBUF	16384	// MC receive ring size (holds several pipelined responses)
+#define MC_REQUEST_TIMEOUT	3000	// default time to wait for an MC response, in milliseconds
+#define MC_PORT_CANDIDATES	8	// MC: ports tried from port_num up, in parallel
+
+// Tag configuration cache
+#define ATLAS_CFG_PROBE		60	// default seconds between checks for tag configuration changes
+#define CFG_TAGS		1	// ATLAS_TARGET.cfg_loaded: tag list is cached and current
+#define CFG_ALARMS		2	// ATLAS_TARGET.cfg_loaded: alarm list is cached and current
+
+// Batched database writes
+#define ATLAS_DBW_BATCH		500	// default most rows written by one multi-row INSERT
+#define ATLAS_DBW_MAX_ROW	640	// longest queued row, as SQL
+#define ATLAS_DBW_MAX_STMT	(512*1024)	// statements are cut at this size (keeps under max_allowed_packet)
+#define SAMPLE_HISTORY		1	// ATLAS_SAMPLE.flags: write to the history table
+#define SAMPLE_REALTIME		2	// ATLAS_SAMPLE.flags: write to the realtime table
+#define SAMPLE_ALARM		4	// ATLAS_SAMPLE.flags: write to the alarm history table (alarm tags only)
+
+// History compression (taglist.comp_mode)
+#define COMP_NONE		0	// every value is written to history
+#define COMP_DEADBAND		1	// exception deadband: written when it moves more than comp_dev
+#define COMP_SWINGDOOR		2	// swinging door: written when a line can't pass within comp_dev of the values since the last
+
+// Persistence writers
+#define ATLAS_WRITERS		1	// default number of writer threads
+#define ATLAS_WRITER_RING	16384	// default samples per writer ring (rounded up to a power of 2)
+#define ATLAS_WRITER_WAIT	50	// default time a push waits for room in a full ring, in milliseconds
+#define ATLAS_WRITER_RETRY	5000	// time between reconnects of a writer's database connection, in milliseconds
+#define ATLAS_WRITER_LINGER	10	// time a writer waits for more samples before writing a partial batch, in milliseconds
+
+// Store-and-forward spool
+#define ATLAS_SPOOL_SEGMENT	65536	// default samples per spool segment file
+#define ATLAS_SPOOL_SYNC	200	// default time between spool syncs (group commit), in milliseconds
+#define ATLAS_SPOOL_RATE	20000	// default most samples replayed per second (0 = no limit)
+
+// Current-value table
+#define ATLAS_CVT_SIZE		16384	// default slots in the current-value table (one per tag)
+#define ATLAS_CVT_FLUSH		1000	// default time between realtime table flushes, in milliseconds (0 = write every value)
+#define ATLAS_CVT_ALIVE		1000	// time between updates of the shared table's alive_ms, in milliseconds
+#define ATLAS_CSTAT_HEARTBEAT	60	// seconds between status row writes while nothing changes
+
+// Sockets
+#define ATLAS_SOCK_MAX_PORTS	16	// most candidate ports connected to at once
+#define ATLAS_CONNECT_TIMEOUT	3000	// default time to wait for a TCP connection, in milliseconds
+
+// Reconnection
+#define RCX_BACKOFF_MIN		1000	// default first reconnect delay, in milliseconds
+#define RCX_BACKOFF_MAX		60000	// default longest reconnect delay, in milliseconds
 
 // Program fatal errors
 #define EFATAL_BREAK		1
@@ -100,6 +178,27 @@ typedef struct {
 	int db_log;
 	int trace_enable;
 	int wait_interval;
+	int mc_rtt_cost;		// MC read planner: cost of one round trip, in bytes
+	int mc_window;			// MC: default pipelining window for 4E targets
+	int mc_timeout;			// MC: time to wait for each response, in milliseconds
+	int workers;			// acquisition worker threads (0 = poll from the main thread)
+	int connect_timeout;		// time to wait for a TCP connection, in milliseconds
+	int cfg_probe;			// seconds between checks for tag configuration changes (0 = reload every round)
+	int db_batch;			// most rows written by one multi-row INSERT
+	int db_flush;			// seconds between writes of queued values (0 = every round)
+	int writers;			// persistence writer threads (0 = write from the main thread)
+	int writer_ring;		// samples per writer ring
+	int writer_wait;		// time a push waits for room in a full ring, in milliseconds
+	char spool_dir[128];		// directory for the writers' spools ("" = don't spool)
+	int spool_segment;		// samples per spool segment file
+	int spool_sync;			// time between spool syncs, in milliseconds
+	int spool_rate;			// most samples replayed from a spool per second, per writer (0 = no limit)
+	int cvt_size;			// slots in the current-value table
+	int rt_flush;			// time between realtime table flushes, in milliseconds (0 = write every value)
+	char cvt_shm[64];		// shm_open() name of the shared current-value table ("" = not shared)
+	int rcx_backoff_min;		// first reconnect delay, in milliseconds (doubled after each failed attempt)
+	int rcx_backoff_max;		// longest reconnect delay, in milliseconds
+	char eip_cache_dir[128];	// EIP: directory for Logix symbol cache files ("" = don't cache)
 } GCONFIG;
 
 
@@ -116,14 +215,57 @@ typedef struct {
 	char sin_zero[8];
 } ATLAS_SOCKADDR_IN;
 
-// Atlas drivers' session/connection data
+// Framing reader: returns the length of the frame starting at data, 0 if more than avail
+// bytes are needed to tell, or -1 if data is not a valid frame header
+typedef int (*ATLAS_FRAMELEN_FN)(unsigned char* data, int avail);
+
+// Framing reader: per-connection receive ring (atlas_frame.c)
 typedef struct {
+	unsigned char* buf;		// ring storage, followed by a mirror of its first max_frame bytes
+	int size;			// ring size (power of 2)
+	int max_frame;			// largest valid frame
+	unsigned int head;		// stream offset of the first unconsumed byte
+	unsigned int tail;		// stream offset of the end of received data
+	int error;			// stream is corrupt; reset before further use
+	ATLAS_FRAMELEN_FN frame_len;	// protocol's frame length function
+} ATLAS_FRAMER;
+
+// Atlas drivers' session/connection data
+typedef struct sATLAS_MCS {
 	int sock_fd;
 	ATLAS_SOCKADDR_IN servaddr;
 	char ip_addr[64];
 	int port_num;
+	unsigned short serial;		// MC: next 4E serial number
+	ATLAS_FRAMER rx;		// MC: received data not yet consumed
+	int monitor_registered;		// MC: monitor set registered on this connection
+	int ev_events;			// event loop: socket events waited for (0 = not in the loop)
+	long long ev_deadline;		// event loop: when to call ev_handler if nothing happens (monotonic ms, 0 = never)
+	int (*ev_handler)(struct sATLAS_MCS* mcs, int events);	// event loop: driver's handler; events = 0 when ev_deadline passes. Returns 1 when idle
+	struct sATLAS_MC_PREQ* q_head;	// MC: requests waiting to be sent
+	struct sATLAS_MC_PREQ* q_tail;
+	struct sATLAS_MC_PREQ* q_inflight[MC_PIPELINE_MAX_WINDOW];	// MC: requests sent, awaiting their response
+	int q_inflight_count;
+	unsigned char* tx_buf;		// MC: frame being sent, when not pre-serialized
+	unsigned char* tx_ptr;		// MC: frame being sent (NULL = none)
+	int tx_sz;			// MC: size of tx_ptr
+	int tx_off;			// MC: bytes of tx_ptr already sent
 } ATLAS_MCS;
 
+// MC read plan (defined in drivers/melsec_mc/melsec.h)
+typedef struct sATLAS_MC_PLAN ATLAS_MC_PLAN;
+
+// EIP symbol & template cache (defined in drivers/eip/eip.h)
+typedef struct sEIP_CACHE EIP_CACHE;
+
+// A set of compiled tags, read together by a driver's read_batch
+typedef struct {
+	struct sATLAS_TAG* tags;	// tags (the same array each cycle, until the configuration changes)
+	int tag_count;
+	void* plan;			// driver's read plan for these tags, kept between cycles (see ATLAS_DRIVER)
+	int failed;			// number of tags whose read failed in the last read_batch
+} ATLAS_TAGSET;
+
 // Target Device typedef (PLC connection info and upkeep ptrs)
 typedef struct sATLAS_TARGET {
 	int id;				// id number from database
@@ -151,10 +293,82 @@ typedef struct sATLAS_TARGET {
 	int session_target;		// target to share a connection session
 	struct sATLAS_TARGET *parent;	// pointer to parent
 	int flags;
+	int mc_window;			// MC: requests in flight (4E only, 0 = global default)
+	unsigned char mc_station[5];	// MC: compiled station header (network, PC, dest I/O [LE], dest station)
+	int mc_station_ok;		// MC: 1 once mc_station has been compiled from path_str
+	int rcx_state;			// RCX_CLOSED or RCX_OPEN (owned by atlas_rcx.c)
+	int rcx_busy;			// 1 while a connection attempt is running
+	int rcx_first;			// 1 until the first connection has been made
+	int rcx_count;			// reconnect attempts since the breaker opened
+	int rcx_total;			// reconnect attempts, in total
+	int rcx_backoff;		// current reconnect delay, in milliseconds
+	long long rcx_next;		// time of the next attempt (atlas_evloop_now())
+	long long rcx_opened;		// time the breaker opened
+	long long rcx_open_ms;		// time spent with the breaker open, before the current outage
+	int last_rstat;			// RSTAT_* code of the last failed read
+	int eip_tns;			// EIP: next PCCC transaction number (SLC/PLC)
+	EIP_CACHE *eip_cache;		// EIP: controller's symbols & structure templates (Logix)
+	struct sATLAS_TAG *cfg_tags;	// cached tag list (see atlas_tagcache.c)
+	int cfg_tag_count;
+	struct sATLAS_ALARM *cfg_alarms;	// cached alarm list
+	struct sATLAS_TAG *cfg_alarm_tags;	// the cached alarms' tags, read each round as alarmset
+	int cfg_alarm_count;
+	int cfg_loaded;			// CFG_* flags: lists which are cached and current
+	ATLAS_TAGSET tagset;		// tags acquired each cycle
+	ATLAS_TAGSET alarmset;		// alarm tags
+	unsigned long long comp_in;	// values read, for history compression (see atlas_compress.c)
+	unsigned long long comp_out;	// values written to history
+	unsigned long long cstat_sum;	// status row last written: hash of its state & message (see update_cstat())
+	time_t cstat_time;		// time it was written
 } ATLAS_TARGET;
 
+// Value returned by a driver read
+typedef struct {
+	int dtype;			// DTYPE_RET_INT, DTYPE_RET_FLOAT or DTYPE_RET_BOOL, as read from the target
+	int v_int;			// value, as an integer
+	float v_float;			// value, as a float
+} ATLAS_VALUE;
+
+// Outcome of a driver read
+typedef struct {
+	int code;			// RSTAT_* code
+	int proto_err;			// error code returned by the target, if any
+} ATLAS_RSTATUS;
+
 
+// History compression settings & state of a tag (atlas_compress.c)
 typedef struct {
+	int mode;			// COMP_*
+	double dev;			// deviation allowed, in the tag's units
+	long long max_ms;		// heartbeat: longest time between history values (0 = none)
+	int started;			// 1 once a value has been written (the segment's start)
+	long long arch_t;		// last value written: time, in milliseconds
+	double arch_v;			// last value written (strings: hash)
+	int held;			// 1 if the last value read hasn't been written
+	long long held_t;		// last value read: time
+	double held_v;			// last value read
+	double slope_hi;		// swinging door: upper & lower slopes, per millisecond
+	double slope_lo;
+	unsigned long long in;		// values read
+	unsigned long long out;		// values written to history
+} ATLAS_COMP;
+
+// Compiled tag descriptor, filled in once when the tag is loaded (see atlas_compile_tag())
+typedef struct {
+	unsigned char compiled;		// 1 = descriptor is valid
+	unsigned char dev_code;		// MC: device type code
+	unsigned char dflags;		// MC: device flags
+	signed char cip_bit;		// EIP: bit number within the value, or -1
+	unsigned char pccc_type;	// EIP (SLC/PLC): data file type
+	unsigned char pccc_sub;		// EIP (SLC/PLC): word within the element (timers, counters & controls)
+	unsigned short pccc_file;	// EIP (SLC/PLC): data file number
+	unsigned short pccc_elem;	// EIP (SLC/PLC): element number
+	int dev_num;			// MC: device number (24-bit address)
+	int cip_path_sz;		// EIP: size of cip_path, in bytes
+	unsigned char cip_path[ATLAS_CIP_PATH_MAX];	// EIP: encoded CIP symbolic path
+} ATLAS_TAGDESC;
+
+typedef struct sATLAS_TAG {
 	int id;				// id number from database
 	int target_id;			// target id
 	int target_index;		// target index
@@ -164,11 +378,31 @@ typedef struct {
 	int v_int;			// value: integer
 	float v_float;			// value: float
 	char v_str[256];		// value: string
+	int read_status;		// result of last read (0 = OK, -1 = failed)
+	ATLAS_TAGDESC desc;		// compiled tag descriptor
+	ATLAS_COMP comp;		// history compression (see atlas_compress.c)
+	int cv_slot;			// slot in the current-value table, or -1 (see atlas_cvt.c)
 	//ATLAS_TARGET* host;		// pointer to host target
 } ATLAS_TAG;
 
-
+// Target driver descriptor, registered for each TARGET_* type it handles (atlas_driver.c).
+// Entries other than start, stop and read_batch may be NULL.
 typedef struct {
+	int api_version;		// ATLAS_DRIVER_API
+	char name[16];
+	int caps;			// DCAP_* flags
+	int (*start)(ATLAS_TARGET* t);					// connect; 0 on success
+	void (*stop)(ATLAS_TARGET* t);					// disconnect
+	int (*compile_tag)(ATLAS_TARGET* t, ATLAS_TAG* curtag);		// fill in curtag->desc when the tag is loaded; 0 if compiled
+	int (*plan)(ATLAS_TARGET* t, ATLAS_TAGSET* set);		// (re)build set->plan for set->tags, if they changed
+	void (*plan_free)(ATLAS_TARGET* t, ATLAS_TAGSET* set);		// free set->plan
+	int (*read_batch)(ATLAS_TARGET* t, ATLAS_TAGSET* set);		// read (or with DCAP_EVLOOP, queue) the whole set; sets each tag's read_status
+	int (*read_done)(ATLAS_TARGET* t, ATLAS_TAGSET* set);		// DCAP_EVLOOP: collect the results, after the event loop has run
+	int (*write_batch)(ATLAS_TARGET* t, ATLAS_TAGSET* set);		// DCAP_WRITE: write each tag's value to the target
+} ATLAS_DRIVER;
+
+
+typedef struct sATLAS_ALARM {
 	ATLAS_TAG tag;			// tag data
 	int parent_id;			// parent id from database
 	int parent_index;		// parent index in array
@@ -224,6 +458,98 @@ typedef struct {
 	float runtime;
 } ATLAS_FTRACER;
 
+// Tag value, as queued for the database (atlas_dbwrite.c, atlas_writer.c)
+typedef struct {
+	int tag_id;
+	int target_id;
+	int dtypei;			// data type (DTYPE_RET_*)
+	int v_int;
+	float v_float;
+	char v_str[256];
+	time_t tstamp;			// time of the read
+	long long queued;		// atlas_evloop_now() when queued (for writer lag)
+	int flags;			// SAMPLE_* tables to write to
+} ATLAS_SAMPLE;
+
+// Rows queued for one table (atlas_dbwrite.c)
+typedef struct {
+	char* rows;			// rows, each "(...)", back to back
+	int len;
+	int cap;
+	int* row_end;			// offset of the end of each row in rows
+	int row_count;
+	int row_cap;
+} ATLAS_DBW_QUEUE;
+
+// Queue of history, realtime & alarm history rows, written in batches (atlas_dbwrite.c)
+typedef struct {
+	ATLAS_DBW_QUEUE history;
+	ATLAS_DBW_QUEUE realtime;
+	ATLAS_DBW_QUEUE alarms;		// alarm history
+	time_t last_flush;
+	int history_only;		// set to queue no realtime rows (spool replay: realtime already has newer values)
+	int samples;			// samples queued
+	long long oldest;		// queued time of the oldest row waiting (0 = none)
+	long long lag_ms;		// queued-to-commit time of the oldest row of the last flush
+	unsigned long long written;	// samples written, in total
+	unsigned long long dropped;	// samples dropped (failed writes), in total
+	char* stmt;			// statement being built by a flush
+	int stmt_cap;
+} ATLAS_DBW;
+
+// Store-and-forward spool of one writer (atlas_spool.c)
+typedef struct sATLAS_SPOOL_SEG ATLAS_SPOOL_SEG;
+typedef struct {
+	int wid;			// writer
+	unsigned int capacity;		// samples per new segment
+	unsigned int rseg;		// segment being replayed
+	unsigned int wseg;		// segment being appended to
+	ATLAS_SPOOL_SEG* rmap;		// mapped segments (may be the same)
+	ATLAS_SPOOL_SEG* wmap;
+	unsigned int wcount;		// samples appended to wmap (synced or not)
+	int rdirty;			// replay position changed since the last sync
+	long long last_sync;		// atlas_evloop_now() of the last sync
+	long long pending;		// samples not yet replayed
+	long long bytes;		// size of the segment files
+} ATLAS_SPOOL;
+
+// Persistence writer statistics (atlas_writer.c)
+typedef struct {
+	int depth;			// samples waiting in the ring
+	int ring_size;
+	unsigned long long written;	// samples written to the database
+	unsigned long long dropped;	// samples dropped: ring full after waiting, or a failed write
+	unsigned long long waits;	// pushes which found the ring full and waited (backpressure)
+	long long lag_ms;		// queued-to-commit time of the last batch
+	int db_status;			// status of the writer's connection
+	long long spooled;		// samples in the spool, waiting to be replayed
+	long long spool_bytes;		// size of the spool on disk
+	time_t spool_oldest;		// timestamp of the oldest sample in the spool (0 = none)
+	int replay_rate;		// samples replayed in the last second
+} ATLAS_WRITER_STATS;
+
+// Current-value table statistics (atlas_cvt.c)
+typedef struct {
+	int slots;			// slots in use
+	int size;			// slots in the table
+	int dirty;			// values changed since the last flush
+	unsigned long long changes;	// values changed, in total
+	unsigned long long written;	// realtime rows written
+	unsigned long long flushes;
+	long long flush_ms;		// time taken by the last flush
+	int db_status;			// status of the flusher's connection
+	int shared;			// 1 if the table is in shared memory (global_config.cvt_shm)
+} ATLAS_CVT_STATS;
+
+// Worker pool job (atlas_pool.c)
+typedef struct sATLAS_JOB {
+	void (*run)(struct sATLAS_JOB* job);	// called on a worker thread
+	void* arg;
+	int arg_count;
+	int home;			// job is dealt to worker (home % pool size)
+	int worker;			// worker which ran the job
+} ATLAS_JOB;
+
 // Superglobal export definitions ///////////////////////////////////
 #ifdef _MAIN_FILE
 	#define ZEXPORT
@@ -238,11 +564,6 @@ typedef struct {
 #define zlog_error(a...)	logthis(0,__FILE__,__LINE__,0,a)
 #define zlog_event(a,b...)	logthis(2,__FILE__,__LINE__,a,b)
 
-// EIP Readtag macros ///////////////////////////////////////////////
-#define eip_readtag_int(a,b)		(int)eip_readtag(a,b,NULL)
-#define eip_readtag_float(a,b)		(float)eip_readtag(a,b,NULL)
-#define eip_readtag_str(a,b)		(char*)eip_readtag(a,b,NULL)
-
 // Function debug asserts ///////////////////////////////////////////
 #define ATLS_ASSERT_NULLPTR(a,z)		if(!a) { zlog_error("**ASSERT FAIL: [%s] pointer is NULL! [@ %s/Line %i/%s] \n",a,__FILE__,__LINE__,__func__); return z; }
 #define ATLS_ASSERT_NONPOS(a,z)			if(!a) { zlog_error("**ASSERT FAIL: [%s] is non-positive! [@ %s/Line %i/%s] \n",a,__FILE__,__LINE__,__func__); return z; }
@@ -256,17 +577,14 @@ typedef struct {
 
 // Superglobal variables ////////////////////////////////////////////
 ZEXPORT GCONFIG global_config;
+ZEXPORT ATLAS_DB *global_db;
+ZEXPORT pthread_mutex_t atlas_db_lock;	// held while using a mySQL connection
 
 ZEXPORT int atx_targets;
 ZEXPORT int atx_alarms;
 ZEXPORT ATLAS_TARGET* atx_tgdex[ATLAS_MAX_TARGETS];
 ZEXPORT ATLAS_ALARM** atx_aldex;
 
-ZEXPORT int eip_readerr;	// global error indicator
-ZEXPORT int eip_autorcx;	// auto-reconnect upon failed/timed-out read
-ZEXPORT int eip_rcxattempt;	// reconnect attempt counter
-ZEXPORT int eip_maxattempts;
-
 /////////////////////////////////////////////////////////////////////
 // Function prototypes //////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////
@@ -277,34 +595,104 @@ ZEXPORT int eip_maxattempts;
 
 int eip_start(ATLAS_TARGET* cur_device);
 int eip_stop(ATLAS_TARGET* cur_device);
-void* eip_readtag(char* tagname, ATLAS_TARGET* cur_device, int* dtype_ret);
+int eip_readtag(ATLAS_TARGET* cur_device, char* tagname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst);
 int eip_genpath(unsigned char** target_ptr, int num_nodes, ...);
 int eip_enum_taglist(ATLAS_TARGET* cur_device);
+int eip_compile_tag(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag);
+int eip_readtag_desc(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag, ATLAS_VALUE* val, ATLAS_RSTATUS* rst);
+int eip_read_batch(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set);
+int eip_tagset_plan(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set);
+void eip_tagset_free(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set);
+int eip_cip_request(ATLAS_TARGET* cur_device, unsigned char service, unsigned char* path, int path_sz, void* reqdata, int reqdata_sz, unsigned char* outbuf, int outbuf_sz, int* gstatus);
+int eip_pccc_selftest();
 
 // MC Interface //
 
 int mc_start(ATLAS_TARGET* atag);
 void mc_stop(ATLAS_TARGET* atag);
-void* mc_readword(char* devname, ATLAS_TARGET* atag);
-int mc_readbit(char *devname, ATLAS_TARGET* atag);
+int mc_readword(ATLAS_TARGET* atag, char* devname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst);
+int mc_readbit(ATLAS_TARGET* atag, char* devname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst);
 int mc_decode_device(char* devstr, unsigned char* dcode, int* dnum);
-int mc_batch_read(char* devname, ATLAS_TARGET* atag, void* outbuf, unsigned short seq);
+int mc_batch_read(char* devname, ATLAS_TARGET* atag, void* outbuf, unsigned short seq, int bitunits);
+
+int mc_request(ATLAS_TARGET* atag, unsigned short command, unsigned short subcommand, unsigned char* reqdata, int reqdata_sz, void* outbuf, int outbuf_sz, char* desc);
+int mc_batch_read_dev(ATLAS_TARGET* atag, unsigned char dev_code, int head_dev, void* outbuf, unsigned short seq, int bitunits);
+
+ATLAS_MC_PLAN* mc_plan_build(ATLAS_TARGET* atag, ATLAS_TAG** taglist, int tag_count);
+void mc_plan_free(ATLAS_MC_PLAN* plan);
+int mc_plan_read(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan);
+int mc_plan_start(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan);
+int mc_plan_finish(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan);
+void mc_plan_print(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan);
+int mc_tagset_plan(ATLAS_TARGET* atag, ATLAS_TAGSET* set);
+void mc_tagset_free(ATLAS_TARGET* atag, ATLAS_TAGSET* set);
+int mc_tagset_read(ATLAS_TARGET* atag, ATLAS_TAGSET* set);
+int mc_tagset_done(ATLAS_TARGET* atag, ATLAS_TAGSET* set);
+int mc_monitor_register(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan);
+int mc_compile_tag(ATLAS_TARGET* atag, ATLAS_TAG* curtag);
+int mc_compile_station(ATLAS_TARGET* atag);
 
 char* mc_get_dev_from_val(unsigned char val);
 int melsec_read_wcd(char* fname);
 
+// Driver registry //////////////////////////////////////////////////
+
+extern ATLAS_DRIVER eip_driver;		// drivers/eip/eip.c
+extern ATLAS_DRIVER mc_driver;		// drivers/melsec_mc/melsec.c
+
+void atlas_driver_init();
+int atlas_driver_register(int target_type, ATLAS_DRIVER* drv);
+ATLAS_DRIVER* atlas_driver_get(int target_type);
+int atlas_driver_load(char* so_path);
+int atlas_read_tagset(ATLAS_TARGET* cur_target, ATLAS_TAGSET* set);
+void atlas_free_tagset(ATLAS_TARGET* cur_target, ATLAS_TAGSET* set);
+
+
 // Database functions ///////////////////////////////////////////////
 
 // mySQL //
 int atlas_mysql_init(ATLAS_DB* target_db);
 char* atlas_gen_sqlargs(ATLAS_DB* curdb, ATLAS_TAG* curtag, char* outstr, int argtype);
+char* get_dtype_str(int dtypei);
+int atlas_mysql_field(MYSQL_RES* resultx, char* fieldname);
 
 // Data Handling //
 int atlas_readtag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag);
+void atlas_tag_setval(ATLAS_TAG* curtag, ATLAS_VALUE* val);
+int atlas_compile_tag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag);
+void atlas_bench_decode(int tag_count);
 int get_target_list(ATLAS_DB* dbconx);
-int get_target_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target);
+int atlas_load_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out);
+int atlas_store_sample(ATLAS_DB* cur_db, ATLAS_SAMPLE* sample);
+int atlas_store_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG* tags, int tag_count);
+void atlas_store_end(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target);
+void atlas_poll_targets(ATLAS_DB* cur_db);
 int session_share_setup(ATLAS_TARGET* child_t);
 
+// Alarms //
+int atlas_load_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_ALARM** alarms_out);
+int atlas_store_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG* tags, int tag_count);
+
+// Tag Configuration Cache //
+int atlas_tagcache_probe(ATLAS_DB* cur_db);
+void atlas_tagcache_reload();
+int atlas_tagcache_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out);
+int atlas_tagcache_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out);
+void atlas_tagcache_free(ATLAS_TARGET* cur_target);
+
+// Batched Database Writes //
+void atlas_dbw_sample(ATLAS_SAMPLE* sample, ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, time_t tstampx);
+int atlas_dbw_add(ATLAS_DBW* dbw, ATLAS_DB* cur_db, ATLAS_SAMPLE* sample);
+int atlas_dbw_pending(ATLAS_DBW* dbw);
+int atlas_dbw_flush(ATLAS_DBW* dbw, ATLAS_DB* cur_db, int force);
+void atlas_dbw_free(ATLAS_DBW* dbw);
+
+// History Compression //
+int atlas_comp_mode(char* mode);
+int atlas_comp_tag(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, long long now_ms, ATLAS_SAMPLE* held);
+int atlas_comp_end(ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, ATLAS_SAMPLE* held);
+void atlas_comp_carry(ATLAS_TAG* old_tags, int old_count, ATLAS_TAG* tags, int tag_count);
+
 // Status Tracking //
 int update_cstat(ATLAS_DB *cur_db, ATLAS_TARGET *cur_target);
 
@@ -322,12 +710,87 @@ void atlas_shutdown(int errval);
 
 // Socket functions /////////////////////////////////////////////////
 
+int atlas_sock_open(char* ip_addr, int* ports, int port_count, int timeout_ms, int* port_dex);
+int atlas_sock_connect_any(ATLAS_MCS* condata, int* ports, int port_count);
 int atlas_sock_connect(ATLAS_MCS* condata);
 void atlas_sock_close(ATLAS_MCS* condata);
 int atlas_sock_send(ATLAS_MCS* condata, char* txdata, int data_sz);
 int atlas_sock_recv(ATLAS_MCS* condata, char* rxdata, int buf_sz);
 
 
+// Framing reader ///////////////////////////////////////////////////
+
+int atlas_framer_init(ATLAS_FRAMER* fr, int size, int max_frame, ATLAS_FRAMELEN_FN frame_len);
+void atlas_framer_free(ATLAS_FRAMER* fr);
+void atlas_framer_reset(ATLAS_FRAMER* fr);
+int atlas_framer_fill(ATLAS_FRAMER* fr, int sock_fd);
+int atlas_framer_feed(ATLAS_FRAMER* fr, void* data, int data_sz);
+unsigned char* atlas_framer_peek(ATLAS_FRAMER* fr, int* frame_sz);
+unsigned char* atlas_framer_next(ATLAS_FRAMER* fr, int sock_fd, int* frame_sz);
+void atlas_framer_consume(ATLAS_FRAMER* fr, int frame_sz);
+int atlas_framer_selftest();
+
+
+// Event loop ///////////////////////////////////////////////////////
+
+long long atlas_evloop_now();
+int atlas_evloop_init();
+void atlas_evloop_close();
+int atlas_evloop_watch(ATLAS_MCS* mcs, int events);
+int atlas_evloop_run(int max_ms);
+
+
+// Reconnection /////////////////////////////////////////////////////
+
+ATLAS_TARGET* atlas_rcx_owner(ATLAS_TARGET* cur_target);
+int atlas_rcx_open(ATLAS_TARGET* cur_target);
+void atlas_rcx_connect(ATLAS_TARGET* cur_target);
+void atlas_rcx_trip(ATLAS_TARGET* cur_target, char* why);
+void atlas_rcx_check(ATLAS_TARGET* cur_target);
+void atlas_rcx_info(ATLAS_TARGET* cur_target, int* state, int* attempts, long long* down_ms);
+int atlas_rcx_start();
+void atlas_rcx_stop();
+
+
+// Persistence writers //////////////////////////////////////////////
+
+int atlas_writer_start(ATLAS_DB* cur_db, int writers);
+void atlas_writer_stop();
+int atlas_writer_count();
+int atlas_writer_push(ATLAS_SAMPLE* sample);
+int atlas_writer_stats(int wid, ATLAS_WRITER_STATS* stats);
+
+
+// Store-and-forward spool //////////////////////////////////////////
+
+long long atlas_spool_open(ATLAS_SPOOL* sp, int wid);
+int atlas_spool_put(ATLAS_SPOOL* sp, ATLAS_SAMPLE* sample);
+int atlas_spool_sync(ATLAS_SPOOL* sp, int force);
+int atlas_spool_peek(ATLAS_SPOOL* sp, ATLAS_SAMPLE* out, int max);
+void atlas_spool_advance(ATLAS_SPOOL* sp, int n);
+time_t atlas_spool_oldest(ATLAS_SPOOL* sp);
+void atlas_spool_close(ATLAS_SPOOL* sp);
+
+
+// Current-value table //////////////////////////////////////////////
+
+int atlas_cvt_start(ATLAS_DB* cur_db);
+void atlas_cvt_stop();
+int atlas_cvt_slot(int tag_id, int target_id);
+int atlas_cvt_put(int slot, ATLAS_SAMPLE* sample, long long now_ms);
+void atlas_cvt_bad(int slot, long long now_ms);
+int atlas_cvt_stats(ATLAS_CVT_STATS* stats);
+
+
+// Worker pool //////////////////////////////////////////////////////
+
+int atlas_pool_start(int workers);
+void atlas_pool_stop();
+int atlas_pool_size();
+int atlas_pool_run(ATLAS_JOB* jobs, int job_count, void (*on_done)(ATLAS_JOB* job));
+void atlas_pool_bench(int target_count);
+
+
 // Logging, Debug, & Exception Handling functions ///////////////////
 
 void log_mysql(int llevel, char* srcname, int srcline, int event_id, char* fmt, ...);
@@ -350,4 +813,7 @@ int mgmtcb_status(char* cargs, int argcnt);
 int mgmtcb_reload(char* cargs, int argcnt);
 int mgmtcb_tag_read(char* cargs, int argcnt);
 int mgmtcb_tag_add(char* cargs, int argcnt);
+int mgmtcb_mc_plan(char* cargs, int argcnt);
+int mgmtcb_writers(char* cargs, int argcnt);
+int mgmtcb_compression(char* cargs, int argcnt);
 
@@ -0,0 +1,272 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Batched Database Writes
+
+	Tag values are queued as rows for the history & realtime tables (and
+	alarm values for the alarm history table), rather than written one
+	statement at a time. A flush writes everything queued
+	as multi-row INSERTs (and multi-row upserts for realtime), of up to
+	--db-batch rows per statement, in a single transaction. Flushes happen
+	at the end of each acquisition round, or every --db-flush seconds.
+
+	Each queue (ATLAS_DBW) belongs to one thread and connection: the
+	persistence writers' (atlas_writer.c), or, without writers, the main
+	thread's, used with atlas_db_lock held.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "atlas_daq.h"
+
+// Appends a row to a queue
+static int atlas_dbw_queue(ATLAS_DBW_QUEUE* q, char* row) {
+	int row_sz = strlen(row);
+	char* nrows;
+	int* nend;
+
+	if(q->len + row_sz > q->cap) {
+		if((nrows = realloc(q->rows, (q->cap + row_sz) * 2)) == NULL) return -1;
+		q->rows = nrows;
+		q->cap = (q->cap + row_sz) * 2;
+	}
+	if(q->row_count == q->row_cap) {
+		if((nend = realloc(q->row_end, sizeof(int) * (q->row_cap ? q->row_cap * 2 : 256))) == NULL) return -1;
+		q->row_end = nend;
+		q->row_cap = q->row_cap ? q->row_cap * 2 : 256;
+	}
+
+	memcpy(q->rows + q->len, row, row_sz);
+	q->len += row_sz;
+	q->row_end[q->row_count++] = q->len;
+
+	return 0;
+}
+
+// Fills in a sample from a tag's value
+void atlas_dbw_sample(ATLAS_SAMPLE* sample, ATLAS_TARGET* cur_target, ATLAS_TAG* curtag, time_t tstampx) {
+
+	sample->tag_id = curtag->id;
+	sample->target_id = cur_target->id;
+	sample->dtypei = curtag->dtypei;
+	sample->v_int = curtag->v_int;
+	sample->v_float = curtag->v_float;
+	if(curtag->dtypei == DTYPE_RET_INT || curtag->dtypei == DTYPE_RET_BOOL || curtag->dtypei == DTYPE_RET_FLOAT) sample->v_str[0] = 0;
+	else strcpy(sample->v_str, curtag->v_str);
+	sample->tstamp = tstampx;
+	sample->queued = atlas_evloop_now();
+	sample->flags = SAMPLE_HISTORY | SAMPLE_REALTIME;
+}
+
+// Value columns (v_int,v_float,v_str) of a sample, as atlas_gen_sqlargs() makes them for a tag
+static char* atlas_dbw_values(ATLAS_DB* cur_db, ATLAS_SAMPLE* sample, char* outstr) {
+	char escaper[512];
+
+	if(sample->dtypei == DTYPE_RET_INT || sample->dtypei == DTYPE_RET_BOOL) {
+		sprintf(outstr,"%i,NULL,NULL",sample->v_int);
+	} else if(sample->dtypei == DTYPE_RET_FLOAT) {
+		sprintf(outstr,"NULL,%f,NULL",sample->v_float);
+	} else {
+		mysql_real_escape_string(cur_db->conx, escaper, sample->v_str, strlen(sample->v_str));
+		sprintf(outstr,"NULL,NULL,\"%s\"",escaper);
+	}
+
+	return outstr;
+}
+
+/*
+ * atlas_dbw_add
+ *	Queues a sample for the history and/or realtime tables, as its flags
+ *	say. A full batch (global_config.db_batch rows) is written at once.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_dbw_add(ATLAS_DBW* dbw, ATLAS_DB* cur_db, ATLAS_SAMPLE* sample) {
+	char row[ATLAS_DBW_MAX_ROW];
+	char datasetsu[560];
+
+	atlas_dbw_values(cur_db, sample, datasetsu);
+
+	// alarm samples go to alarm history alone
+	if(sample->flags & SAMPLE_ALARM) {
+		sprintf(row,"(%i,%i,'%s',%s,%i)",sample->tag_id, sample->target_id, get_dtype_str(sample->dtypei), datasetsu, (int)sample->tstamp);
+		if(atlas_dbw_queue(&dbw->alarms, row)) goto fail;
+	}
+
+	if(sample->flags & SAMPLE_HISTORY) {
+		sprintf(row,"(%i,%i,'%s',%s,%i)",sample->tag_id, sample->target_id, get_dtype_str(sample->dtypei), datasetsu, (int)sample->tstamp);
+		if(atlas_dbw_queue(&dbw->history, row)) goto fail;
+	}
+
+	if((sample->flags & SAMPLE_REALTIME) && !dbw->history_only) {
+		sprintf(row,"(%i,%i,'%s',%s,%i,0)",sample->tag_id, sample->target_id, get_dtype_str(sample->dtypei), datasetsu, (int)sample->tstamp);
+		if(atlas_dbw_queue(&dbw->realtime, row)) {
+			// a sample is queued whole, or not at all
+			if(sample->flags & SAMPLE_HISTORY) {
+				dbw->history.len = dbw->history.row_count > 1 ? dbw->history.row_end[dbw->history.row_count - 2] : 0;
+				dbw->history.row_count--;
+			}
+			goto fail;
+		}
+	}
+
+	dbw->samples++;
+	if(!dbw->oldest || sample->queued < dbw->oldest) dbw->oldest = sample->queued;
+
+	// write out a batch as soon as it fills, rather than holding it for the flush
+	if((dbw->history.row_count >= global_config.db_batch || dbw->realtime.row_count >= global_config.db_batch ||
+	    dbw->alarms.row_count >= global_config.db_batch) && atlas_dbw_flush(dbw, cur_db, 1) < 0) return -1;
+
+	return 0;
+
+fail:
+	zlog_error("atlas_dbw_add(): Memory allocation failed! Value of tag [%i] not stored.\n",sample->tag_id);
+	dbw->dropped++;
+	return -1;
+}
+
+// Number of samples waiting to be written
+int atlas_dbw_pending(ATLAS_DBW* dbw) {
+
+	return dbw->samples;
+}
+
+// Appends to the statement being built
+static int atlas_dbw_stmt_cat(ATLAS_DBW* dbw, int* len, char* data, int data_sz) {
+	char* nstmt;
+
+	if(*len + data_sz + 1 > dbw->stmt_cap) {
+		if((nstmt = realloc(dbw->stmt, (*len + data_sz + 1) * 2)) == NULL) return -1;
+		dbw->stmt = nstmt;
+		dbw->stmt_cap = (*len + data_sz + 1) * 2;
+	}
+
+	memcpy(dbw->stmt + *len, data, data_sz);
+	*len += data_sz;
+	dbw->stmt[*len] = 0;
+
+	return 0;
+}
+
+// Writes a queue as statements of up to global_config.db_batch rows
+static int atlas_dbw_write(ATLAS_DBW* dbw, ATLAS_DB* cur_db, ATLAS_DBW_QUEUE* q, char* prefix, char* suffix) {
+	int row = 0;
+	int start;
+	int len;
+	int rows;
+
+	while(row < q->row_count) {
+		len = 0;
+		if(atlas_dbw_stmt_cat(dbw, &len, prefix, strlen(prefix))) return -1;
+
+		for(rows = 0; row < q->row_count && rows < global_config.db_batch && len < ATLAS_DBW_MAX_STMT; row++, rows++) {
+			start = row ? q->row_end[row - 1] : 0;
+			if(rows && atlas_dbw_stmt_cat(dbw, &len, ",", 1)) return -1;
+			if(atlas_dbw_stmt_cat(dbw, &len, q->rows + start, q->row_end[row] - start)) return -1;
+		}
+
+		if(atlas_dbw_stmt_cat(dbw, &len, suffix, strlen(suffix))) return -1;
+
+		if(mysql_real_query(cur_db->conx, dbw->stmt, len)) {
+			zlog_error("atlas_dbw_flush(): Query failed! %i - %s [%.128s...]\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),dbw->stmt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Empties the queues
+static void atlas_dbw_clear(ATLAS_DBW* dbw) {
+
+	dbw->history.len = 0;
+	dbw->history.row_count = 0;
+	dbw->realtime.len = 0;
+	dbw->realtime.row_count = 0;
+	dbw->alarms.len = 0;
+	dbw->alarms.row_count = 0;
+	dbw->samples = 0;
+	dbw->oldest = 0;
+}
+
+/*
+ * atlas_dbw_flush
+ *	Writes the queued rows in one transaction, if a flush is due: always
+ *	with force, otherwise once global_config.db_flush seconds have passed
+ *	since the last (0 = every call), or a batch's worth of rows is waiting.
+ *	If the database isn't available, or the transaction fails, the queued
+ *	samples are dropped.
+ *	Returns:
+ *		Number of samples written, or -1 on failure
+ */
+int atlas_dbw_flush(ATLAS_DBW* dbw, ATLAS_DB* cur_db, int force) {
+	char prefix[256];
+	char suffix[256];
+	time_t now = time(NULL);
+	int rows = dbw->samples;
+
+	if(!rows) return 0;
+	if(!force && global_config.db_flush > 0 && now - dbw->last_flush < global_config.db_flush &&
+	   dbw->history.row_count < global_config.db_batch && dbw->realtime.row_count < global_config.db_batch &&
+	   dbw->alarms.row_count < global_config.db_batch) return 0;
+	dbw->last_flush = now;
+
+	if(cur_db->status != STATUS_READY) {
+		zlog_error("atlas_dbw_flush(): mySQL connection not ready! %i values dropped.\n",rows);
+		goto drop;
+	}
+
+	if(mysql_query(cur_db->conx, "START TRANSACTION")) goto fail;
+
+	// history: plain inserts
+	sprintf(prefix,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate) VALUES ",cur_db->tables.tag_history);
+	if(dbw->history.row_count && atlas_dbw_write(dbw, cur_db, &dbw->history, prefix, "")) goto fail;
+
+	// realtime: upserts; only the value column of the tag's type is replaced
+	sprintf(prefix,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate,flags) VALUES ",cur_db->tables.tag_realtime);
+	sprintf(suffix," ON DUPLICATE KEY UPDATE v_int = COALESCE(VALUES(v_int),v_int), v_float = COALESCE(VALUES(v_float),v_float), "
+		       "v_str = COALESCE(VALUES(v_str),v_str), tupdate = VALUES(tupdate)");
+	if(dbw->realtime.row_count && atlas_dbw_write(dbw, cur_db, &dbw->realtime, prefix, suffix)) goto fail;
+
+	// alarm history: plain inserts
+	sprintf(prefix,"INSERT INTO %s (tag_id,target_id,dtype,v_int,v_float,v_str,tupdate) VALUES ",cur_db->tables.alarm_history);
+	if(dbw->alarms.row_count && atlas_dbw_write(dbw, cur_db, &dbw->alarms, prefix, "")) goto fail;
+
+	if(mysql_query(cur_db->conx, "COMMIT")) goto fail;
+
+	zlog_debug("atlas_dbw_flush(): Wrote %i values.\n",rows);
+	dbw->lag_ms = atlas_evloop_now() - dbw->oldest;
+	dbw->written += rows;
+	atlas_dbw_clear(dbw);
+	return rows;
+
+fail:
+	zlog_error("atlas_dbw_flush(): Write failed! %i - %s. %i values dropped.\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),rows);
+	mysql_query(cur_db->conx, "ROLLBACK");
+	cur_db->status = STATUS_NOTREADY;
+	cur_db->last_error = mysql_errno(cur_db->conx);
+drop:
+	dbw->dropped += rows;
+	atlas_dbw_clear(dbw);
+	return -1;
+}
+
+// Frees a queue's memory
+void atlas_dbw_free(ATLAS_DBW* dbw) {
+
+	free(dbw->history.rows);
+	free(dbw->history.row_end);
+	free(dbw->realtime.rows);
+	free(dbw->realtime.row_end);
+	free(dbw->alarms.rows);
+	free(dbw->alarms.row_end);
+	free(dbw->stmt);
+	memset(dbw, 0, sizeof(ATLAS_DBW));
+}
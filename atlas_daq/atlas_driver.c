@@ -0,0 +1,146 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Target Driver Registry
+
+	Maps each TARGET_* type to the ATLAS_DRIVER which handles it. The
+	built-in drivers are registered at start-up; further drivers may be
+	loaded from shared objects (--driver), which register themselves from
+	their atlas_driver_plugin() entry point and may replace a built-in one.
+
+	The acquisition code only reads whole tag sets, through read_batch.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include "atlas_daq.h"
+
+static ATLAS_DRIVER* drivers[TARGET_MAXNUM + 1];
+
+// Registers the built-in drivers
+void atlas_driver_init() {
+
+	atlas_driver_register(TARGET_PLC, &eip_driver);
+	atlas_driver_register(TARGET_SLC, &eip_driver);
+	atlas_driver_register(TARGET_LGX, &eip_driver);
+	atlas_driver_register(TARGET_MC, &mc_driver);
+}
+
+/*
+ * atlas_driver_register
+ *	Sets the driver for a target type, replacing any already registered.
+ *	Returns:
+ *		0 on success, -1 if the type or driver is invalid
+ */
+int atlas_driver_register(int target_type, ATLAS_DRIVER* drv) {
+
+	if(target_type <= TARGET_NONE || target_type > TARGET_MAXNUM) {
+		zlog_error("atlas_driver_register(): Invalid target type %i!\n",target_type);
+		return -1;
+	}
+
+	if(!drv || drv->api_version != ATLAS_DRIVER_API || !drv->start || !drv->stop || !drv->read_batch) {
+		zlog_error("atlas_driver_register(): Driver for target type %i is incomplete or built for another version! (api = %i, expected %i)\n",
+		           target_type,drv ? drv->api_version : 0,ATLAS_DRIVER_API);
+		return -1;
+	}
+
+	if((drv->caps & DCAP_EVLOOP) && !drv->read_done) {
+		zlog_error("atlas_driver_register(): [%s] Event loop driver has no read_done!\n",drv->name);
+		return -1;
+	}
+
+	if(drivers[target_type] && drivers[target_type] != drv) {
+		zlog_info("atlas_driver_register(): Target type %i: driver [%s] replaced by [%s]\n",target_type,drivers[target_type]->name,drv->name);
+	}
+	drivers[target_type] = drv;
+
+	return 0;
+}
+
+// Returns the driver for a target type, or NULL if none is registered
+ATLAS_DRIVER* atlas_driver_get(int target_type) {
+
+	if(target_type <= TARGET_NONE || target_type > TARGET_MAXNUM) return NULL;
+
+	return drivers[target_type];
+}
+
+/*
+ * atlas_driver_load
+ *	Loads a driver from a shared object, and calls its entry point:
+ *		int atlas_driver_plugin(int api_version);
+ *	which registers its drivers with atlas_driver_register(), and returns 0.
+ *	The object stays loaded for the life of the process.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_driver_load(char* so_path) {
+	void* so_handle;
+	int (*plugin_init)(int api_version);
+
+	if((so_handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		zlog_error("atlas_driver_load(): Failed to load [%s]! %s\n",so_path,dlerror());
+		return -1;
+	}
+
+	if((plugin_init = (int (*)(int))dlsym(so_handle, "atlas_driver_plugin")) == NULL) {
+		zlog_error("atlas_driver_load(): [%s] has no atlas_driver_plugin() entry point!\n",so_path);
+		dlclose(so_handle);
+		return -1;
+	}
+
+	if(plugin_init(ATLAS_DRIVER_API)) {
+		zlog_error("atlas_driver_load(): [%s] failed to initialize!\n",so_path);
+		dlclose(so_handle);
+		return -1;
+	}
+
+	zlog_info("atlas_driver_load(): Loaded driver plugin [%s]\n",so_path);
+	return 0;
+}
+
+/*
+ * atlas_read_tagset
+ *	Reads a tag set from a target and waits for it to complete. Drivers
+ *	running on the event loop are run to completion on this thread's loop.
+ *	Returns:
+ *		Number of tags whose read failed, or -1 on error
+ */
+int atlas_read_tagset(ATLAS_TARGET* cur_target, ATLAS_TAGSET* set) {
+	ATLAS_DRIVER* drv;
+
+	if(!(drv = atlas_driver_get(cur_target->target_type))) {
+		zlog_error("atlas_read_tagset(): [%s] No driver registered for target type %i!\n",cur_target->sname,cur_target->target_type);
+		return -1;
+	}
+
+	// connection lost: left to the reconnect thread
+	if(atlas_rcx_open(cur_target)) {
+		set->failed = set->tag_count;
+		return set->failed;
+	}
+
+	if(drv->plan && drv->plan(cur_target, set)) return -1;
+
+	if(!drv->read_batch(cur_target, set) && (drv->caps & DCAP_EVLOOP)) atlas_evloop_run(0);
+	if(drv->caps & DCAP_EVLOOP) drv->read_done(cur_target, set);
+	atlas_rcx_check(cur_target);
+
+	return set->failed;
+}
+
+// Frees a tag set's driver plan
+void atlas_free_tagset(ATLAS_TARGET* cur_target, ATLAS_TAGSET* set) {
+	ATLAS_DRIVER* drv;
+
+	if(set->plan && (drv = atlas_driver_get(cur_target->target_type)) && drv->plan_free) drv->plan_free(cur_target, set);
+	set->plan = NULL;
+}
@@ -0,0 +1,169 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Connection Event Loop
+
+	Drives every driver connection (ATLAS_MCS) with queued work from a
+	thread, using epoll. Sockets are non-blocking; each connection's
+	driver handler is called when its socket is ready, or when its deadline
+	passes, and advances that connection's request queue. A slow or dead
+	target only holds up its own requests.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "atlas_daq.h"
+
+#define ATLS_EVLOOP_MAX_EVENTS		64
+
+// each thread has its own loop, for the connections it is polling
+static __thread int ev_fd = -1;
+static __thread ATLAS_MCS* ev_conns[ATLAS_MAX_TARGETS];		// connections with work queued
+static __thread int ev_count = 0;
+
+// Monotonic clock, in milliseconds
+long long atlas_evloop_now() {
+	struct timespec ttx;
+
+	clock_gettime(CLOCK_MONOTONIC, &ttx);
+	return (long long)ttx.tv_sec * 1000 + ttx.tv_nsec / 1000000;
+}
+
+int atlas_evloop_init() {
+
+	if(ev_fd != -1) return 0;
+
+	if((ev_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		zlog_error("atlas_evloop_init(): epoll_create1() failed! [%s]\n",strerror(errno));
+		ev_fd = -1;
+		return -1;
+	}
+
+	ev_count = 0;
+	return 0;
+}
+
+void atlas_evloop_close() {
+
+	for(int i = 0; i < ev_count; i++) ev_conns[i]->ev_events = 0;
+	ev_count = 0;
+
+	if(ev_fd != -1) close(ev_fd);
+	ev_fd = -1;
+}
+
+/*
+ * atlas_evloop_watch
+ *	Sets the socket events (EPOLLIN, EPOLLOUT) the loop waits for on a
+ *	connection. The connection is added to the loop as needed, and removed
+ *	when events is 0. The connection's ev_handler must be set first.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_evloop_watch(ATLAS_MCS* mcs, int events) {
+	struct epoll_event ev;
+	int op;
+
+	if(events == mcs->ev_events) return 0;
+	if(ev_fd == -1 && atlas_evloop_init()) return -1;
+
+	if(!events) {
+		epoll_ctl(ev_fd, EPOLL_CTL_DEL, mcs->sock_fd, NULL);
+		for(int i = 0; i < ev_count; i++) {
+			if(ev_conns[i] == mcs) {
+				ev_conns[i] = ev_conns[--ev_count];
+				break;
+			}
+		}
+		mcs->ev_events = 0;
+		mcs->ev_deadline = 0;
+		return 0;
+	}
+
+	if(!mcs->ev_events && ev_count >= ATLAS_MAX_TARGETS) {
+		zlog_error("atlas_evloop_watch(): Too many connections! (max = %i)\n",ATLAS_MAX_TARGETS);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = mcs;
+	op = mcs->ev_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if(epoll_ctl(ev_fd, op, mcs->sock_fd, &ev)) {
+		zlog_error("atlas_evloop_watch(): epoll_ctl() failed for %s:%u! [%s]\n",mcs->ip_addr,mcs->port_num,strerror(errno));
+		return -1;
+	}
+
+	if(!mcs->ev_events) ev_conns[ev_count++] = mcs;
+	mcs->ev_events = events;
+
+	return 0;
+}
+
+/*
+ * atlas_evloop_run
+ *	Services all connections until none has work left, or until max_ms
+ *	milliseconds have passed (0 = no limit). Handlers returning 1 are
+ *	considered idle and are removed from the loop.
+ *	Returns:
+ *		Number of connections still busy
+ */
+int atlas_evloop_run(int max_ms) {
+	struct epoll_event evs[ATLS_EVLOOP_MAX_EVENTS];
+	ATLAS_MCS* mcs;
+	long long now;
+	long long run_deadline;
+	long long next_deadline;
+	int wait_ms;
+	int n;
+
+	now = atlas_evloop_now();
+	run_deadline = max_ms ? now + max_ms : 0;
+
+	while(ev_count) {
+		// connections whose deadline has passed are told so, and may give up
+		next_deadline = run_deadline;
+		for(int i = 0; i < ev_count; i++) {
+			mcs = ev_conns[i];
+			if(!mcs->ev_deadline) continue;
+			if(mcs->ev_deadline <= now) {
+				if(mcs->ev_handler(mcs, 0)) atlas_evloop_watch(mcs, 0);
+				i = -1;		// list may have changed; rescan
+				now = atlas_evloop_now();
+				continue;
+			}
+			if(!next_deadline || mcs->ev_deadline < next_deadline) next_deadline = mcs->ev_deadline;
+		}
+		if(!ev_count) break;
+		if(run_deadline && now >= run_deadline) break;
+
+		wait_ms = next_deadline ? (int)(next_deadline - now) : -1;
+		if((n = epoll_wait(ev_fd, evs, ATLS_EVLOOP_MAX_EVENTS, wait_ms)) < 0) {
+			if(errno == EINTR) continue;
+			zlog_error("atlas_evloop_run(): epoll_wait() failed! [%s]\n",strerror(errno));
+			break;
+		}
+
+		for(int i = 0; i < n; i++) {
+			mcs = evs[i].data.ptr;
+			// removed by an earlier handler in this batch
+			if(!mcs->ev_events) continue;
+			if(mcs->ev_handler(mcs, evs[i].events)) atlas_evloop_watch(mcs, 0);
+		}
+
+		now = atlas_evloop_now();
+	}
+
+	return ev_count;
+}
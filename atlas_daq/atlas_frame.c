@@ -0,0 +1,327 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Stream Framing Reader
+
+	Per-connection receive ring buffer, which reassembles length-prefixed
+	protocol frames from a byte stream and hands them out in place.
+
+	The ring is followed by a mirror of its first max_frame bytes, so a frame
+	which wraps around the end of the ring can still be viewed contiguously.
+	Only data landing at the start of the ring is copied to the mirror.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "atlas_daq.h"
+
+/*
+ * atlas_framer_init
+ *	Allocates the receive ring for a connection.
+ *	Args:
+ *		size = ring size, in bytes (rounded up to a power of 2)
+ *		max_frame = largest frame the protocol can produce
+ *		frame_len = driver's frame length function (see ATLAS_FRAMELEN_FN)
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_framer_init(ATLAS_FRAMER* fr, int size, int max_frame, ATLAS_FRAMELEN_FN frame_len) {
+	int ring_sz = 1;
+
+	while(ring_sz < size || ring_sz < max_frame) ring_sz <<= 1;
+
+	memset(fr,0,sizeof(ATLAS_FRAMER));
+	if((fr->buf = malloc(ring_sz + max_frame)) == NULL) {
+		zlog_error("atlas_framer_init(): malloc() failed when creating receive buffer!\n");
+		return -1;
+	}
+
+	fr->size = ring_sz;
+	fr->max_frame = max_frame;
+	fr->frame_len = frame_len;
+
+	return 0;
+}
+
+void atlas_framer_free(ATLAS_FRAMER* fr) {
+
+	if(fr->buf) free(fr->buf);
+	fr->buf = NULL;
+	fr->size = 0;
+}
+
+// Discards all buffered data (after a connection is dropped or re-established)
+void atlas_framer_reset(ATLAS_FRAMER* fr) {
+
+	fr->head = 0;
+	fr->tail = 0;
+	fr->error = 0;
+}
+
+/*
+ * atlas_framer_space
+ *	Returns the room available for new data, and its location in the ring.
+ *	The room ends at the end of the ring, so a read may need two calls to fill.
+ */
+static int atlas_framer_space(ATLAS_FRAMER* fr, unsigned char** wptr) {
+	unsigned int wpos = fr->tail & (fr->size - 1);
+	int room = fr->size - (int)(fr->tail - fr->head);
+
+	if(room > fr->size - (int)wpos) room = fr->size - wpos;
+	(*wptr) = fr->buf + wpos;
+
+	return room;
+}
+
+// Accounts for data_sz bytes written at the tail, keeping the mirror up to date
+static void atlas_framer_commit(ATLAS_FRAMER* fr, int data_sz) {
+	unsigned int wpos = fr->tail & (fr->size - 1);
+
+	if((int)wpos < fr->max_frame) {
+		memcpy(fr->buf + fr->size + wpos, fr->buf + wpos, (data_sz < fr->max_frame - (int)wpos) ? data_sz : fr->max_frame - wpos);
+	}
+	fr->tail += data_sz;
+}
+
+/*
+ * atlas_framer_fill
+ *	Performs one recv() from sock_fd into the ring.
+ *	Returns:
+ *		Number of bytes received, 0 if a non-blocking socket has no data yet,
+ *		or -1 if the connection failed or was closed
+ */
+int atlas_framer_fill(ATLAS_FRAMER* fr, int sock_fd) {
+	unsigned char* wptr;
+	int room;
+	int rx_len;
+
+	if((room = atlas_framer_space(fr, &wptr)) <= 0) {
+		zlog_error("atlas_framer_fill(): Receive buffer full!\n");
+		fr->error = 1;
+		return -1;
+	}
+
+	if((rx_len = recv(sock_fd, wptr, room, 0)) < 1) {
+		if(rx_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+		if(rx_len < 0) zlog_error("atlas_framer_fill(): recv() failed! [%s]\n",strerror(errno));
+		else           zlog_error("atlas_framer_fill(): Connection closed by target!\n");
+		return -1;
+	}
+
+	atlas_framer_commit(fr, rx_len);
+
+	return rx_len;
+}
+
+/*
+ * atlas_framer_feed
+ *	Appends data from some other source (such as a non-blocking reader, or
+ *	a test) to the ring.
+ *	Returns:
+ *		Number of bytes accepted; less than data_sz if the ring is full
+ */
+int atlas_framer_feed(ATLAS_FRAMER* fr, void* data, int data_sz) {
+	unsigned char* wptr;
+	int room;
+	int fed = 0;
+
+	while(fed < data_sz && (room = atlas_framer_space(fr, &wptr)) > 0) {
+		if(room > data_sz - fed) room = data_sz - fed;
+		memcpy(wptr, (unsigned char*)data + fed, room);
+		atlas_framer_commit(fr, room);
+		fed += room;
+	}
+
+	return fed;
+}
+
+/*
+ * atlas_framer_peek
+ *	Returns the next complete frame if one is already buffered, without any I/O.
+ *	The frame stays valid until atlas_framer_consume() is called.
+ *	Returns:
+ *		Pointer to the frame, or NULL if incomplete (fr->error is set if the
+ *		stream is corrupt and the connection must be reset)
+ */
+unsigned char* atlas_framer_peek(ATLAS_FRAMER* fr, int* frame_sz) {
+	unsigned char* frame;
+	int avail = fr->tail - fr->head;
+	int flen;
+
+	if(fr->error || !avail) return NULL;
+
+	frame = fr->buf + (fr->head & (fr->size - 1));
+	if((flen = fr->frame_len(frame, (avail < fr->max_frame) ? avail : fr->max_frame)) < 0 || flen > fr->max_frame) {
+		zlog_error("atlas_framer_peek(): Invalid frame header! (length = %i, max = %i)\n",flen,fr->max_frame);
+		fr->error = 1;
+		return NULL;
+	}
+
+	if(!flen || flen > avail) return NULL;
+
+	(*frame_sz) = flen;
+	return frame;
+}
+
+/*
+ * atlas_framer_next
+ *	Receives from a blocking sock_fd until a complete frame is buffered.
+ *	Returns:
+ *		Pointer to the frame, or NULL on communication failure
+ */
+unsigned char* atlas_framer_next(ATLAS_FRAMER* fr, int sock_fd, int* frame_sz) {
+	unsigned char* frame;
+
+	while(!(frame = atlas_framer_peek(fr, frame_sz))) {
+		if(fr->error) return NULL;
+		if(atlas_framer_fill(fr, sock_fd) <= 0) return NULL;
+	}
+
+	return frame;
+}
+
+// Releases a frame returned by atlas_framer_peek() or atlas_framer_next()
+void atlas_framer_consume(ATLAS_FRAMER* fr, int frame_sz) {
+
+	fr->head += frame_sz;
+	if(fr->head == fr->tail) {
+		// keep new data at the start of the ring, where wrapped frames aren't split
+		fr->head = 0;
+		fr->tail = 0;
+	}
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Self test
+
+#define FRAMER_TEST_FRAMES		2000
+#define FRAMER_TEST_MAXDATA		1900
+
+// Test frame format: MC 3E/4E response header, with random response data
+static int atlas_framer_test_len(unsigned char* data, int avail) {
+	int hdr_sz;
+
+	if(data[0] != 0xD0 && data[0] != 0xD4) return -1;
+	hdr_sz = (data[0] == 0xD4) ? 13 : 9;
+	if(avail < hdr_sz) return 0;
+
+	return hdr_sz + (data[hdr_sz - 2] | (data[hdr_sz - 1] << 8));
+}
+
+static int atlas_framer_test_pass(unsigned char* stream, int stream_sz, int* offsets, int frame_count, int mode) {
+	ATLAS_FRAMER fr;
+	unsigned char* frame;
+	int frame_sz;
+	int pos = 0;
+	int seg;
+	int got = 0;
+
+	// small ring, so frames wrap around the end often
+	if(atlas_framer_init(&fr, 4096, 2048, atlas_framer_test_len)) return -1;
+
+	while(pos < stream_sz) {
+		switch(mode) {
+			case 0:  seg = 1 + rand() % 7; break;			// fragmented
+			case 1:  seg = 1 + rand() % 4096; break;		// coalesced
+			default: seg = (rand() & 1) ? 1 + rand() % 16 : 1 + rand() % 3000; break;
+		}
+		if(seg > stream_sz - pos) seg = stream_sz - pos;
+		seg = atlas_framer_feed(&fr, stream + pos, seg);
+		pos += seg;
+
+		while((frame = atlas_framer_peek(&fr, &frame_sz))) {
+			if(got >= frame_count || frame_sz != offsets[got + 1] - offsets[got] || memcmp(frame, stream + offsets[got], frame_sz)) {
+				zlog_error("atlas_framer_selftest(): mode %i: frame %i mismatch!\n",mode,got);
+				atlas_framer_free(&fr);
+				return -1;
+			}
+			atlas_framer_consume(&fr, frame_sz);
+			got++;
+		}
+		if(fr.error || (!seg && pos < stream_sz)) {
+			zlog_error("atlas_framer_selftest(): mode %i: stream stalled at frame %i!\n",mode,got);
+			atlas_framer_free(&fr);
+			return -1;
+		}
+	}
+
+	atlas_framer_free(&fr);
+	if(got != frame_count) {
+		zlog_error("atlas_framer_selftest(): mode %i: got %i of %i frames!\n",mode,got,frame_count);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * atlas_framer_selftest
+ *	Feeds a stream of MC 3E/4E response frames through the framing reader in
+ *	fragmented, coalesced, and mixed segments, and checks every frame comes out
+ *	whole and in order. (--selftest-framing)
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_framer_selftest() {
+	ATLAS_FRAMER fr;
+	unsigned char* stream;
+	unsigned char* sp;
+	int* offsets;
+	int stream_sz = 0;
+	int data_sz;
+	int hdr_sz;
+	int frame_sz;
+	int rc = 0;
+	unsigned char bad[16] = { 0x50, 0x00 };
+
+	if((stream = malloc(FRAMER_TEST_FRAMES * (13 + FRAMER_TEST_MAXDATA))) == NULL || (offsets = malloc(sizeof(int) * (FRAMER_TEST_FRAMES + 1))) == NULL) {
+		zlog_error("atlas_framer_selftest(): Memory allocation failed!\n");
+		if(stream) free(stream);
+		return -1;
+	}
+
+	srand(1);
+	for(int i = 0; i < FRAMER_TEST_FRAMES; i++) {
+		offsets[i] = stream_sz;
+		sp = stream + stream_sz;
+		hdr_sz = (rand() & 1) ? 13 : 9;
+		data_sz = (rand() & 3) ? 2 + rand() % 64 : 2 + rand() % (FRAMER_TEST_MAXDATA - 1);
+		sp[0] = (hdr_sz == 13) ? 0xD4 : 0xD0;
+		for(int j = 1; j < hdr_sz - 2; j++) sp[j] = rand();
+		sp[hdr_sz - 2] = data_sz & 0xFF;
+		sp[hdr_sz - 1] = (data_sz >> 8) & 0xFF;
+		for(int j = 0; j < data_sz; j++) sp[hdr_sz + j] = rand();
+		stream_sz += hdr_sz + data_sz;
+	}
+	offsets[FRAMER_TEST_FRAMES] = stream_sz;
+
+	for(int mode = 0; mode < 3; mode++) {
+		if(atlas_framer_test_pass(stream, stream_sz, offsets, FRAMER_TEST_FRAMES, mode)) rc = -1;
+		else zlog_info("atlas_framer_selftest(): mode %i: %i frames (%i bytes) OK\n",mode,FRAMER_TEST_FRAMES,stream_sz);
+	}
+
+	// a corrupt header must be reported, not waited on
+	if(!atlas_framer_init(&fr, 4096, 2048, atlas_framer_test_len)) {
+		atlas_framer_feed(&fr, bad, sizeof(bad));
+		if(atlas_framer_peek(&fr, &frame_sz) || !fr.error) {
+			zlog_error("atlas_framer_selftest(): Corrupt header not detected!\n");
+			rc = -1;
+		}
+		atlas_framer_free(&fr);
+	}
+
+	free(offsets);
+	free(stream);
+
+	return rc;
+}
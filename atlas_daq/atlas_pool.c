@@ -0,0 +1,352 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Acquisition Worker Pool
+
+	A fixed pool of worker threads, each with its own job deque. Jobs are
+	dealt to the worker given by their home index, so the same target group
+	lands on the same worker every cycle. A worker runs its own jobs newest
+	first, and when it runs dry, steals the oldest job from the busiest
+	other worker. Finished jobs are handed back to the thread which called
+	atlas_pool_run(), which does anything that needs the database.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "atlas_daq.h"
+
+typedef struct {
+	pthread_t thread;
+	int id;
+	pthread_mutex_t lock;		// protects the deque
+	ATLAS_JOB** deque;		// jobs dealt to this worker; [head, tail) are waiting
+	int head;
+	int tail;
+	int cap;
+	int jobs_run;			// stats: jobs run, in total
+	int jobs_stolen;		// stats: jobs taken from other workers
+} ATLAS_WORKER;
+
+static ATLAS_WORKER* pool_workers = NULL;
+static int pool_size = 0;
+static int pool_started = 0;		// threads actually running
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;	// signalled when jobs are dealt, or on shutdown
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;	// signalled when a job finishes
+static int pool_queued = 0;		// jobs dealt but not yet taken by a worker
+static int pool_shutdown = 0;
+static ATLAS_JOB** pool_finished = NULL;	// finished jobs, waiting for atlas_pool_run()
+static int pool_finished_count = 0;
+
+// Takes the newest job from a worker's own deque
+static ATLAS_JOB* atlas_pool_take(ATLAS_WORKER* w) {
+	ATLAS_JOB* job = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if(w->tail > w->head) job = w->deque[--w->tail];
+	pthread_mutex_unlock(&w->lock);
+
+	return job;
+}
+
+// Takes the oldest job from the worker with the most waiting
+static ATLAS_JOB* atlas_pool_steal(ATLAS_WORKER* thief) {
+	ATLAS_WORKER* victim = NULL;
+	ATLAS_JOB* job = NULL;
+	int most = 0;
+	int waiting;
+
+	for(int i = 0; i < pool_size; i++) {
+		if(&pool_workers[i] == thief) continue;
+		pthread_mutex_lock(&pool_workers[i].lock);
+		waiting = pool_workers[i].tail - pool_workers[i].head;
+		pthread_mutex_unlock(&pool_workers[i].lock);
+		if(waiting > most) {
+			most = waiting;
+			victim = &pool_workers[i];
+		}
+	}
+	if(!victim) return NULL;
+
+	pthread_mutex_lock(&victim->lock);
+	if(victim->tail > victim->head) job = victim->deque[victim->head++];
+	pthread_mutex_unlock(&victim->lock);
+
+	if(job) thief->jobs_stolen++;
+	return job;
+}
+
+static void* atlas_pool_worker(void* arg) {
+	ATLAS_WORKER* w = arg;
+	ATLAS_JOB* job;
+
+	while(1) {
+		if(!(job = atlas_pool_take(w))) job = atlas_pool_steal(w);
+
+		if(job) {
+			pthread_mutex_lock(&pool_lock);
+			pool_queued--;
+			pthread_mutex_unlock(&pool_lock);
+
+			job->worker = w->id;
+			job->run(job);
+			w->jobs_run++;
+
+			pthread_mutex_lock(&pool_lock);
+			pool_finished[pool_finished_count++] = job;
+			pthread_cond_signal(&pool_done);
+			pthread_mutex_unlock(&pool_lock);
+			continue;
+		}
+
+		// nothing left to take; wait for the next cycle
+		pthread_mutex_lock(&pool_lock);
+		while(!pool_shutdown && !pool_queued) pthread_cond_wait(&pool_work, &pool_lock);
+		if(pool_shutdown) {
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	atlas_evloop_close();
+	return NULL;
+}
+
+/*
+ * atlas_pool_start
+ *	Starts the worker threads.
+ *	Args:
+ *		workers = number of worker threads
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_pool_start(int workers) {
+
+	if(pool_size) return 0;
+
+	if((pool_workers = calloc(workers, sizeof(ATLAS_WORKER))) == NULL) {
+		zlog_error("atlas_pool_start(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	pool_shutdown = 0;
+	pool_size = workers;
+	for(int i = 0; i < workers; i++) {
+		pool_workers[i].id = i;
+		pthread_mutex_init(&pool_workers[i].lock, NULL);
+	}
+	for(int i = 0; i < workers; i++) {
+		if(pthread_create(&pool_workers[i].thread, NULL, atlas_pool_worker, &pool_workers[i])) {
+			zlog_error("atlas_pool_start(): Failed to start worker %i!\n",i);
+			atlas_pool_stop();
+			return -1;
+		}
+		pool_started = i + 1;
+	}
+
+	zlog_info("atlas_pool_start(): Started %i acquisition workers.\n",pool_size);
+	return 0;
+}
+
+// Stops the worker threads, once they have finished what they are doing
+void atlas_pool_stop() {
+
+	if(!pool_workers) return;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_shutdown = 1;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	for(int i = 0; i < pool_started; i++) pthread_join(pool_workers[i].thread, NULL);
+	for(int i = 0; i < pool_size; i++) {
+		pthread_mutex_destroy(&pool_workers[i].lock);
+		if(pool_workers[i].deque) free(pool_workers[i].deque);
+	}
+
+	free(pool_workers);
+	pool_workers = NULL;
+	pool_size = 0;
+	pool_started = 0;
+	if(pool_finished) free(pool_finished);
+	pool_finished = NULL;
+}
+
+int atlas_pool_size() {
+	return pool_size;
+}
+
+/*
+ * atlas_pool_run
+ *	Deals a list of jobs to the workers, and waits for all of them to finish.
+ *	on_done is called from this thread for each job, in the order they finish,
+ *	while the rest are still running.
+ *	Args:
+ *		jobs* = array of jobs; job->home picks the worker it is dealt to
+ *		job_count = number of jobs in array
+ *		on_done = called for each finished job (may be NULL)
+ *	Returns:
+ *		Number of jobs stolen by idle workers, or -1 on failure
+ */
+int atlas_pool_run(ATLAS_JOB* jobs, int job_count, void (*on_done)(ATLAS_JOB* job)) {
+	ATLAS_JOB* job;
+	ATLAS_WORKER* w;
+	ATLAS_JOB** nlist;
+	int finished = 0;
+	int stolen = 0;
+
+	if(!pool_size) {
+		zlog_error("atlas_pool_run(): Pool not started!\n");
+		return -1;
+	}
+
+	// size the deques & finished list for the whole cycle up front
+	if((nlist = realloc(pool_finished, sizeof(ATLAS_JOB*) * (job_count + 1))) == NULL) {
+		zlog_error("atlas_pool_run(): Memory allocation failed!\n");
+		return -1;
+	}
+	pool_finished = nlist;
+	for(int i = 0; i < pool_size; i++) {
+		w = &pool_workers[i];
+		stolen -= w->jobs_stolen;
+		if(w->cap < job_count) {
+			pthread_mutex_lock(&w->lock);
+			if((nlist = realloc(w->deque, sizeof(ATLAS_JOB*) * job_count)) != NULL) {
+				w->deque = nlist;
+				w->cap = job_count;
+			}
+			pthread_mutex_unlock(&w->lock);
+			if(!nlist) {
+				zlog_error("atlas_pool_run(): Memory allocation failed!\n");
+				return -1;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_finished_count = 0;
+	for(int i = 0; i < pool_size; i++) {
+		pthread_mutex_lock(&pool_workers[i].lock);
+		pool_workers[i].head = 0;
+		pool_workers[i].tail = 0;
+	}
+	for(int i = 0; i < job_count; i++) {
+		w = &pool_workers[jobs[i].home % pool_size];
+		jobs[i].worker = -1;
+		w->deque[w->tail++] = &jobs[i];
+	}
+	for(int i = 0; i < pool_size; i++) pthread_mutex_unlock(&pool_workers[i].lock);
+	pool_queued = job_count;
+	pthread_cond_broadcast(&pool_work);
+
+	// hand back finished jobs as they come in
+	while(finished < job_count) {
+		while(finished == pool_finished_count) pthread_cond_wait(&pool_done, &pool_lock);
+		job = pool_finished[finished++];
+		pthread_mutex_unlock(&pool_lock);
+		if(on_done) on_done(job);
+		pthread_mutex_lock(&pool_lock);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	for(int i = 0; i < pool_size; i++) stolen += pool_workers[i].jobs_stolen;
+
+	return stolen;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+#define POOL_BENCH_CYCLES		3
+
+typedef struct {
+	int requests;			// round trips per cycle
+	int rtt_us;			// simulated round trip time
+} ATLAS_SIMPLC;
+
+// Simulated PLC group: one blocking round trip after another
+static void atlas_pool_bench_job(ATLAS_JOB* job) {
+	ATLAS_SIMPLC* plcs = job->arg;
+
+	for(int i = 0; i < job->arg_count; i++) {
+		for(int r = 0; r < plcs[i].requests; r++) usleep(plcs[i].rtt_us);
+	}
+}
+
+/*
+ * atlas_pool_bench
+ *	Measures cycle time against pool size, polling target_count simulated
+ *	PLCs. Every fourth PLC shares its session with the one before it, so
+ *	those two are polled as one job. (--bench-pool)
+ */
+void atlas_pool_bench(int target_count) {
+	ATLAS_SIMPLC* plcs;
+	ATLAS_JOB* jobs;
+	int job_count = 0;
+	int sizes[] = { 1, 2, 4, 8, 16, 32 };
+	long long serial_us = 0;
+	long long t_start;
+	int stolen;
+
+	if(target_count < 1) target_count = 1;
+	if(target_count > ATLAS_MAX_TARGETS) target_count = ATLAS_MAX_TARGETS;
+
+	plcs = malloc(sizeof(ATLAS_SIMPLC) * target_count);
+	jobs = malloc(sizeof(ATLAS_JOB) * target_count);
+	if(!plcs || !jobs) {
+		zlog_error("atlas_pool_bench(): Memory allocation failed!\n");
+		if(plcs) free(plcs);
+		if(jobs) free(jobs);
+		return;
+	}
+
+	// uneven workloads, so that some workers run dry early and steal
+	srand(1);
+	for(int i = 0; i < target_count; i++) {
+		plcs[i].requests = 2 + rand() % 12;
+		plcs[i].rtt_us = 2000 + rand() % 8000;
+		serial_us += plcs[i].requests * plcs[i].rtt_us;
+
+		if(i % 4 == 3) {
+			jobs[job_count - 1].arg_count++;
+		} else {
+			memset(&jobs[job_count], 0, sizeof(ATLAS_JOB));
+			jobs[job_count].run = atlas_pool_bench_job;
+			jobs[job_count].arg = &plcs[i];
+			jobs[job_count].arg_count = 1;
+			jobs[job_count].home = job_count;
+			job_count++;
+		}
+	}
+
+	printf("atlas_pool_bench(): %i simulated PLCs in %i jobs, %.1f ms of round trips per cycle\n",target_count,job_count,serial_us / 1000.0);
+	printf("%8s %12s %10s %8s\n","workers","cycle (ms)","speedup","steals");
+
+	for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		if(atlas_pool_start(sizes[s])) break;
+
+		stolen = 0;
+		t_start = atlas_evloop_now();
+		for(int c = 0; c < POOL_BENCH_CYCLES; c++) stolen += atlas_pool_run(jobs, job_count, NULL);
+		t_start = atlas_evloop_now() - t_start;
+
+		printf("%8i %12.1f %9.2fx %8.1f\n",sizes[s],(double)t_start / POOL_BENCH_CYCLES,
+		       (serial_us / 1000.0) / ((double)t_start / POOL_BENCH_CYCLES),(double)stolen / POOL_BENCH_CYCLES);
+		atlas_pool_stop();
+	}
+
+	free(jobs);
+	free(plcs);
+}
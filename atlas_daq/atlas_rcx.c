@@ -0,0 +1,320 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Target Reconnection
+
+	Each target has a circuit breaker. When a read finds the target's
+	connection gone, the breaker is opened: the acquisition round stops
+	reading that target, and the reconnect thread takes it over. The thread
+	retries the connection with exponential backoff and jitter, so a dead
+	PLC costs the acquisition rounds nothing, and a plant full of targets
+	coming back at once don't all reconnect in the same instant. Once the
+	target is connected again, the breaker is closed and it is read from
+	the next round. Targets sharing a session (TFLAG_CSESSION) go through
+	their parent's breaker.
+
+	Targets start out the same way, with the breaker open and the first
+	attempt due at once, so every target is connected concurrently at
+	startup. Each attempt runs on its own short-lived thread, so one slow
+	or unreachable target never holds up the others.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "atlas_daq.h"
+
+static pthread_t rcx_thread;
+static int rcx_started = 0;
+static int rcx_shutdown = 0;
+static int rcx_active = 0;		// attempt threads running, under rcx_lock
+static unsigned int rcx_seed = 0;	// jitter (rand_r), under rcx_lock
+
+static pthread_mutex_t rcx_lock = PTHREAD_MUTEX_INITIALIZER;	// protects every target's rcx_* fields
+static pthread_cond_t rcx_wake = PTHREAD_COND_INITIALIZER;	// signalled when a breaker opens, an attempt ends, or on shutdown
+
+/*
+ * atlas_rcx_owner
+ *	Returns the target which owns cur_target's connection: its parent if it
+ *	shares a session (TFLAG_CSESSION), otherwise the target itself.
+ */
+ATLAS_TARGET* atlas_rcx_owner(ATLAS_TARGET* cur_target) {
+
+	if((cur_target->flags & TFLAG_CSESSION) && cur_target->parent) return cur_target->parent;
+	return cur_target;
+}
+
+/*
+ * atlas_rcx_open
+ *	Checks the breaker of the target's connection.
+ *	Returns:
+ *		1 if the breaker is open (don't read the target), 0 if closed
+ */
+int atlas_rcx_open(ATLAS_TARGET* cur_target) {
+	int open;
+
+	pthread_mutex_lock(&rcx_lock);
+	open = (atlas_rcx_owner(cur_target)->rcx_state == RCX_OPEN);
+	pthread_mutex_unlock(&rcx_lock);
+
+	return open;
+}
+
+// Waiting time before the next attempt: half the backoff, plus up to as much again (rcx_lock held)
+static long long atlas_rcx_delay(int backoff) {
+
+	return backoff / 2 + rand_r(&rcx_seed) % (backoff / 2 + 1);
+}
+
+/*
+ * atlas_rcx_trip
+ *	Opens the breaker of the target's connection, and hands the target to
+ *	the reconnect thread. Does nothing if it is already open.
+ */
+void atlas_rcx_trip(ATLAS_TARGET* cur_target, char* why) {
+	ATLAS_TARGET* owner = atlas_rcx_owner(cur_target);
+
+	pthread_mutex_lock(&rcx_lock);
+	if(owner->rcx_state == RCX_OPEN) {
+		pthread_mutex_unlock(&rcx_lock);
+		return;
+	}
+
+	if(!rcx_seed) rcx_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	owner->rcx_state = RCX_OPEN;
+	owner->rcx_count = 0;
+	owner->rcx_opened = atlas_evloop_now();
+	owner->rcx_backoff = global_config.rcx_backoff_min;
+	owner->rcx_next = owner->rcx_opened + atlas_rcx_delay(owner->rcx_backoff);
+	pthread_cond_signal(&rcx_wake);
+	pthread_mutex_unlock(&rcx_lock);
+
+	zlog_error("[%s] Connection lost (%s). Reads suspended until it is re-established.\n",owner->sname,why);
+	set_target_msg(owner,"Connection lost (%s). Reconnecting...",why);
+	if(owner != cur_target) set_target_msg(cur_target,"Connection lost via [%s] (%s). Reconnecting...",owner->sname,why);
+}
+
+/*
+ * atlas_rcx_connect
+ *	Hands a target which hasn't been connected yet to the reconnect thread,
+ *	with its first attempt due at once. Called for each target at startup.
+ */
+void atlas_rcx_connect(ATLAS_TARGET* cur_target) {
+
+	pthread_mutex_lock(&rcx_lock);
+	if(!rcx_seed) rcx_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	cur_target->rcx_state = RCX_OPEN;
+	cur_target->rcx_first = 1;
+	cur_target->rcx_count = 0;
+	cur_target->rcx_opened = atlas_evloop_now();
+	cur_target->rcx_backoff = global_config.rcx_backoff_min;
+	cur_target->rcx_next = cur_target->rcx_opened;
+	pthread_cond_signal(&rcx_wake);
+	pthread_mutex_unlock(&rcx_lock);
+
+	set_target_msg(cur_target,"Connecting...");
+}
+
+/*
+ * atlas_rcx_check
+ *	Opens the target's breaker if a read has left it (or the target whose
+ *	session it shares) disconnected. Called after each round of reads.
+ */
+void atlas_rcx_check(ATLAS_TARGET* cur_target) {
+	ATLAS_TARGET* owner = atlas_rcx_owner(cur_target);
+
+	if(cur_target->status == STATUS_DISABLED || cur_target->status == STATUS_SHUTDOWN) return;
+	if(cur_target->status == STATUS_READY && owner->status == STATUS_READY) return;
+
+	atlas_rcx_trip(cur_target, cur_target->status == STATUS_READY ? "parent session" : "read failed");
+}
+
+// Total time the breaker has been open, in milliseconds (rcx_lock held)
+static long long atlas_rcx_downtime(ATLAS_TARGET* cur_target, long long now) {
+
+	return cur_target->rcx_open_ms + (cur_target->rcx_state == RCX_OPEN ? now - cur_target->rcx_opened : 0);
+}
+
+/*
+ * atlas_rcx_info
+ *	Copies a target's breaker state, for the status table.
+ */
+void atlas_rcx_info(ATLAS_TARGET* cur_target, int* state, int* attempts, long long* down_ms) {
+	ATLAS_TARGET* owner = atlas_rcx_owner(cur_target);
+
+	pthread_mutex_lock(&rcx_lock);
+	*state = owner->rcx_state;
+	*attempts = owner->rcx_total;
+	*down_ms = atlas_rcx_downtime(owner, atlas_evloop_now());
+	pthread_mutex_unlock(&rcx_lock);
+}
+
+// Attempt thread: reconnects one target, and closes its breaker if connected
+static void* atlas_rcx_attempt(void* arg) {
+	ATLAS_TARGET* cur_target = arg;
+	ATLAS_DRIVER* drv = atlas_driver_get(cur_target->target_type);
+	long long now;
+	long long wait_ms;
+	int count;
+	int first;
+	int ok;
+
+	pthread_mutex_lock(&rcx_lock);
+	cur_target->rcx_count++;
+	cur_target->rcx_total++;
+	count = cur_target->rcx_count;
+	first = cur_target->rcx_first;
+	pthread_mutex_unlock(&rcx_lock);
+
+	if(first) zlog_debug("[%s] Connecting... [Attempt %i]\n",cur_target->sname,count);
+	else zlog_info("[%s] Attempting to reconnect... [Attempt %i]\n",cur_target->sname,count);
+	if(drv) {
+		drv->stop(cur_target);
+		drv->start(cur_target);
+	}
+	ok = (cur_target->status == STATUS_READY);
+
+	pthread_mutex_lock(&rcx_lock);
+	now = atlas_evloop_now();
+	if(ok) {
+		if(!first) cur_target->rcx_open_ms = atlas_rcx_downtime(cur_target, now);
+		cur_target->rcx_state = RCX_CLOSED;
+		cur_target->rcx_first = 0;
+
+		// targets sharing this session follow it to the new connection
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(atx_tgdex[tgi] == cur_target || atlas_rcx_owner(atx_tgdex[tgi]) != cur_target) continue;
+			atx_tgdex[tgi]->mc_session = cur_target->mc_session;
+			if(atx_tgdex[tgi]->status != STATUS_DISABLED) atx_tgdex[tgi]->status = cur_target->status;
+		}
+	} else {
+		cur_target->rcx_backoff *= 2;
+		if(cur_target->rcx_backoff > global_config.rcx_backoff_max) cur_target->rcx_backoff = global_config.rcx_backoff_max;
+		cur_target->rcx_next = now + atlas_rcx_delay(cur_target->rcx_backoff);
+	}
+
+	wait_ms = cur_target->rcx_next - now;
+	pthread_mutex_unlock(&rcx_lock);
+
+	if(ok && first) {
+		zlog_info("[INIT] Successfully connected to %s [%02i/%s] at %s\n",cur_target->descx,cur_target->id,cur_target->sname,cur_target->ip_addr);
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(atx_tgdex[tgi] == cur_target || atlas_rcx_owner(atx_tgdex[tgi]) != cur_target) continue;
+			zlog_info("[INIT] Successfully associated [%s] to parent connection [%s]\n",atx_tgdex[tgi]->sname,cur_target->sname);
+		}
+	} else if(ok) {
+		zlog_info("[%s] Connection re-established after %i attempts!\n",cur_target->sname,count);
+		set_target_msg(cur_target,"OK. Reconnected after %i attempts.",count);
+	} else {
+		zlog_error("[%s] %s failed. Next attempt in %lli ms.\n",cur_target->sname,first ? "Connection" : "Reconnect",wait_ms);
+	}
+
+	pthread_mutex_lock(&rcx_lock);
+	cur_target->rcx_busy = 0;
+	rcx_active--;
+	pthread_cond_broadcast(&rcx_wake);
+	pthread_mutex_unlock(&rcx_lock);
+
+	atlas_evloop_close();
+	return NULL;
+}
+
+// Reconnect thread: starts an attempt on each open target as its backoff runs out
+static void* atlas_rcx_run(void* arg) {
+	pthread_t attempt;
+	pthread_attr_t attr;
+	long long now;
+	long long next;
+	struct timespec ts;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&rcx_lock);
+	while(!rcx_shutdown) {
+		next = -1;
+		now = atlas_evloop_now();
+
+		for(int tgi = 0; tgi < atx_targets; tgi++) {
+			if(atx_tgdex[tgi]->rcx_state != RCX_OPEN || atx_tgdex[tgi]->rcx_busy) continue;
+			if(atx_tgdex[tgi]->rcx_next > now) {
+				if(next == -1 || atx_tgdex[tgi]->rcx_next < next) next = atx_tgdex[tgi]->rcx_next;
+				continue;
+			}
+
+			atx_tgdex[tgi]->rcx_busy = 1;
+			rcx_active++;
+			if(pthread_create(&attempt, &attr, atlas_rcx_attempt, atx_tgdex[tgi])) {
+				// no thread to spare: make this attempt from here
+				pthread_mutex_unlock(&rcx_lock);
+				atlas_rcx_attempt(atx_tgdex[tgi]);
+				pthread_mutex_lock(&rcx_lock);
+			}
+		}
+
+		// sleep until the next attempt is due, or a breaker opens
+		if(next == -1) {
+			pthread_cond_wait(&rcx_wake, &rcx_lock);
+		} else {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			next -= now;
+			ts.tv_sec += next / 1000;
+			ts.tv_nsec += (next % 1000) * 1000000;
+			if(ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&rcx_wake, &rcx_lock, &ts);
+		}
+	}
+
+	// let any attempts in progress finish
+	while(rcx_active) pthread_cond_wait(&rcx_wake, &rcx_lock);
+	pthread_mutex_unlock(&rcx_lock);
+
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+/*
+ * atlas_rcx_start
+ *	Starts the reconnect thread.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_rcx_start() {
+
+	if(rcx_started) return 0;
+
+	rcx_shutdown = 0;
+	if(pthread_create(&rcx_thread, NULL, atlas_rcx_run, NULL)) {
+		zlog_error("atlas_rcx_start(): Failed to start the reconnect thread!\n");
+		return -1;
+	}
+	rcx_started = 1;
+
+	return 0;
+}
+
+// Stops the reconnect thread, after any attempts in progress
+void atlas_rcx_stop() {
+
+	if(!rcx_started) return;
+
+	pthread_mutex_lock(&rcx_lock);
+	rcx_shutdown = 1;
+	pthread_cond_signal(&rcx_wake);
+	pthread_mutex_unlock(&rcx_lock);
+
+	pthread_join(rcx_thread, NULL);
+	rcx_started = 0;
+}
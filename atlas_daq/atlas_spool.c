@@ -0,0 +1,345 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Store-and-Forward Spool
+
+	Each persistence writer (atlas_writer.c) keeps samples it can't write
+	to the database yet in its own spool on disk, and replays them once the
+	database keeps up again. A spool is a series of fixed-size segment files
+	in --spool-dir, "atlas_spool.<writer>.<segment>", each a header followed
+	by an array of samples, mapped into memory. Samples are appended to the
+	newest segment, and replayed from the oldest; a segment is deleted once
+	it has been replayed, and a new one started once the newest is full.
+
+	Appends are made durable in groups: the header's count only covers
+	samples which have been synced (atlas_spool_sync()), so after a crash a
+	spool resumes from the last sync. The replay position is synced with
+	them, so a crash may replay some samples twice, but loses none.
+
+	Only used from the writer's thread.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "atlas_daq.h"
+
+#define ATLAS_SPOOL_MAGIC	0x4C4F5053	// "SPOL"
+#define ATLAS_SPOOL_HDR_SIZE	4096		// samples start on the page after the header
+
+// Segment file header
+struct sATLAS_SPOOL_SEG {
+	unsigned int magic;
+	unsigned int rec_size;		// sizeof(ATLAS_SAMPLE)
+	unsigned int capacity;		// samples the segment holds
+	unsigned int count;		// samples appended and synced
+	unsigned int sent;		// samples replayed
+};
+
+// Segment file name
+static void atlas_spool_path(ATLAS_SPOOL* sp, unsigned int seg, char* path) {
+
+	snprintf(path, 256, "%s/atlas_spool.%i.%u", global_config.spool_dir, sp->wid, seg);
+}
+
+// Samples in a segment
+static ATLAS_SAMPLE* atlas_spool_recs(ATLAS_SPOOL_SEG* hdr) {
+
+	return (ATLAS_SAMPLE*)((char*)hdr + ATLAS_SPOOL_HDR_SIZE);
+}
+
+// Maps a segment; creates it if create is set. NULL if it doesn't exist or isn't usable.
+static ATLAS_SPOOL_SEG* atlas_spool_map(ATLAS_SPOOL* sp, unsigned int seg, int create) {
+	ATLAS_SPOOL_SEG* hdr;
+	ATLAS_SPOOL_SEG ohdr;
+	char path[256];
+	size_t map_sz = ATLAS_SPOOL_HDR_SIZE + (size_t)sp->capacity * sizeof(ATLAS_SAMPLE);
+	struct stat st;
+	int fd;
+
+	atlas_spool_path(sp, seg, path);
+	if((fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0640)) == -1) {
+		if(create) zlog_error("atlas_spool_map(): [%i] Can't create spool segment [%s]!\n",sp->wid,path);
+		return NULL;
+	}
+
+	if(create) {
+		if(ftruncate(fd, map_sz)) {
+			zlog_error("atlas_spool_map(): [%i] Can't size spool segment [%s]!\n",sp->wid,path);
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+	} else {
+		if(fstat(fd, &st) || st.st_size < ATLAS_SPOOL_HDR_SIZE ||
+		   pread(fd, &ohdr, sizeof(ohdr), 0) != (ssize_t)sizeof(ohdr)) {
+			close(fd);
+			return NULL;
+		}
+		// map the segment as its header sizes it (which atlas_spool_unmap() relies on), not the file,
+		// which may have been written with another --spool-segment
+		map_sz = ATLAS_SPOOL_HDR_SIZE + (size_t)ohdr.capacity * sizeof(ATLAS_SAMPLE);
+		if(ohdr.magic != ATLAS_SPOOL_MAGIC || ohdr.rec_size != sizeof(ATLAS_SAMPLE) || map_sz > (size_t)st.st_size ||
+		   ohdr.count > ohdr.capacity || ohdr.sent > ohdr.count) {
+			zlog_error("atlas_spool_map(): [%i] Spool segment [%s] is not valid. Ignored.\n",sp->wid,path);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	hdr = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(hdr == MAP_FAILED) {
+		zlog_error("atlas_spool_map(): [%i] Can't map spool segment [%s]!\n",sp->wid,path);
+		return NULL;
+	}
+
+	if(create) {
+		hdr->magic = ATLAS_SPOOL_MAGIC;
+		hdr->rec_size = sizeof(ATLAS_SAMPLE);
+		hdr->capacity = sp->capacity;
+		hdr->count = 0;
+		hdr->sent = 0;
+	}
+
+	return hdr;
+}
+
+// Unmaps a segment
+static void atlas_spool_unmap(ATLAS_SPOOL_SEG* hdr) {
+
+	if(hdr) munmap(hdr, ATLAS_SPOOL_HDR_SIZE + (size_t)hdr->capacity * sizeof(ATLAS_SAMPLE));
+}
+
+// Size of a segment file, in bytes
+static long long atlas_spool_seg_bytes(ATLAS_SPOOL_SEG* hdr) {
+
+	return ATLAS_SPOOL_HDR_SIZE + (long long)hdr->capacity * sizeof(ATLAS_SAMPLE);
+}
+
+/*
+ * atlas_spool_open
+ *	Opens writer wid's spool, picking up any samples left from a previous
+ *	run. Nothing is created on disk until the first sample is appended.
+ *	Returns:
+ *		Number of unsent samples in the spool, or -1 if --spool-dir can't
+ *		be read
+ */
+long long atlas_spool_open(ATLAS_SPOOL* sp, int wid) {
+	ATLAS_SPOOL_SEG* hdr;
+	DIR* dir;
+	struct dirent* ent;
+	char prefix[64];
+	unsigned int seg;
+	unsigned int first = 0;
+	unsigned int last = 0;
+
+	memset(sp, 0, sizeof(ATLAS_SPOOL));
+	sp->wid = wid;
+	sp->capacity = global_config.spool_segment;
+
+	// find the oldest & newest segments left over
+	sprintf(prefix, "atlas_spool.%i.", wid);
+	if((dir = opendir(global_config.spool_dir)) == NULL) return -1;
+	while((ent = readdir(dir)) != NULL) {
+		if(strncmp(ent->d_name, prefix, strlen(prefix))) continue;
+		seg = strtoul(ent->d_name + strlen(prefix), NULL, 10);
+		if(!seg) continue;
+		if(!first || seg < first) first = seg;
+		if(seg > last) last = seg;
+	}
+	closedir(dir);
+
+	if(!first) {
+		sp->rseg = sp->wseg = 1;
+		return 0;
+	}
+
+	// count what's left to send
+	for(seg = first; seg <= last; seg++) {
+		if(!(hdr = atlas_spool_map(sp, seg, 0))) continue;
+		sp->pending += hdr->count - hdr->sent;
+		sp->bytes += atlas_spool_seg_bytes(hdr);
+		atlas_spool_unmap(hdr);
+	}
+
+	// append to a new segment; replay from the oldest
+	sp->rseg = first;
+	sp->wseg = last + 1;
+
+	if(sp->pending) zlog_info("atlas_spool_open(): [%i] %lli samples left in the spool from the last run. Replaying.\n",wid,sp->pending);
+	return sp->pending;
+}
+
+/*
+ * atlas_spool_sync
+ *	Makes the samples appended since the last sync durable, and records the
+ *	replay position: with force, at once; otherwise only once
+ *	global_config.spool_sync ms have passed since the last sync (so that
+ *	many appends share one sync).
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_spool_sync(ATLAS_SPOOL* sp, int force) {
+	ATLAS_SPOOL_SEG* hdr = sp->wmap;
+	long long now = atlas_evloop_now();
+	size_t from;
+	size_t to;
+	int rv = 0;
+
+	if(!force && now - sp->last_sync < global_config.spool_sync) return 0;
+	sp->last_sync = now;
+
+	if(hdr && sp->wcount > hdr->count) {
+		// samples first, then the count which covers them
+		from = (ATLAS_SPOOL_HDR_SIZE + (size_t)hdr->count * sizeof(ATLAS_SAMPLE)) & ~(size_t)(ATLAS_SPOOL_HDR_SIZE - 1);
+		to = ATLAS_SPOOL_HDR_SIZE + (size_t)sp->wcount * sizeof(ATLAS_SAMPLE);
+		if(msync((char*)hdr + from, to - from, MS_SYNC)) rv = -1;
+		hdr->count = sp->wcount;
+		if(msync(hdr, ATLAS_SPOOL_HDR_SIZE, MS_SYNC)) rv = -1;
+		if(sp->rmap == hdr) sp->rdirty = 0;
+	}
+
+	// replay position
+	if(sp->rmap && sp->rdirty && msync(sp->rmap, ATLAS_SPOOL_HDR_SIZE, MS_SYNC)) rv = -1;
+	sp->rdirty = 0;
+
+	if(rv) zlog_error("atlas_spool_sync(): [%i] msync() failed!\n",sp->wid);
+	return rv;
+}
+
+/*
+ * atlas_spool_put
+ *	Appends a sample, starting a new segment when the newest is full.
+ *	Returns:
+ *		0 on success, -1 on failure (sample not spooled)
+ */
+int atlas_spool_put(ATLAS_SPOOL* sp, ATLAS_SAMPLE* sample) {
+
+	if(sp->wmap && sp->wcount == sp->wmap->capacity) {
+		// newest segment is full: seal it, and start the next
+		atlas_spool_sync(sp, 1);
+		if(sp->wmap != sp->rmap) atlas_spool_unmap(sp->wmap);
+		sp->wmap = NULL;
+		sp->wseg++;
+	}
+
+	if(!sp->wmap) {
+		if(!(sp->wmap = atlas_spool_map(sp, sp->wseg, 1))) return -1;
+		sp->wcount = 0;
+		sp->bytes += atlas_spool_seg_bytes(sp->wmap);
+	}
+
+	atlas_spool_recs(sp->wmap)[sp->wcount++] = *sample;
+	sp->pending++;
+
+	return 0;
+}
+
+// Maps the oldest segment with samples to replay; NULL if there are none (yet)
+static ATLAS_SPOOL_SEG* atlas_spool_head(ATLAS_SPOOL* sp) {
+	ATLAS_SPOOL_SEG* hdr;
+	char path[256];
+
+	while(!sp->rmap) {
+		if(sp->rseg == sp->wseg) {
+			// replaying the segment being appended to
+			if(!sp->wmap) return NULL;
+			sp->rmap = sp->wmap;
+			break;
+		}
+		if((sp->rmap = atlas_spool_map(sp, sp->rseg, 0)) != NULL) break;
+
+		// missing or unusable: skip it
+		atlas_spool_path(sp, sp->rseg, path);
+		unlink(path);
+		sp->rseg++;
+	}
+
+	hdr = sp->rmap;
+	if(hdr->sent < hdr->count) return hdr;
+
+	// fully replayed: delete it (if it's the one being appended to, once
+	// everything appended has been synced & replayed; the next append
+	// starts a new one)
+	if(hdr == sp->wmap) {
+		if(sp->wcount > hdr->count) return NULL;
+		sp->wmap = NULL;
+		sp->wseg++;
+	}
+	sp->bytes -= atlas_spool_seg_bytes(hdr);
+	atlas_spool_unmap(hdr);
+	atlas_spool_path(sp, sp->rseg, path);
+	unlink(path);
+	sp->rmap = NULL;
+	sp->rseg++;
+
+	return atlas_spool_head(sp);
+}
+
+/*
+ * atlas_spool_peek
+ *	Copies up to max of the oldest unsent (and synced) samples, without
+ *	taking them from the spool; atlas_spool_advance() takes them once they
+ *	have been written.
+ *	Returns:
+ *		Number of samples copied
+ */
+int atlas_spool_peek(ATLAS_SPOOL* sp, ATLAS_SAMPLE* out, int max) {
+	ATLAS_SPOOL_SEG* hdr;
+	int n;
+
+	if(!sp->pending || !(hdr = atlas_spool_head(sp))) return 0;
+
+	n = hdr->count - hdr->sent;
+	if(n > max) n = max;
+	memcpy(out, atlas_spool_recs(hdr) + hdr->sent, sizeof(ATLAS_SAMPLE) * n);
+
+	return n;
+}
+
+// Takes n samples, as returned by atlas_spool_peek(), from the spool
+void atlas_spool_advance(ATLAS_SPOOL* sp, int n) {
+
+	if(!sp->rmap) return;
+	sp->rmap->sent += n;
+	sp->pending -= n;
+	sp->rdirty = 1;
+
+	// delete the segment now if that was the last of it
+	atlas_spool_head(sp);
+}
+
+// Timestamp of the oldest unsent sample (0 = none)
+time_t atlas_spool_oldest(ATLAS_SPOOL* sp) {
+	ATLAS_SPOOL_SEG* hdr;
+
+	if(!sp->pending) return 0;
+	if((hdr = atlas_spool_head(sp)) != NULL) return atlas_spool_recs(hdr)[hdr->sent].tstamp;
+
+	// only unsynced samples left
+	if(sp->wmap && sp->wcount > sp->wmap->count) return atlas_spool_recs(sp->wmap)[sp->wmap->count].tstamp;
+	return 0;
+}
+
+// Syncs & closes a spool
+void atlas_spool_close(ATLAS_SPOOL* sp) {
+
+	atlas_spool_sync(sp, 1);
+	if(sp->rmap && sp->rmap != sp->wmap) atlas_spool_unmap(sp->rmap);
+	atlas_spool_unmap(sp->wmap);
+	sp->rmap = NULL;
+	sp->wmap = NULL;
+
+	if(sp->pending) zlog_info("atlas_spool_close(): [%i] %lli samples left in the spool, for the next run.\n",sp->wid,sp->pending);
+}
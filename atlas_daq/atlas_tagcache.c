@@ -0,0 +1,214 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Tag Configuration Cache
+
+	Each target's tag and alarm lists are loaded from the database once,
+	compiled, and kept; every acquisition round reuses them. The lists are
+	only loaded again when they change: a CHECKSUM TABLE of the tag and
+	alarm tables is taken every --cfg-probe seconds, and a different
+	checksum marks every target's lists for reloading. The management
+	"reload" command does the same at once.
+
+	The cache is only used from the main thread (acquisition rounds load
+	their tag lists there, before handing them to the workers).
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "atlas_daq.h"
+
+static time_t cfg_last_probe = 0;	// time of the last CHECKSUM TABLE
+static unsigned long long cfg_checksum = 0;	// combined checksum of the tag & alarm tables
+static int cfg_checksum_ok = 0;		// 1 once cfg_checksum has been taken
+static int cfg_reload = 0;		// set by atlas_tagcache_reload()
+
+// Marks every target's lists for reloading
+static void atlas_tagcache_stale() {
+
+	for(int tgi = 0; tgi < atx_targets; tgi++) atx_tgdex[tgi]->cfg_loaded = 0;
+}
+
+// Checksum of the tag & alarm tables, or -1 if it couldn't be taken
+static int atlas_tagcache_checksum(ATLAS_DB* cur_db, unsigned long long* sum) {
+	MYSQL_RES* resultx;
+	MYSQL_ROW  rowx;
+	char qq[512];
+
+	sprintf(qq,"CHECKSUM TABLE %s, %s",cur_db->tables.tag_list,cur_db->tables.alarm_list);
+	if(mysql_query(cur_db->conx,qq) || !(resultx = mysql_store_result(cur_db->conx))) {
+		zlog_error("atlas_tagcache_probe(): Query failed! %i - %s [%s]\n",mysql_errno(cur_db->conx),mysql_error(cur_db->conx),qq);
+		return -1;
+	}
+
+	// one row per table: name, checksum (NULL if the table doesn't exist)
+	*sum = 0;
+	while((rowx = mysql_fetch_row(resultx))) {
+		*sum = *sum * 1000003ULL + (rowx[1] ? strtoull(rowx[1], NULL, 10) : 0);
+	}
+	mysql_free_result(resultx);
+
+	return 0;
+}
+
+/*
+ * atlas_tagcache_probe
+ *	Checks whether the tag configuration has changed, at most once every
+ *	global_config.cfg_probe seconds (0 = reload every round), or at once
+ *	after atlas_tagcache_reload(). If it has, every target's lists are
+ *	loaded again as they are next used.
+ *	Returns:
+ *		1 if the lists will be reloaded, 0 if not
+ */
+int atlas_tagcache_probe(ATLAS_DB* cur_db) {
+	unsigned long long sum;
+	time_t now = time(NULL);
+
+	if(cfg_reload) {
+		zlog_info("atlas_tagcache_probe(): Reload requested. Reloading tag configuration.\n");
+		cfg_reload = 0;
+		cfg_checksum_ok = 0;
+		atlas_tagcache_stale();
+		return 1;
+	}
+
+	if(global_config.cfg_probe <= 0) {
+		atlas_tagcache_stale();
+		return 1;
+	}
+
+	if(cfg_checksum_ok && now - cfg_last_probe < global_config.cfg_probe) return 0;
+	if(cur_db->status != STATUS_READY) return 0;
+	cfg_last_probe = now;
+
+	if(atlas_tagcache_checksum(cur_db, &sum)) return 0;
+	if(cfg_checksum_ok && sum == cfg_checksum) return 0;
+
+	if(cfg_checksum_ok) zlog_info("atlas_tagcache_probe(): Tag configuration has changed. Reloading.\n");
+	cfg_checksum = sum;
+	cfg_checksum_ok = 1;
+	atlas_tagcache_stale();
+
+	return 1;
+}
+
+// Requests a reload of every target's lists, from the next round (management "reload")
+void atlas_tagcache_reload() {
+
+	cfg_reload = 1;
+}
+
+/*
+ * atlas_tagcache_tags
+ *	Returns a target's cached tag list, loading it first if it isn't
+ *	cached or has changed. The values and read status of each tag are
+ *	cleared for a new round. If the list can't be loaded (or the database
+ *	is down), the last one cached is used, and loading is tried again next
+ *	round.
+ *	Args:
+ *		cur_db*			Database connection
+ *		cur_target*		Target to retrieve tags for
+ *		tags_out**		Set to the cached tag array (owned by the cache; don't free)
+ *	Returns:
+ *		Number of tags in array, or -1 on failure
+ */
+int atlas_tagcache_tags(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out) {
+	ATLAS_TAG* tags;
+	int tag_count;
+
+	(*tags_out) = NULL;
+
+	if(!(cur_target->cfg_loaded & CFG_TAGS) && cur_db->status == STATUS_READY) {
+		if((tag_count = atlas_load_tags(cur_db, cur_target, &tags)) >= 0) {
+			zlog_debug("atlas_tagcache_tags(): [%s] Loaded %i tags.\n",cur_target->sname,tag_count);
+			atlas_comp_carry(cur_target->cfg_tags, cur_target->cfg_tag_count, tags, tag_count);
+			for(int i = 0; i < tag_count; i++) tags[i].cv_slot = atlas_cvt_slot(tags[i].id, cur_target->id);
+			free(cur_target->cfg_tags);
+			cur_target->cfg_tags = tags;
+			cur_target->cfg_tag_count = tag_count;
+			cur_target->cfg_loaded |= CFG_TAGS;
+		}
+	}
+	if(!(cur_target->cfg_loaded & CFG_TAGS) && !cur_target->cfg_tags) return -1;
+
+	for(int i = 0; i < cur_target->cfg_tag_count; i++) {
+		tags = &cur_target->cfg_tags[i];
+		tags->v_int = 0;
+		tags->v_float = 0.0f;
+		tags->v_str[0] = 0;
+		tags->read_status = -1;
+	}
+
+	(*tags_out) = cur_target->cfg_tags;
+	return cur_target->cfg_tag_count;
+}
+
+/*
+ * atlas_tagcache_alarms
+ *	Returns the tags of a target's cached alarm list, as one array to be
+ *	read like a tag list, as atlas_tagcache_tags() does for tags.
+ *	Args:
+ *		cur_db*			Database connection
+ *		cur_target*		Target to retrieve alarms for
+ *		tags_out**		Set to the cached alarm tag array (owned by the cache; don't free)
+ *	Returns:
+ *		Number of alarms in array, or -1 on failure
+ */
+int atlas_tagcache_alarms(ATLAS_DB* cur_db, ATLAS_TARGET* cur_target, ATLAS_TAG** tags_out) {
+	ATLAS_ALARM* alarms;
+	ATLAS_TAG* tags;
+	int alarm_count;
+
+	(*tags_out) = NULL;
+
+	if(!(cur_target->cfg_loaded & CFG_ALARMS) && cur_db->status == STATUS_READY) {
+		if((alarm_count = atlas_load_alarms(cur_db, cur_target, &alarms)) >= 0) {
+			if((tags = malloc(sizeof(ATLAS_TAG) * (alarm_count ? alarm_count : 1))) == NULL) {
+				zlog_error("atlas_tagcache_alarms(): Memory allocation failed!\n");
+				free(alarms);
+			} else {
+				zlog_debug("atlas_tagcache_alarms(): [%s] Loaded %i alarms.\n",cur_target->sname,alarm_count);
+				for(int i = 0; i < alarm_count; i++) tags[i] = alarms[i].tag;
+				free(cur_target->cfg_alarms);
+				free(cur_target->cfg_alarm_tags);
+				cur_target->cfg_alarms = alarms;
+				cur_target->cfg_alarm_tags = tags;
+				cur_target->cfg_alarm_count = alarm_count;
+				cur_target->cfg_loaded |= CFG_ALARMS;
+			}
+		}
+	}
+	if(!(cur_target->cfg_loaded & CFG_ALARMS) && !cur_target->cfg_alarm_tags) return -1;
+
+	for(int i = 0; i < cur_target->cfg_alarm_count; i++) {
+		tags = &cur_target->cfg_alarm_tags[i];
+		tags->v_int = 0;
+		tags->v_float = 0.0f;
+		tags->v_str[0] = 0;
+		tags->read_status = -1;
+	}
+
+	(*tags_out) = cur_target->cfg_alarm_tags;
+	return cur_target->cfg_alarm_count;
+}
+
+// Frees a target's cached lists
+void atlas_tagcache_free(ATLAS_TARGET* cur_target) {
+
+	free(cur_target->cfg_tags);
+	free(cur_target->cfg_alarms);
+	free(cur_target->cfg_alarm_tags);
+	cur_target->cfg_tags = NULL;
+	cur_target->cfg_alarms = NULL;
+	cur_target->cfg_alarm_tags = NULL;
+	cur_target->cfg_tag_count = 0;
+	cur_target->cfg_alarm_count = 0;
+	cur_target->cfg_loaded = 0;
+}
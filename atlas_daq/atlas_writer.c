@@ -0,0 +1,532 @@
+/*
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	Persistence Writers
+
+	Tag values are written to the database by writer threads (--writers),
+	so a slow commit never holds up the next read. Acquisition pushes each
+	value as a fixed-size sample into a writer's ring; the writer drains it
+	into its own batch queue (atlas_dbwrite.c) and writes the batches on
+	its own connection. Samples are dealt to writers by tag id, so the
+	values of a tag are always written in the order they were read.
+
+	The rings are bounded lock-free multi-producer, single-consumer queues
+	(D. Vyukov's bounded queue: each slot carries a sequence number which
+	says whether it is free or filled for the current lap). A push into a
+	full ring waits up to --writer-wait ms for room (backpressure), then
+	drops the sample; until a push succeeds again, later ones are dropped
+	at once, so a stuck writer can't stall acquisition for long.
+
+	With --spool-dir set, a writer doesn't let samples pile up while the
+	database is down or slow: it moves them to its spool (atlas_spool.c),
+	along with any batch which failed to write, and replays the spool into
+	the history table, between live batches, once it has caught up.
+
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "atlas_daq.h"
+
+typedef struct {
+	unsigned long long seq;		// pos when free for pos, pos + 1 once filled
+	ATLAS_SAMPLE sample;
+} ATLAS_RING_SLOT;
+
+typedef struct {
+	pthread_t thread;
+	int id;
+	ATLAS_DB db;			// the writer's own connection
+	ATLAS_DBW dbw;			// batch being built
+	long long next_connect;		// time of the next connection attempt (atlas_evloop_now())
+
+	ATLAS_RING_SLOT* ring;
+	unsigned long long mask;	// ring size - 1
+	char pad0[64];
+	unsigned long long head;	// next slot to fill (producers)
+	char pad1[64];
+	unsigned long long tail;	// next slot to drain (writer)
+	char pad2[64];
+
+	int idle;			// set while the writer waits; producers wake it
+	int saturated;			// set when a push gave up waiting for room
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	unsigned long long written;	// stats
+	unsigned long long dropped;
+	unsigned long long waits;
+	long long lag_ms;
+	int db_status;
+
+	ATLAS_SPOOL spool;		// store-and-forward spool (if spool_dir is set)
+	ATLAS_SAMPLE* batch;		// history & alarm samples of the batch in dbw, spooled if its write fails
+	int batch_count;
+	ATLAS_DBW replay;		// batch being replayed from the spool
+	ATLAS_SAMPLE* rbatch;
+	int replay_count;		// samples replayed in the current second
+	long long replay_window;	// start of the current second (atlas_evloop_now())
+	int replay_last;		// samples replayed in the last whole second
+	long long spooled;		// stats
+	long long spool_bytes;
+	time_t spool_oldest;
+	int replay_rate;
+} ATLAS_WRITER;
+
+static ATLAS_WRITER* writers = NULL;
+static int writer_count = 0;
+static int writer_started = 0;		// threads actually running
+static int writer_shutdown = 0;
+
+// Fills the next free slot; -1 if the ring is full
+static int atlas_writer_put(ATLAS_WRITER* w, ATLAS_SAMPLE* sample) {
+	ATLAS_RING_SLOT* slot;
+	unsigned long long pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+	unsigned long long seq;
+	long long diff;
+
+	for(;;) {
+		slot = &w->ring[pos & w->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long long)(seq - pos);
+		if(!diff) {
+			if(__atomic_compare_exchange_n(&w->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if(diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->sample = *sample;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// 1 if the next slot to drain is filled
+static int atlas_writer_ready(ATLAS_WRITER* w) {
+
+	return __atomic_load_n(&w->ring[w->tail & w->mask].seq, __ATOMIC_ACQUIRE) == w->tail + 1;
+}
+
+// Takes the next sample (writer thread only); -1 if the ring is empty
+static int atlas_writer_take(ATLAS_WRITER* w, ATLAS_SAMPLE* sample) {
+	ATLAS_RING_SLOT* slot = &w->ring[w->tail & w->mask];
+
+	if(!atlas_writer_ready(w)) return -1;
+
+	*sample = slot->sample;
+	__atomic_store_n(&slot->seq, w->tail + w->mask + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// Wakes the writer, if it's waiting for samples
+static void atlas_writer_wake(ATLAS_WRITER* w) {
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&w->idle, __ATOMIC_RELAXED)) return;
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Waits up to max_ms for samples, or shutdown
+static void atlas_writer_sleep(ATLAS_WRITER* w, int max_ms) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += max_ms / 1000;
+	ts.tv_nsec += (max_ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	__atomic_store_n(&w->idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!atlas_writer_ready(w) && !__atomic_load_n(&writer_shutdown, __ATOMIC_RELAXED)) pthread_cond_timedwait(&w->wake, &w->lock, &ts);
+	__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Publishes the batch queue's counters to the writer's stats
+static void atlas_writer_publish(ATLAS_WRITER* w) {
+
+	__atomic_store_n(&w->written, w->dbw.written, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->lag_ms, w->dbw.lag_ms, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->db_status, w->db.status, __ATOMIC_RELAXED);
+	if(w->batch) {
+		if(atlas_evloop_now() - w->replay_window >= 1000) {
+			w->replay_last = atlas_evloop_now() - w->replay_window < 2000 ? w->replay_count : 0;
+			w->replay_count = 0;
+			w->replay_window = atlas_evloop_now();
+		}
+		__atomic_store_n(&w->written, w->dbw.written + w->replay.written, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->spooled, w->spool.pending, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->spool_bytes, w->spool.bytes, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->spool_oldest, atlas_spool_oldest(&w->spool), __ATOMIC_RELAXED);
+		__atomic_store_n(&w->replay_rate, w->replay_last, __ATOMIC_RELAXED);
+	}
+	if(w->dbw.dropped) {
+		__atomic_fetch_add(&w->dropped, w->dbw.dropped, __ATOMIC_RELAXED);
+		w->dbw.dropped = 0;
+	}
+}
+
+// (Re)connects the writer's database connection
+static void atlas_writer_connect(ATLAS_WRITER* w) {
+
+	if(w->db.conx) mysql_close(w->db.conx);
+	w->db.conx = NULL;
+	w->next_connect = atlas_evloop_now() + ATLAS_WRITER_RETRY;
+
+	if(atlas_mysql_init(&w->db) == STATUS_READY) {
+		zlog_info("atlas_writer(): [%i] Connected to mySQL.\n",w->id);
+	}
+	atlas_writer_publish(w);
+}
+
+// Spools samples which couldn't be written (or drops them, without a spool)
+static void atlas_writer_spill(ATLAS_WRITER* w, ATLAS_SAMPLE* samples, int count, int counted) {
+	int spooled = 0;
+
+	for(int i = 0; i < count && w->batch; i++) {
+		// realtime-only values are dropped; the table gets a newer one
+		if(!(samples[i].flags & (SAMPLE_HISTORY | SAMPLE_ALARM))) continue;
+		if(atlas_spool_put(&w->spool, &samples[i])) break;
+		spooled++;
+	}
+
+	// counted: already counted as dropped by the batch queue
+	if(counted) w->dbw.dropped -= spooled;
+	else w->dbw.dropped += count - spooled;
+}
+
+// Moves up to max samples (-1 = all) from the ring to the spool
+static void atlas_writer_divert(ATLAS_WRITER* w, int max) {
+	ATLAS_SAMPLE sample;
+
+	for(int n = 0; (max < 0 || n < max) && !atlas_writer_take(w, &sample); n++) {
+		atlas_writer_spill(w, &sample, 1, 0);
+	}
+}
+
+// Queues a sample; spools the batch if writing it failed
+static void atlas_writer_add(ATLAS_WRITER* w, ATLAS_SAMPLE* sample) {
+	int rv;
+
+	if(w->batch && (sample->flags & (SAMPLE_HISTORY | SAMPLE_ALARM))) w->batch[w->batch_count++] = *sample;
+	rv = atlas_dbw_add(&w->dbw, &w->db, sample);
+
+	if(!w->batch || atlas_dbw_pending(&w->dbw)) return;
+	if(rv) atlas_writer_spill(w, w->batch, w->batch_count, 1);
+	w->batch_count = 0;
+}
+
+// Writes the batch, if due (always with force); spools it if that failed
+static void atlas_writer_flush(ATLAS_WRITER* w, int force) {
+	int rv;
+
+	rv = atlas_dbw_flush(&w->dbw, &w->db, force);
+
+	if(!w->batch || atlas_dbw_pending(&w->dbw)) return;
+	if(rv < 0) atlas_writer_spill(w, w->batch, w->batch_count, 1);
+	w->batch_count = 0;
+}
+
+// Replays a batch from the spool, within global_config.spool_rate; returns the samples replayed
+static int atlas_writer_replay(ATLAS_WRITER* w) {
+	unsigned long long written = w->replay.written;
+	int max = global_config.db_batch;
+	int n;
+
+	if(global_config.spool_rate > 0 && global_config.spool_rate - w->replay_count < max) max = global_config.spool_rate - w->replay_count;
+	if(max <= 0 || !(n = atlas_spool_peek(&w->spool, w->rbatch, max))) return 0;
+
+	// history only: realtime already has newer values
+	for(int i = 0; i < n; i++) atlas_dbw_add(&w->replay, &w->db, &w->rbatch[i]);
+	atlas_dbw_flush(&w->replay, &w->db, 1);
+	w->replay.dropped = 0;
+
+	// if it failed, the samples are still in the spool
+	if(w->replay.written - written != (unsigned long long)n) return 0;
+
+	atlas_spool_advance(&w->spool, n);
+	w->replay_count += n;
+	if(!w->spool.pending) zlog_info("atlas_writer(): [%i] Spool replayed.\n",w->id);
+
+	return n;
+}
+
+// Writer thread: drains the ring into batches, and writes them
+static void* atlas_writer_run(void* arg) {
+	ATLAS_WRITER* w = arg;
+	ATLAS_SAMPLE sample;
+	int ring_size = w->mask + 1;
+	int lingered = 0;
+	int stopping;
+	int depth;
+	int n;
+
+	mysql_thread_init();
+
+	for(;;) {
+		stopping = __atomic_load_n(&writer_shutdown, __ATOMIC_RELAXED);
+
+		// no connection: samples go to the spool, or without one, stay in the ring
+		if(w->db.status != STATUS_READY) {
+			if(atlas_evloop_now() >= w->next_connect) atlas_writer_connect(w);
+			if(w->db.status != STATUS_READY) {
+				if(w->batch) {
+					atlas_writer_flush(w, 1);
+					atlas_writer_divert(w, -1);
+					atlas_spool_sync(&w->spool, stopping);
+					atlas_writer_publish(w);
+				}
+				if(stopping) break;
+				atlas_writer_sleep(w, w->batch ? global_config.spool_sync : w->next_connect - atlas_evloop_now());
+				continue;
+			}
+		}
+
+		// falling behind: spool the excess, so the ring doesn't fill
+		depth = (int)(__atomic_load_n(&w->head, __ATOMIC_RELAXED) - w->tail);
+		if(w->batch && depth > ring_size / 2) atlas_writer_divert(w, depth - ring_size / 4);
+
+		for(n = 0; n < global_config.db_batch && w->db.status == STATUS_READY && !atlas_writer_take(w, &sample); n++) {
+			atlas_writer_add(w, &sample);
+		}
+		if(n) {
+			lingered = 0;
+			if(w->batch) atlas_spool_sync(&w->spool, 0);
+			atlas_writer_publish(w);
+			continue;
+		}
+
+		// ring is empty; give the rest of a round a moment to arrive before writing
+		if(atlas_dbw_pending(&w->dbw) && !lingered && !stopping) {
+			lingered = 1;
+			usleep(ATLAS_WRITER_LINGER * 1000);
+			continue;
+		}
+		lingered = 0;
+
+		atlas_writer_flush(w, stopping);
+
+		// caught up: replay from the spool, between live batches
+		if(w->batch && !stopping && w->db.status == STATUS_READY && atlas_writer_replay(w)) {
+			atlas_writer_publish(w);
+			continue;
+		}
+
+		if(w->batch) atlas_spool_sync(&w->spool, stopping);
+		atlas_writer_publish(w);
+		if(stopping) break;
+
+		atlas_writer_sleep(w, w->spool.pending ? 100 : 1000);
+	}
+
+	// anything left could not be written: spool it, or drop it
+	atlas_writer_flush(w, 1);
+	atlas_writer_divert(w, -1);
+	if(w->batch) atlas_spool_close(&w->spool);
+	atlas_writer_publish(w);
+
+	if(w->db.conx) mysql_close(w->db.conx);
+	w->db.conx = NULL;
+	mysql_thread_end();
+	return NULL;
+}
+
+/*
+ * atlas_writer_start
+ *	Starts the persistence writers, each with its own connection to the
+ *	database given (connected from the writer's thread).
+ *	Args:
+ *		cur_db = database to connect to
+ *		count = number of writer threads
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int atlas_writer_start(ATLAS_DB* cur_db, int count) {
+	unsigned long long ring_size = 2;
+	struct stat st;
+
+	if(writer_count || count <= 0) return 0;
+
+	while(ring_size < (unsigned long long)global_config.writer_ring) ring_size <<= 1;
+
+	// check the spool directory once, rather than failing to create a segment for every sample spilled
+	if(global_config.spool_dir[0] &&
+	   (stat(global_config.spool_dir, &st) || !S_ISDIR(st.st_mode) || access(global_config.spool_dir, W_OK | X_OK))) {
+		zlog_error("atlas_writer_start(): Spool directory [%s] doesn't exist or isn't writable! Spooling disabled.\n",global_config.spool_dir);
+		global_config.spool_dir[0] = 0;
+	}
+
+	if((writers = calloc(count, sizeof(ATLAS_WRITER))) == NULL) {
+		zlog_error("atlas_writer_start(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	writer_shutdown = 0;
+	writer_count = count;
+	for(int i = 0; i < count; i++) {
+		writers[i].id = i;
+		writers[i].db = *cur_db;
+		writers[i].db.conx = NULL;
+		writers[i].db.status = STATUS_NOTREADY;
+		writers[i].mask = ring_size - 1;
+		pthread_mutex_init(&writers[i].lock, NULL);
+		pthread_cond_init(&writers[i].wake, NULL);
+		if((writers[i].ring = malloc(sizeof(ATLAS_RING_SLOT) * ring_size)) == NULL) {
+			zlog_error("atlas_writer_start(): Memory allocation failed!\n");
+			atlas_writer_stop();
+			return -1;
+		}
+		for(unsigned long long s = 0; s < ring_size; s++) writers[i].ring[s].seq = s;
+
+		// store-and-forward spool
+		if(global_config.spool_dir[0]) {
+			writers[i].replay.history_only = 1;
+			// dbw writes out a batch when either its history or alarm queue fills, so up to two queues' worth
+			if((writers[i].batch = malloc(sizeof(ATLAS_SAMPLE) * global_config.db_batch * 2)) == NULL ||
+			   (writers[i].rbatch = malloc(sizeof(ATLAS_SAMPLE) * global_config.db_batch)) == NULL) {
+				zlog_error("atlas_writer_start(): Memory allocation failed!\n");
+				atlas_writer_stop();
+				return -1;
+			}
+			if(atlas_spool_open(&writers[i].spool, i) < 0) {
+				zlog_error("atlas_writer_start(): [%i] Can't open spool! Spooling disabled for this writer.\n",i);
+				free(writers[i].batch);
+				free(writers[i].rbatch);
+				writers[i].batch = writers[i].rbatch = NULL;
+				writers[i].replay.history_only = 0;
+			}
+		}
+	}
+	for(int i = 0; i < count; i++) {
+		if(pthread_create(&writers[i].thread, NULL, atlas_writer_run, &writers[i])) {
+			zlog_error("atlas_writer_start(): Failed to start writer %i!\n",i);
+			atlas_writer_stop();
+			return -1;
+		}
+		writer_started = i + 1;
+	}
+
+	zlog_info("atlas_writer_start(): Started %i persistence writers (%llu samples each).\n",writer_count,ring_size);
+	return 0;
+}
+
+// Stops the writers, once they have written everything pushed so far
+void atlas_writer_stop() {
+
+	if(!writers) return;
+
+	__atomic_store_n(&writer_shutdown, 1, __ATOMIC_RELAXED);
+	for(int i = 0; i < writer_count; i++) {
+		pthread_mutex_lock(&writers[i].lock);
+		pthread_cond_signal(&writers[i].wake);
+		pthread_mutex_unlock(&writers[i].lock);
+	}
+
+	for(int i = 0; i < writer_started; i++) {
+		pthread_join(writers[i].thread, NULL);
+		if(writers[i].dropped) zlog_error("atlas_writer_stop(): [%i] %llu values were dropped.\n",i,writers[i].dropped);
+	}
+	for(int i = 0; i < writer_count; i++) {
+		pthread_mutex_destroy(&writers[i].lock);
+		pthread_cond_destroy(&writers[i].wake);
+		atlas_dbw_free(&writers[i].dbw);
+		atlas_dbw_free(&writers[i].replay);
+		free(writers[i].ring);
+		free(writers[i].batch);
+		free(writers[i].rbatch);
+	}
+
+	free(writers);
+	writers = NULL;
+	writer_count = 0;
+	writer_started = 0;
+}
+
+int atlas_writer_count() {
+	return writer_count;
+}
+
+/*
+ * atlas_writer_push
+ *	Queues a sample for the writer of its tag. If the ring is full, waits
+ *	up to global_config.writer_wait ms for room, then drops the sample.
+ *	Returns:
+ *		0 on success, -1 if the sample was dropped
+ */
+int atlas_writer_push(ATLAS_SAMPLE* sample) {
+	ATLAS_WRITER* w = &writers[(unsigned int)sample->tag_id % writer_count];
+	long long deadline = 0;
+
+	while(atlas_writer_put(w, sample)) {
+		// already found full, and gave up waiting: don't wait again until there's room
+		if(__atomic_load_n(&w->saturated, __ATOMIC_RELAXED)) goto drop;
+
+		if(!deadline) {
+			__atomic_fetch_add(&w->waits, 1, __ATOMIC_RELAXED);
+			deadline = atlas_evloop_now() + global_config.writer_wait;
+		} else if(atlas_evloop_now() >= deadline) {
+			if(!__atomic_exchange_n(&w->saturated, 1, __ATOMIC_RELAXED)) {
+				zlog_error("atlas_writer_push(): [%i] Writer is not keeping up! Dropping values until it does.\n",w->id);
+			}
+			goto drop;
+		}
+
+		atlas_writer_wake(w);
+		usleep(1000);
+	}
+
+	if(__atomic_load_n(&w->saturated, __ATOMIC_RELAXED) && __atomic_exchange_n(&w->saturated, 0, __ATOMIC_RELAXED)) {
+		zlog_info("atlas_writer_push(): [%i] Writer has caught up. %llu values dropped so far.\n",w->id,__atomic_load_n(&w->dropped, __ATOMIC_RELAXED));
+	}
+
+	atlas_writer_wake(w);
+	return 0;
+
+drop:
+	__atomic_fetch_add(&w->dropped, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+// Statistics of writer wid; -1 if there is no such writer
+int atlas_writer_stats(int wid, ATLAS_WRITER_STATS* stats) {
+	ATLAS_WRITER* w;
+
+	if(wid < 0 || wid >= writer_count) return -1;
+	w = &writers[wid];
+
+	stats->depth = (int)(__atomic_load_n(&w->head, __ATOMIC_RELAXED) - __atomic_load_n(&w->tail, __ATOMIC_RELAXED));
+	if(stats->depth < 0) stats->depth = 0;
+	stats->ring_size = (int)(w->mask + 1);
+	stats->written = __atomic_load_n(&w->written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&w->dropped, __ATOMIC_RELAXED);
+	stats->waits = __atomic_load_n(&w->waits, __ATOMIC_RELAXED);
+	stats->lag_ms = __atomic_load_n(&w->lag_ms, __ATOMIC_RELAXED);
+	stats->db_status = __atomic_load_n(&w->db_status, __ATOMIC_RELAXED);
+	stats->spooled = __atomic_load_n(&w->spooled, __ATOMIC_RELAXED);
+	stats->spool_bytes = __atomic_load_n(&w->spool_bytes, __ATOMIC_RELAXED);
+	stats->spool_oldest = __atomic_load_n(&w->spool_oldest, __ATOMIC_RELAXED);
+	stats->replay_rate = __atomic_load_n(&w->replay_rate, __ATOMIC_RELAXED);
+
+	return 0;
+}
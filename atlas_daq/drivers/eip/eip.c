@@ -16,7 +16,15 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "atlas_daq.h"
+#include "eip.h"
+
+// TuxEip reports errors through globals (cip_errno, cip_err_msg), so only one
+// thread may be in the library at a time
+static pthread_mutex_t eip_lib_lock = PTHREAD_MUTEX_INITIALIZER;
 
 extern CIP_UINT _OriginatorVendorID;
 extern CIP_UDINT _OriginatorSerialNumber;
@@ -26,47 +34,84 @@ extern WORD _Parameters;
 extern BYTE _Transport;
 extern BYTE _TimeOutMultiplier;
 
-#define ATLS_EIP_MRS_GET_INSTANCE_ATTRIBUTE_LIST	0x0055
+#define ATLS_EIP_MRS_READ_TAG				0x004C
+#define ATLS_EIP_MRS_UNCONNECTED_SEND			0x0052
+#define ATLS_EIP_MRS_MULTIPLE_SERVICE			0x000A
+
+#define ATLS_EIP_PORT					44818	// EtherNet/IP explicit messaging (TCP)
+
+#define ATLS_EIP_MAX_REQUEST				504	// max CIP request data (stays under the 504 byte unconnected limit)
+#define ATLS_EIP_MSP_REPLY_TAG				12	// largest reply per scalar tag: offset, reply header, type & value
 
+#define ATLS_EIP_ARRAY_GAP				16	// largest gap between array elements read in one block
+#define ATLS_EIP_ARRAY_MAX				1000	// most elements read in one array block
 
+#define EIP_BLOCK_ARRAY		1
+#define EIP_BLOCK_STRUCT	2
+#define EIP_BLOCK_PCCC		3	// SLC/PLC: span of a data file's elements
+
+// A Multiple Service Packet [0x0A]: tags plan->tag_index[first .. first + count - 1]
 typedef struct {
-	unsigned int instance_id;
-	unsigned short int stype;
-	unsigned short int namestr_sz;
-	char* namestr;
-} EIP_SYMBOL_INSTANCE_DATA;
+	int first;
+	int count;
+} EIP_MSP_PACKET;
 
-int eip_enum_taglist(ATLAS_TARGET* cur_device) {
+// Tag decoded from a block read
+typedef struct {
+	int tag;			// index into the set's tags
+	unsigned int pos;		// array: element number in the block; structure & PCCC: byte offset
+	unsigned short type;		// structure & PCCC: value type (arrays use the type in the reply)
+	signed char bit;		// bit number to take from the value, or -1
+} EIP_BLOCK_TAG;
 
-	MR_Reply* mr_reply;
-	int mr_reply_sz;
-	char* resp_data;
-	int resp_data_sz;
-	int reply_status = 1;
-
-	// request data:
-	// num of attribs (word), attrib #2 - symbol type (word), attrib #1 - symbol len & name (word)
-	char rq_data[6] = { 0x02, 0x00, 0x02, 0x00, 0x01, 0x00 };
-	int rq_data_sz = 6;
-
-	char path_data[6] = { 0x20, 0x6b, 0x25, 0x00, 0x00, 0x00 };
-	unsigned short int* instance_id = (unsigned short int*)&path_data[4];
-	int path_data_sz = 6;
-
-	// Build request packet
-	//while(reply_status) {
-		zlog_debug("eip_enum_taglist(): Sending CIP/MR packet, service = 0x%04x, instance_id = 0x%04x\n",ATLS_EIP_MRS_GET_INSTANCE_ATTRIBUTE_LIST,(*instance_id));
-		mr_reply = _SendMRRequest(cur_device->eip_session, ATLS_EIP_MRS_GET_INSTANCE_ATTRIBUTE_LIST, path_data, path_data_sz, rq_data, rq_data_sz, &mr_reply_sz);
-		ATLS_DEBUG_LOGFUNC();
-		resp_data = _GetMRData(mr_reply);
-		ATLS_DEBUG_LOGFUNC();
-		reply_status = mr_reply->General_Status;
-		ATLS_DEBUG_LOGFUNC();
-		zlog_debug("eip_enum_taglist(): Got response! Status = 0x%02x, data sz = %i\n",reply_status,resp_data_sz);
-	//}
+// Span of an array, or a whole structure, read with Read Tag Fragmented [0x52],
+// or span of a data file read with a PCCC typed read:
+// tags plan->btags[first .. first + count - 1]
+typedef struct {
+	int kind;			// EIP_BLOCK_*
+	unsigned char path[ATLAS_CIP_PATH_MAX];	// arrays: path to the first element; PCCC: the typed read
+	int path_sz;
+	int elements;			// number of elements to read
+	unsigned short handle;		// structure: handle, from the template
+	unsigned int size;		// size of data, in bytes
+	unsigned char* data;		// block read buffer
+	int first;
+	int count;
+} EIP_BLOCK;
+
+// Tag path addressing the tag's symbol by instance [0x6B]
+typedef struct {
+	unsigned char path[ATLAS_CIP_PATH_MAX];
+	int path_sz;			// 0 = use the tag's symbolic path
+} EIP_TAGPATH;
+
+// EIP driver read plan: compiled Logix tags read as array & structure blocks,
+// or packed into Multiple Service Packets, and compiled SLC/PLC tags read as
+// spans of their data files; all other tags are read one at a time
+typedef struct {
+	int tag_count;			// number of tags in the set when planned
+	unsigned int tag_sig;		// signature of the set's tag names (see eip_plan_tag_sig)
+	int stale;			// rebuild the plan next cycle (templates or symbols couldn't be read, or changed)
+	int by_instance;		// 1 if any paths address symbols by instance
+	EIP_TAGPATH* paths;		// by tag
+	int* tag_index;			// indexes into the set's tags, in packet order
+	EIP_MSP_PACKET* packets;
+	int packet_count;
+	EIP_BLOCK_TAG* btags;
+	int btag_count;
+	EIP_BLOCK* blocks;
+	int block_count;
+} EIP_PLAN;
+
+// Block candidate, while planning: tags sharing kind & key are read together
+typedef struct {
+	int tag;
+	int kind;			// EIP_BLOCK_*; PCCC: the data file type
+	unsigned char* key;		// path of the array or structure
+	int key_sz;			// PCCC: the data file number
+	unsigned int idx;		// array & PCCC: element number
+} EIP_BLOCK_CAND;
 
-	return 0;
-}
 
 /*
  * eip_genpath
@@ -203,101 +248,1255 @@ int eip_stop(ATLAS_TARGET* cur_device) {
 	return 0;
 }
 
-void* eip_readtag(char* tagname, ATLAS_TARGET* cur_device, int* dtype_ret) {
-	static char tempreg[32];
-	static int  txnum = 0;
+// Records a failed read in the status and the target
+static int eip_read_failed(ATLAS_TARGET* cur_device, ATLAS_RSTATUS* rst, int code) {
 
-	static union {
-		int  v_int;
-		float v_float;
-	} rval;
+	rst->code = code;
+	cur_device->last_rstat = code;
+	return -1;
+}
 
-	float vfloat;
-	int vint;
-	LGX_Read *rdata;
-	PLC_Read *pdata;
+// Records a read which lost the session. The target's connection is restored
+// by the reconnect thread (atlas_rcx.c), not here.
+static int eip_read_lost(ATLAS_TARGET* cur_device, ATLAS_RSTATUS* rst) {
 
-	if(cur_device->status != STATUS_READY) {
-		zlog_error("eip_readtag(): Target device is not ready!\n");
-		zlog_error("eip_readtag(): Attempting to re-establish connection...\n");
-		if(!eip_start(cur_device)) {
-			zlog_info("eip_readtag(): Connection re-established OK!\n");
-		} else {
-			zlog_error("eip_readtag(): Connection failed. Will try next time.\n");
-			eip_readerr = 1;
-			return -1;
-		}
-	}
+	cur_device->status = STATUS_COMFAIL;
+	return eip_read_failed(cur_device, rst, RSTAT_COMFAIL);
+}
+
+// Records a good read in the status and the target
+static int eip_read_ok(ATLAS_TARGET* cur_device, ATLAS_RSTATUS* rst) {
+
+	rst->code = RSTAT_OK;
+	return 0;
+}
+
+// Fails a read straight away if the target isn't connected, so that the rest
+// of a dead target's tags cost nothing
+static int eip_read_ready(ATLAS_TARGET* cur_device, ATLAS_RSTATUS* rst, char* fname) {
+
+	if(cur_device->status == STATUS_READY) return 0;
+
+	zlog_debug("%s(): [%s] Target device is not ready!\n",fname,cur_device->sname);
+	return eip_read_failed(cur_device, rst, RSTAT_NOTREADY);
+}
+
+/*
+ * eip_readtag
+ *	Reads a tag by name, using TuxEip's Logix or PCCC reads as appropriate
+ *	for the target type.
+ *	Args:
+ *		tagname = tag name (Logix) or data table address (SLC/PLC)
+ *		val* = filled in with the value read
+ *		rst* = filled in with the outcome of the read
+ *	Returns:
+ *		0 on success, -1 on failure (see rst->code)
+ */
+int eip_readtag(ATLAS_TARGET* cur_device, char* tagname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+	LGX_Read *rdata = NULL;
+	PLC_Read *pdata = NULL;
+	int vtype;
+
+	memset(val,0,sizeof(ATLAS_VALUE));
+	memset(rst,0,sizeof(ATLAS_RSTATUS));
+
+	if(eip_read_ready(cur_device, rst, "eip_readtag")) return -1;
 
 	// Retrieve tag value from target
 	zlog_debug("eip_readtag: Reading \"%s\"...\n",tagname);
 	if(cur_device->target_type == TARGET_LGX) {
 		rdata = ReadLgxData(cur_device->eip_session,cur_device->eip_con,tagname,1);
-		if(!rdata) {
-			zlog_error("[%s:%s] ReadLgxData() failed to read from target! %s (%i : %i)\n",cur_device->sname, tagname, cip_err_msg,cip_errno,cip_ext_errno);
-			set_target_msg(cur_device,"[%s] Failed to read tag from target. [%s] (%i:%i)",tagname,cip_err_msg,cip_errno,cip_ext_errno);
-
-			cur_device->status = STATUS_COMFAIL;
-			eip_readerr = 1;
-			if(eip_autorcx && (eip_rcxattempt < eip_maxattempts)) {
-				zlog_error("[%s] Attempting to reconnect to target... [Attempt %i]\n",cur_device->sname,eip_rcxattempt+1);
-				// dump current connection
-				eip_stop(cur_device);
-				// increment connection ID and serial
-				cur_device->conn_id++;
-				cur_device->conn_serial++;
-				// reconnect...
-				eip_start(cur_device);
-				// increment attempt counter
-				eip_rcxattempt++;
-				// now retry eip_readtag() call...
-				return eip_readtag(tagname,cur_device,dtype_ret);
-			} else {
-				cur_device->status = STATUS_COMFAIL;
-				return -1;
-			}
-		} else {
-			eip_rcxattempt = 0;
-			zlog_debug("ReadLgxData() OK! type[%d] varcount[%d] totalsize[%d] elementsize[%d] mask[0x%08x]\n",
-		        	   rdata->type,rdata->Varcount,rdata->totalsize,rdata->elementsize,rdata->mask);
-		}
 	} else {
-		pdata = ReadPLCData(cur_device->eip_session,cur_device->eip_con,NULL,NULL,0,cur_device->target_type,txnum++,tagname,1);
+		pdata = ReadPLCData(cur_device->eip_session,cur_device->eip_con,NULL,NULL,0,cur_device->target_type,cur_device->eip_tns++,tagname,1);
 	}
 
-	// Retrieve multiple values, if necessary...
-	for(int i = 0; i < rdata->Varcount; i++) {
-		vfloat = _GetLGXValueAsFloat(rdata,i);
-		vint   = _GetLGXValueAsInteger(rdata,i);
-		sprintf(tempreg,"%d",vint);
-		zlog_debug("eip_readtag: index[%i] = vfloat[%0.04f] vint[%d]\n",i,vfloat,vint);
-		switch(rdata->type) {
+	if(!rdata && !pdata) {
+		zlog_error("[%s:%s] eip_readtag(): Failed to read from target! %s (%i : %i)\n",cur_device->sname, tagname, cip_err_msg,cip_errno,cip_ext_errno);
+		set_target_msg(cur_device,"[%s] Failed to read tag from target. [%s] (%i:%i)",tagname,cip_err_msg,cip_errno,cip_ext_errno);
+		rst->proto_err = cip_errno;
+		return eip_read_lost(cur_device, rst);
+	}
+
+	if(rdata) {
+		zlog_debug("ReadLgxData() OK! type[%d] varcount[%d] totalsize[%d] elementsize[%d] mask[0x%08x]\n",
+			   rdata->type,rdata->Varcount,rdata->totalsize,rdata->elementsize,rdata->mask);
+		vtype = rdata->type;
+		val->v_int   = _GetLGXValueAsInteger(rdata,0);
+		val->v_float = _GetLGXValueAsFloat(rdata,0);
+		// Data read by ReadXXXData must be free'd!
+		free(rdata);
+
+		switch(vtype) {
 			case EIP_DTYPE_BOOL:
-				rval.v_int = vint;
-				if(dtype_ret) (*dtype_ret) = DTYPE_RET_BOOL;
-				zlog_debug("eip_readtag: [EIP_DTYPE_BOOL] v_int = %i\n",rval.v_int);
+				val->dtype = DTYPE_RET_BOOL;
 				break;
 			case EIP_DTYPE_ASC:
+			case EIP_DTYPE_SINT16:
 			case EIP_DTYPE_INT:
-				rval.v_int = vint;
-				if(dtype_ret) (*dtype_ret) = DTYPE_RET_INT;
-				zlog_debug("eip_readtag: [EIP_DTYPE_INT] v_int = %i\n",rval.v_int);
+			case EIP_DTYPE_DWORD:
+				val->dtype = DTYPE_RET_INT;
 				break;
 			case EIP_DTYPE_FLP:
-				rval.v_float = vfloat;
-				if(dtype_ret) (*dtype_ret) = DTYPE_RET_FLOAT;
-				zlog_debug("eip_readtag: [EIP_DTYPE_FLP] v_float = %f\n",rval.v_float);
+				val->dtype = DTYPE_RET_FLOAT;
+				break;
+			default:
+				zlog_error("eip_readtag: unknown data type! type = %i\n",vtype);
+				return eip_read_failed(cur_device, rst, RSTAT_DTYPE);
+		}
+	} else {
+		zlog_debug("ReadPLCData() OK! type[%d] varcount[%d]\n",pdata->type,pdata->Varcount);
+		vtype = pdata->type;
+		val->v_int   = _GetPLCValueAsInteger(pdata,0);
+		val->v_float = _GetPLCValueAsFloat(pdata,0);
+		free(pdata);
+
+		switch(vtype) {
+			case PLC_BIT:
+				val->dtype = DTYPE_RET_BOOL;
+				break;
+			case PLC_INTEGER:
+				val->dtype = DTYPE_RET_INT;
+				break;
+			case PLC_FLOATING:
+				val->dtype = DTYPE_RET_FLOAT;
 				break;
 			default:
-				if(dtype_ret) (*dtype_ret) = 0;
-				zlog_error("eip_readtag: unknown data type! type = %i\n",rdata->type);
+				zlog_error("eip_readtag: unsupported PCCC data type! type = %i\n",vtype);
+				return eip_read_failed(cur_device, rst, RSTAT_DTYPE);
+		}
+	}
+
+	zlog_debug("eip_readtag: dtype[%i] vint[%d] vfloat[%0.04f]\n",val->dtype,val->v_int,val->v_float);
+
+	return eip_read_ok(cur_device, rst);
+}
+
+// Encodes an element segment (8, 16 or 32-bit), and returns its size
+static int eip_path_element(unsigned char* pp, unsigned long idx) {
+
+	if(idx <= 0xFF) {
+		pp[0] = 0x28;
+		pp[1] = idx;
+		return 2;
+	} else if(idx <= 0xFFFF) {
+		pp[0] = 0x29;
+		pp[1] = 0x00;
+		pp[2] = idx & 0xFF;
+		pp[3] = (idx >> 8) & 0xFF;
+		return 4;
+	}
+
+	pp[0] = 0x2A;
+	pp[1] = 0x00;
+	pp[2] = idx & 0xFF;
+	pp[3] = (idx >> 8) & 0xFF;
+	pp[4] = (idx >> 16) & 0xFF;
+	pp[5] = (idx >> 24) & 0xFF;
+	return 6;
+}
+
+/*
+ * eip_compile_tag
+ *	Encodes a Logix tag name into a CIP symbolic path (ANSI extended symbol
+ *	segments, with member & array element segments) once at load time, so
+ *	that reads don't have to parse the tag string again.
+ *	eg. "Line1.Station[3].Count" or "Program:Main.Flags.5" (bit 5)
+ *	SLC/PLC data table addresses are compiled by eip_pccc_compile().
+ *	Args:
+ *		cur_device*		Target the tag belongs to
+ *		curtag*			Tag to compile
+ *	Returns:
+ *		0 on success, -1 if the tag can't be compiled (it will be read by name)
+ */
+int eip_compile_tag(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag) {
+	ATLAS_TAGDESC* desc = &curtag->desc;
+	unsigned char* pp = desc->cip_path;
+	char* cc = curtag->tagname;
+	char* endp;
+	unsigned long idx;
+	int seglen;
+	int sz = 0;
+
+	desc->compiled = 0;
+	desc->cip_bit = -1;
+
+	// PLC5/SLC file addresses (eg. N7:0) aren't symbolic
+	if(cur_device->target_type != TARGET_LGX) return eip_pccc_compile(cur_device, curtag);
+
+	while(*cc) {
+		// trailing bit number, eg. "Flags.5"
+		if(isdigit(*cc)) {
+			idx = strtoul(cc, &endp, 10);
+			if(!sz || *endp || idx > 31) return -1;
+			desc->cip_bit = idx;
+			break;
+		}
+
+		// symbol segment: 0x91, length, name, pad to even length
+		seglen = strcspn(cc, ".[");
+		if(!seglen || seglen > 255 || sz + 3 + seglen > ATLAS_CIP_PATH_MAX) return -1;
+		pp[sz++] = 0x91;
+		pp[sz++] = seglen;
+		memcpy(pp + sz, cc, seglen);
+		sz += seglen;
+		if(seglen & 1) pp[sz++] = 0x00;
+		cc += seglen;
+
+		// element segments, eg. "Tag[3]" or "Tag[1,2]"
+		if(*cc == '[') {
+			cc++;
+			while(1) {
+				idx = strtoul(cc, &endp, 10);
+				if(endp == cc || sz + 6 > ATLAS_CIP_PATH_MAX) return -1;
+				sz += eip_path_element(pp + sz, idx);
+				cc = endp;
+				if(*cc == ',') {
+					cc++;
+					continue;
+				}
+				if(*cc != ']') return -1;
+				cc++;
+				break;
+			}
+		}
+
+		if(*cc == '.') cc++;
+		else if(*cc) return -1;
+	}
+
+	desc->cip_path_sz = sz;
+	desc->compiled = 1;
+
+	return 0;
+}
+
+/*
+ * eip_cip_request
+ *	Sends an explicit CIP request to the target's controller. When the target
+ *	has a route path (eg. backplane port & slot), the request is wrapped in an
+ *	Unconnected Send [0x52] to the Connection Manager.
+ *	Args:
+ *		cur_device*		Target to send the request to
+ *		service			CIP service code
+ *		path*			Request path (encoded)
+ *		path_sz			Size of request path, in bytes
+ *		reqdata*		Request data
+ *		reqdata_sz		Size of request data, in bytes
+ *		outbuf*			Buffer to receive the reply data
+ *		outbuf_sz		Size of outbuf, in bytes
+ *		gstatus*		If not NULL, replies with a partial transfer [0x06]
+ *					or embedded service error [0x1E] status are
+ *					returned too, and the status stored here
+ *	Returns:
+ *		Number of reply data bytes copied to outbuf, -1 on communication
+ *		failure, or -2 if the controller returned an error status
+ */
+int eip_cip_request(ATLAS_TARGET* cur_device, unsigned char service, unsigned char* path, int path_sz, void* reqdata, int reqdata_sz, unsigned char* outbuf, int outbuf_sz, int* gstatus) {
+	unsigned char cm_path[4] = { 0x20, 0x06, 0x24, 0x01 };	// Connection Manager, instance 1
+	unsigned char rq_data[ATLS_EIP_MAX_REQUEST + ATLAS_CIP_PATH_MAX + 32];
+	MR_Reply* mr_reply;
+	int mr_reply_sz = 0;
+	int msg_sz;
+	int rq_sz = 0;
+	int data_sz;
+
+	if(!cur_device->eip_session) return -1;
+
+	if(reqdata_sz > ATLS_EIP_MAX_REQUEST || path_sz > ATLAS_CIP_PATH_MAX) {
+		zlog_error("eip_cip_request(): [%s] Request too large! (%i bytes)\n",cur_device->sname,reqdata_sz + path_sz);
+		return -2;
+	}
+
+	if(cur_device->path_sz) {
+		msg_sz = 2 + path_sz + reqdata_sz;
+		rq_data[rq_sz++] = 0x0A;		// priority/time tick
+		rq_data[rq_sz++] = 0x0E;		// timeout ticks
+		rq_data[rq_sz++] = msg_sz & 0xFF;
+		rq_data[rq_sz++] = (msg_sz >> 8) & 0xFF;
+		rq_data[rq_sz++] = service;
+		rq_data[rq_sz++] = path_sz / 2;
+		memcpy(rq_data + rq_sz, path, path_sz);
+		rq_sz += path_sz;
+		memcpy(rq_data + rq_sz, reqdata, reqdata_sz);
+		rq_sz += reqdata_sz;
+		if(msg_sz & 1) rq_data[rq_sz++] = 0x00;
+		rq_data[rq_sz++] = (cur_device->path_sz + 1) / 2;
+		rq_data[rq_sz++] = 0x00;
+		memcpy(rq_data + rq_sz, cur_device->path, cur_device->path_sz);
+		rq_sz += cur_device->path_sz;
+		if(cur_device->path_sz & 1) rq_data[rq_sz++] = 0x00;
+
+		mr_reply = _SendMRRequest(cur_device->eip_session, ATLS_EIP_MRS_UNCONNECTED_SEND, cm_path, sizeof(cm_path), rq_data, rq_sz, &mr_reply_sz);
+	} else {
+		mr_reply = _SendMRRequest(cur_device->eip_session, service, path, path_sz, reqdata, reqdata_sz, &mr_reply_sz);
+	}
+
+	if(!mr_reply) {
+		zlog_error("[%s] eip_cip_request(): No reply! %s (%i : %i)\n",cur_device->sname,cip_err_msg,cip_errno,cip_ext_errno);
+		set_target_msg(cur_device,"CIP request [0x%02X] failed. [%s] (%i:%i)",service,cip_err_msg,cip_errno,cip_ext_errno);
+		return -1;
+	}
+
+	if(gstatus) *gstatus = mr_reply->General_Status;
+	if(mr_reply->General_Status && !(gstatus && (mr_reply->General_Status == EIP_STATUS_PARTIAL || mr_reply->General_Status == EIP_STATUS_EMBEDDED))) {
+		zlog_error("[%s] eip_cip_request(): Service 0x%02X returned status 0x%02X\n",cur_device->sname,service,mr_reply->General_Status);
+		set_target_msg(cur_device,"CIP request [0x%02X] returned status 0x%02X",service,mr_reply->General_Status);
+		free(mr_reply);
+		return -2;
+	}
+
+	data_sz = mr_reply_sz - sizeof(MR_Reply) - (mr_reply->Add_Status_Size * 2);
+	if(data_sz < 0 || data_sz > outbuf_sz) {
+		zlog_error("[%s] eip_cip_request(): Reply data does not fit! (%i bytes)\n",cur_device->sname,data_sz);
+		free(mr_reply);
+		return -2;
+	}
+
+	memcpy(outbuf, _GetMRData(mr_reply), data_sz);
+	free(mr_reply);
+
+	return data_sz;
+}
+
+// Returns the size of an atomic data type's value, or 0 if it isn't supported
+static int eip_type_size(unsigned short type) {
+
+	switch(type) {
+		case EIP_DTYPE_BOOL:
+		case EIP_DTYPE_ASC:
+			return 1;
+		case EIP_DTYPE_SINT16:
+			return 2;
+		case EIP_DTYPE_INT:
+		case EIP_DTYPE_DWORD:
+		case EIP_DTYPE_FLP:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * eip_decode_value
+ *	Decodes the data of a Read Tag [0x4C] reply: the data type (UINT), then
+ *	the value.
+ *	Args:
+ *		curtag* = tag which was read
+ *		rdata* = reply data
+ *		rsz = size of reply data, in bytes
+ *		bit = bit number to take from the value, or -1 (usually the tag's cip_bit)
+ *		val* = filled in with the value
+ *		rst* = filled in with the outcome of the read
+ *	Returns:
+ *		0 on success, -1 on failure (see rst->code)
+ */
+static int eip_decode_value(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag, unsigned char* rdata, int rsz, int bit, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+	unsigned short rtype;
+	int vsz;
+	int vint;
+
+	if(rsz < 2) {
+		zlog_error("[%s:%s] eip_decode_value(): Reply truncated!\n",cur_device->sname,curtag->tagname);
+		return eip_read_failed(cur_device, rst, RSTAT_PROTO);
+	}
+
+	rtype = rdata[0] | (rdata[1] << 8);
+	if(!(vsz = eip_type_size(rtype))) {
+		zlog_error("eip_decode_value: [%s] unknown data type! type = 0x%04X\n",curtag->tagname,rtype);
+		return eip_read_failed(cur_device, rst, RSTAT_DTYPE);
+	}
+
+	if(rsz < 2 + vsz) {
+		zlog_error("[%s:%s] eip_decode_value(): Reply truncated!\n",cur_device->sname,curtag->tagname);
+		return eip_read_failed(cur_device, rst, RSTAT_PROTO);
+	}
+
+	val->dtype = DTYPE_RET_INT;
+	switch(vsz) {
+		case 1:
+			vint = (signed char)rdata[2];
+			if(rtype == EIP_DTYPE_BOOL) {
+				vint = rdata[2] ? 1 : 0;
+				val->dtype = DTYPE_RET_BOOL;
+			}
+			break;
+		case 2:
+			vint = (short)(rdata[2] | (rdata[3] << 8));
+			break;
+		default:
+			vint = rdata[2] | (rdata[3] << 8) | (rdata[4] << 16) | (rdata[5] << 24);
+			if(rtype == EIP_DTYPE_FLP) {
+				memcpy(&val->v_float, &vint, sizeof(float));
+				val->dtype = DTYPE_RET_FLOAT;
+			}
+			break;
+	}
+
+	if(bit >= 0) {
+		vint = (vint >> bit) & 1;
+		val->dtype = DTYPE_RET_BOOL;
+	}
+
+	if(val->dtype == DTYPE_RET_FLOAT) {
+		val->v_int = (int)val->v_float;
+	} else {
+		val->v_int = vint;
+		val->v_float = (float)vint;
+	}
+
+	return eip_read_ok(cur_device, rst);
+}
+
+/*
+ * eip_readtag_desc
+ *	Reads a compiled Logix tag with Read Tag [0x4C], using the tag's
+ *	pre-encoded CIP path.
+ *	Args:
+ *		curtag* = compiled tag to read (not modified)
+ *		val* = filled in with the value read
+ *		rst* = filled in with the outcome of the read
+ *	Returns:
+ *		0 on success, -1 on failure (see rst->code)
+ */
+int eip_readtag_desc(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+	unsigned char rq_data[2] = { 0x01, 0x00 };	// number of elements
+	unsigned char rdata[64];
+	int rsz;
+
+	memset(val,0,sizeof(ATLAS_VALUE));
+	memset(rst,0,sizeof(ATLAS_RSTATUS));
+
+	if(eip_read_ready(cur_device, rst, "eip_readtag_desc")) return -1;
+
+	zlog_debug("eip_readtag_desc: Reading \"%s\"...\n",curtag->tagname);
+	if((rsz = eip_cip_request(cur_device, ATLS_EIP_MRS_READ_TAG, curtag->desc.cip_path, curtag->desc.cip_path_sz, rq_data, sizeof(rq_data), rdata, sizeof(rdata), NULL)) < 2) {
+		zlog_error("[%s:%s] eip_readtag_desc(): Read failed!\n",cur_device->sname,curtag->tagname);
+		if(rsz != -1) {
+			// target answered, but refused the read
+			rst->proto_err = cip_errno;
+			return eip_read_failed(cur_device, rst, RSTAT_PROTO);
+		}
+
+		// lost the session
+		return eip_read_lost(cur_device, rst);
+	}
+
+	return eip_decode_value(cur_device, curtag, rdata, rsz, curtag->desc.cip_bit, val, rst);
+}
+
+// Stores the outcome of one tag's read in the tag, and counts failures in the set
+static void eip_store_result(ATLAS_TAGSET* set, ATLAS_TAG* curtag, int rv, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+
+	if(rv) {
+		zlog_debug("* eip_read_batch(): [%s] Read failed! (status = %i, protocol error = 0x%04X)\n",curtag->tagname,rst->code,rst->proto_err);
+		curtag->read_status = -1;
+		set->failed++;
+		return;
+	}
+
+	atlas_tag_setval(curtag, val);
+	curtag->read_status = 0;
+}
+
+// FNV-1a hash of the tag names, to detect tag list changes
+static unsigned int eip_plan_tag_sig(ATLAS_TAG* tags, int tag_count) {
+	unsigned int sig = 2166136261u;
+
+	for(int i = 0; i < tag_count; i++) {
+		for(char* cc = tags[i].tagname; *cc; cc++) {
+			sig ^= (unsigned char)*cc;
+			sig *= 16777619u;
+		}
+		sig ^= (unsigned int)tags[i].desc.compiled;
+		sig *= 16777619u;
+	}
+
+	return sig;
+}
+
+// Largest Multiple Service request & reply: the connection size TuxEip asks
+// for in ConnectPLCOverCNET() (low 9 bits of _Parameters), capped at the
+// unconnected message limit used by eip_cip_request()
+static int eip_msp_limit() {
+	int conn_sz = _Parameters & 0x01FF;
+
+	if(!conn_sz || conn_sz > ATLS_EIP_MAX_REQUEST) conn_sz = ATLS_EIP_MAX_REQUEST;
+
+	return conn_sz;
+}
+
+static void eip_plan_free(EIP_PLAN* plan) {
+
+	for(int i = 0; i < plan->block_count; i++) free(plan->blocks[i].data);
+	free(plan->tag_index);
+	free(plan->packets);
+	free(plan->btags);
+	free(plan->blocks);
+	free(plan->paths);
+	free(plan);
+}
+
+// Finds the last segment of a compiled tag's path: tags whose last segment is
+// an element, or a member, may be read in one block with others of the same
+// array or structure
+static int eip_block_cand(ATLAS_TAG* curtag, int tag, EIP_BLOCK_CAND* cand) {
+	unsigned char* pp = curtag->desc.cip_path;
+	int last = -1;
+	int segsz;
+
+	for(int pos = 0; pos < curtag->desc.cip_path_sz; pos += segsz) {
+		if(!(segsz = eip_path_segsz(pp + pos))) return 0;
+		last = pos;
+	}
+	if(last <= 0) return 0;
+
+	cand->tag = tag;
+	cand->key = pp;
+	cand->key_sz = last;
+	switch(pp[last]) {
+		case 0x91:
+			cand->kind = EIP_BLOCK_STRUCT;
+			cand->idx = 0;
+			break;
+		case 0x28:
+			cand->kind = EIP_BLOCK_ARRAY;
+			cand->idx = pp[last + 1];
+			break;
+		case 0x29:
+			cand->kind = EIP_BLOCK_ARRAY;
+			cand->idx = pp[last + 2] | (pp[last + 3] << 8);
+			break;
+		default:
+			cand->kind = EIP_BLOCK_ARRAY;
+			cand->idx = pp[last + 2] | (pp[last + 3] << 8) | (pp[last + 4] << 16) | ((unsigned int)pp[last + 5] << 24);
+			break;
+	}
+
+	return 1;
+}
+
+// Orders block candidates by kind & key, then element
+static int eip_block_cand_cmp(const void* a, const void* b) {
+	const EIP_BLOCK_CAND* ca = a;
+	const EIP_BLOCK_CAND* cb = b;
+	int rv;
+
+	if(ca->kind != cb->kind) return ca->kind - cb->kind;
+	if(ca->key_sz != cb->key_sz) return ca->key_sz - cb->key_sz;
+	if((rv = memcmp(ca->key, cb->key, ca->key_sz))) return rv;
+	if(ca->idx != cb->idx) return (ca->idx < cb->idx) ? -1 : 1;
+
+	return ca->tag - cb->tag;
+}
+
+// Adds a block for a span of array elements, from the first candidate's element
+static int eip_plan_array(EIP_PLAN* plan, ATLAS_TAGSET* set, EIP_BLOCK_CAND* cands, int count, int* used) {
+	EIP_BLOCK* blk = &plan->blocks[plan->block_count];
+	EIP_BLOCK_TAG* bt;
+	int sz = cands[0].key_sz;
+
+	if(sz + 6 > ATLAS_CIP_PATH_MAX) return 0;
+	memcpy(blk->path, cands[0].key, sz);
+	blk->path_sz = sz + eip_path_element(blk->path + sz, cands[0].idx);
+	blk->kind = EIP_BLOCK_ARRAY;
+	blk->elements = cands[count - 1].idx - cands[0].idx + 1;
+	blk->size = blk->elements * 4;	// largest atomic value (see eip_type_size)
+	if((blk->data = malloc(blk->size)) == NULL) {
+		zlog_error("eip_plan_array(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	blk->first = plan->btag_count;
+	blk->count = count;
+	for(int i = 0; i < count; i++) {
+		bt = &plan->btags[plan->btag_count++];
+		bt->tag = cands[i].tag;
+		bt->pos = cands[i].idx - cands[0].idx;
+		bt->type = 0;
+		bt->bit = set->tags[cands[i].tag].desc.cip_bit;
+		used[cands[i].tag] = 1;
+	}
+	plan->block_count++;
+
+	return 0;
+}
+
+// Adds a block for a whole structure, for those candidates which are atomic
+// members of it, using the structure's template. Needs the library lock.
+static int eip_plan_struct(ATLAS_TARGET* cur_device, EIP_PLAN* plan, ATLAS_TAGSET* set, EIP_BLOCK_CAND* cands, int count, int* used) {
+	EIP_BLOCK* blk = &plan->blocks[plan->block_count];
+	EIP_BLOCK_TAG* bt;
+	EIP_TEMPLATE* tmpl;
+	EIP_MEMBER* mbr;
+	ATLAS_TAG* curtag;
+	char name[EIP_NAME_MAX + 1];
+	unsigned char* seg;
+	unsigned short mtype;
+
+	if((tmpl = eip_template_resolve(cur_device, cands[0].key, cands[0].key_sz)) == NULL) {
+		// try again next cycle if the symbol table couldn't be read
+		if(!cur_device->eip_cache || !cur_device->eip_cache->symbols_loaded) plan->stale = 1;
+		return 0;
+	}
+
+	blk->count = 0;
+	for(int i = 0; i < count; i++) {
+		curtag = &set->tags[cands[i].tag];
+		seg = curtag->desc.cip_path + cands[i].key_sz;
+		if(seg[1] > EIP_NAME_MAX) continue;
+		memcpy(name, seg + 2, seg[1]);
+		name[seg[1]] = 0;
+
+		// atomic members only; arrays and nested structures are read by name
+		if((mbr = eip_member_find(tmpl, name)) == NULL) continue;
+		mtype = mbr->type & 0x0FFF;
+		if((mbr->type & (EIP_SYMTYPE_STRUCT | EIP_SYMTYPE_DIMS)) || !eip_type_size(mtype) || (mbr->info && mtype != EIP_DTYPE_BOOL)) continue;
+
+		bt = &plan->btags[plan->btag_count + blk->count++];
+		bt->tag = cands[i].tag;
+		bt->pos = mbr->offset;
+		bt->type = mtype;
+		bt->bit = (mtype == EIP_DTYPE_BOOL) ? mbr->info : curtag->desc.cip_bit;
+	}
+	if(blk->count < 2) return 0;
+
+	memcpy(blk->path, cands[0].key, cands[0].key_sz);
+	blk->path_sz = cands[0].key_sz;
+	blk->kind = EIP_BLOCK_STRUCT;
+	blk->elements = 1;
+	blk->handle = tmpl->handle;
+	blk->size = tmpl->size;
+	if((blk->data = malloc(blk->size ? blk->size : 1)) == NULL) {
+		zlog_error("eip_plan_struct(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	blk->first = plan->btag_count;
+	for(int i = 0; i < blk->count; i++) used[plan->btags[blk->first + i].tag] = 1;
+	plan->btag_count += blk->count;
+	plan->block_count++;
+
+	return 0;
+}
+
+// Groups a Logix tag set's array elements & structure members into blocks
+static int eip_plan_blocks(ATLAS_TARGET* cur_device, EIP_PLAN* plan, ATLAS_TAGSET* set, int* used) {
+	EIP_BLOCK_CAND* cands;
+	int cand_count = 0;
+	int ready;
+	int rv = 0;
+	int i, j, k;
+
+	if((cands = malloc(sizeof(EIP_BLOCK_CAND) * (set->tag_count ? set->tag_count : 1))) == NULL) {
+		zlog_error("eip_plan_blocks(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	for(i = 0; i < set->tag_count; i++) {
+		if(set->tags[i].desc.compiled && eip_block_cand(&set->tags[i], i, &cands[cand_count])) cand_count++;
+	}
+	qsort(cands, cand_count, sizeof(EIP_BLOCK_CAND), eip_block_cand_cmp);
+
+	// templates are read from the controller, but planning doesn't connect
+	ready = (cur_device->status == STATUS_READY);
+
+	for(i = 0; i < cand_count && !rv; i = j) {
+		for(j = i + 1; j < cand_count && cands[j].kind == cands[i].kind && cands[j].key_sz == cands[i].key_sz &&
+		    !memcmp(cands[j].key, cands[i].key, cands[i].key_sz); j++);
+		if(j - i < 2) continue;
+
+		if(cands[i].kind == EIP_BLOCK_STRUCT) {
+			if(ready) rv = eip_plan_struct(cur_device, plan, set, cands + i, j - i, used);
+			else plan->stale = 1;
+			continue;
+		}
+
+		// split arrays into runs of nearby elements
+		for(int run = i; run < j && !rv; run = k) {
+			for(k = run + 1; k < j && cands[k].idx - cands[k - 1].idx <= ATLS_EIP_ARRAY_GAP &&
+			    cands[k].idx - cands[run].idx < ATLS_EIP_ARRAY_MAX; k++);
+			if(k - run >= 2) rv = eip_plan_array(plan, set, cands + run, k - run, used);
+		}
+	}
+
+	free(cands);
+
+	return rv;
+}
+
+/*
+ * eip_plan_instances
+ *	Rewrites the plan's tag & block paths to address their symbols by
+ *	instance, from the target's symbol index, when the controller has a
+ *	change counter to tell us when the instances move. Tags which can't be
+ *	addressed by instance keep their symbolic paths. Needs the library lock.
+ */
+static void eip_plan_instances(ATLAS_TARGET* cur_device, EIP_PLAN* plan, ATLAS_TAGSET* set) {
+	EIP_BLOCK* blk;
+	unsigned char path[ATLAS_CIP_PATH_MAX];
+	int path_sz;
+	int count = 0;
+
+	// the symbol table is read from the controller, but planning doesn't connect
+	if(cur_device->status != STATUS_READY) {
+		plan->stale = 1;
+		return;
+	}
+	if(eip_symbols_load(cur_device)) {
+		plan->stale = 1;
+		return;
+	}
+	if(!cur_device->eip_cache->has_counter) return;
+
+	for(int i = 0; i < set->tag_count; i++) {
+		if(!set->tags[i].desc.compiled) continue;
+		plan->paths[i].path_sz = eip_path_instance(cur_device, set->tags[i].desc.cip_path, set->tags[i].desc.cip_path_sz, plan->paths[i].path);
+		if(plan->paths[i].path_sz) count++;
+	}
+
+	for(int i = 0; i < plan->block_count; i++) {
+		blk = &plan->blocks[i];
+		if((path_sz = eip_path_instance(cur_device, blk->path, blk->path_sz, path)) == 0) continue;
+		memcpy(blk->path, path, path_sz);
+		blk->path_sz = path_sz;
+		count++;
+	}
+
+	plan->by_instance = (count > 0);
+}
+
+// Returns the path to read a planned tag with: by instance, if it can be
+static unsigned char* eip_plan_path(EIP_PLAN* plan, ATLAS_TAG* tags, int tag, int* path_sz) {
+
+	if(plan->paths[tag].path_sz) {
+		*path_sz = plan->paths[tag].path_sz;
+		return plan->paths[tag].path;
+	}
+
+	*path_sz = tags[tag].desc.cip_path_sz;
+	return tags[tag].desc.cip_path;
+}
+
+static int eip_pccc_cand_cmp(const void* a, const void* b) {
+	const EIP_BLOCK_CAND* ca = a;
+	const EIP_BLOCK_CAND* cb = b;
+
+	if(ca->kind != cb->kind) return ca->kind - cb->kind;
+	if(ca->key_sz != cb->key_sz) return ca->key_sz - cb->key_sz;
+	if(ca->idx != cb->idx) return (ca->idx < cb->idx) ? -1 : 1;
+
+	return ca->tag - cb->tag;
+}
+
+// Groups an SLC/PLC tag set's compiled tags by data file, into typed reads of
+// spans of nearby elements (a lone tag is a span of one element)
+static int eip_plan_pccc(ATLAS_TARGET* cur_device, EIP_PLAN* plan, ATLAS_TAGSET* set, int* used) {
+	EIP_BLOCK_CAND* cands;
+	EIP_BLOCK* blk;
+	EIP_BLOCK_TAG* bt;
+	ATLAS_TAGDESC* desc;
+	int cand_count = 0;
+	int esz;
+	int i, k;
+
+	if((cands = malloc(sizeof(EIP_BLOCK_CAND) * (set->tag_count ? set->tag_count : 1))) == NULL) {
+		zlog_error("eip_plan_pccc(): Memory allocation failed!\n");
+		return -1;
+	}
+
+	for(i = 0; i < set->tag_count; i++) {
+		desc = &set->tags[i].desc;
+		if(!desc->compiled) continue;
+		cands[cand_count].tag = i;
+		cands[cand_count].kind = desc->pccc_type;
+		cands[cand_count].key = NULL;
+		cands[cand_count].key_sz = desc->pccc_file;
+		cands[cand_count].idx = desc->pccc_elem;
+		cand_count++;
+	}
+	qsort(cands, cand_count, sizeof(EIP_BLOCK_CAND), eip_pccc_cand_cmp);
+
+	for(i = 0; i < cand_count; i = k) {
+		esz = eip_pccc_elem_size(cands[i].kind);
+		for(k = i + 1; k < cand_count && cands[k].kind == cands[i].kind && cands[k].key_sz == cands[i].key_sz &&
+		    cands[k].idx - cands[k - 1].idx <= ATLS_EIP_ARRAY_GAP && (cands[k].idx - cands[i].idx + 1) * esz <= EIP_PCCC_MAX_DATA; k++);
+
+		blk = &plan->blocks[plan->block_count];
+		blk->kind = EIP_BLOCK_PCCC;
+		blk->elements = cands[k - 1].idx - cands[i].idx + 1;
+		blk->size = blk->elements * esz;
+		blk->path_sz = eip_pccc_address(cur_device, cands[i].kind, cands[i].key_sz, cands[i].idx, blk->elements, blk->path);
+		if((blk->data = malloc(blk->size)) == NULL) {
+			zlog_error("eip_plan_pccc(): Memory allocation failed!\n");
+			free(cands);
+			return -1;
+		}
+
+		blk->first = plan->btag_count;
+		blk->count = k - i;
+		for(int j = i; j < k; j++) {
+			desc = &set->tags[cands[j].tag].desc;
+			bt = &plan->btags[plan->btag_count++];
+			bt->tag = cands[j].tag;
+			bt->pos = (cands[j].idx - cands[i].idx) * esz + desc->pccc_sub * 2;
+			bt->type = eip_pccc_value_type(desc);
+			bt->bit = desc->cip_bit;
+			used[cands[j].tag] = 1;
+		}
+		plan->block_count++;
+	}
+	free(cands);
+
+	return 0;
+}
+
+/*
+ * eip_tagset_plan
+ *	Driver plan entry: plans a Logix target's tag set. Elements of the same
+ *	array, and atomic members of the same structure (found through its
+ *	template), are read as blocks; the rest of the compiled tags are packed
+ *	into as few Multiple Service Packets [0x0A] as will fit in the connection
+ *	size, both for the requests and for the largest scalar replies. Symbols
+ *	are addressed by instance where the controller allows it. SLC/PLC data
+ *	table addresses are grouped by data file, and read as spans of elements
+ *	with PCCC typed reads. The plan is kept until the tag list, or the
+ *	controller's tags, change.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int eip_tagset_plan(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set) {
+	EIP_PLAN* plan = set->plan;
+	EIP_MSP_PACKET* pk = NULL;
+	unsigned int tag_sig;
+	int* used;
+	int alloc_count = set->tag_count ? set->tag_count : 1;
+	int limit;
+	int rq_sz = 0;
+	int path_sz;
+	int tsz;
+	int n = 0;
+
+	tag_sig = eip_plan_tag_sig(set->tags, set->tag_count);
+	if(plan) {
+		if(plan->tag_count == set->tag_count && plan->tag_sig == tag_sig && !plan->stale) return 0;
+		if(!plan->stale) zlog_info("[%s] Tag list has changed. Rebuilding read plan.\n",cur_device->sname);
+		eip_plan_free(plan);
+		set->plan = NULL;
+	}
+
+	if((plan = calloc(1, sizeof(EIP_PLAN))) == NULL ||
+	   (plan->tag_index = malloc(sizeof(int) * alloc_count)) == NULL ||
+	   (plan->packets = malloc(sizeof(EIP_MSP_PACKET) * alloc_count)) == NULL ||
+	   (plan->btags = malloc(sizeof(EIP_BLOCK_TAG) * alloc_count)) == NULL ||
+	   (plan->blocks = calloc(alloc_count, sizeof(EIP_BLOCK))) == NULL ||
+	   (plan->paths = calloc(alloc_count, sizeof(EIP_TAGPATH))) == NULL ||
+	   (used = calloc(alloc_count, sizeof(int))) == NULL) {
+		zlog_error("eip_tagset_plan(): Memory allocation failed!\n");
+		if(plan) eip_plan_free(plan);
+		return -1;
+	}
+	plan->tag_count = set->tag_count;
+	plan->tag_sig = tag_sig;
+
+	if(cur_device->target_type != TARGET_LGX) {
+		if(eip_plan_pccc(cur_device, plan, set, used)) {
+			free(used);
+			eip_plan_free(plan);
+			return -1;
+		}
+	} else {
+		pthread_mutex_lock(&eip_lib_lock);
+		if(eip_plan_blocks(cur_device, plan, set, used)) {
+			pthread_mutex_unlock(&eip_lib_lock);
+			free(used);
+			eip_plan_free(plan);
+			return -1;
 		}
+		eip_plan_instances(cur_device, plan, set);
+		pthread_mutex_unlock(&eip_lib_lock);
+	}
+
+	limit = eip_msp_limit();
+	for(int i = 0; i < set->tag_count; i++) {
+		if(!set->tags[i].desc.compiled || used[i]) continue;
+
+		// offset, service, path size, path, element count
+		eip_plan_path(plan, set->tags, i, &path_sz);
+		tsz = 2 + 2 + path_sz + 2;
+
+		// request: service, path size & Message Router path, then the packet;
+		// reply: reply header, service count, then each tag's reply
+		if(!pk || 6 + rq_sz + tsz > limit || 6 + ATLS_EIP_MSP_REPLY_TAG * (pk->count + 1) > limit) {
+			pk = &plan->packets[plan->packet_count++];
+			pk->first = n;
+			pk->count = 0;
+			rq_sz = 2;	// service count
+		}
+
+		plan->tag_index[n++] = i;
+		pk->count++;
+		rq_sz += tsz;
+	}
+	free(used);
+
+	zlog_info("[%s] Read plan: %i tags in %i blocks, %i tags in %i Multiple Service Packets, %i by name%s\n",cur_device->sname,
+	          plan->btag_count,plan->block_count,n,plan->packet_count,set->tag_count - plan->btag_count - n,
+	          plan->by_instance ? " (symbols by instance)" : "");
+	set->plan = plan;
+
+	return 0;
+}
+
+// Driver plan_free entry
+void eip_tagset_free(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set) {
+
+	if(set->plan) eip_plan_free(set->plan);
+	set->plan = NULL;
+}
+
+// Reads a packet's tags one at a time, when the packet can't be used
+static void eip_msp_read_single(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set, EIP_PLAN* plan, EIP_MSP_PACKET* pk) {
+	ATLAS_TAG* curtag;
+	ATLAS_VALUE val;
+	ATLAS_RSTATUS rst;
+
+	for(int i = 0; i < pk->count; i++) {
+		curtag = &set->tags[plan->tag_index[pk->first + i]];
+		eip_store_result(set, curtag, eip_readtag_desc(cur_device, curtag, &val, &rst), &val, &rst);
+	}
+}
+
+/*
+ * eip_msp_read
+ *	Reads a packet's tags with one Multiple Service Packet [0x0A] of Read Tag
+ *	[0x4C] requests, and stores each reply in its tag. A packet which the
+ *	target refuses as a whole is read one tag at a time instead.
+ */
+static void eip_msp_read(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set, EIP_PLAN* plan, EIP_MSP_PACKET* pk) {
+	unsigned char mr_path[4] = { 0x20, 0x02, 0x24, 0x01 };	// Message Router, instance 1
+	unsigned char rq_data[ATLS_EIP_MAX_REQUEST];
+	unsigned char rdata[ATLS_EIP_MAX_REQUEST];
+	ATLAS_TAG* curtag;
+	ATLAS_VALUE val;
+	ATLAS_RSTATUS rst;
+	unsigned char* path;
+	int path_sz;
+	int gstatus;
+	int rq_sz;
+	int rsz;
+	int off;
+	int end;
+	int rv;
+
+	if(pk->count == 1) {
+		eip_msp_read_single(cur_device, set, plan, pk);
+		return;
+	}
+
+	memset(&val,0,sizeof(ATLAS_VALUE));
+	memset(&rst,0,sizeof(ATLAS_RSTATUS));
+
+	// service count, offset table, then the Read Tag requests
+	rq_data[0] = pk->count & 0xFF;
+	rq_data[1] = (pk->count >> 8) & 0xFF;
+	rq_sz = 2 + 2 * pk->count;
+	for(int i = 0; i < pk->count; i++) {
+		curtag = &set->tags[plan->tag_index[pk->first + i]];
+		rq_data[2 + i * 2] = rq_sz & 0xFF;
+		rq_data[3 + i * 2] = (rq_sz >> 8) & 0xFF;
+		rq_data[rq_sz++] = ATLS_EIP_MRS_READ_TAG;
+		path = eip_plan_path(plan, set->tags, plan->tag_index[pk->first + i], &path_sz);
+		rq_data[rq_sz++] = path_sz / 2;
+		memcpy(rq_data + rq_sz, path, path_sz);
+		rq_sz += path_sz;
+		rq_data[rq_sz++] = 0x01;	// number of elements
+		rq_data[rq_sz++] = 0x00;
+	}
+
+	rv = eip_read_ready(cur_device, &rst, "eip_msp_read");
+	zlog_debug("eip_msp_read: [%s] Reading %i tags (%i bytes)...\n",cur_device->sname,pk->count,rq_sz);
+	if(!rv && (rsz = eip_cip_request(cur_device, ATLS_EIP_MRS_MULTIPLE_SERVICE, mr_path, sizeof(mr_path), rq_data, rq_sz, rdata, sizeof(rdata), &gstatus)) == -1) {
+		// lost the session
+		zlog_error("[%s] eip_msp_read(): Read failed!\n",cur_device->sname);
+		rv = eip_read_lost(cur_device, &rst);
+	}
+
+	if(rv) {
+		for(int i = 0; i < pk->count; i++) eip_store_result(set, &set->tags[plan->tag_index[pk->first + i]], rv, &val, &rst);
+		return;
+	}
+
+	if(rsz < 2 + 2 * pk->count || (rdata[0] | (rdata[1] << 8)) != pk->count) {
+		zlog_error("[%s] eip_msp_read(): Multiple Service Packet refused. Reading %i tags one at a time.\n",cur_device->sname,pk->count);
+		eip_msp_read_single(cur_device, set, plan, pk);
+		return;
+	}
+
+	// each reply: service | 0x80, reserved, status, extended status size (words),
+	// extended status, then the Read Tag reply data
+	for(int i = 0; i < pk->count; i++) {
+		curtag = &set->tags[plan->tag_index[pk->first + i]];
+		off = rdata[2 + i * 2] | (rdata[3 + i * 2] << 8);
+		end = (i + 1 < pk->count) ? (rdata[4 + i * 2] | (rdata[5 + i * 2] << 8)) : rsz;
+		rst.code = RSTAT_OK;
+		rst.proto_err = 0;
+
+		if(off + 4 > end || end > rsz || rdata[off] != (ATLS_EIP_MRS_READ_TAG | 0x80) || off + 4 + rdata[off + 3] * 2 > end) {
+			zlog_error("[%s:%s] eip_msp_read(): Bad reply!\n",cur_device->sname,curtag->tagname);
+			rv = eip_read_failed(cur_device, &rst, RSTAT_PROTO);
+		} else if(rdata[off + 2]) {
+			// target refused this read
+			zlog_error("[%s:%s] eip_msp_read(): Read Tag returned status 0x%02X\n",cur_device->sname,curtag->tagname,rdata[off + 2]);
+			rst.proto_err = rdata[off + 2];
+			rv = eip_read_failed(cur_device, &rst, RSTAT_PROTO);
+		} else {
+			off += 4 + rdata[off + 3] * 2;
+			rv = eip_decode_value(cur_device, curtag, rdata + off, end - off, curtag->desc.cip_bit, &val, &rst);
+		}
+
+		eip_store_result(set, curtag, rv, &val, &rst);
+	}
+}
+
+/*
+ * eip_block_fetch
+ *	Reads a block with Read Tag Fragmented [0x52], in as many replies as the
+ *	target needs, into blk->data.
+ *	Args:
+ *		rtype* = filled in with the data type in the reply
+ *		handle* = filled in with the structure handle, for structures
+ *	Returns:
+ *		Number of bytes read, -1 on communication failure (see rst->code),
+ *		or -2 if the target refused the read
+ */
+static int eip_block_fetch(ATLAS_TARGET* cur_device, EIP_BLOCK* blk, unsigned short* rtype, unsigned short* handle, ATLAS_RSTATUS* rst) {
+	unsigned char rq_data[6];
+	unsigned char rdata[EIP_REPLY_MAX];
+	unsigned int off = 0;
+	int gstatus;
+	int hdr;
+	int rsz;
+
+	do {
+		// number of elements, byte offset
+		rq_data[0] = blk->elements & 0xFF;
+		rq_data[1] = (blk->elements >> 8) & 0xFF;
+		rq_data[2] = off & 0xFF;
+		rq_data[3] = (off >> 8) & 0xFF;
+		rq_data[4] = (off >> 16) & 0xFF;
+		rq_data[5] = (off >> 24) & 0xFF;
+
+		if((rsz = eip_cip_request(cur_device, EIP_SVC_READ_TAG_FRAGMENTED, blk->path, blk->path_sz, rq_data, sizeof(rq_data), rdata, sizeof(rdata), &gstatus)) == -1) {
+			// lost the session
+			zlog_error("[%s] eip_block_fetch(): Read failed!\n",cur_device->sname);
+			return eip_read_lost(cur_device, rst);
+		}
+		if(rsz < 2) return -2;
+
+		// reply data: data type (UINT, and a handle for structures), then the data
+		*rtype = rdata[0] | (rdata[1] << 8);
+		hdr = 2;
+		if(*rtype == EIP_TYPE_STRUCT) {
+			if(rsz < 4) return -2;
+			*handle = rdata[2] | (rdata[3] << 8);
+			hdr = 4;
+		}
+
+		if(off + rsz - hdr > blk->size) {
+			zlog_error("[%s] eip_block_fetch(): Block is larger than planned! (%u bytes)\n",cur_device->sname,off + rsz - hdr);
+			return -2;
+		}
+		memcpy(blk->data + off, rdata + hdr, rsz - hdr);
+		off += rsz - hdr;
+	} while(gstatus == EIP_STATUS_PARTIAL && rsz > hdr);
+
+	return off;
+}
+
+/*
+ * eip_pccc_fetch
+ *	Reads a span of a data file with a PCCC typed read, into blk->data.
+ *	Returns:
+ *		Number of bytes read, -1 on communication failure (see rst->code),
+ *		or -2 if the target refused the read (see rst->proto_err)
+ */
+static int eip_pccc_fetch(ATLAS_TARGET* cur_device, EIP_BLOCK* blk, ATLAS_RSTATUS* rst) {
+	int sts;
+	int rsz;
+
+	if((rsz = eip_pccc_request(cur_device, blk->path, blk->path_sz, blk->data, blk->size, &sts)) == -1) {
+		// lost the session
+		zlog_error("[%s] eip_pccc_fetch(): Read failed!\n",cur_device->sname);
+		return eip_read_lost(cur_device, rst);
+	}
+	if(rsz < 0) rst->proto_err = sts;
+
+	return rsz;
+}
+
+/*
+ * eip_block_read
+ *	Reads an array, structure or data file block, and decodes each of its
+ *	tags' values from it. A block which the target refuses, or a structure
+ *	whose handle no longer matches its template, is read one tag at a time
+ *	instead.
+ */
+static void eip_block_read(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set, EIP_PLAN* plan, EIP_BLOCK* blk) {
+	EIP_BLOCK_TAG* bt;
+	ATLAS_TAG* curtag;
+	ATLAS_VALUE val;
+	ATLAS_RSTATUS rst;
+	unsigned char vbuf[6];
+	unsigned short rtype = 0;
+	unsigned short handle = 0;
+	unsigned short vtype;
+	unsigned int off;
+	int vsz;
+	int n = 0;
+	int rv;
+
+	memset(&val,0,sizeof(ATLAS_VALUE));
+	memset(&rst,0,sizeof(ATLAS_RSTATUS));
+
+	if(!(rv = eip_read_ready(cur_device, &rst, "eip_block_read"))) {
+		zlog_debug("eip_block_read: [%s] Reading %i tags from a block of %i elements...\n",cur_device->sname,blk->count,blk->elements);
+		if(blk->kind == EIP_BLOCK_PCCC) n = eip_pccc_fetch(cur_device, blk, &rst);
+		else n = eip_block_fetch(cur_device, blk, &rtype, &handle, &rst);
+
+		if(n >= 0 && blk->kind == EIP_BLOCK_STRUCT && (rtype != EIP_TYPE_STRUCT || handle != blk->handle)) {
+			// the program was changed; read the templates again next cycle
+			zlog_info("[%s] Structure has changed (handle 0x%04x, expected 0x%04x). Rebuilding read plan.\n",cur_device->sname,handle,blk->handle);
+			eip_cache_flush(cur_device);
+			plan->stale = 1;
+			n = -2;
+		}
+
+		if(n == -2) {
+			zlog_error("[%s] eip_block_read(): Block read refused. Reading %i tags one at a time.\n",cur_device->sname,blk->count);
+			for(int i = 0; i < blk->count; i++) {
+				curtag = &set->tags[plan->btags[blk->first + i].tag];
+				if(blk->kind == EIP_BLOCK_PCCC) rv = eip_readtag(cur_device, curtag->tagname, &val, &rst);
+				else rv = eip_readtag_desc(cur_device, curtag, &val, &rst);
+				eip_store_result(set, curtag, rv, &val, &rst);
+			}
+			return;
+		}
+		if(n < 0) rv = -1;
+	}
+
+	for(int i = 0; i < blk->count; i++) {
+		bt = &plan->btags[blk->first + i];
+		curtag = &set->tags[bt->tag];
+		if(rv) {
+			eip_store_result(set, curtag, rv, &val, &rst);
+			continue;
+		}
+		rst.code = RSTAT_OK;
+		rst.proto_err = 0;
+
+		// array elements all have the reply's type; BOOL members are a bit of their host byte
+		vtype = (blk->kind == EIP_BLOCK_ARRAY) ? rtype : ((bt->type == EIP_DTYPE_BOOL) ? EIP_DTYPE_ASC : bt->type);
+		vsz = eip_type_size(vtype);
+		off = (blk->kind == EIP_BLOCK_ARRAY) ? bt->pos * vsz : bt->pos;
+
+		vbuf[0] = vtype & 0xFF;
+		vbuf[1] = (vtype >> 8) & 0xFF;
+		if(off + vsz > (unsigned int)n) {
+			zlog_error("[%s:%s] eip_block_read(): Block reply truncated!\n",cur_device->sname,curtag->tagname);
+			eip_store_result(set, curtag, eip_read_failed(cur_device, &rst, RSTAT_PROTO), &val, &rst);
+			continue;
+		}
+		memcpy(vbuf + 2, blk->data + off, vsz);
+
+		eip_store_result(set, curtag, eip_decode_value(cur_device, curtag, vbuf, 2 + vsz, bt->bit, &val, &rst), &val, &rst);
+	}
+}
+
+/*
+ * eip_read_batch
+ *	Driver read_batch entry: reads the set's compiled tags with the blocks &
+ *	Multiple Service Packets of its plan, and the rest of the tags one at a
+ *	time by name, and stores the values in the tags. If the
+ *	controller's tags have changed since the plan addressed them by
+ *	instance, all of them are read by name until it is rebuilt.
+ *	Returns:
+ *		0 if every tag was read, -1 if any failed (see set->failed)
+ */
+int eip_read_batch(ATLAS_TARGET* cur_device, ATLAS_TAGSET* set) {
+	EIP_PLAN* plan = set->plan;
+	ATLAS_TAG* curtag;
+	ATLAS_VALUE val;
+	ATLAS_RSTATUS rst;
+	int rv;
+
+	set->failed = 0;
+
+	pthread_mutex_lock(&eip_lib_lock);
+
+	// instances move when the controller's tags change; read by name until replanned
+	if(plan && plan->by_instance && cur_device->status == STATUS_READY && eip_symbols_changed(cur_device)) {
+		plan->stale = 1;
+		plan = NULL;
+	}
+
+	if(plan) {
+		for(int i = 0; i < plan->block_count; i++) eip_block_read(cur_device, set, plan, &plan->blocks[i]);
+		for(int i = 0; i < plan->packet_count; i++) eip_msp_read(cur_device, set, plan, &plan->packets[i]);
+	}
+
+	for(int i = 0; i < set->tag_count; i++) {
+		curtag = &set->tags[i];
+		if(plan && curtag->desc.compiled) continue;
+		zlog_debug("eip_read_batch: Retrieving tag [%s] from target device [%s]...\n",curtag->tagname,cur_device->sname);
+
+		if(cur_device->target_type == TARGET_LGX && curtag->desc.compiled) rv = eip_readtag_desc(cur_device, curtag, &val, &rst);
+		else rv = eip_readtag(cur_device, curtag->tagname, &val, &rst);
+
+		eip_store_result(set, curtag, rv, &val, &rst);
+	}
+	pthread_mutex_unlock(&eip_lib_lock);
+
+	return set->failed ? -1 : 0;
+}
+
+static void eip_drv_stop(ATLAS_TARGET* cur_device) {
+	pthread_mutex_lock(&eip_lib_lock);
+	eip_stop(cur_device);
+	pthread_mutex_unlock(&eip_lib_lock);
+}
+
+static int eip_drv_start(ATLAS_TARGET* cur_device) {
+	int port = ATLS_EIP_PORT;
+	int sock;
+	int rv;
+
+	// TuxEip connects with a blocking connect() while holding the library,
+	// which would stall every other EIP target; so check the target answers
+	// first, with a timeout, and without the lock
+	if((sock = atlas_sock_open(cur_device->ip_addr, &port, 1, global_config.connect_timeout, NULL)) < 0) {
+		zlog_error("[%s] Target not reachable at %s:%i!\n",cur_device->sname,cur_device->ip_addr,port);
+		set_target_msg(cur_device,"Connection failed. Target not reachable.");
+		cur_device->status = STATUS_COMFAIL;
+		return -1;
 	}
+	close(sock);
 
-	// Data read by ReadXXXData must be free'd!
-	free(rdata);
+	pthread_mutex_lock(&eip_lib_lock);
+	rv = eip_start(cur_device);
+	pthread_mutex_unlock(&eip_lib_lock);
 
-	eip_readerr = 0;
-	return &rval.v_int;
+	return rv;
 }
 
+// Driver descriptor (see atlas_driver.c)
+ATLAS_DRIVER eip_driver = {
+	ATLAS_DRIVER_API, "eip", DCAP_BATCH,
+	eip_drv_start,
+	eip_drv_stop,
+	eip_compile_tag,
+	eip_tagset_plan,
+	eip_tagset_free,
+	eip_read_batch,
+	NULL,
+	NULL
+};
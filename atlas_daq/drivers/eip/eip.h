@@ -0,0 +1,111 @@
+/*
+
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	EtherNet/IP & Common Industrial Protocol (CIP) - TuxEIP Interface
+	Header File
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+
+	Logix symbol & template objects, as described in Rockwell Automation
+	"Logix5000 Data Access" (1756-PM020), and PCCC typed reads of SLC 500 &
+	PLC-5 data tables.
+
+*/
+
+#define EIP_CLASS_SYMBOL			0x6B
+#define EIP_CLASS_TEMPLATE			0x6C
+#define EIP_CLASS_CHANGE			0xAC	// controller attributes which change with the tag database
+#define EIP_CLASS_PCCC				0x67
+
+#define EIP_SVC_GET_ATTRIBUTE_LIST		0x03
+#define EIP_SVC_EXECUTE_PCCC			0x4B
+#define EIP_SVC_READ_TEMPLATE			0x4C
+#define EIP_SVC_READ_TAG_FRAGMENTED		0x52
+#define EIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST	0x55
+
+#define EIP_STATUS_PARTIAL			0x06	// more data to follow (fragmented services)
+#define EIP_STATUS_EMBEDDED			0x1E	// Multiple Service Packet: one or more of the services failed
+
+#define EIP_TYPE_STRUCT				0x02A0	// Read Tag reply type of a structure, followed by its handle
+
+// Symbol & member types
+#define EIP_SYMTYPE_STRUCT			0x8000	// structure; the low 12 bits are its template instance
+#define EIP_SYMTYPE_DIMS			0x6000	// number of array dimensions
+#define EIP_SYMTYPE_SYSTEM			0x1000	// system symbol
+#define EIP_SYMTYPE_TEMPLATE(x)			((x) & 0x0FFF)
+
+#define EIP_NAME_MAX				40	// longest Logix symbol or member name
+#define EIP_REPLY_MAX				512	// largest reply data of one request
+
+// PCCC data file types (SLC file type codes)
+#define PCCC_FILE_STATUS			0x84
+#define PCCC_FILE_BIT				0x85
+#define PCCC_FILE_TIMER				0x86
+#define PCCC_FILE_COUNTER			0x87
+#define PCCC_FILE_CONTROL			0x88
+#define PCCC_FILE_INTEGER			0x89
+#define PCCC_FILE_FLOAT				0x8A
+#define PCCC_FILE_OUTPUT			0x8B
+#define PCCC_FILE_INPUT				0x8C
+#define PCCC_FILE_LONG				0x91
+
+#define EIP_PCCC_ADDR_MAX			16	// largest encoded typed read (function & parameters)
+#define EIP_PCCC_MAX_DATA			236	// most data bytes in one typed read reply
+
+// Structure member, from the template definition
+typedef struct {
+	char name[EIP_NAME_MAX + 1];
+	unsigned short type;		// member type (symbol type bits)
+	unsigned short info;		// BOOL: bit number in the host byte; otherwise array size
+	unsigned int offset;		// byte offset in the structure
+} EIP_MEMBER;
+
+// Structure template [0x6C]
+typedef struct sEIP_TEMPLATE {
+	unsigned int instance;
+	unsigned short handle;		// structure handle, as in Read Tag replies
+	unsigned int size;		// size of the structure, in bytes
+	int member_count;
+	EIP_MEMBER* members;
+	struct sEIP_TEMPLATE* next;
+} EIP_TEMPLATE;
+
+// Controller-scope symbol [0x6B]
+typedef struct {
+	char name[EIP_NAME_MAX + 1];
+	unsigned int instance;
+	unsigned short type;
+	unsigned int dims[3];		// array dimensions (0 = unused)
+} EIP_SYMBOL;
+
+// Per target cache of the controller's symbols & templates
+struct sEIP_CACHE {
+	EIP_SYMBOL* symbols;		// symbol index, sorted by name
+	int symbol_count;
+	int symbols_loaded;		// 1 once the symbol table has been read
+	EIP_TEMPLATE* templates;
+	int has_counter;		// 1 if the controller reports a change counter
+	unsigned int counter;		// change counter when the symbols were read
+};
+
+// eip_template.c
+EIP_CACHE* eip_cache_get(ATLAS_TARGET* cur_device);
+void eip_cache_flush(ATLAS_TARGET* cur_device);
+int eip_change_counter(ATLAS_TARGET* cur_device, unsigned int* counter);
+int eip_symbols_load(ATLAS_TARGET* cur_device);
+int eip_symbols_changed(ATLAS_TARGET* cur_device);
+EIP_SYMBOL* eip_symbol_find(ATLAS_TARGET* cur_device, char* name);
+int eip_path_instance(ATLAS_TARGET* cur_device, unsigned char* path, int path_sz, unsigned char* out);
+EIP_TEMPLATE* eip_template_get(ATLAS_TARGET* cur_device, unsigned int instance);
+EIP_MEMBER* eip_member_find(EIP_TEMPLATE* tmpl, char* name);
+EIP_TEMPLATE* eip_template_resolve(ATLAS_TARGET* cur_device, unsigned char* path, int path_sz);
+int eip_path_segsz(unsigned char* seg);
+
+// eip_pccc.c
+int eip_pccc_compile(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag);
+int eip_pccc_elem_size(unsigned char type);
+unsigned short eip_pccc_value_type(ATLAS_TAGDESC* desc);
+int eip_pccc_address(ATLAS_TARGET* cur_device, unsigned char type, unsigned int file, unsigned int elem, unsigned int count, unsigned char* out);
+int eip_pccc_request(ATLAS_TARGET* cur_device, unsigned char* fnc, int fnc_sz, unsigned char* outbuf, int outbuf_sz, int* sts);
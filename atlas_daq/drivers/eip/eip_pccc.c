@@ -0,0 +1,488 @@
+/*
+
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	EtherNet/IP & Common Industrial Protocol (CIP) - PCCC Data Table Reads
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+
+	Data table addresses of SLC 500 & PLC-5 targets (eg. N7:10, F8:0,
+	B3:2/5, T4:0.ACC) are compiled once, so that the read planner can group
+	tags by data file and read whole spans of elements with one typed read,
+	carried in Execute PCCC [0x4B] requests to the PCCC object [0x67]. See
+	Rockwell Automation "DF1 Protocol and Command Set" (1770-6.5.16).
+	Callers must hold the EIP driver's library lock.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "atlas_daq.h"
+#include "eip.h"
+
+extern CIP_UINT _OriginatorVendorID;
+extern CIP_UDINT _OriginatorSerialNumber;
+
+#define PCCC_CMD_TYPED			0x0F	// command of the typed read functions
+#define PCCC_FNC_PLC5_TYPED_READ	0x68	// PLC-5: typed read, PLC-5 logical binary address
+#define PCCC_FNC_SLC_TYPED_READ		0xA2	// SLC: protected typed logical read, 3 address fields
+#define PCCC_STS_EXTENDED		0xF0	// extended status follows the TNS
+
+// Data file types, with their default file numbers and element sizes
+typedef struct {
+	char prefix;
+	unsigned char type;		// SLC file type code
+	short file;			// default file number, or -1 if it must be given
+	unsigned char elem_sz;		// bytes per element
+} EIP_PCCC_FILE;
+
+static const EIP_PCCC_FILE pccc_files[] = {
+	{ 'O', PCCC_FILE_OUTPUT,  0, 2 },
+	{ 'I', PCCC_FILE_INPUT,   1, 2 },
+	{ 'S', PCCC_FILE_STATUS,  2, 2 },
+	{ 'B', PCCC_FILE_BIT,    -1, 2 },
+	{ 'T', PCCC_FILE_TIMER,  -1, 6 },
+	{ 'C', PCCC_FILE_COUNTER,-1, 6 },
+	{ 'R', PCCC_FILE_CONTROL,-1, 6 },
+	{ 'N', PCCC_FILE_INTEGER,-1, 2 },
+	{ 'F', PCCC_FILE_FLOAT,  -1, 4 },
+	{ 'L', PCCC_FILE_LONG,   -1, 4 },
+	{ 0 }
+};
+
+// Sub-elements & control bits of timers, counters & controls (word, bit)
+typedef struct {
+	unsigned char type;
+	char name[4];
+	unsigned char sub;		// word within the element
+	signed char bit;		// bit within the word, or -1
+} EIP_PCCC_SUB;
+
+static const EIP_PCCC_SUB pccc_subs[] = {
+	{ PCCC_FILE_TIMER,   "PRE", 1, -1 }, { PCCC_FILE_TIMER,   "ACC", 2, -1 },
+	{ PCCC_FILE_TIMER,   "EN",  0, 15 }, { PCCC_FILE_TIMER,   "TT",  0, 14 }, { PCCC_FILE_TIMER,   "DN",  0, 13 },
+	{ PCCC_FILE_COUNTER, "PRE", 1, -1 }, { PCCC_FILE_COUNTER, "ACC", 2, -1 },
+	{ PCCC_FILE_COUNTER, "CU",  0, 15 }, { PCCC_FILE_COUNTER, "CD",  0, 14 }, { PCCC_FILE_COUNTER, "DN",  0, 13 },
+	{ PCCC_FILE_COUNTER, "OV",  0, 12 }, { PCCC_FILE_COUNTER, "UN",  0, 11 },
+	{ PCCC_FILE_CONTROL, "LEN", 1, -1 }, { PCCC_FILE_CONTROL, "POS", 2, -1 },
+	{ PCCC_FILE_CONTROL, "EN",  0, 15 }, { PCCC_FILE_CONTROL, "EU",  0, 14 }, { PCCC_FILE_CONTROL, "DN",  0, 13 },
+	{ PCCC_FILE_CONTROL, "EM",  0, 12 }, { PCCC_FILE_CONTROL, "ER",  0, 11 }, { PCCC_FILE_CONTROL, "UL",  0, 10 },
+	{ PCCC_FILE_CONTROL, "IN",  0,  9 }, { PCCC_FILE_CONTROL, "FD",  0,  8 },
+	{ 0 }
+};
+
+static const EIP_PCCC_FILE* eip_pccc_file(unsigned char type) {
+
+	for(const EIP_PCCC_FILE* pf = pccc_files; pf->prefix; pf++) {
+		if(pf->type == type) return pf;
+	}
+
+	return NULL;
+}
+
+// Returns the size of a data file's elements, in bytes (0 if unknown)
+int eip_pccc_elem_size(unsigned char type) {
+	const EIP_PCCC_FILE* pf = eip_pccc_file(type);
+
+	return pf ? pf->elem_sz : 0;
+}
+
+// Returns the CIP data type a tag's value is decoded as (see eip_decode_value())
+unsigned short eip_pccc_value_type(ATLAS_TAGDESC* desc) {
+
+	switch(desc->pccc_type) {
+		case PCCC_FILE_FLOAT:
+			return EIP_DTYPE_FLP;
+		case PCCC_FILE_LONG:
+			return EIP_DTYPE_INT;
+		default:
+			return EIP_DTYPE_SINT16;
+	}
+}
+
+/*
+ * eip_pccc_compile
+ *	Parses an SLC 500 / PLC-5 data table address into the tag's descriptor.
+ *	eg. "N7:10", "F8:0", "L9:3", "B3:2/5", "B3/37" (bit 37 of the file),
+ *	"T4:0.ACC", "T4:0/DN", "C5:1.PRE", "R6:0.POS", "I:1/3", "S:1/15"
+ *	Returns:
+ *		0 on success, -1 if the address can't be compiled (it will be read by name)
+ */
+int eip_pccc_compile(ATLAS_TARGET* cur_device, ATLAS_TAG* curtag) {
+	ATLAS_TAGDESC* desc = &curtag->desc;
+	const EIP_PCCC_FILE* pf;
+	const EIP_PCCC_SUB* ps;
+	char* cc = curtag->tagname;
+	char* endp;
+	unsigned long file;
+	unsigned long elem = 0;
+	unsigned long bit;
+	int has_elem = 0;
+
+	for(pf = pccc_files; pf->prefix && pf->prefix != toupper((unsigned char)*cc); pf++);
+	if(!pf->prefix) return -1;
+	cc++;
+
+	// file number, or the file's default
+	if(isdigit((unsigned char)*cc)) {
+		file = strtoul(cc, &endp, 10);
+		cc = endp;
+	} else if(pf->file >= 0) {
+		file = pf->file;
+	} else {
+		return -1;
+	}
+	if(file > 999) return -1;
+
+	desc->pccc_type = pf->type;
+	desc->pccc_file = file;
+	desc->pccc_sub = 0;
+
+	// element; bit files may be addressed by bit alone, eg. "B3/37"
+	if(*cc == ':') {
+		elem = strtoul(cc + 1, &endp, 10);
+		if(endp == cc + 1 || elem > 0xFFFF) return -1;
+		cc = endp;
+		has_elem = 1;
+	} else if(!(*cc == '/' && pf->type == PCCC_FILE_BIT)) {
+		return -1;
+	}
+
+	if(*cc == '.' && isalpha((unsigned char)cc[1])) {
+		// sub-element or control bit by name, eg. ".ACC", ".DN"
+		for(ps = pccc_subs; ps->type && (ps->type != pf->type || strcasecmp(ps->name, cc + 1)); ps++);
+		if(!ps->type) return -1;
+		desc->pccc_sub = ps->sub;
+		desc->cip_bit = ps->bit;
+	} else if(*cc == '/' && isalpha((unsigned char)cc[1])) {
+		for(ps = pccc_subs; ps->type && (ps->type != pf->type || ps->bit < 0 || strcasecmp(ps->name, cc + 1)); ps++);
+		if(!ps->type) return -1;
+		desc->cip_bit = ps->bit;
+	} else if(*cc == '/') {
+		bit = strtoul(cc + 1, &endp, 10);
+		if(endp == cc + 1 || *endp) return -1;
+		if(!has_elem) {
+			// "B3/37": bit number within the file
+			elem = bit / 16;
+			bit %= 16;
+		}
+		if(elem > 0xFFFF || bit > ((pf->elem_sz == 4) ? 31 : 15) || pf->type == PCCC_FILE_FLOAT) return -1;
+		desc->cip_bit = bit;
+	} else if(*cc) {
+		return -1;
+	}
+
+	desc->pccc_elem = elem;
+	desc->compiled = 1;
+
+	return 0;
+}
+
+// Encodes a PCCC address field (1 byte, or 0xFF then 2 bytes), and returns its size
+static int eip_pccc_field(unsigned char* pp, unsigned int val) {
+
+	if(val < 0xFF) {
+		pp[0] = val;
+		return 1;
+	}
+
+	pp[0] = 0xFF;
+	pp[1] = val & 0xFF;
+	pp[2] = (val >> 8) & 0xFF;
+	return 3;
+}
+
+/*
+ * eip_pccc_address
+ *	Encodes the function code & parameters of a typed read of 'count'
+ *	elements from a data file, starting at 'elem', for the target type:
+ *	SLC protected typed logical read [0xA2], or PLC-5 typed read [0x68].
+ *	Args:
+ *		out* = receives the function & parameters (EIP_PCCC_ADDR_MAX bytes)
+ *	Returns:
+ *		Size of the encoded read
+ */
+int eip_pccc_address(ATLAS_TARGET* cur_device, unsigned char type, unsigned int file, unsigned int elem, unsigned int count, unsigned char* out) {
+	unsigned int nbytes = count * eip_pccc_elem_size(type);
+	int sz = 0;
+
+	if(cur_device->target_type == TARGET_PLC) {
+		// packet offset & total transaction (elements), PLC-5 logical binary
+		// address (level mask: file, element), then the size (elements)
+		out[sz++] = PCCC_FNC_PLC5_TYPED_READ;
+		out[sz++] = 0x00;
+		out[sz++] = 0x00;
+		out[sz++] = count & 0xFF;
+		out[sz++] = (count >> 8) & 0xFF;
+		out[sz++] = 0x06;
+		sz += eip_pccc_field(out + sz, file);
+		sz += eip_pccc_field(out + sz, elem);
+		out[sz++] = count & 0xFF;
+		out[sz++] = (count >> 8) & 0xFF;
+		return sz;
+	}
+
+	// byte size, file number, file type, element, sub-element
+	out[sz++] = PCCC_FNC_SLC_TYPED_READ;
+	out[sz++] = nbytes;
+	sz += eip_pccc_field(out + sz, file);
+	out[sz++] = type;
+	sz += eip_pccc_field(out + sz, elem);
+	sz += eip_pccc_field(out + sz, 0);
+
+	return sz;
+}
+
+// Skips a PLC-5 type/data parameter (type id in the high nibble, size in the low;
+// either may be extended into the following bytes), and returns its type id
+static int eip_pccc_typeparam(unsigned char* rdata, int rsz, int* pos) {
+	unsigned char flag;
+	int type;
+	int n;
+
+	if(*pos >= rsz) return -1;
+	flag = rdata[(*pos)++];
+	type = flag >> 4;
+
+	if(flag & 0x80) {
+		n = type & 0x07;
+		if(*pos + n > rsz) return -1;
+		type = 0;
+		for(int i = 0; i < n; i++) type |= rdata[*pos + i] << (i * 8);
+		*pos += n;
+	}
+	if(flag & 0x08) {
+		n = flag & 0x07;
+		if(*pos + n > rsz) return -1;
+		*pos += n;
+	}
+
+	return type;
+}
+
+// Builds the PCCC command of a typed read: requestor ID (as in the Forward Open),
+// command, status, transaction number, then the function; returns its size
+static int eip_pccc_command(unsigned char* rq_data, unsigned short tns, unsigned char* fnc, int fnc_sz) {
+
+	rq_data[0] = 7;
+	rq_data[1] = _OriginatorVendorID & 0xFF;
+	rq_data[2] = (_OriginatorVendorID >> 8) & 0xFF;
+	for(int i = 0; i < 4; i++) rq_data[3 + i] = (_OriginatorSerialNumber >> (i * 8)) & 0xFF;
+
+	rq_data[7] = PCCC_CMD_TYPED;
+	rq_data[8] = 0x00;
+	rq_data[9] = tns & 0xFF;
+	rq_data[10] = (tns >> 8) & 0xFF;
+	memcpy(rq_data + 11, fnc, fnc_sz);
+
+	return 11 + fnc_sz;
+}
+
+/*
+ * eip_pccc_reply
+ *	Checks the reply to typed read 'tns', and copies its data table values
+ *	to outbuf.
+ *	Returns:
+ *		Number of bytes copied to outbuf, or -2 if the target refused the
+ *		read (see *sts: STS, or EXT STS << 8) or the reply is malformed
+ */
+static int eip_pccc_reply(ATLAS_TARGET* cur_device, unsigned char* rdata, int rsz, unsigned short tns, unsigned char* outbuf, int outbuf_sz, int* sts) {
+	int type;
+	int pos;
+
+	*sts = 0;
+
+	// reply: requestor ID, command | 0x40, status, transaction number, data
+	pos = rsz ? rdata[0] : 0;
+	if(!pos || pos + 4 > rsz || rdata[pos] != (PCCC_CMD_TYPED | 0x40) || (rdata[pos + 2] | (rdata[pos + 3] << 8)) != tns) {
+		zlog_error("[%s] eip_pccc_reply(): Bad reply!\n",cur_device->sname);
+		return -2;
+	}
+	if(rdata[pos + 1]) {
+		*sts = rdata[pos + 1];
+		if(*sts == PCCC_STS_EXTENDED && pos + 4 < rsz) *sts |= rdata[pos + 4] << 8;
+		zlog_error("[%s] eip_pccc_reply(): Typed read returned status 0x%02X (extended 0x%02X)\n",cur_device->sname,*sts & 0xFF,*sts >> 8);
+		return -2;
+	}
+	pos += 4;
+
+	// PLC-5 data is preceded by its type: an array [9], of elements of one type
+	if(cur_device->target_type == TARGET_PLC) {
+		if((type = eip_pccc_typeparam(rdata, rsz, &pos)) == 9) type = eip_pccc_typeparam(rdata, rsz, &pos);
+		if(type < 0) {
+			zlog_error("[%s] eip_pccc_reply(): Bad reply!\n",cur_device->sname);
+			return -2;
+		}
+	}
+
+	if(rsz - pos > outbuf_sz) rsz = pos + outbuf_sz;
+	memcpy(outbuf, rdata + pos, rsz - pos);
+
+	return rsz - pos;
+}
+
+/*
+ * eip_pccc_request
+ *	Sends a typed read (see eip_pccc_address()) with Execute PCCC [0x4B], and
+ *	copies the data table values of the reply to outbuf.
+ *	Args:
+ *		fnc* = function & parameters
+ *		outbuf* = receives the values
+ *	Returns:
+ *		Number of bytes copied to outbuf, -1 on communication failure, or -2
+ *		if the target refused the read (see *sts: STS, or EXT STS << 8)
+ */
+int eip_pccc_request(ATLAS_TARGET* cur_device, unsigned char* fnc, int fnc_sz, unsigned char* outbuf, int outbuf_sz, int* sts) {
+	unsigned char path_data[4] = { 0x20, EIP_CLASS_PCCC, 0x24, 0x01 };
+	unsigned char rq_data[EIP_PCCC_ADDR_MAX + 16];
+	unsigned char rdata[EIP_REPLY_MAX];
+	unsigned short tns = cur_device->eip_tns++;
+	int rq_sz;
+	int rsz;
+
+	rq_sz = eip_pccc_command(rq_data, tns, fnc, fnc_sz);
+
+	*sts = 0;
+	if((rsz = eip_cip_request(cur_device, EIP_SVC_EXECUTE_PCCC, path_data, sizeof(path_data), rq_data, rq_sz, rdata, sizeof(rdata), NULL)) < 0) return rsz;
+
+	return eip_pccc_reply(cur_device, rdata, rsz, tns, outbuf, outbuf_sz, sts);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Self test
+
+// An address, and what it compiles & encodes to
+typedef struct {
+	int target_type;
+	char* tagname;
+	unsigned char type;
+	unsigned short file;
+	unsigned short elem;
+	unsigned char sub;
+	signed char bit;
+	unsigned int count;		// elements read
+	int fnc_sz;
+	unsigned char fnc[EIP_PCCC_ADDR_MAX];
+} EIP_PCCC_TEST_ADDR;
+
+static const EIP_PCCC_TEST_ADDR pccc_test_addrs[] = {
+	// SLC protected typed logical read: function, byte size, file, type, element, sub-element
+	{ TARGET_SLC, "N7:10",    PCCC_FILE_INTEGER, 7,  10, 0, -1,  1,  6, { 0xA2, 0x02, 0x07, 0x89, 0x0A, 0x00 } },
+	{ TARGET_SLC, "B3/37",    PCCC_FILE_BIT,     3,   2, 0,  5,  1,  6, { 0xA2, 0x02, 0x03, 0x85, 0x02, 0x00 } },
+	{ TARGET_SLC, "T4:0.ACC", PCCC_FILE_TIMER,   4,   0, 2, -1,  1,  6, { 0xA2, 0x06, 0x04, 0x86, 0x00, 0x00 } },
+	{ TARGET_SLC, "T4:0/DN",  PCCC_FILE_TIMER,   4,   0, 0, 13,  1,  6, { 0xA2, 0x06, 0x04, 0x86, 0x00, 0x00 } },
+	{ TARGET_SLC, "N7:300",   PCCC_FILE_INTEGER, 7, 300, 0, -1, 10,  8, { 0xA2, 0x14, 0x07, 0x89, 0xFF, 0x2C, 0x01, 0x00 } },
+	// PLC-5 typed read: function, packet offset, total transaction, level mask, file, element, size
+	{ TARGET_PLC, "N7:10",    PCCC_FILE_INTEGER, 7,  10, 0, -1,  1, 10, { 0x68, 0x00, 0x00, 0x01, 0x00, 0x06, 0x07, 0x0A, 0x01, 0x00 } },
+	{ TARGET_PLC, "B3/37",    PCCC_FILE_BIT,     3,   2, 0,  5,  1, 10, { 0x68, 0x00, 0x00, 0x01, 0x00, 0x06, 0x03, 0x02, 0x01, 0x00 } },
+	{ TARGET_PLC, "T4:0.ACC", PCCC_FILE_TIMER,   4,   0, 2, -1,  1, 10, { 0x68, 0x00, 0x00, 0x01, 0x00, 0x06, 0x04, 0x00, 0x01, 0x00 } },
+	{ TARGET_PLC, "T4:0/DN",  PCCC_FILE_TIMER,   4,   0, 0, 13,  1, 10, { 0x68, 0x00, 0x00, 0x01, 0x00, 0x06, 0x04, 0x00, 0x01, 0x00 } },
+	{ TARGET_PLC, "N7:300",   PCCC_FILE_INTEGER, 7, 300, 0, -1, 10, 12, { 0x68, 0x00, 0x00, 0x0A, 0x00, 0x06, 0x07, 0xFF, 0x2C, 0x01, 0x0A, 0x00 } },
+	{ 0 }
+};
+
+// A reply to transaction 0x0102, and what it parses to
+typedef struct {
+	int target_type;
+	int rsz;
+	unsigned char rdata[24];
+	int rv;				// bytes of data, or -2
+	int sts;
+	int data_sz;
+	unsigned char data[8];
+} EIP_PCCC_TEST_REPLY;
+
+static const EIP_PCCC_TEST_REPLY pccc_test_replies[] = {
+	// requestor ID, command | 0x40, status, transaction number, then data: N7 values 42, -2
+	{ TARGET_SLC, 15, { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x4F, 0x00, 0x02, 0x01, 0x2A, 0x00, 0xFE, 0xFF }, 4, 0, 4, { 0x2A, 0x00, 0xFE, 0xFF } },
+	// PLC-5: array [9] of 3 bytes of descriptor, of integers [4] of 2 bytes
+	{ TARGET_PLC, 17, { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x4F, 0x00, 0x02, 0x01, 0x99, 0x09, 0x03, 0x42, 0x2A, 0x00 }, 2, 0, 2, { 0x2A, 0x00 } },
+	// refused, with extended status 0x06 (address doesn't exist)
+	{ TARGET_SLC, 12, { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x4F, 0xF0, 0x02, 0x01, 0x06 }, -2, 0x06F0, 0, { 0 } },
+	// refused, plain status 0x10 (illegal command or format)
+	{ TARGET_SLC, 11, { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x4F, 0x10, 0x02, 0x01 }, -2, 0x10, 0, { 0 } },
+	// another transaction's reply
+	{ TARGET_SLC, 13, { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x4F, 0x00, 0x03, 0x01, 0x2A, 0x00 }, -2, 0, 0, { 0 } },
+	{ 0 }
+};
+
+/*
+ * eip_pccc_selftest
+ *	Compiles SLC 500 & PLC-5 data table addresses, encodes typed reads of
+ *	them, and parses typed read replies, and checks each against hand-built
+ *	frames. (--selftest-pccc)
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int eip_pccc_selftest() {
+	const EIP_PCCC_TEST_ADDR* ta;
+	const EIP_PCCC_TEST_REPLY* tr;
+	ATLAS_TARGET dev;
+	ATLAS_TAG tag;
+	ATLAS_TAGDESC* desc = &tag.desc;
+	CIP_UINT vendor_id = _OriginatorVendorID;
+	CIP_UDINT serial_num = _OriginatorSerialNumber;
+	unsigned char cmd_hdr[11] = { 0x07, 0x34, 0x12, 0xEF, 0xCD, 0xAB, 0x89, 0x0F, 0x00, 0x02, 0x01 };
+	unsigned char fnc[EIP_PCCC_ADDR_MAX];
+	unsigned char rq_data[EIP_PCCC_ADDR_MAX + 16];
+	unsigned char rdata[24];
+	unsigned char outbuf[8];
+	int fnc_sz;
+	int rv;
+	int sts;
+	int rc = 0;
+
+	// a known requestor ID, for the hand-built frames
+	_OriginatorVendorID = 0x1234;
+	_OriginatorSerialNumber = 0x89ABCDEF;
+
+	memset(&dev, 0, sizeof(ATLAS_TARGET));
+	strcpy(dev.sname, "selftest");
+
+	for(ta = pccc_test_addrs; ta->target_type; ta++) {
+		dev.target_type = ta->target_type;
+		memset(&tag, 0, sizeof(ATLAS_TAG));
+		strcpy(tag.tagname, ta->tagname);
+
+		if(eip_compile_tag(&dev, &tag) || !desc->compiled || desc->pccc_type != ta->type || desc->pccc_file != ta->file ||
+		   desc->pccc_elem != ta->elem || desc->pccc_sub != ta->sub || desc->cip_bit != ta->bit) {
+			zlog_error("eip_pccc_selftest(): %s: %s compiled wrong!\n",ta->target_type == TARGET_PLC ? "PLC-5" : "SLC",ta->tagname);
+			rc = -1;
+			continue;
+		}
+
+		fnc_sz = eip_pccc_address(&dev, desc->pccc_type, desc->pccc_file, desc->pccc_elem, ta->count, fnc);
+		if(fnc_sz != ta->fnc_sz || memcmp(fnc, ta->fnc, fnc_sz) ||
+		   eip_pccc_command(rq_data, 0x0102, fnc, fnc_sz) != 11 + fnc_sz || memcmp(rq_data, cmd_hdr, 11) || memcmp(rq_data + 11, ta->fnc, fnc_sz)) {
+			zlog_error("eip_pccc_selftest(): %s: %s encoded wrong!\n",ta->target_type == TARGET_PLC ? "PLC-5" : "SLC",ta->tagname);
+			rc = -1;
+			continue;
+		}
+
+		zlog_info("eip_pccc_selftest(): %s: %s OK\n",ta->target_type == TARGET_PLC ? "PLC-5" : "SLC",ta->tagname);
+	}
+
+	for(tr = pccc_test_replies; tr->target_type; tr++) {
+		dev.target_type = tr->target_type;
+		memcpy(rdata, tr->rdata, tr->rsz);
+		memset(outbuf, 0, sizeof(outbuf));
+
+		rv = eip_pccc_reply(&dev, rdata, tr->rsz, 0x0102, outbuf, sizeof(outbuf), &sts);
+		if(rv != tr->rv || sts != tr->sts || (rv > 0 && memcmp(outbuf, tr->data, tr->data_sz))) {
+			zlog_error("eip_pccc_selftest(): reply %i parsed wrong! (%i, status 0x%04X)\n",(int)(tr - pccc_test_replies),rv,sts);
+			rc = -1;
+			continue;
+		}
+
+		zlog_info("eip_pccc_selftest(): reply %i OK\n",(int)(tr - pccc_test_replies));
+	}
+
+	_OriginatorVendorID = vendor_id;
+	_OriginatorSerialNumber = serial_num;
+
+	return rc;
+}
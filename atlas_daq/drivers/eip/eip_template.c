@@ -0,0 +1,520 @@
+/*
+
+	Atlas Project - Data Acquisition Daemon (DAQ)
+	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+	Nichiha USA, Inc.
+
+	EtherNet/IP & Common Industrial Protocol (CIP) - Logix Symbols & Templates
+	Copyright (c) 2013 Jacob Hipps/Nichiha USA, Inc.
+
+	Reads the controller's symbol table [0x6B] and structure templates
+	[0x6C], so that tags can be addressed by symbol instance, and whole
+	structures read as one block and their members decoded locally. Both are
+	cached per target, and the symbol table on disk too (eip_cache_dir),
+	until the controller's change counter [0xAC] changes. Callers must hold
+	the EIP driver's library lock.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "atlas_daq.h"
+#include "eip.h"
+
+#define EIP_LE16(p)	((p)[0] | ((p)[1] << 8))
+#define EIP_LE32(p)	((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8) | ((unsigned int)(p)[2] << 16) | ((unsigned int)(p)[3] << 24))
+
+#define EIP_SYMFILE_MAGIC	"atlas-eip-symbols 1"
+
+// Returns the target's cache, creating it if needed
+EIP_CACHE* eip_cache_get(ATLAS_TARGET* cur_device) {
+
+	if(!cur_device->eip_cache && (cur_device->eip_cache = calloc(1, sizeof(EIP_CACHE))) == NULL) {
+		zlog_error("eip_cache_get(): Memory allocation failed!\n");
+	}
+
+	return cur_device->eip_cache;
+}
+
+// Drops the target's cached symbols & templates (eg. after a program download)
+void eip_cache_flush(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache = cur_device->eip_cache;
+	EIP_TEMPLATE* tmpl;
+
+	if(!cache) return;
+
+	while((tmpl = cache->templates) != NULL) {
+		cache->templates = tmpl->next;
+		free(tmpl->members);
+		free(tmpl);
+	}
+
+	free(cache->symbols);
+	cache->symbols = NULL;
+	cache->symbol_count = 0;
+	cache->symbols_loaded = 0;
+}
+
+static int eip_symbol_cmp(const void* a, const void* b) {
+	return strcasecmp(((const EIP_SYMBOL*)a)->name, ((const EIP_SYMBOL*)b)->name);
+}
+
+/*
+ * eip_enum_taglist
+ *	Reads the controller-scope symbol table with Get Instance Attribute List
+ *	[0x55], paging through it from instance 0 until the controller no longer
+ *	answers with a partial transfer [0x06], into the target's symbol index.
+ *	Returns:
+ *		Number of symbols, or -1 on failure
+ */
+int eip_enum_taglist(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache;
+	EIP_SYMBOL* sym;
+	unsigned char path_data[6] = { 0x20, EIP_CLASS_SYMBOL, 0x25, 0x00, 0x00, 0x00 };
+	// number of attributes, attribute 1 - symbol name, 2 - symbol type, 8 - array dimensions
+	unsigned char rq_data[8] = { 0x03, 0x00, 0x01, 0x00, 0x02, 0x00, 0x08, 0x00 };
+	unsigned char rdata[EIP_REPLY_MAX];
+	unsigned char* ent;
+	unsigned int instance = 0;
+	int sym_alloc = 0;
+	int gstatus;
+	int rsz;
+	int name_sz;
+	int pos;
+
+	if((cache = eip_cache_get(cur_device)) == NULL) return -1;
+	eip_cache_flush(cur_device);
+
+	do {
+		path_data[4] = instance & 0xFF;
+		path_data[5] = (instance >> 8) & 0xFF;
+		zlog_debug("eip_enum_taglist(): [%s] Reading symbols from instance 0x%04x\n",cur_device->sname,instance);
+
+		if((rsz = eip_cip_request(cur_device, EIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST, path_data, sizeof(path_data), rq_data, sizeof(rq_data), rdata, sizeof(rdata), &gstatus)) < 0) {
+			zlog_error("eip_enum_taglist(): [%s] Failed to read the symbol table!\n",cur_device->sname);
+			eip_cache_flush(cur_device);
+			return -1;
+		}
+
+		// each symbol: instance (UDINT), name length (UINT), name, type (UINT), dimensions (3 x UDINT)
+		for(pos = 0; pos + 20 <= rsz; pos += 20 + name_sz) {
+			ent = rdata + pos;
+			name_sz = EIP_LE16(ent + 4);
+			if(pos + 20 + name_sz > rsz) break;
+
+			instance = EIP_LE32(ent);
+			if(name_sz > EIP_NAME_MAX) continue;
+
+			if(cache->symbol_count == sym_alloc) {
+				sym_alloc = sym_alloc ? sym_alloc * 2 : 256;
+				if((sym = realloc(cache->symbols, sizeof(EIP_SYMBOL) * sym_alloc)) == NULL) {
+					zlog_error("eip_enum_taglist(): Memory allocation failed!\n");
+					eip_cache_flush(cur_device);
+					return -1;
+				}
+				cache->symbols = sym;
+			}
+
+			sym = &cache->symbols[cache->symbol_count++];
+			memcpy(sym->name, ent + 6, name_sz);
+			sym->name[name_sz] = 0;
+			sym->instance = instance;
+			ent += 6 + name_sz;
+			sym->type = EIP_LE16(ent);
+			for(int d = 0; d < 3; d++) sym->dims[d] = EIP_LE32(ent + 2 + d * 4);
+		}
+
+		instance++;
+	} while(gstatus == EIP_STATUS_PARTIAL && rsz > 0);
+
+	qsort(cache->symbols, cache->symbol_count, sizeof(EIP_SYMBOL), eip_symbol_cmp);
+	cache->symbols_loaded = 1;
+	zlog_info("[%s] Read %i symbols from the controller\n",cur_device->sname,cache->symbol_count);
+
+	return cache->symbol_count;
+}
+
+/*
+ * eip_change_counter
+ *	Reads the controller's change detection attributes [0xAC], which change
+ *	whenever tags or structure definitions are edited or downloaded, and
+ *	folds them into one counter value.
+ *	Returns:
+ *		0 on success, -1 if the controller doesn't report them
+ */
+int eip_change_counter(ATLAS_TARGET* cur_device, unsigned int* counter) {
+	unsigned char path_data[4] = { 0x20, EIP_CLASS_CHANGE, 0x24, 0x01 };
+	// number of attributes, attributes 1, 2, 3, 4 & 10
+	unsigned char rq_data[12] = { 0x05, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04, 0x00, 0x0A, 0x00 };
+	unsigned char rdata[EIP_REPLY_MAX];
+	unsigned int sig = 2166136261u;
+	int rsz;
+
+	if((rsz = eip_cip_request(cur_device, EIP_SVC_GET_ATTRIBUTE_LIST, path_data, sizeof(path_data), rq_data, sizeof(rq_data), rdata, sizeof(rdata), NULL)) < 2) return -1;
+
+	for(int i = 0; i < rsz; i++) {
+		sig ^= rdata[i];
+		sig *= 16777619u;
+	}
+	*counter = sig;
+
+	return 0;
+}
+
+// Builds the name of a target's symbol cache file, from its address & route path
+static int eip_symfile_name(ATLAS_TARGET* cur_device, char* fname, int fname_sz) {
+	char key[96];
+	int n;
+
+	if(!global_config.eip_cache_dir[0]) return -1;
+
+	n = snprintf(key, sizeof(key), "%s_%s", cur_device->ip_addr, cur_device->path_str);
+	if(n >= (int)sizeof(key)) n = sizeof(key) - 1;
+	for(int i = 0; i < n; i++) {
+		if(!isalnum((unsigned char)key[i])) key[i] = '_';
+	}
+
+	return (snprintf(fname, fname_sz, "%s/eip_%s.sym", global_config.eip_cache_dir, key) < fname_sz) ? 0 : -1;
+}
+
+// Loads the symbol index from the target's cache file, if it was saved at the current change counter
+static int eip_symfile_read(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache = cur_device->eip_cache;
+	EIP_SYMBOL* sym;
+	FILE* fp;
+	char fname[256];
+	char line[128];
+	unsigned int counter;
+	int count;
+	int type;
+
+	if(eip_symfile_name(cur_device, fname, sizeof(fname)) || (fp = fopen(fname, "r")) == NULL) return -1;
+
+	// header: magic, change counter, number of symbols
+	if(!fgets(line, sizeof(line), fp) || strncmp(line, EIP_SYMFILE_MAGIC, strlen(EIP_SYMFILE_MAGIC)) ||
+	   sscanf(line + strlen(EIP_SYMFILE_MAGIC), "%x %i", &counter, &count) != 2 || counter != cache->counter || count < 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	eip_cache_flush(cur_device);
+	if((cache->symbols = malloc(sizeof(EIP_SYMBOL) * (count ? count : 1))) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+
+	// each symbol: instance, type, dimensions, name (in index order)
+	while(cache->symbol_count < count && fgets(line, sizeof(line), fp)) {
+		sym = &cache->symbols[cache->symbol_count];
+		if(sscanf(line, "%u %x %u %u %u %40s", &sym->instance, &type, &sym->dims[0], &sym->dims[1], &sym->dims[2], sym->name) != 6) break;
+		sym->type = type;
+		cache->symbol_count++;
+	}
+	fclose(fp);
+
+	if(cache->symbol_count != count) {
+		zlog_error("[%s] Symbol cache file [%s] is corrupt. Reading symbols from the controller.\n",cur_device->sname,fname);
+		eip_cache_flush(cur_device);
+		return -1;
+	}
+
+	cache->symbols_loaded = 1;
+	zlog_info("[%s] Read %i symbols from [%s]\n",cur_device->sname,count,fname);
+
+	return 0;
+}
+
+// Saves the symbol index to the target's cache file
+static void eip_symfile_write(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache = cur_device->eip_cache;
+	EIP_SYMBOL* sym;
+	FILE* fp;
+	char fname[256];
+	char tname[264];
+
+	if(eip_symfile_name(cur_device, fname, sizeof(fname))) return;
+
+	// write a temporary file & rename it, so a reader never sees half a file
+	snprintf(tname, sizeof(tname), "%s.tmp", fname);
+	if((fp = fopen(tname, "w")) == NULL) {
+		zlog_error("[%s] Failed to write symbol cache file [%s]!\n",cur_device->sname,tname);
+		return;
+	}
+
+	fprintf(fp, "%s %08x %i\n", EIP_SYMFILE_MAGIC, cache->counter, cache->symbol_count);
+	for(int i = 0; i < cache->symbol_count; i++) {
+		sym = &cache->symbols[i];
+		fprintf(fp, "%u %04x %u %u %u %s\n", sym->instance, sym->type, sym->dims[0], sym->dims[1], sym->dims[2], sym->name);
+	}
+
+	if(fclose(fp) || rename(tname, fname)) {
+		zlog_error("[%s] Failed to write symbol cache file [%s]!\n",cur_device->sname,fname);
+		unlink(tname);
+	}
+}
+
+/*
+ * eip_symbols_load
+ *	Loads the target's symbol index, if not loaded already: from its cache
+ *	file if that was saved at the controller's current change counter, or
+ *	else from the controller (and saves it).
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int eip_symbols_load(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache;
+
+	if((cache = eip_cache_get(cur_device)) == NULL) return -1;
+	if(cache->symbols_loaded) return 0;
+
+	cache->has_counter = !eip_change_counter(cur_device, &cache->counter);
+	if(!cache->has_counter) zlog_info("[%s] Controller has no change counter. Symbols won't be cached.\n",cur_device->sname);
+
+	if(cache->has_counter && !eip_symfile_read(cur_device)) return 0;
+	if(eip_enum_taglist(cur_device) < 0) return -1;
+	if(cache->has_counter) eip_symfile_write(cur_device);
+
+	return 0;
+}
+
+/*
+ * eip_symbols_changed
+ *	Checks the controller's change counter against the one the symbol index
+ *	was read at. If it has changed, the cached symbols & templates are
+ *	dropped (they'll be read again when next needed).
+ *	Returns:
+ *		1 if the symbols changed, 0 if not (or if it can't tell)
+ */
+int eip_symbols_changed(ATLAS_TARGET* cur_device) {
+	EIP_CACHE* cache = cur_device->eip_cache;
+	unsigned int counter;
+
+	if(!cache || !cache->symbols_loaded || !cache->has_counter) return 0;
+	if(eip_change_counter(cur_device, &counter) || counter == cache->counter) return 0;
+
+	zlog_info("[%s] Controller's tags have changed (counter %08x, was %08x). Reloading symbols.\n",cur_device->sname,counter,cache->counter);
+	eip_cache_flush(cur_device);
+
+	return 1;
+}
+
+// Finds a controller-scope symbol by name, loading the symbol index if needed
+EIP_SYMBOL* eip_symbol_find(ATLAS_TARGET* cur_device, char* name) {
+	EIP_SYMBOL key;
+
+	if(eip_symbols_load(cur_device) || strlen(name) > EIP_NAME_MAX) return NULL;
+
+	strcpy(key.name, name);
+	return bsearch(&key, cur_device->eip_cache->symbols, cur_device->eip_cache->symbol_count, sizeof(EIP_SYMBOL), eip_symbol_cmp);
+}
+
+/*
+ * eip_path_instance
+ *	Rewrites a compiled symbolic path to address its controller-scope symbol
+ *	by instance [0x6B], so the controller doesn't have to look the name up.
+ *	Only done when the controller has a change counter to tell us when the
+ *	instances move.
+ *	Args:
+ *		out* = receives the new path (ATLAS_CIP_PATH_MAX bytes)
+ *	Returns:
+ *		Size of the new path, or 0 if the path can't be addressed by instance
+ */
+int eip_path_instance(ATLAS_TARGET* cur_device, unsigned char* path, int path_sz, unsigned char* out) {
+	EIP_SYMBOL* sym;
+	char name[EIP_NAME_MAX + 1];
+	int segsz;
+
+	if(!cur_device->eip_cache || !cur_device->eip_cache->has_counter) return 0;
+	if(path_sz < 2 || path[0] != 0x91 || path[1] > EIP_NAME_MAX || !(segsz = eip_path_segsz(path))) return 0;
+
+	memcpy(name, path + 2, path[1]);
+	name[path[1]] = 0;
+	if((sym = eip_symbol_find(cur_device, name)) == NULL || (sym->type & EIP_SYMTYPE_SYSTEM) || sym->instance > 0xFFFF) return 0;
+	if(6 + path_sz - segsz > ATLAS_CIP_PATH_MAX) return 0;
+
+	out[0] = 0x20;
+	out[1] = EIP_CLASS_SYMBOL;
+	out[2] = 0x25;
+	out[3] = 0x00;
+	out[4] = sym->instance & 0xFF;
+	out[5] = (sym->instance >> 8) & 0xFF;
+	memcpy(out + 6, path + segsz, path_sz - segsz);
+
+	return 6 + path_sz - segsz;
+}
+
+// Reads a template's definition (Read Template [0x4C]) and parses its members
+static EIP_TEMPLATE* eip_template_read(ATLAS_TARGET* cur_device, unsigned int instance) {
+	unsigned char path_data[6] = { 0x20, EIP_CLASS_TEMPLATE, 0x25, 0x00, instance & 0xFF, (instance >> 8) & 0xFF };
+	// number of attributes, attribute 4 - definition size (words), 5 - structure size (bytes), 2 - member count, 1 - handle
+	unsigned char attr_rq[10] = { 0x04, 0x00, 0x04, 0x00, 0x05, 0x00, 0x02, 0x00, 0x01, 0x00 };
+	unsigned char rq_data[6];
+	unsigned char rdata[EIP_REPLY_MAX];
+	unsigned char* def = NULL;
+	unsigned int def_sz;
+	unsigned int def_off = 0;
+	EIP_TEMPLATE* tmpl;
+	char* cc;
+	char* endp;
+	int gstatus;
+	int rsz;
+
+	// attribute list reply: count, then each attribute's id (UINT), status (UINT) & value
+	if((rsz = eip_cip_request(cur_device, EIP_SVC_GET_ATTRIBUTE_LIST, path_data, sizeof(path_data), attr_rq, sizeof(attr_rq), rdata, sizeof(rdata), NULL)) < 30 ||
+	   EIP_LE16(rdata + 4) || EIP_LE16(rdata + 12) || EIP_LE16(rdata + 20) || EIP_LE16(rdata + 26)) {
+		zlog_error("eip_template_read(): [%s] Failed to read template 0x%04x attributes!\n",cur_device->sname,instance);
+		return NULL;
+	}
+
+	if((tmpl = calloc(1, sizeof(EIP_TEMPLATE))) == NULL) {
+		zlog_error("eip_template_read(): Memory allocation failed!\n");
+		return NULL;
+	}
+	tmpl->instance = instance;
+	def_sz = EIP_LE32(rdata + 6) * 4;
+	tmpl->size = EIP_LE32(rdata + 14);
+	tmpl->member_count = EIP_LE16(rdata + 22);
+	tmpl->handle = EIP_LE16(rdata + 28);
+
+	// the definition is 23 bytes shorter than its size attribute says
+	if(def_sz < 23 || tmpl->member_count * 8 > def_sz - 23 ||
+	   (def = malloc(def_sz)) == NULL || (tmpl->members = calloc(tmpl->member_count ? tmpl->member_count : 1, sizeof(EIP_MEMBER))) == NULL) {
+		zlog_error("eip_template_read(): [%s] Template 0x%04x is invalid, or out of memory!\n",cur_device->sname,instance);
+		goto fail;
+	}
+	def_sz -= 23;
+
+	do {
+		rq_data[0] = def_off & 0xFF;
+		rq_data[1] = (def_off >> 8) & 0xFF;
+		rq_data[2] = (def_off >> 16) & 0xFF;
+		rq_data[3] = (def_off >> 24) & 0xFF;
+		rq_data[4] = (def_sz - def_off) & 0xFF;
+		rq_data[5] = ((def_sz - def_off) >> 8) & 0xFF;
+
+		if((rsz = eip_cip_request(cur_device, EIP_SVC_READ_TEMPLATE, path_data, sizeof(path_data), rq_data, sizeof(rq_data), rdata, sizeof(rdata), &gstatus)) < 0) {
+			zlog_error("eip_template_read(): [%s] Failed to read template 0x%04x!\n",cur_device->sname,instance);
+			goto fail;
+		}
+		if(rsz > def_sz - def_off) rsz = def_sz - def_off;
+		memcpy(def + def_off, rdata, rsz);
+		def_off += rsz;
+	} while(gstatus == EIP_STATUS_PARTIAL && rsz > 0 && def_off < def_sz);
+
+	// member info: info (UINT), type (UINT), offset (UDINT); then the template
+	// name and each member's name, NUL terminated
+	if(def_off < tmpl->member_count * 8) goto fail;
+	for(int i = 0; i < tmpl->member_count; i++) {
+		tmpl->members[i].info = EIP_LE16(def + i * 8);
+		tmpl->members[i].type = EIP_LE16(def + i * 8 + 2);
+		tmpl->members[i].offset = EIP_LE32(def + i * 8 + 4);
+	}
+
+	cc = (char*)def + tmpl->member_count * 8;
+	endp = (char*)def + def_off;
+	for(int i = -1; i < tmpl->member_count && cc < endp; i++) {
+		int len = strnlen(cc, endp - cc);
+		if(i >= 0 && len <= EIP_NAME_MAX) {
+			memcpy(tmpl->members[i].name, cc, len);
+			tmpl->members[i].name[len] = 0;
+		}
+		cc += len + 1;
+	}
+
+	free(def);
+	zlog_debug("eip_template_read(): [%s] Template 0x%04x: handle 0x%04x, %u bytes, %i members\n",cur_device->sname,instance,tmpl->handle,tmpl->size,tmpl->member_count);
+
+	return tmpl;
+
+fail:
+	free(def);
+	free(tmpl->members);
+	free(tmpl);
+	return NULL;
+}
+
+// Returns a template from the target's cache, reading it from the controller if needed
+EIP_TEMPLATE* eip_template_get(ATLAS_TARGET* cur_device, unsigned int instance) {
+	EIP_CACHE* cache;
+	EIP_TEMPLATE* tmpl;
+
+	if((cache = eip_cache_get(cur_device)) == NULL) return NULL;
+
+	for(tmpl = cache->templates; tmpl; tmpl = tmpl->next) {
+		if(tmpl->instance == instance) return tmpl;
+	}
+
+	if((tmpl = eip_template_read(cur_device, instance)) != NULL) {
+		tmpl->next = cache->templates;
+		cache->templates = tmpl;
+	}
+
+	return tmpl;
+}
+
+// Finds a structure member by name
+EIP_MEMBER* eip_member_find(EIP_TEMPLATE* tmpl, char* name) {
+
+	for(int i = 0; i < tmpl->member_count; i++) {
+		if(!strcasecmp(tmpl->members[i].name, name)) return &tmpl->members[i];
+	}
+
+	return NULL;
+}
+
+// Returns the size of the CIP path segment at seg, or 0 if it isn't one eip_compile_tag() makes
+int eip_path_segsz(unsigned char* seg) {
+
+	switch(seg[0]) {
+		case 0x91:	return 2 + seg[1] + (seg[1] & 1);
+		case 0x28:	return 2;
+		case 0x29:	return 4;
+		case 0x2A:	return 6;
+		default:	return 0;
+	}
+}
+
+/*
+ * eip_template_resolve
+ *	Finds the template of the structure a compiled symbolic path refers to,
+ *	starting from the controller-scope symbol and following each member's
+ *	type. Element segments select an element of the same type.
+ *	Returns:
+ *		Template, or NULL if the path isn't a structure (or can't be resolved)
+ */
+EIP_TEMPLATE* eip_template_resolve(ATLAS_TARGET* cur_device, unsigned char* path, int path_sz) {
+	EIP_TEMPLATE* tmpl = NULL;
+	EIP_SYMBOL* sym;
+	EIP_MEMBER* mbr;
+	char name[EIP_NAME_MAX + 1];
+	unsigned short type = 0;
+	int segsz;
+
+	for(int pos = 0; pos < path_sz; pos += segsz) {
+		if(!(segsz = eip_path_segsz(path + pos))) return NULL;
+		if(path[pos] != 0x91) continue;
+
+		if(path[pos + 1] > EIP_NAME_MAX) return NULL;
+		memcpy(name, path + pos + 2, path[pos + 1]);
+		name[path[pos + 1]] = 0;
+
+		if(!pos) {
+			if((sym = eip_symbol_find(cur_device, name)) == NULL) return NULL;
+			type = sym->type;
+		} else {
+			if(!tmpl || (mbr = eip_member_find(tmpl, name)) == NULL) return NULL;
+			type = mbr->type;
+		}
+
+		if(!(type & EIP_SYMTYPE_STRUCT)) {
+			tmpl = NULL;
+			continue;
+		}
+		if((tmpl = eip_template_get(cur_device, EIP_SYMTYPE_TEMPLATE(type))) == NULL) return NULL;
+	}
+
+	return tmpl;
+}
@@ -0,0 +1,808 @@
+/**
+ *	Atlas Project - Data Acquisition Daemon (DAQ)
+ *	J. Hipps - http://jhipps.org/ (jhipps@nichiha.com)
+ *	Nichiha USA, Inc.
+ *
+ *	MELSEC Communication Protocol (MC Protocol) Driver Implementation
+ *	Read Planner
+ *	Copyright (c) 2012-2013 Jacob Hipps/Nichiha USA, Inc.
+ *
+ *	Coalesces a target's tag list into as few requests as possible. Tags
+ *	are sorted by device code and device number, then merged into runs
+ *	(blocks). Small gaps between runs are read through whenever the extra
+ *	data costs less than another round trip (see the cost model in
+ *	melsec.h). Runs are then packed into request frames:
+ *
+ *	* Runs of more than 2 points are packed into Multiple Block Batch
+ *	  Read [0406] frames (or Batch Read [0401] when a frame has only one)
+ *	* Scattered 1 and 2 point runs are packed into Random Read [0403]
+ *	  frames as word and double word access points, unless they all fit
+ *	  into the free space of the multiple block frames
+ *	* Bool tags on bit devices (M/X/Y/B relays, alarm bits) are planned
+ *	  in bit units, and read with Batch Read [0401] subcommand [0001]
+ *
+ *	Values are then split back out to the individual tags. On 4E targets
+ *	the frames are pipelined (see mc_request_pipeline()).
+ *
+ *	A target's tag list plan is cached, and only rebuilt when the tag list
+ *	changes. On targets with TFLAG_MC_MONITOR, the largest Random Read frame
+ *	is registered once as a monitor set [0801] and then read each cycle with
+ *	the bare Monitor command [0802].
+ *
+ **/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "atlas_daq.h"
+#include "melsec.h"
+
+// Returns the device flags for a device code from regmap
+static unsigned char mc_plan_devflags(unsigned char dev_code) {
+
+	for(int i = 0; i < 100; i++) {
+		if(!regmap[i].bval && !regmap[i].cval[0]) break;
+		if(regmap[i].bval == dev_code) return regmap[i].dflags;
+	}
+
+	return MC_DEVF_WORD;
+}
+
+/*
+ * mc_compile_tag
+ *	Decodes a tag's device name into its compiled descriptor, so that
+ *	planning and reading only deal with device codes & numbers.
+ *	Bool tags on bit devices are flagged to be read in bit units.
+ *	Returns:
+ *		0 on success, -1 if the device could not be decoded
+ */
+int mc_compile_tag(ATLAS_TARGET* atag, ATLAS_TAG* curtag) {
+	ATLAS_TAGDESC* desc = &curtag->desc;
+
+	desc->compiled = 0;
+	if(!mc_decode_device(curtag->tagname, &desc->dev_code, &desc->dev_num)) return -1;
+
+	desc->dflags = mc_plan_devflags(desc->dev_code);
+	if((desc->dflags & MC_DEVF_BIT) && curtag->dtypei == DTYPE_RET_BOOL) desc->dflags |= MC_DEVF_BITUNIT;
+	desc->cip_bit = -1;
+	desc->cip_path_sz = 0;
+	desc->compiled = 1;
+
+	return 0;
+}
+
+// qsort() comparator: order by device code, then device number
+static int mc_plan_ptag_cmp(const void* a, const void* b) {
+	const ATLAS_MC_PTAG* pa = (const ATLAS_MC_PTAG*)a;
+	const ATLAS_MC_PTAG* pb = (const ATLAS_MC_PTAG*)b;
+
+	if((pa->dflags & MC_DEVF_BITUNIT) != (pb->dflags & MC_DEVF_BITUNIT)) return (pa->dflags & MC_DEVF_BITUNIT) ? 1 : -1;
+	if(pa->dev_code != pb->dev_code) return (int)pa->dev_code - (int)pb->dev_code;
+	if(pa->dev_num != pb->dev_num) return (pa->dev_num < pb->dev_num) ? -1 : 1;
+	return (int)pb->width - (int)pa->width;
+}
+
+// Assigns frame data offsets to the blocks of a frame, and calculates its request & response sizes
+static void mc_plan_frame_finalize(ATLAS_MC_PLAN* plan, ATLAS_MC_FRAME* cur_frame) {
+	ATLAS_MC_BLOCK* cur_block;
+	int word_offset = 0;
+	int dword_offset;
+
+	cur_frame->points = 0;
+	for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+		cur_frame->points += plan->blocks[b].num_points;
+	}
+
+	if(cur_frame->subcommand == 0x0001) {
+		// bit units: one block, two points per response byte
+		plan->blocks[cur_frame->block_first].data_offset = 0;
+		cur_frame->tx_sz = MC_REQ_FIXED_SZ + 6;
+		cur_frame->rx_sz = MC_3E_RSP_HEADER_SZ + ((cur_frame->points + 1) / 2);
+		return;
+	}
+
+	if(cur_frame->command == 0x0403) {
+		// word access points come first in the response, followed by the double word access points
+		dword_offset = cur_frame->word_count;
+		for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+			cur_block = &plan->blocks[b];
+			if(cur_block->num_points == 1) {
+				cur_block->data_offset = word_offset++;
+			} else {
+				cur_block->data_offset = dword_offset;
+				dword_offset += 2;
+			}
+		}
+		cur_frame->tx_sz = MC_REQ_FIXED_SZ + 2 + (cur_frame->block_count * 4);
+	} else {
+		// blocks are already ordered (word devices before bit devices)
+		for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+			plan->blocks[b].data_offset = word_offset;
+			word_offset += plan->blocks[b].num_points;
+		}
+		if(cur_frame->command == 0x0406) cur_frame->tx_sz = MC_REQ_FIXED_SZ + 2 + (cur_frame->block_count * 6);
+		else cur_frame->tx_sz = MC_REQ_FIXED_SZ + 6;
+	}
+
+	cur_frame->rx_sz = MC_3E_RSP_HEADER_SZ + (cur_frame->points * 2);
+}
+
+/*
+ * mc_plan_build
+ *	Builds a read plan for the tags in taglist.
+ *	Args:
+ *		atag*			Target the tags belong to
+ *		taglist**		Array of tag pointers
+ *		tag_count		Number of tags in taglist
+ *	Returns:
+ *		Pointer to new plan (free with mc_plan_free()), or NULL on failure
+ */
+ATLAS_MC_PLAN* mc_plan_build(ATLAS_TARGET* atag, ATLAS_TAG** taglist, int tag_count) {
+	ATLAS_MC_PLAN* plan;
+	ATLAS_MC_PTAG* cur_ptag;
+	ATLAS_MC_BLOCK* runs = NULL;
+	ATLAS_MC_BLOCK* cur_run = NULL;
+	ATLAS_MC_FRAME* cur_frame = NULL;
+	int* run_frame = NULL;
+	int run_count = 0;
+	int mblock_frames = 0;
+	int single_count = 0;
+	int free_blocks = 0;
+	int fold_singles = 0;
+	int frame_end = 0;
+	int ptag_end;
+	int gap_bytes;
+	int rtt_cost = global_config.mc_rtt_cost / mc_window(atag);	// pipelined frames share round trips
+	int nalloc = tag_count ? tag_count : 1;
+
+	if((plan = malloc(sizeof(ATLAS_MC_PLAN))) == NULL) {
+		zlog_error("mc_plan_build(): Memory allocation failed!\n");
+		return NULL;
+	}
+	memset(plan,0,sizeof(ATLAS_MC_PLAN));
+	plan->tag_count = tag_count;
+	plan->monitor_frame = -1;
+
+	// one planned tag, block and (at most) one frame per tag
+	plan->ptags  = malloc(sizeof(ATLAS_MC_PTAG) * nalloc);
+	plan->blocks = malloc(sizeof(ATLAS_MC_BLOCK) * nalloc);
+	plan->frames = malloc(sizeof(ATLAS_MC_FRAME) * nalloc);
+	runs = malloc(sizeof(ATLAS_MC_BLOCK) * nalloc);
+	run_frame = malloc(sizeof(int) * nalloc);
+	if(!plan->ptags || !plan->blocks || !plan->frames || !runs || !run_frame) {
+		zlog_error("mc_plan_build(): Memory allocation failed!\n");
+		if(runs) free(runs);
+		if(run_frame) free(run_frame);
+		mc_plan_free(plan);
+		return NULL;
+	}
+
+	// decode each tag's device
+	for(int i = 0; i < tag_count; i++) {
+		cur_ptag = &plan->ptags[plan->ptag_count];
+
+		if(!taglist[i]->desc.compiled && mc_compile_tag(atag, taglist[i])) {
+			zlog_error("mc_plan_build(): [%s] Failed to decode device \"%s\". Tag will not be read.\n",atag->sname,taglist[i]->tagname);
+			taglist[i]->read_status = -1;
+			continue;
+		}
+
+		cur_ptag->tag = taglist[i];
+		cur_ptag->tag_index = i;
+		cur_ptag->dev_code = taglist[i]->desc.dev_code;
+		cur_ptag->dev_num = taglist[i]->desc.dev_num;
+		cur_ptag->dflags = taglist[i]->desc.dflags;
+		cur_ptag->width = (taglist[i]->dtypei == DTYPE_RET_FLOAT) ? 2 : 1;
+		cur_ptag->offset = 0;
+		plan->ptag_count++;
+	}
+
+	qsort(plan->ptags, plan->ptag_count, sizeof(ATLAS_MC_PTAG), mc_plan_ptag_cmp);
+
+	// merge into runs
+	for(int i = 0; i < plan->ptag_count; i++) {
+		cur_ptag = &plan->ptags[i];
+		ptag_end = cur_ptag->dev_num + cur_ptag->width;
+
+		if(cur_run && cur_run->dev_code == cur_ptag->dev_code && cur_run->dflags == cur_ptag->dflags
+		   && (ptag_end - cur_run->head_dev) <= ((cur_ptag->dflags & MC_DEVF_BITUNIT) ? MC_BATCH_MAX_BITS : MC_BATCH_MAX_WORDS)) {
+			// read through the gap if it's cheaper than another request
+			if(cur_ptag->dflags & MC_DEVF_BITUNIT) gap_bytes = (cur_ptag->dev_num - frame_end + 1) / 2;
+			else gap_bytes = (cur_ptag->dev_num - frame_end) * 2;
+			if(gap_bytes <= 0 || gap_bytes <= (MC_PLAN_FRAME_OVERHEAD + rtt_cost)) {
+				if(ptag_end > frame_end) frame_end = ptag_end;
+				cur_run->num_points = frame_end - cur_run->head_dev;
+				cur_run->ptag_count++;
+				cur_ptag->offset = cur_ptag->dev_num - cur_run->head_dev;
+				continue;
+			}
+		}
+
+		// start a new run
+		cur_run = &runs[run_count++];
+		cur_run->dev_code = cur_ptag->dev_code;
+		cur_run->dflags = cur_ptag->dflags;
+		cur_run->head_dev = cur_ptag->dev_num;
+		cur_run->num_points = cur_ptag->width;
+		cur_run->data_offset = 0;
+		cur_run->ptag_first = i;
+		cur_run->ptag_count = 1;
+		cur_ptag->offset = 0;
+		frame_end = ptag_end;
+
+		// bit devices read in word units are read one word at a time, starting at the tag's own device
+		if(cur_ptag->dflags == MC_DEVF_BIT) cur_run = NULL;
+	}
+
+	// pack runs of more than 2 points into multiple block frames
+	for(int r = 0; r < run_count; r++) {
+		run_frame[r] = -1;
+		if(runs[r].dflags & MC_DEVF_BITUNIT) {
+			// bit unit runs are read with their own batch read
+			cur_frame = &plan->frames[plan->frame_count++];
+			memset(cur_frame,0,sizeof(ATLAS_MC_FRAME));
+			cur_frame->command = 0x0401;
+			cur_frame->subcommand = 0x0001;
+			run_frame[r] = plan->frame_count - 1;
+			cur_frame = NULL;
+			continue;
+		} else if(runs[r].num_points <= 2) {
+			single_count++;
+			continue;
+		}
+
+		if(!cur_frame || cur_frame->block_count >= MC_MBLOCK_MAX_BLOCKS || cur_frame->points + runs[r].num_points > MC_MBLOCK_MAX_POINTS) {
+			cur_frame = &plan->frames[plan->frame_count++];
+			memset(cur_frame,0,sizeof(ATLAS_MC_FRAME));
+			cur_frame->command = 0x0406;
+		}
+
+		cur_frame->block_count++;
+		cur_frame->points += runs[r].num_points;
+		run_frame[r] = plan->frame_count - 1;
+	}
+	mblock_frames = plan->frame_count;
+
+	// if the scattered points all fit into the multiple block frames, put them there.
+	// otherwise, pack them into random read frames.
+	for(int f = 0; f < mblock_frames; f++) {
+		if(plan->frames[f].command != 0x0406) continue;
+		if(plan->frames[f].points + 2 <= MC_MBLOCK_MAX_POINTS) free_blocks += MC_MBLOCK_MAX_BLOCKS - plan->frames[f].block_count;
+	}
+	fold_singles = (single_count && single_count <= free_blocks);
+
+	cur_frame = NULL;
+	for(int r = 0; r < run_count; r++) {
+		if(run_frame[r] != -1) continue;
+
+		if(fold_singles) {
+			for(int f = 0; f < mblock_frames; f++) {
+				if(plan->frames[f].command == 0x0406 && plan->frames[f].block_count < MC_MBLOCK_MAX_BLOCKS && plan->frames[f].points + runs[r].num_points <= MC_MBLOCK_MAX_POINTS) {
+					plan->frames[f].block_count++;
+					plan->frames[f].points += runs[r].num_points;
+					run_frame[r] = f;
+					break;
+				}
+			}
+			if(run_frame[r] != -1) continue;
+		}
+
+		if(!cur_frame || cur_frame->block_count >= MC_RANDOM_MAX_POINTS) {
+			cur_frame = &plan->frames[plan->frame_count++];
+			memset(cur_frame,0,sizeof(ATLAS_MC_FRAME));
+			cur_frame->command = 0x0403;
+		}
+
+		cur_frame->block_count++;
+		if(runs[r].num_points == 1) cur_frame->word_count++;
+		else cur_frame->dword_count++;
+		run_frame[r] = plan->frame_count - 1;
+	}
+
+	// lay out blocks in frame order. in multiple block frames, word devices
+	// come before bit devices; in random read frames, words come before double words.
+	for(int f = 0; f < plan->frame_count; f++) {
+		cur_frame = &plan->frames[f];
+		cur_frame->block_first = plan->block_count;
+		cur_frame->block_count = 0;
+
+		for(int pass = 0; pass < 2; pass++) {
+			for(int r = 0; r < run_count; r++) {
+				if(run_frame[r] != f) continue;
+				if(cur_frame->subcommand == 0x0001) {
+					if(pass == 1) continue;
+				} else if(cur_frame->command == 0x0403) {
+					if((runs[r].num_points == 1) != (pass == 0)) continue;
+				} else {
+					if(((runs[r].dflags & MC_DEVF_BIT) != 0) != (pass == 1)) continue;
+					if(pass == 0) cur_frame->word_count++;
+					else cur_frame->dword_count++;
+				}
+				plan->blocks[plan->block_count++] = runs[r];
+				cur_frame->block_count++;
+			}
+		}
+
+		// a multiple block frame with only one block is sent as a plain batch read
+		if(cur_frame->command == 0x0406 && cur_frame->block_count == 1) {
+			cur_frame->command = 0x0401;
+			cur_frame->word_count = 0;
+			cur_frame->dword_count = 0;
+		}
+
+		mc_plan_frame_finalize(plan, cur_frame);
+	}
+
+	free(runs);
+	free(run_frame);
+
+	// tally up stats
+	for(int i = 0; i < plan->frame_count; i++) {
+		if(atag->flags & TFLAG_MC_4E) {
+			plan->frames[i].tx_sz += MC_4E_EXTRA_SZ;
+			plan->frames[i].rx_sz += MC_4E_EXTRA_SZ;
+		}
+		plan->points   += plan->frames[i].points;
+		plan->tx_bytes += plan->frames[i].tx_sz;
+		plan->rx_bytes += plan->frames[i].rx_sz;
+	}
+
+	zlog_debug("mc_plan_build(): [%s] %i tags -> %i blocks, %i frames, %i points\n",atag->sname,plan->ptag_count,plan->block_count,plan->frame_count,plan->points);
+
+	return plan;
+}
+
+void mc_plan_free(ATLAS_MC_PLAN* plan) {
+
+	if(!plan) return;
+	if(plan->ptags) free(plan->ptags);
+	if(plan->blocks) free(plan->blocks);
+	if(plan->frames) free(plan->frames);
+	if(plan->reqs) free(plan->reqs);
+	if(plan->wire) free(plan->wire);
+	free(plan);
+}
+
+// Copies a value out of the response data into its tag
+// (index is in words, or in points for bit unit reads)
+static void mc_plan_set_value(ATLAS_MC_PTAG* cur_ptag, unsigned char* databuf, int index) {
+	ATLAS_TAG* curtag = cur_ptag->tag;
+	unsigned char* wptr = databuf + (index * 2);
+	unsigned int dword;
+
+	if(cur_ptag->dflags & MC_DEVF_BITUNIT) {
+		dword = MC_BIT_NIBBLE(databuf, index);
+	} else if(cur_ptag->width == 2) {
+		dword = (unsigned int)wptr[0] | ((unsigned int)wptr[1] << 8) | ((unsigned int)wptr[2] << 16) | ((unsigned int)wptr[3] << 24);
+	} else {
+		dword = (unsigned int)wptr[0] | ((unsigned int)wptr[1] << 8);
+	}
+
+	if(curtag->dtypei == DTYPE_RET_BOOL) {
+		curtag->v_int = dword & 0x0001;
+		zlog_debug("\t>> [%s] v_int (BOOL) = %i\n",curtag->tagname,curtag->v_int);
+	} else if(curtag->dtypei == DTYPE_RET_FLOAT) {
+		memcpy(&curtag->v_float, &dword, sizeof(float));
+		zlog_debug("\t>> [%s] v_float = %f\n",curtag->tagname,curtag->v_float);
+	} else if(curtag->dtypei == DTYPE_RET_INT) {
+		curtag->v_int = (int)dword;
+		zlog_debug("\t>> [%s] v_int = %i\n",curtag->tagname,curtag->v_int);
+	} else {
+		sprintf(curtag->v_str,"%u",dword);
+		zlog_debug("\t>> [%s] v_str = \"%s\"\n",curtag->tagname,curtag->v_str);
+	}
+
+	curtag->read_status = 0;
+}
+
+// Builds the request data (following the subcommand) for a frame
+static int mc_plan_frame_data(ATLAS_MC_PLAN* plan, ATLAS_MC_FRAME* cur_frame, unsigned char* reqdata) {
+	ATLAS_MC_BLOCK* cur_block;
+	// the monitor set is registered in the same format as Random Read
+	unsigned short command = (cur_frame->command == 0x0802) ? 0x0403 : cur_frame->command;
+	int rq_sz = 0;
+
+	if(command != 0x0401) {
+		reqdata[rq_sz++] = cur_frame->word_count;
+		reqdata[rq_sz++] = cur_frame->dword_count;
+	}
+
+	for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+		cur_block = &plan->blocks[b];
+		reqdata[rq_sz++] = cur_block->head_dev & 0xFF;
+		reqdata[rq_sz++] = (cur_block->head_dev >> 8) & 0xFF;
+		reqdata[rq_sz++] = (cur_block->head_dev >> 16) & 0xFF;
+		reqdata[rq_sz++] = cur_block->dev_code;
+		if(command != 0x0403) {
+			reqdata[rq_sz++] = cur_block->num_points & 0xFF;
+			reqdata[rq_sz++] = (cur_block->num_points >> 8) & 0xFF;
+		}
+	}
+
+	return rq_sz;
+}
+
+/*
+ * mc_monitor_register
+ *	Registers the plan's monitor frame as the connection's monitor set,
+ *	using Monitor Data Registration [0801].
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int mc_monitor_register(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	ATLAS_MC_PREQ req;
+	unsigned char reqdata[MC_REQ_MAX_DATA];
+	unsigned char rspdata[4];
+
+	if(plan->monitor_frame == -1 || !atag->mc_session) return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.command = 0x0801;
+	req.subcommand = 0x0000;
+	req.reqdata = reqdata;
+	req.reqdata_sz = mc_plan_frame_data(plan, &plan->frames[plan->monitor_frame], reqdata);
+	req.outbuf = rspdata;
+	req.outbuf_sz = sizeof(rspdata);
+	sprintf(req.desc,"0801:0000 monitor set");
+
+	atag->mc_session->monitor_registered = 0;
+	if(mc_request_pipeline(atag, &req, 1) != 0) {
+		zlog_error("mc_monitor_register(): [%s] Monitor registration failed! [0x%04hX]\n",atag->sname,req.complete_code);
+		return -1;
+	}
+
+	zlog_debug("mc_monitor_register(): [%s] Registered %hu word + %hu dword points.\n",atag->sname,
+		   plan->frames[plan->monitor_frame].word_count,plan->frames[plan->monitor_frame].dword_count);
+	atag->mc_session->monitor_registered = 1;
+
+	return 0;
+}
+
+// Size of the response data expected for a frame
+static int mc_plan_rx_expect(ATLAS_MC_FRAME* cur_frame) {
+	if(cur_frame->subcommand == 0x0001) return (cur_frame->points + 1) / 2;
+	return cur_frame->points * 2;
+}
+
+// Distributes a frame's response data to its tags, straight from the receive buffer (ATLAS_MC_PREQ.on_data)
+static void mc_plan_frame_values(ATLAS_MC_PREQ* cur_req, unsigned char* data, int data_sz) {
+	ATLAS_MC_PLAN* plan = cur_req->cb_arg;
+	ATLAS_MC_FRAME* cur_frame = &plan->frames[cur_req->cb_index];
+	ATLAS_MC_BLOCK* cur_block;
+
+	if(data_sz != mc_plan_rx_expect(cur_frame)) return;
+
+	for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+		cur_block = &plan->blocks[b];
+		for(int i = cur_block->ptag_first; i < cur_block->ptag_first + cur_block->ptag_count; i++) {
+			mc_plan_set_value(&plan->ptags[i], data, cur_block->data_offset + plan->ptags[i].offset);
+		}
+	}
+}
+
+/*
+ * mc_plan_serialize
+ *	Builds the exact wire bytes of every frame in the plan once, along with
+ *	its pipeline request, so that reading the plan only hands ready-made
+ *	buffers to the socket (the 4E serial number is patched in at send time).
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+static int mc_plan_serialize(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	unsigned char reqdata[MC_REQ_MAX_DATA];
+	ATLAS_MC_FRAME* cur_frame;
+	ATLAS_MC_BLOCK* cur_block;
+	ATLAS_MC_PREQ* cur_req;
+	int wire_total = 0;
+	int wire_offset = 0;
+	int rq_sz;
+
+	if(!atag->mc_station_ok && mc_compile_station(atag)) return -1;
+
+	for(int f = 0; f < plan->frame_count; f++) wire_total += MC_REQ_FIXED_SZ + MC_4E_EXTRA_SZ + mc_plan_frame_data(plan, &plan->frames[f], reqdata);
+
+	plan->reqs = malloc(sizeof(ATLAS_MC_PREQ) * (plan->frame_count > 0 ? (size_t)plan->frame_count : 1));
+	plan->wire = malloc(wire_total ? wire_total : 1);
+	if(!plan->reqs || !plan->wire) {
+		zlog_error("mc_plan_serialize(): Memory allocation failed!\n");
+		if(plan->reqs) free(plan->reqs);
+		if(plan->wire) free(plan->wire);
+		plan->reqs = NULL;
+		plan->wire = NULL;
+		return -1;
+	}
+
+	for(int f = 0; f < plan->frame_count; f++) {
+		cur_frame = &plan->frames[f];
+		cur_block = &plan->blocks[cur_frame->block_first];
+		cur_req = &plan->reqs[f];
+
+		memset(cur_req, 0, sizeof(ATLAS_MC_PREQ));
+		cur_req->command = cur_frame->command;
+		cur_req->subcommand = cur_frame->subcommand;
+
+		// Monitor [0802] has no request data
+		rq_sz = (f == plan->monitor_frame) ? 0 : mc_plan_frame_data(plan, cur_frame, reqdata);
+
+		cur_req->wire = plan->wire + wire_offset;
+		cur_req->wire_sz = mc_frame_build(atag, 0, cur_frame->command, cur_frame->subcommand, reqdata, rq_sz, cur_req->wire);
+		wire_offset += cur_req->wire_sz;
+
+		cur_req->on_data = mc_plan_frame_values;
+		cur_req->cb_arg = plan;
+		cur_req->cb_index = f;
+		sprintf(cur_req->desc,"%04hX:%04hX %s%i+%i",cur_frame->command,cur_frame->subcommand,mc_get_dev_from_val(cur_block->dev_code),cur_block->head_dev,cur_frame->block_count - 1);
+	}
+
+	return 0;
+}
+
+/*
+ * mc_plan_start
+ *	Queues each frame of the plan on the target's connection. The frames
+ *	are read as the event loop runs; the results are distributed to the tags
+ *	as they arrive, and checked by mc_plan_finish().
+ *	Tags are marked with read_status = -1 until read.
+ *	Returns:
+ *		0 on success, or -1 if the target is not ready
+ */
+int mc_plan_start(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	ATLAS_MC_PREQ* mon_req;
+
+	// mark everything failed until read
+	for(int i = 0; i < plan->ptag_count; i++) plan->ptags[i].tag->read_status = -1;
+	plan->queued = 0;
+
+	// a lost connection is restored by the reconnect thread (atlas_rcx.c)
+	if(atag->status != STATUS_READY || !atag->mc_session) {
+		zlog_debug("[%s] Target not ready!\n",atag->sname);
+		return -1;
+	}
+
+	if(!plan->frame_count) return 0;
+
+	if(!plan->reqs && mc_plan_serialize(atag, plan)) return -1;
+
+	if(plan->monitor_frame != -1) {
+		// (re-)register the monitor set if this connection doesn't have it yet
+		if(!atag->mc_session->monitor_registered) mc_monitor_register(atag, plan);
+
+		// if it couldn't be registered, fall back to Random Read for this cycle
+		if(!atag->mc_session->monitor_registered) {
+			mon_req = &plan->reqs[plan->monitor_frame];
+			plan->monitor_wire = mon_req->wire;
+			mon_req->wire = NULL;
+			mon_req->command = 0x0403;
+			mon_req->reqdata = plan->monitor_fallback;
+			mon_req->reqdata_sz = mc_plan_frame_data(plan, &plan->frames[plan->monitor_frame], plan->monitor_fallback);
+		}
+	}
+
+	if(mc_queue(atag, plan->reqs, plan->frame_count)) return -1;
+	plan->queued = 1;
+
+	return 0;
+}
+
+/*
+ * mc_plan_finish
+ *	Checks the frames queued by mc_plan_start(), once the event loop has
+ *	run them to completion. Tags in frames which failed keep read_status = -1.
+ *	Returns:
+ *		Number of frames that failed, or -1 if the plan was not queued
+ */
+int mc_plan_finish(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	ATLAS_MC_PREQ* mon_req;
+	int frame_fails = 0;
+
+	if(!plan->queued) return plan->frame_count ? -1 : 0;
+	plan->queued = 0;
+
+	if(mc_queue_results(plan->reqs, plan->frame_count) < 0) {
+		zlog_error("mc_plan_read(): [%s] communication failure\n",atag->sname);
+	}
+
+	if(plan->monitor_wire) {
+		// back to the monitor template
+		mon_req = &plan->reqs[plan->monitor_frame];
+		mon_req->command = 0x0802;
+		mon_req->wire = plan->monitor_wire;
+		mon_req->reqdata = NULL;
+		mon_req->reqdata_sz = 0;
+		plan->monitor_wire = NULL;
+	}
+
+	for(int f = 0; f < plan->frame_count; f++) {
+		if(plan->reqs[f].result != mc_plan_rx_expect(&plan->frames[f])) {
+			zlog_error("mc_plan_read(): [%s] read failed for frame %i (%s)\n",atag->sname,f,plan->reqs[f].desc);
+			// the PLC may have dropped the registration; register again next cycle
+			if(f == plan->monitor_frame && plan->reqs[f].responded && atag->mc_session) atag->mc_session->monitor_registered = 0;
+			frame_fails++;
+		}
+	}
+
+	return frame_fails;
+}
+
+/*
+ * mc_plan_read
+ *	Executes each frame of the plan and distributes the results to the tags.
+ *	Tags in frames which fail are marked with read_status = -1.
+ *	Returns:
+ *		Number of frames that failed, or -1 if the target is not ready
+ */
+int mc_plan_read(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+
+	if(mc_plan_start(atag, plan)) return -1;
+	atlas_evloop_run(0);
+
+	return mc_plan_finish(atag, plan);
+}
+
+// Prints a plan summary and frame listing to the management FIFO
+void mc_plan_print(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	ATLAS_MC_FRAME* cur_frame;
+	ATLAS_MC_BLOCK* cur_block;
+
+	AMF_printf("[%s] tags = %i, frames = %i (%i round trips saved), blocks = %i, points = %i, tx = %i bytes, rx = %i bytes, window = %i\n",
+		   atag->sname, plan->tag_count, plan->frame_count, plan->ptag_count - plan->frame_count,
+		   plan->block_count, plan->points, plan->tx_bytes, plan->rx_bytes, mc_window(atag));
+
+	for(int f = 0; f < plan->frame_count; f++) {
+		cur_frame = &plan->frames[f];
+		AMF_printf("\t[%04hX:%04hX] %i blocks, %hu points, tx = %i bytes, rx = %i bytes\n",cur_frame->command,cur_frame->subcommand,
+			   cur_frame->block_count,cur_frame->points,cur_frame->tx_sz,cur_frame->rx_sz);
+		for(int b = cur_frame->block_first; b < cur_frame->block_first + cur_frame->block_count; b++) {
+			cur_block = &plan->blocks[b];
+			AMF_printf("\t\t%s%i x %hu points (%i tags)\n",mc_get_dev_from_val(cur_block->dev_code),
+				   cur_block->head_dev,cur_block->num_points,cur_block->ptag_count);
+		}
+	}
+}
+
+// FNV-1a hash of the tags' devices & data types, to detect tag list changes
+static unsigned int mc_plan_tag_sig(ATLAS_TAG* tags, int tag_count) {
+	unsigned int sig = 2166136261u;
+	unsigned int key;
+
+	for(int i = 0; i < tag_count; i++) {
+		if(tags[i].desc.compiled) {
+			key = ((unsigned int)tags[i].desc.dev_code << 24) ^ (unsigned int)tags[i].desc.dev_num;
+			sig ^= key;
+			sig *= 16777619u;
+		} else {
+			for(char* cc = tags[i].tagname; *cc; cc++) {
+				sig ^= (unsigned char)*cc;
+				sig *= 16777619u;
+			}
+		}
+		sig ^= (unsigned int)tags[i].dtypei;
+		sig *= 16777619u;
+	}
+
+	return sig;
+}
+
+// Turns the plan's largest Random Read frame into a Monitor [0802] frame
+static void mc_plan_monitor_setup(ATLAS_TARGET* atag, ATLAS_MC_PLAN* plan) {
+	ATLAS_MC_FRAME* cur_frame;
+	int tx_sz = MC_REQ_FIXED_SZ + ((atag->flags & TFLAG_MC_4E) ? MC_4E_EXTRA_SZ : 0);
+	int best = -1;
+
+	if(!(atag->flags & TFLAG_MC_MONITOR)) return;
+
+	// the monitor set belongs to the connection, so targets sharing one would overwrite each other's
+	if(atag->parent) {
+		zlog_warn("[%s] Monitor mode is not available on a shared session. Using Random Read.\n",atag->sname);
+		return;
+	}
+	for(int i = 0; i < atx_targets; i++) {
+		if(atx_tgdex[i] && atx_tgdex[i]->parent == atag) {
+			zlog_warn("[%s] Monitor mode is not available on a shared session. Using Random Read.\n",atag->sname);
+			return;
+		}
+	}
+
+	for(int f = 0; f < plan->frame_count; f++) {
+		if(plan->frames[f].command != 0x0403) continue;
+		if(best == -1 || plan->frames[f].points > plan->frames[best].points) best = f;
+	}
+	if(best == -1) return;
+
+	cur_frame = &plan->frames[best];
+	cur_frame->command = 0x0802;
+	plan->tx_bytes -= cur_frame->tx_sz - tx_sz;
+	cur_frame->tx_sz = tx_sz;
+	plan->monitor_frame = best;
+
+	zlog_debug("mc_plan_monitor_setup(): [%s] Monitoring %hu points with frame %i\n",atag->sname,cur_frame->points,best);
+}
+
+/*
+ * mc_tagset_plan
+ *	Driver plan entry: makes set->plan the read plan for the set's tags. The
+ *	plan is kept between cycles, and only rebuilt when the tag list changes.
+ *	Only the target's acquisition tag set may use monitor mode, since the
+ *	monitor registration belongs to the connection.
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int mc_tagset_plan(ATLAS_TARGET* atag, ATLAS_TAGSET* set) {
+	ATLAS_TAG** taglist;
+	ATLAS_MC_PLAN* plan = set->plan;
+	unsigned int tag_sig = mc_plan_tag_sig(set->tags, set->tag_count);
+
+	if(plan && (plan->tag_count != set->tag_count || plan->tag_sig != tag_sig)) {
+		zlog_info("[%s] Tag list has changed. Rebuilding read plan.\n",atag->sname);
+		mc_plan_free(plan);
+		plan = set->plan = NULL;
+		if(set == &atag->tagset && atag->mc_session) atag->mc_session->monitor_registered = 0;
+	}
+
+	if(!plan) {
+		if((taglist = malloc(sizeof(ATLAS_TAG*) * (set->tag_count ? set->tag_count : 1))) == NULL) {
+			zlog_error("mc_tagset_plan(): Memory allocation failed!\n");
+			return -1;
+		}
+
+		for(int i = 0; i < set->tag_count; i++) taglist[i] = &set->tags[i];
+
+		plan = mc_plan_build(atag, taglist, set->tag_count);
+		free(taglist);
+		if(!plan) return -1;
+
+		plan->tag_sig = tag_sig;
+		if(set == &atag->tagset) mc_plan_monitor_setup(atag, plan);
+		set->plan = plan;
+	} else {
+		// the tag list is reloaded each cycle, so point the plan at this cycle's tags
+		for(int i = 0; i < plan->ptag_count; i++) plan->ptags[i].tag = &set->tags[plan->ptags[i].tag_index];
+	}
+
+	return 0;
+}
+
+// Driver plan_free entry
+void mc_tagset_free(ATLAS_TARGET* atag, ATLAS_TAGSET* set) {
+
+	if(set->plan) mc_plan_free(set->plan);
+	set->plan = NULL;
+}
+
+/*
+ * mc_tagset_read
+ *	Driver read_batch entry: queues the frames of the set's plan, to be read
+ *	by the event loop along with any other targets. Finish with mc_tagset_done().
+ *	Returns:
+ *		0 on success, or -1 if the target is not ready
+ */
+int mc_tagset_read(ATLAS_TARGET* atag, ATLAS_TAGSET* set) {
+
+	for(int i = 0; i < set->tag_count; i++) set->tags[i].read_status = -1;
+	set->failed = set->tag_count;
+	if(!set->plan) return -1;
+
+	return mc_plan_start(atag, set->plan);
+}
+
+/*
+ * mc_tagset_done
+ *	Driver read_done entry: completes the reads queued by mc_tagset_read(),
+ *	after the event loop has run.
+ *	Returns:
+ *		Number of frames that failed, or -1 on error
+ */
+int mc_tagset_done(ATLAS_TARGET* atag, ATLAS_TAGSET* set) {
+	int rv;
+
+	if(!set->plan) return -1;
+
+	rv = mc_plan_finish(atag, set->plan);
+
+	set->failed = 0;
+	for(int i = 0; i < set->tag_count; i++) {
+		if(set->tags[i].read_status) set->failed++;
+	}
+
+	return rv;
+}
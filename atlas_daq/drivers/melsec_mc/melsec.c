@@ -15,6 +15,7 @@
  *	[jp] SH-08003-V      - http://www.mitsubishielectric.co.jp/
  *
  *	* Protocol Type 3E (binary) QnA compatible framing
+ *	* Protocol Type 4E (binary) framing, with pipelined requests
  *
  **/
 
@@ -24,9 +25,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include "atlas_daq.h"
 #include "melsec.h"
 
+static void mc_conn_fail(ATLAS_MCS* mcs, char* why);
+
 char* mc_errmsg(unsigned short errnum) {
 	char* msgptr = NULL;
 
@@ -44,38 +48,40 @@ char* mc_errmsg(unsigned short errnum) {
 int mc_start(ATLAS_TARGET* atag) {
 	char p_ipaddr[24];
 	int  p_port;
-	int port_retries = 0;
+	int ports[MC_PORT_CANDIDATES];
 
 	// allocate memory for mc_session struct
-	if((atag->mc_session = malloc(sizeof(ATLAS_MCS))) == NULL) {
+	if((atag->mc_session = calloc(1, sizeof(ATLAS_MCS))) == NULL) {
 		zlog_error("CRITICAL: Failed to allocate memory for mc_session!\n\n");
 		atlas_shutdown(254);
 		return 0;
 	}
 
+	if(atlas_framer_init(&atag->mc_session->rx, MC_SESSION_RXBUF, MC_RSP_MAX_SZ, mc_frame_len) ||
+	   (atag->mc_session->tx_buf = malloc(MC_REQ_FIXED_SZ + MC_4E_EXTRA_SZ + MC_REQ_MAX_DATA)) == NULL) {
+		zlog_error("CRITICAL: Failed to allocate receive buffer for mc_session!\n\n");
+		atlas_shutdown(254);
+		return 0;
+	}
+
 	// Copy IP address to mc_session data
 	strcpy(atag->mc_session->ip_addr,atag->ip_addr);
+	atag->mc_session->serial = 0;
+	atag->mc_session->monitor_registered = 0;
 
-	// set to default port_num
-	atag->port_num_active = atag->port_num;
+	// Attempt to connect to target, on the configured port and the next few
+	// after it, all at once; the first to answer is kept
+	for(int i = 0; i < MC_PORT_CANDIDATES; i++) ports[i] = atag->port_num + i;
 
-	// Attempt to connect to target...
-	while(atag->status != STATUS_READY && port_retries < 8) {
-		// Copy port_num to mc_session
-		atag->mc_session->port_num = atag->port_num_active;
+	// increment retry count
+	atag->retry_count++;
 
-		// increment retry count
-		atag->retry_count++;
-
-		zlog_debug("mc_start(): Connecting to \"%s\" at %s on port %u ...\n",atag->sname,atag->ip_addr,atag->port_num_active);
-		if(!atlas_sock_connect(atag->mc_session)) {
-			atag->status = STATUS_COMFAIL;
-			atag->port_num_active++;
-			zlog_error("mc_start(): Failed to connect to \"%s\" (%s:%u).\n",atag->sname,atag->ip_addr,atag->port_num_active);
-			port_retries++;
-		} else {
-			atag->status = STATUS_READY;
-		}		
+	zlog_debug("mc_start(): Connecting to \"%s\" at %s on ports %u-%u ...\n",atag->sname,atag->ip_addr,ports[0],ports[MC_PORT_CANDIDATES - 1]);
+	if(atlas_sock_connect_any(atag->mc_session, ports, MC_PORT_CANDIDATES)) {
+		atag->port_num_active = atag->mc_session->port_num;
+		atag->status = STATUS_READY;
+	} else {
+		atag->status = STATUS_COMFAIL;
 	}
 
 	if(atag->status == STATUS_READY) {
@@ -85,7 +91,7 @@ int mc_start(ATLAS_TARGET* atag) {
 		if(atag->connect_count > 1) set_target_msg(atag,"OK. Reconnect count = %i",atag->connect_count);
 	} else {
 		zlog_error("mc_start(): Failed to connect!\n");
-		set_target_msg("Connection failed. (retries = %i)",atag->retry_count);
+		set_target_msg(atag,"Connection failed. (retries = %i)",atag->retry_count);
 		return -1;		
 	}
 	
@@ -96,7 +102,12 @@ void mc_stop(ATLAS_TARGET* atag) {
 
 	zlog_debug("mc_stop(): Disconnecting from target. Freeing mc_session memory.\n");
 	if(atag->mc_session) {
+		// requests still queued on the connection go down with it
+		if(atag->mc_session->q_head || atag->mc_session->q_inflight_count) mc_conn_fail(atag->mc_session, "Disconnected!");
+		atlas_evloop_watch(atag->mc_session, 0);
 		atlas_sock_close(atag->mc_session);
+		atlas_framer_free(&atag->mc_session->rx);
+		free(atag->mc_session->tx_buf);
 		free(atag->mc_session);
 		atag->mc_session = NULL;
 	}
@@ -202,7 +213,7 @@ int mc_decode_device(char* devstr, unsigned char* dcode, int* dnum) {
 
 	// Loop through and check against regmap values
 	for(int i = 0; i < 100; i++) {
-		if(regmap[i].bval == NULL && regmap[i].cval == NULL) break;
+		if(!regmap[i].bval && !regmap[i].cval[0]) break;
 		if(!strcmp(dcd,regmap[i].cval)) {
 			matched = i;
 			break;
@@ -219,140 +230,664 @@ int mc_decode_device(char* devstr, unsigned char* dcode, int* dnum) {
 	return 1;
 }
 
-int mc_batch_read(char* devname, ATLAS_TARGET* atag, void* outbuf, unsigned short seq) {
+/*
+ * mc_compile_station
+ *	Decodes the target's station spec (path_str) once, into the raw header
+ *	bytes used by every request (see ATLAS_TARGET.mc_station).
+ *	Returns:
+ *		0 on success, -1 on failure
+ */
+int mc_compile_station(ATLAS_TARGET* atag) {
 	ATLAS_MC_3E_REQ request_header;
-	ATLAS_MC_3E_ACK resp_header;
-	ATLAS_MC_BATCHRW read_req;
-	unsigned char dev_code;
-	int head_dev;
-	char tx_buf[128];
-	char rx_buf[4096];
-	unsigned short qcontent_sz = 12; // Q content size is always 12 bytes for Tx
-	int tx_sz = MC_3E_HEADER_SZ + qcontent_sz;
-	int rx_sz = 0;
-	unsigned short rez_datalen = 0;
-	unsigned short rez_wordlen = 0;
-	unsigned short cdatabuf[1024];
 
 	// Setup header with defaults
 	mc_dset_header_3e(&request_header);
 
 	// Setup station params
 	if(mc_decode_station(atag->path_str, &request_header)) {
-		set_target_msg(atag,"[%s] Failed to decode station spec! [%s]\n",devname,atag->path_str);
-		return 0;
+		set_target_msg(atag,"Failed to decode station spec! [%s]\n",atag->path_str);
+		atag->mc_station_ok = 0;
+		return -1;
 	}
 
-	// Set command
-	request_header.command = 0x0401;	// Batch Read
+	atag->mc_station[0] = request_header.network_no;
+	atag->mc_station[1] = request_header.pc_no;
+	atag->mc_station[2] = request_header.request_dest_io & 0xFF;
+	atag->mc_station[3] = (request_header.request_dest_io >> 8) & 0xFF;
+	atag->mc_station[4] = request_header.request_dest_sta;
+	atag->mc_station_ok = 1;
+
+	return 0;
+}
+
+int mc_batch_read(char* devname, ATLAS_TARGET* atag, void* outbuf, unsigned short seq, int bitunits) {
+	unsigned char dev_code;
+	int head_dev;
 
-	// Setup command area (read request)
-	read_req.subcommand = 0x0000;		// Response data type = Word [0000]
-						// [0001] = Point
 	// Device Type
 	if(!mc_decode_device(devname, &dev_code, &head_dev)) {
 		set_target_msg(atag,"Failed to decode device \"%s\"",devname);
 		return 0;
 	}
-	read_req.dev_type = dev_code;
 
-	// Set content length
-	request_header.data_length = qcontent_sz;
+	return mc_batch_read_dev(atag, dev_code, head_dev, outbuf, seq, bitunits);
+}
 
-	// Copy head device number (24-bit integer)
-	memcpy(read_req.head_device, &head_dev, 3);
+/*
+ * mc_window
+ *	Returns the number of requests that may be in flight on the target's
+ *	connection. 3E frames carry no serial number, so only 4E targets are
+ *	pipelined.
+ */
+int mc_window(ATLAS_TARGET* atag) {
+	int window;
 
-	// Specify number of points
-	read_req.num_points = seq;
+	if(!(atag->flags & TFLAG_MC_4E)) return 1;
 
-	// Copy data to transmit buffer
-	memcpy(tx_buf,&request_header,sizeof(request_header));
-	memcpy(tx_buf+sizeof(request_header),&read_req,sizeof(read_req));
+	window = atag->mc_window ? atag->mc_window : global_config.mc_window;
+	if(window < 1) window = 1;
+	if(window > MC_PIPELINE_MAX_WINDOW) window = MC_PIPELINE_MAX_WINDOW;
 
-	// Tx
-	if(atlas_sock_send(atag->mc_session, tx_buf, tx_sz) != tx_sz) {
-		zlog_error("mc_batch_read(): Data send error!\n");
-		set_target_msg(atag,"[%s] mc_batch_read(): Data send error!\n",devname);
+	return window;
+}
+
+/*
+ * mc_frame_build
+ *	Serializes a request frame byte-by-byte (little-endian) so that the
+ *	wire format does not depend on the compiler's struct layout.
+ *	The station bytes come from the target's compiled station header.
+ *	4E frames insert the serial number and 2 reserved bytes after the subheader.
+ *	Returns:
+ *		Size of the frame, in bytes
+ */
+int mc_frame_build(ATLAS_TARGET* atag, unsigned short serial, unsigned short command, unsigned short subcommand, unsigned char* reqdata, int reqdata_sz, unsigned char* tx_buf) {
+	// data length covers the monitor timer, command, subcommand and request data
+	unsigned short data_length = 6 + reqdata_sz;
+	int tx_sz = 0;
+
+	if(atag->flags & TFLAG_MC_4E) {
+		tx_buf[tx_sz++] = MC_4E_REQ_SIG;
+		tx_buf[tx_sz++] = 0x00;
+		tx_buf[tx_sz++] = serial & 0xFF;
+		tx_buf[tx_sz++] = (serial >> 8) & 0xFF;
+		tx_buf[tx_sz++] = 0x00;
+		tx_buf[tx_sz++] = 0x00;
+	} else {
+		tx_buf[tx_sz++] = MC_3E_REQ_SIG;
+		tx_buf[tx_sz++] = 0x00;
+	}
+
+	// network, PC, dest I/O & dest station, as compiled by mc_compile_station()
+	memcpy(tx_buf + tx_sz, atag->mc_station, 5);
+	tx_sz += 5;
+	tx_buf[tx_sz++] = data_length & 0xFF;
+	tx_buf[tx_sz++] = (data_length >> 8) & 0xFF;
+	tx_buf[tx_sz++] = 0x00;		// monitor timer
+	tx_buf[tx_sz++] = 0x00;
+	tx_buf[tx_sz++] = command & 0xFF;
+	tx_buf[tx_sz++] = (command >> 8) & 0xFF;
+	tx_buf[tx_sz++] = subcommand & 0xFF;
+	tx_buf[tx_sz++] = (subcommand >> 8) & 0xFF;
+	memcpy(tx_buf + tx_sz, reqdata, reqdata_sz);
+
+	return tx_sz + reqdata_sz;
+}
+
+/*
+ * mc_frame_len
+ *	Framing reader callback: length of the 3E/4E response frame at data,
+ *	taken from the header's response data length.
+ */
+int mc_frame_len(unsigned char* data, int avail) {
+	int hdr_sz;
+
+	if(data[0] == MC_3E_RSP_SIG)      hdr_sz = MC_3E_HEADER_SZ;
+	else if(data[0] == MC_4E_RSP_SIG) hdr_sz = MC_4E_HEADER_SZ;
+	else return -1;
+
+	if(avail < hdr_sz) return 0;
+
+	return hdr_sz + (data[hdr_sz - 2] | (data[hdr_sz - 1] << 8));
+}
+
+/*
+ * mc_frame_parse
+ *	Checks a response frame and hands its response data to the request's
+ *	on_data callback (in place), or copies it to the request's outbuf.
+ *	Sets the request's responded flag & completion code.
+ *	Returns:
+ *		Number of response data bytes copied to outbuf, 0 on a malformed
+ *		response, or -1 on abnormal completion
+ */
+static int mc_frame_parse(ATLAS_TARGET* atag, unsigned char* rx_frame, int rx_sz, ATLAS_MC_PREQ* cur_req) {
+	char* desc = cur_req->desc;
+	unsigned char* rsp = rx_frame;
+	unsigned short data_length;
+	unsigned short complete_code;
+	int rez_datalen;
+
+	// skip past the 4E serial number, so the rest lines up with 3E
+	if(atag->flags & TFLAG_MC_4E) {
+		if(rx_frame[0] != MC_4E_RSP_SIG) {
+			zlog_error("mc_frame_parse(): Invalid response subheader signature! Expected 0x%02hhX / Rcvd 0x%02hhX\n",MC_4E_RSP_SIG,rx_frame[0]);
+			set_target_msg(atag,"[%s] mc_request(): Invalid response subheader!",desc);
+			return 0;
+		}
+		rsp += MC_4E_EXTRA_SZ;
+		rx_sz -= MC_4E_EXTRA_SZ;
+	} else if(rx_frame[0] != MC_3E_RSP_SIG) {
+		zlog_error("mc_frame_parse(): Invalid response subheader signature! Expected 0x%02hhX / Rcvd 0x%02hhX\n",MC_3E_RSP_SIG,rx_frame[0]);
+		set_target_msg(atag,"[%s] mc_request(): Invalid response subheader!",desc);
 		return 0;
 	}
 
-	// Rx
-	if((rx_sz = atlas_sock_recv(atag->mc_session, rx_buf, 4096)) <= 0) {
-		zlog_error("mc_batch_read(): No data received!\n");
-		set_target_msg(atag,"[%s] mc_batch_read(): No data received!\n",devname);
+	if(rx_sz < MC_3E_RSP_HEADER_SZ) {
+		zlog_error("mc_frame_parse(): Response truncated! (%i bytes)\n",rx_sz);
+		set_target_msg(atag,"[%s] mc_request(): Response truncated!\n",desc);
 		return 0;
 	}
 
-	zlog_debug("mc_batch_read(): Got %i bytes!\n",rx_sz);
+	data_length   = rsp[7] | (rsp[8] << 8);
+	complete_code = rsp[9] | (rsp[10] << 8);
 
-	memcpy(&resp_header,rx_buf,sizeof(resp_header));
+	zlog_debug("mc_frame_parse(): net[0x%02hhX] pc[0x%02hhX] datalen[%hu bytes / 0x%04hX] ccode[0x%04hX]\n",rsp[2],rsp[3],data_length,data_length,complete_code);
 
-	zlog_debug("mc_batch_read(): net[0x%02hhX] pc[0x%02hhX] reqdest_io[0x%04hX] datalen[%hu bytes / 0x%04hX] ccode[0x%04hX]\n",resp_header.network_no,resp_header.pc_no, resp_header.request_dest_io, resp_header.data_length, resp_header.data_length, resp_header.complete_code);
+	cur_req->responded = 1;
+	cur_req->complete_code = complete_code;
 
-	//if(resp_header.subheader[0] == MC_3E_RSP_SIG) {
-	if(resp_header.complete_code == 0x0000) {
-		rez_datalen = resp_header.data_length - 2; // subtract 2 from data length to account for response code (word)
-		rez_wordlen = rez_datalen / 2;
-		zlog_debug("mc_batch_read(): Char data len = %u bytes (%i words).\n",rez_datalen, rez_wordlen);
-		if(outbuf > 0) {
-			memcpy(&cdatabuf, rx_buf+sizeof(resp_header), rez_datalen);
-			memcpy(outbuf, rx_buf+sizeof(resp_header), rez_datalen);
-			zlog_debug(">> outbuf[0] = 0x%04hX\n",cdatabuf[0]);
-			return rez_wordlen;
-		} else {
-			zlog_error("mc_batch_read(): Invalid outbuf pointer!\n");
-			set_target_msg(atag,"[%s] mc_batch_read(): Invalid outbuf pointer!\n",devname);
-		}
-	} else {
-		zlog_error("mc_batch_read(): Abnormal completion. [%04hX] %s\n",resp_header.complete_code,mc_errmsg(resp_header.complete_code));
-		set_target_msg(atag,"[%s] mc_batch_read(): Abnormal response: [0x%04hX] %s",devname,mc_errmsg(resp_header.complete_code));
+	if(complete_code != 0x0000) {
+		zlog_error("mc_request(): Abnormal completion. [%04hX] %s\n",complete_code,mc_errmsg(complete_code));
+		set_target_msg(atag,"[%s] mc_request(): Abnormal response: [0x%04hX] %s",desc,complete_code,mc_errmsg(complete_code));
 		return -1;
 	}
-	//} else {
-	//	zlog_error("mc_batch_read(): Invalid response subheader signature! Expected 0x%02hhX / Rcvd 0x%02hhX\n",MC_3E_RSP_SIG,resp_header.subheader[0]);
-	//	return -1;
-	//}
 
-	return -1;
+	rez_datalen = data_length - 2; // subtract 2 from data length to account for completion code (word)
+	if((!cur_req->on_data && rez_datalen > cur_req->outbuf_sz) || MC_3E_RSP_HEADER_SZ + rez_datalen > rx_sz) {
+		zlog_error("mc_request(): Response data does not fit! (%i bytes)\n",rez_datalen);
+		set_target_msg(atag,"[%s] mc_request(): Response data does not fit!",desc);
+		cur_req->responded = 0;
+		return 0;
+	}
+
+	if(cur_req->on_data) cur_req->on_data(cur_req, rsp + MC_3E_RSP_HEADER_SZ, rez_datalen);
+	else if(rez_datalen) memcpy(cur_req->outbuf, rsp + MC_3E_RSP_HEADER_SZ, rez_datalen);
+
+	return rez_datalen;
 }
 
-void* mc_readword(char* devname, ATLAS_TARGET* atag) {
-	unsigned short zword = 0;
-	static volatile unsigned int iword = 0;
-
-	if(atag->status != STATUS_READY) {
-		zlog_error("[%s] Target not ready!\n",atag->sname);
-		zlog_error("[%s] Attempting to reconnect...\n",atag->sname);
-		mc_stop(atag);
-		mc_start(atag);
-		if(atag->sname != STATUS_READY) {
-			zlog_error("[%s] Target is still not ready! Will try again next time...\n",atag->sname);
+/*
+ * mc_request
+ *	Sends an MC request and waits for the response.
+ *	Args:
+ *		atag*			Target to send request to
+ *		command			Command (eg. 0x0401)
+ *		subcommand		Subcommand
+ *		reqdata*		Request data (follows the subcommand)
+ *		reqdata_sz		Size of request data, in bytes
+ *		outbuf*			Buffer to receive response data (following the completion code)
+ *		outbuf_sz		Size of outbuf, in bytes
+ *		desc*			Description of the request, for messages
+ *	Returns:
+ *		Number of response data bytes copied to outbuf, 0 on communication
+ *		failure, or -1 on abnormal completion
+ */
+int mc_request(ATLAS_TARGET* atag, unsigned short command, unsigned short subcommand, unsigned char* reqdata, int reqdata_sz, void* outbuf, int outbuf_sz, char* desc) {
+	ATLAS_MC_PREQ req;
+
+	memset(&req, 0, sizeof(req));
+	req.command = command;
+	req.subcommand = subcommand;
+	req.reqdata = reqdata;
+	req.reqdata_sz = reqdata_sz;
+	req.outbuf = outbuf;
+	req.outbuf_sz = outbuf_sz;
+	strncpy(req.desc, desc, sizeof(req.desc) - 1);
+
+	mc_request_pipeline(atag, &req, 1);
+
+	return req.result;
+}
+
+/*
+ * mc_request_pipeline
+ *	Sends a list of MC requests, keeping up to mc_window() of them in flight
+ *	on the target's connection, and waits for them all to complete. Other
+ *	connections with queued requests are serviced in the meantime.
+ *	Each request's result is set as for mc_request(); commands with no
+ *	response data are checked with the responded flag & completion code.
+ *	Args:
+ *		atag*			Target to send requests to
+ *		reqs*			Array of requests
+ *		req_count		Number of requests in array
+ *	Returns:
+ *		Number of requests that failed, or -1 on communication failure
+ */
+int mc_request_pipeline(ATLAS_TARGET* atag, ATLAS_MC_PREQ* reqs, int req_count) {
+
+	if(mc_queue(atag, reqs, req_count)) return -1;
+	atlas_evloop_run(0);
+
+	return mc_queue_results(reqs, req_count);
+}
+
+/*
+ * mc_queue_results
+ *	Checks a list of requests, once mc_queue() has been run to completion.
+ *	Returns:
+ *		Number of requests that failed, or -1 if the connection failed
+ */
+int mc_queue_results(ATLAS_MC_PREQ* reqs, int req_count) {
+	int fails = 0;
+
+	for(int i = 0; i < req_count; i++) {
+		if(reqs[i].lost || reqs[i].inflight) return -1;
+		if(!reqs[i].responded || reqs[i].complete_code) fails++;
+	}
+
+	return fails;
+}
+
+// Marks a request as lost with its connection
+static void mc_req_lost(ATLAS_MC_PREQ* cur_req, char* why) {
+	ATLAS_TARGET* owner = cur_req->atag->parent ? cur_req->atag->parent : cur_req->atag;
+
+	cur_req->inflight = 0;
+	cur_req->lost = 1;
+	cur_req->result = 0;
+
+	// flag the session's owner, so that shared sessions are only reconnected once
+	if(owner->status != STATUS_COMFAIL) set_target_msg(cur_req->atag,"[%s] mc_request(): %s",cur_req->desc,why);
+	owner->status = STATUS_COMFAIL;
+}
+
+/*
+ * mc_conn_fail
+ *	Fails every request queued or in flight on a connection. Anything sent
+ *	but unanswered is lost, so the stream must be re-established; each
+ *	request's target is marked for reconnection.
+ */
+static void mc_conn_fail(ATLAS_MCS* mcs, char* why) {
+
+	zlog_error("mc_request(): [%s:%u] %s (%i requests in flight)\n",mcs->ip_addr,mcs->port_num,why,mcs->q_inflight_count);
+
+	for(int i = 0; i < mcs->q_inflight_count; i++) mc_req_lost(mcs->q_inflight[i], why);
+	for(ATLAS_MC_PREQ* cur_req = mcs->q_head; cur_req; cur_req = cur_req->q_next) mc_req_lost(cur_req, why);
+
+	mcs->q_head = NULL;
+	mcs->q_tail = NULL;
+	mcs->q_inflight_count = 0;
+	mcs->tx_ptr = NULL;
+	atlas_framer_reset(&mcs->rx);
+	atlas_evloop_watch(mcs, 0);
+}
+
+/*
+ * mc_conn_tx
+ *	Sends queued requests until the window is full, or the socket stops
+ *	taking data (the rest is sent when the event loop reports it writable).
+ *	Returns:
+ *		0 on success, -1 on communication failure
+ */
+static int mc_conn_tx(ATLAS_MCS* mcs) {
+	ATLAS_MC_PREQ* cur_req;
+	ATLAS_TARGET* atag;
+	int tx_len;
+
+	while(1) {
+		if(!mcs->tx_ptr) {
+			if(!(cur_req = mcs->q_head)) break;
+			atag = cur_req->atag;
+			if(mcs->q_inflight_count >= mc_window(atag)) break;
+
+			mcs->q_head = cur_req->q_next;
+			if(!mcs->q_head) mcs->q_tail = NULL;
+
+			if(!cur_req->wire && cur_req->reqdata_sz > MC_REQ_MAX_DATA) {
+				zlog_error("mc_request(): [%s] Request data too large! (%i bytes)\n",cur_req->desc,cur_req->reqdata_sz);
+				cur_req->result = 0;
+				continue;
+			}
+
+			cur_req->serial = mcs->serial++;
+			if(cur_req->wire) {
+				// pre-serialized frame; only the 4E serial number changes
+				mcs->tx_ptr = cur_req->wire;
+				mcs->tx_sz = cur_req->wire_sz;
+				if(atag->flags & TFLAG_MC_4E) {
+					mcs->tx_ptr[2] = cur_req->serial & 0xFF;
+					mcs->tx_ptr[3] = (cur_req->serial >> 8) & 0xFF;
+				}
+			} else {
+				mcs->tx_ptr = mcs->tx_buf;
+				mcs->tx_sz = mc_frame_build(atag, cur_req->serial, cur_req->command, cur_req->subcommand, cur_req->reqdata, cur_req->reqdata_sz, mcs->tx_buf);
+			}
+			mcs->tx_off = 0;
+
+			cur_req->inflight = 1;
+			cur_req->deadline = atlas_evloop_now() + global_config.mc_timeout;
+			mcs->q_inflight[mcs->q_inflight_count++] = cur_req;
+		}
+
+		// Tx
+		if((tx_len = atlas_sock_send(mcs, (char*)mcs->tx_ptr + mcs->tx_off, mcs->tx_sz - mcs->tx_off)) < 0) {
 			return -1;
-		} else {
-			zlog_info("[%s] Connection re-established successfully!\n",atag->sname);
 		}
+		if(!tx_len) break;
+
+		mcs->tx_off += tx_len;
+		if(mcs->tx_off == mcs->tx_sz) mcs->tx_ptr = NULL;
 	}
 
-	if(mc_batch_read(devname, atag, &zword, 1) != 1) {
-		zlog_error("mc_readword(): batch read failed.\n");
-		return -1;
+	return 0;
+}
+
+// Matches a response frame to its request, and hands it over
+static void mc_conn_dispatch(ATLAS_MCS* mcs, unsigned char* rx_frame, int rx_sz) {
+	ATLAS_MC_PREQ* cur_req = NULL;
+	unsigned short serial;
+	int slot = -1;
+
+	zlog_debug("mc_request(): Got %i bytes!\n",rx_sz);
+
+	if(rx_frame[0] == MC_4E_RSP_SIG) {
+		// 4E responses may come back in any order
+		serial = rx_frame[2] | (rx_frame[3] << 8);
+		for(int i = 0; i < mcs->q_inflight_count; i++) {
+			if(mcs->q_inflight[i]->serial == serial) {
+				slot = i;
+				break;
+			}
+		}
+		if(slot == -1) {
+			// response to a request we've given up on; drop it
+			zlog_warn("mc_request(): [%s:%u] Discarding response with unknown serial %hu\n",mcs->ip_addr,mcs->port_num,serial);
+			return;
+		}
+	} else if(mcs->q_inflight_count) {
+		slot = 0;
+	} else {
+		zlog_warn("mc_request(): [%s:%u] Discarding unexpected response\n",mcs->ip_addr,mcs->port_num);
+		return;
 	}
 
-	// perform conversion from word (unsigned short) to dword (int)
-	iword = zword;
+	cur_req = mcs->q_inflight[slot];
+	cur_req->result = mc_frame_parse(cur_req->atag, rx_frame, rx_sz, cur_req);
+	cur_req->inflight = 0;
 
-	return &iword;
+	// keep the remaining requests in the order they were sent
+	mcs->q_inflight_count--;
+	memmove(&mcs->q_inflight[slot], &mcs->q_inflight[slot + 1], sizeof(ATLAS_MC_PREQ*) * (mcs->q_inflight_count - slot));
 }
 
-int mc_readbit(char *devname, ATLAS_TARGET* atag) {
-	int outbit;
-	int* xword;
+/*
+ * mc_conn_rx
+ *	Receives whatever the socket has, and dispatches each complete frame.
+ *	Returns:
+ *		0 on success, -1 on communication failure
+ */
+static int mc_conn_rx(ATLAS_MCS* mcs) {
+	unsigned char* rx_frame;
+	int rx_sz;
+	int rx_len;
+
+	do {
+		if((rx_len = atlas_framer_fill(&mcs->rx, mcs->sock_fd)) < 0) return -1;
+
+		while((rx_frame = atlas_framer_peek(&mcs->rx, &rx_sz))) {
+			mc_conn_dispatch(mcs, rx_frame, rx_sz);
+			atlas_framer_consume(&mcs->rx, rx_sz);
+		}
+		if(mcs->rx.error) return -1;
+	} while(rx_len > 0);
+
+	return 0;
+}
 
-	if((xword = mc_readword(devname, atag)) == -1) {
+/*
+ * mc_conn_update
+ *	Sets what the event loop waits for on the connection: its responses,
+ *	until the earliest in-flight request's deadline, and room to send if a
+ *	frame is part way out.
+ *	Returns:
+ *		1 if the connection is idle, 0 otherwise
+ */
+static int mc_conn_update(ATLAS_MCS* mcs) {
+	long long deadline = 0;
+
+	if(!mcs->q_head && !mcs->q_inflight_count && !mcs->tx_ptr) {
+		atlas_evloop_watch(mcs, 0);
+		return 1;
+	}
+
+	for(int i = 0; i < mcs->q_inflight_count; i++) {
+		if(!deadline || mcs->q_inflight[i]->deadline < deadline) deadline = mcs->q_inflight[i]->deadline;
+	}
+	mcs->ev_deadline = deadline;
+
+	if(atlas_evloop_watch(mcs, EPOLLIN | (mcs->tx_ptr ? EPOLLOUT : 0))) {
+		mc_conn_fail(mcs, "Unable to wait for connection!");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * mc_conn_event
+ *	Event loop handler for MC connections (ATLAS_MCS.ev_handler). Takes in
+ *	responses as they arrive, and sends further requests as the window opens.
+ *	Returns:
+ *		1 once the connection has nothing left in flight or queued
+ */
+static int mc_conn_event(ATLAS_MCS* mcs, int events) {
+
+	if(!events) {
+		mc_conn_fail(mcs, "Response timed out!");
+		return 1;
+	}
+
+	if(events & EPOLLIN) {
+		if(mc_conn_rx(mcs)) {
+			mc_conn_fail(mcs, "No data received!");
+			return 1;
+		}
+	} else if(events & (EPOLLERR | EPOLLHUP)) {
+		mc_conn_fail(mcs, "Connection lost!");
+		return 1;
+	}
+
+	if(mc_conn_tx(mcs)) {
+		mc_conn_fail(mcs, "Data send error!");
+		return 1;
+	}
+
+	return mc_conn_update(mcs);
+}
+
+/*
+ * mc_queue
+ *	Queues a list of MC requests on the target's connection, and starts
+ *	sending them. The rest is done by the event loop (see atlas_evloop_run()),
+ *	which keeps up to mc_window() requests in flight on each connection. 4E
+ *	responses are matched back to their requests by serial number, so they
+ *	may complete in any order. A request which gets no response within
+ *	global_config.mc_timeout fails the whole connection, as the stream is
+ *	then out of step.
+ *	Args:
+ *		atag*			Target to send requests to
+ *		reqs*			Array of requests; must stay put until they complete
+ *		req_count		Number of requests in array
+ *	Returns:
+ *		0 on success, -1 on communication failure
+ */
+int mc_queue(ATLAS_TARGET* atag, ATLAS_MC_PREQ* reqs, int req_count) {
+	ATLAS_MCS* mcs = atag->mc_session;
+
+	for(int i = 0; i < req_count; i++) {
+		reqs[i].atag = atag;
+		reqs[i].q_next = (i + 1 < req_count) ? &reqs[i + 1] : NULL;
+		reqs[i].inflight = 0;
+		reqs[i].lost = 0;
+		reqs[i].responded = 0;
+		reqs[i].complete_code = 0;
+		reqs[i].result = 0;
+	}
+
+	if(!mcs || (!atag->mc_station_ok && mc_compile_station(atag))) {
+		zlog_error("mc_queue(): [%s] No session!\n",atag->sname);
+		for(int i = 0; i < req_count; i++) reqs[i].lost = 1;
 		return -1;
 	}
-	
-	outbit = (*xword) & 0x0001;
 
-	return outbit;
-}
\ No newline at end of file
+	if(!req_count) return 0;
+
+	if(mcs->q_tail) mcs->q_tail->q_next = &reqs[0];
+	else            mcs->q_head = &reqs[0];
+	mcs->q_tail = &reqs[req_count - 1];
+	mcs->ev_handler = mc_conn_event;
+
+	if(mc_conn_tx(mcs)) {
+		mc_conn_fail(mcs, "Data send error!");
+		return -1;
+	}
+	mc_conn_update(mcs);
+
+	return 0;
+}
+
+/*
+ * mc_batch_read_dev
+ *	Batch Read [0401] of seq points, starting at the head device.
+ *	In word units [0000], outbuf receives seq words. In bit units [0001], outbuf
+ *	receives the points nibble-packed, two per byte (see MC_BIT_NIBBLE()).
+ *	Returns:
+ *		Number of points read, 0 on communication failure, or -1 on abnormal completion
+ */
+int mc_batch_read_dev(ATLAS_TARGET* atag, unsigned char dev_code, int head_dev, void* outbuf, unsigned short seq, int bitunits) {
+	unsigned char read_req[6];
+	char devname[32];
+	int rez_datalen;
+
+	// Device name, for messages
+	sprintf(devname,"%s%i",mc_get_dev_from_val(dev_code),head_dev);
+
+	// Setup command area (read request): head device (24-bit), device code, number of points
+	read_req[0] = head_dev & 0xFF;
+	read_req[1] = (head_dev >> 8) & 0xFF;
+	read_req[2] = (head_dev >> 16) & 0xFF;
+	read_req[3] = dev_code;
+	read_req[4] = seq & 0xFF;
+	read_req[5] = (seq >> 8) & 0xFF;
+
+	// Batch Read, response data type = Word [0000] or Point [0001]
+	if(bitunits) {
+		if((rez_datalen = mc_request(atag, 0x0401, 0x0001, read_req, sizeof(read_req), outbuf, (seq + 1) / 2, devname)) <= 0) {
+			return rez_datalen;
+		}
+
+		zlog_debug("mc_batch_read(): Char data len = %u bytes (%i points).\n",rez_datalen, seq);
+		return (rez_datalen == (seq + 1) / 2) ? seq : 0;
+	}
+
+	if((rez_datalen = mc_request(atag, 0x0401, 0x0000, read_req, sizeof(read_req), outbuf, seq * 2, devname)) <= 0) {
+		return rez_datalen;
+	}
+
+	zlog_debug("mc_batch_read(): Char data len = %u bytes (%i words).\n",rez_datalen, rez_datalen / 2);
+
+	return rez_datalen / 2;
+}
+
+// Fails a single read straight away if the target isn't connected (see atlas_rcx.c)
+static int mc_read_ready(ATLAS_TARGET* atag, ATLAS_RSTATUS* rst) {
+
+	if(atag->status == STATUS_READY) return 0;
+
+	zlog_debug("[%s] Target not ready!\n",atag->sname);
+	rst->code = RSTAT_NOTREADY;
+	atag->last_rstat = rst->code;
+	return -1;
+}
+
+// Fills in a single read's status, from the result of mc_batch_read()
+static int mc_read_result(ATLAS_TARGET* atag, ATLAS_RSTATUS* rst, int rez, char* fname) {
+
+	if(rez == 1) {
+		rst->code = RSTAT_OK;
+		return 0;
+	}
+
+	zlog_error("%s(): batch read failed.\n",fname);
+	rst->code = (atag->status == STATUS_READY) ? RSTAT_PROTO : RSTAT_COMFAIL;
+	atag->last_rstat = rst->code;
+	return -1;
+}
+
+/*
+ * mc_readword
+ *	Reads a single word device.
+ *	Args:
+ *		devname = device name (eg. "D100")
+ *		val* = filled in with the value read
+ *		rst* = filled in with the outcome of the read
+ *	Returns:
+ *		0 on success, -1 on failure (see rst->code)
+ */
+int mc_readword(ATLAS_TARGET* atag, char* devname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+	unsigned short zword = 0;
+
+	memset(val,0,sizeof(ATLAS_VALUE));
+	memset(rst,0,sizeof(ATLAS_RSTATUS));
+
+	if(mc_read_ready(atag, rst)) return -1;
+
+	if(mc_read_result(atag, rst, mc_batch_read(devname, atag, &zword, 1, 0), "mc_readword")) return -1;
+
+	// perform conversion from word (unsigned short) to dword (int)
+	val->dtype = DTYPE_RET_INT;
+	val->v_int = zword;
+	val->v_float = (float)zword;
+
+	return 0;
+}
+
+/*
+ * mc_readbit
+ *	Reads a single bit device.
+ *	Args:
+ *		devname = device name (eg. "M100")
+ *		val* = filled in with the value read
+ *		rst* = filled in with the outcome of the read
+ *	Returns:
+ *		0 on success, -1 on failure (see rst->code)
+ */
+int mc_readbit(ATLAS_TARGET* atag, char* devname, ATLAS_VALUE* val, ATLAS_RSTATUS* rst) {
+	unsigned char zbits = 0;
+
+	memset(val,0,sizeof(ATLAS_VALUE));
+	memset(rst,0,sizeof(ATLAS_RSTATUS));
+
+	if(mc_read_ready(atag, rst)) return -1;
+
+	// read a single point in bit units
+	if(mc_read_result(atag, rst, mc_batch_read(devname, atag, &zbits, 1, 1), "mc_readbit")) return -1;
+
+	val->dtype = DTYPE_RET_BOOL;
+	val->v_int = MC_BIT_NIBBLE(&zbits, 0);
+	val->v_float = (float)val->v_int;
+
+	return 0;
+}
+
+// Driver descriptor (see atlas_driver.c)
+ATLAS_DRIVER mc_driver = {
+	ATLAS_DRIVER_API, "melsec_mc", DCAP_BATCH | DCAP_EVLOOP | DCAP_SHARE,
+	mc_start,
+	mc_stop,
+	mc_compile_tag,
+	mc_tagset_plan,
+	mc_tagset_free,
+	mc_tagset_read,
+	mc_tagset_done,
+	NULL
+};
@@ -17,11 +17,14 @@
 	[jp] SH-08003-V      - http://www.mitsubishielectric.co.jp/
 
 	* Protocol Type 3E (binary) QnA compatible framing
+	* Protocol Type 4E (binary) framing, with serial numbers
 
 */
 
 #define MC_3E_REQ_SIG				0x50
 #define MC_3E_RSP_SIG				0xD0
+#define MC_4E_REQ_SIG				0x54
+#define MC_4E_RSP_SIG				0xD4
 
 #define MC_DEFAULT_NETWORK			0x00
 #define MC_DEFAULT_PC				0xFF
@@ -29,6 +32,34 @@
 #define MC_DEFAULT_MODULE_STATION	0x00
 
 #define MC_3E_HEADER_SZ				9
+#define MC_3E_RSP_HEADER_SZ			11	// response header, including completion code
+#define MC_4E_EXTRA_SZ				4	// 4E adds a serial number and 2 reserved bytes after the subheader
+#define MC_4E_HEADER_SZ				(MC_3E_HEADER_SZ + MC_4E_EXTRA_SZ)
+
+#define MC_RSP_MAX_SZ				2048	// largest response frame (4E header + 960 words)
+#define MC_REQ_FIXED_SZ				15	// request header, monitor timer, command & subcommand
+#define MC_REQ_MAX_DATA				1024	// max request data following the subcommand
+
+// Per-frame limits (Q/L series, binary)
+#define MC_BATCH_MAX_WORDS			960	// max points for Batch Read [0401] in word units
+#define MC_BATCH_MAX_BITS			3584	// max points for Batch Read [0401] in bit units
+#define MC_RANDOM_MAX_POINTS		192	// max word + dword points for Random Read [0403]
+#define MC_MBLOCK_MAX_BLOCKS		120	// max word + bit device blocks for Multiple Block Batch Read [0406]
+#define MC_MBLOCK_MAX_POINTS		960	// max total points for Multiple Block Batch Read [0406]
+
+// Read planner cost model
+// An extra request costs one network round trip (global_config.mc_rtt_cost, expressed as an
+// equivalent number of data bytes) plus the request and response headers. Gaps between tags
+// are read through (and discarded) whenever doing so is cheaper than another request.
+#define MC_PLAN_FRAME_OVERHEAD		(MC_3E_HEADER_SZ + 12 + MC_3E_RSP_HEADER_SZ)
+
+// Device flags (ATLAS_REGMAP.dflags)
+#define MC_DEVF_WORD				0	// word device
+#define MC_DEVF_BIT					1	// bit device (device number counts bits)
+#define MC_DEVF_BITUNIT				2	// planned in bit units (bool tags on bit devices)
+
+// Bit unit response data is nibble-packed: the high nibble holds the first point of each pair
+#define MC_BIT_NIBBLE(buf,n)		((((unsigned char*)(buf))[(n) >> 1] >> (((n) & 1) ? 0 : 4)) & 0x01)
 
 /*
 	subheader		2 bytes \
@@ -86,8 +117,97 @@ typedef struct {
 typedef struct {
 	unsigned char bval;
 	char cval[3];
+	unsigned char dflags;
 } ATLAS_REGMAP;
 
+// Read plan - one entry per planned tag
+typedef struct {
+	ATLAS_TAG* tag;				// tag to receive the value
+	int tag_index;				// index of the tag in the taglist the plan was built from
+	unsigned char dev_code;			// device type code
+	unsigned char dflags;			// device flags (MC_DEVF_*)
+	int dev_num;				// device number
+	unsigned short width;			// number of words occupied by the tag's value
+	unsigned short offset;			// offset of the value from the head of its block (words, or points in bit units)
+} ATLAS_MC_PTAG;
+
+// Read plan - one entry per contiguous run of device points
+typedef struct {
+	unsigned char dev_code;			// head device type code
+	unsigned char dflags;			// device flags (MC_DEVF_*)
+	int head_dev;				// head device number
+	unsigned short num_points;		// number of device points (words, or bits in bit units)
+	unsigned short data_offset;		// word offset of the block within the frame's response data
+	int ptag_first;				// index of first ATLAS_MC_PTAG in this block
+	int ptag_count;				// number of ATLAS_MC_PTAGs in this block
+} ATLAS_MC_BLOCK;
+
+// Read plan - one entry per request frame
+typedef struct {
+	unsigned short command;			// 0401 = Batch Read, 0403 = Random Read, 0406 = Multiple Block Batch Read, 0802 = Monitor
+	unsigned short subcommand;		// subcommand
+	int block_first;			// index of first ATLAS_MC_BLOCK serviced by this frame
+	int block_count;			// number of ATLAS_MC_BLOCKs serviced by this frame
+	unsigned short word_count;		// [0403] word access points, [0406] word device blocks
+	unsigned short dword_count;		// [0403] double word access points, [0406] bit device blocks
+	unsigned short points;			// number of points in the response data (words, or bits in bit units)
+	int tx_sz;				// request size, in bytes
+	int rx_sz;				// response size, in bytes
+} ATLAS_MC_FRAME;
+
+// Read plan for a target's tag list
+struct sATLAS_MC_PLAN {
+	ATLAS_MC_PTAG* ptags;			// planned tags, sorted by device code & number
+	int ptag_count;
+	ATLAS_MC_BLOCK* blocks;			// contiguous runs, in frame order
+	int block_count;
+	ATLAS_MC_FRAME* frames;			// request frames
+	int frame_count;
+	int tag_count;				// number of tags the plan was built from
+	int points;				// total device points requested
+	int tx_bytes;				// total request bytes per cycle
+	int rx_bytes;				// total response bytes per cycle
+	unsigned int tag_sig;			// signature of the taglist the plan was built from
+	int monitor_frame;			// index of the Monitor [0802] frame, or -1 if none
+	struct sATLAS_MC_PREQ* reqs;		// one request per frame, with its pre-serialized wire bytes (see mc_plan_serialize())
+	unsigned char* wire;			// wire bytes for all frames
+	int queued;				// 1 while reqs are queued on the connection (see mc_plan_start())
+	unsigned char* monitor_wire;		// monitor frame's wire bytes, while it falls back to Random Read
+	unsigned char monitor_fallback[MC_REQ_MAX_DATA];	// Random Read request data for the fallback
+};
+
+// Pipelined request - see mc_queue() & mc_request_pipeline()
+typedef struct sATLAS_MC_PREQ {
+	unsigned short command;			// command
+	unsigned short subcommand;		// subcommand
+	unsigned char* reqdata;			// request data (follows the subcommand)
+	int reqdata_sz;				// size of request data, in bytes
+	unsigned char* wire;			// pre-serialized frame (see mc_frame_build()); used instead of command & reqdata when set
+	int wire_sz;				// size of wire, in bytes
+	void* outbuf;				// buffer to receive response data
+	int outbuf_sz;				// size of outbuf, in bytes
+	void (*on_data)(struct sATLAS_MC_PREQ* req, unsigned char* data, int data_sz);	// receives response data in place, instead of outbuf
+	void* cb_arg;				// for on_data
+	int cb_index;				// for on_data
+	char desc[64];				// description, for messages
+	ATLAS_TARGET* atag;			// target the request was queued for
+	struct sATLAS_MC_PREQ* q_next;		// next request waiting to be sent on the connection
+	long long deadline;			// when the response is due (monotonic ms, see atlas_evloop_now())
+	unsigned short serial;			// 4E serial number the request was sent with
+	int inflight;				// 1 while sent and awaiting a response
+	int lost;				// 1 if the connection failed before the response arrived
+	int responded;				// 1 once a well-formed response has been received
+	unsigned short complete_code;		// completion code of the response
+	int result;				// as for mc_request(): data bytes, 0 = comm failure, -1 = abnormal completion
+} ATLAS_MC_PREQ;
+
+int mc_request_pipeline(ATLAS_TARGET* atag, ATLAS_MC_PREQ* reqs, int req_count);
+int mc_queue(ATLAS_TARGET* atag, ATLAS_MC_PREQ* reqs, int req_count);
+int mc_queue_results(ATLAS_MC_PREQ* reqs, int req_count);
+int mc_frame_build(ATLAS_TARGET* atag, unsigned short serial, unsigned short command, unsigned short subcommand, unsigned char* reqdata, int reqdata_sz, unsigned char* tx_buf);
+int mc_window(ATLAS_TARGET* atag);
+int mc_frame_len(unsigned char* data, int avail);
+
 typedef struct {
 	unsigned short errval;
 	char errdesc[128];
@@ -97,34 +217,34 @@ typedef struct {
 
 // Mapping of register types from ASCII to binary codes used by MC Protocol
 ATLAS_REGMAP regmap[] =	{
-				{ 0x91, "SM" },
-				{ 0xA9, "SD" },
-				{ 0x9C, "X"  },
-				{ 0x9D, "Y"  },
-				{ 0x90, "M"  },
-				{ 0x92, "L"  },
-				{ 0x93, "F"  },
-				{ 0x94, "V"  },
-				{ 0xA0, "B"  },
-				{ 0xA8, "D"  },
-				{ 0xB4, "W"  },
-				{ 0xC1, "TS" },
-				{ 0xC0, "TC" },
-				{ 0xC7, "SS" },
-				{ 0xC6, "SC" },
-				{ 0xC8, "SN" },
-				{ 0xC4, "CS" },
-				{ 0xC3, "CC" },
-				{ 0xC5, "CN" },
-				{ 0xA1, "SB" },
-				{ 0xB5, "SW" },
-				{ 0x98, "S"  },
-				{ 0xA2, "DX" },
-				{ 0xA3, "DY" },
-				{ 0xCC, "Z"  },
-				{ 0xAF, "R"  },
-				{ 0xB0, "ZR" },
-				{ NULL, NULL }
+				{ 0x91, "SM", MC_DEVF_BIT  },
+				{ 0xA9, "SD", MC_DEVF_WORD },
+				{ 0x9C, "X",  MC_DEVF_BIT  },
+				{ 0x9D, "Y",  MC_DEVF_BIT  },
+				{ 0x90, "M",  MC_DEVF_BIT  },
+				{ 0x92, "L",  MC_DEVF_BIT  },
+				{ 0x93, "F",  MC_DEVF_BIT  },
+				{ 0x94, "V",  MC_DEVF_BIT  },
+				{ 0xA0, "B",  MC_DEVF_BIT  },
+				{ 0xA8, "D",  MC_DEVF_WORD },
+				{ 0xB4, "W",  MC_DEVF_WORD },
+				{ 0xC1, "TS", MC_DEVF_BIT  },
+				{ 0xC0, "TC", MC_DEVF_BIT  },
+				{ 0xC7, "SS", MC_DEVF_BIT  },
+				{ 0xC6, "SC", MC_DEVF_BIT  },
+				{ 0xC8, "SN", MC_DEVF_WORD },
+				{ 0xC4, "CS", MC_DEVF_BIT  },
+				{ 0xC3, "CC", MC_DEVF_BIT  },
+				{ 0xC5, "CN", MC_DEVF_WORD },
+				{ 0xA1, "SB", MC_DEVF_BIT  },
+				{ 0xB5, "SW", MC_DEVF_WORD },
+				{ 0x98, "S",  MC_DEVF_BIT  },
+				{ 0xA2, "DX", MC_DEVF_BIT  },
+				{ 0xA3, "DY", MC_DEVF_BIT  },
+				{ 0xCC, "Z",  MC_DEVF_WORD },
+				{ 0xAF, "R",  MC_DEVF_WORD },
+				{ 0xB0, "ZR", MC_DEVF_WORD },
+				{ NULL, NULL, 0 }
 			};
 
 // Error code to Error message mapping
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include "atlas_daq.h"
 
 /********************************************************************
@@ -35,8 +36,10 @@ int mgmtcb_status(char* cargs, int argcnt) {
 
 int mgmtcb_reload(char* cargs, int argcnt) {
 	ATLS_DEBUG_LOGFUNC();
+	// reloads every target's tag & alarm lists (see atlas_tagcache.c); the target list itself is read at startup
+	zlog_debug("mgmtcb_reload(): Reloading tag & alarm configuration from the next round...\n");
+	atlas_tagcache_reload();
 	AMF_printf("%s EXEC OK\n\n",__func__);
-	//zlog_debug("mgmtcb_reload(): Dropping all connections and reloading target & tag information...\n");
 	return 0;
 }
 
@@ -51,3 +54,96 @@ int mgmtcb_tag_add(char* cargs, int argcnt) {
 	AMF_printf("%s EXEC OK\n\n",__func__);
 	return 0;
 }
+
+int mgmtcb_mc_plan(char* cargs, int argcnt) {
+	ATLAS_TAG* tags;
+	ATLAS_TAG** taglist;
+	ATLAS_MC_PLAN* plan;
+	int tag_count;
+
+	ATLS_DEBUG_LOGFUNC();
+
+	// Print the read plan for each MC target (or only the target named by the first argument)
+	for(int tgi = 0; tgi < atx_targets; tgi++) {
+		if(atx_tgdex[tgi]->target_type != TARGET_MC) continue;
+		if(argcnt && cargs && cargs[0] && strcmp(cargs, atx_tgdex[tgi]->sname)) continue;
+
+		if((tag_count = atlas_load_tags(global_db, atx_tgdex[tgi], &tags)) < 0) {
+			AMF_printf("[%s] Failed to retrieve tag list!\n",atx_tgdex[tgi]->sname);
+			continue;
+		}
+
+		if((taglist = malloc(sizeof(ATLAS_TAG*) * (tag_count ? tag_count : 1))) == NULL) {
+			free(tags);
+			return -1;
+		}
+		for(int i = 0; i < tag_count; i++) taglist[i] = &tags[i];
+
+		if((plan = mc_plan_build(atx_tgdex[tgi], taglist, tag_count)) != NULL) {
+			mc_plan_print(atx_tgdex[tgi], plan);
+			mc_plan_free(plan);
+		}
+
+		free(taglist);
+		free(tags);
+	}
+
+	AMF_printf("%s EXEC OK\n\n",__func__);
+	return 0;
+}
+
+int mgmtcb_writers(char* cargs, int argcnt) {
+	ATLAS_WRITER_STATS st;
+	ATLAS_CVT_STATS cst;
+
+	ATLS_DEBUG_LOGFUNC();
+
+	// Print each persistence writer's ring depth, counters & lag, and its spool
+	if(!atlas_writer_count()) AMF_printf("No persistence writers; values are written from the main thread.\n");
+	for(int i = 0; atlas_writer_stats(i, &st) == 0; i++) {
+		AMF_printf("writer %i: depth %i/%i written %llu dropped %llu waits %llu lag %lli ms db %s\n",
+			   i, st.depth, st.ring_size, st.written, st.dropped, st.waits, st.lag_ms,
+			   st.db_status == STATUS_READY ? "ready" : "not ready");
+		if(st.spooled || st.spool_bytes) {
+			AMF_printf("writer %i: spool %lli samples (%lli KB) oldest %lli s ago, replaying %i/s\n",
+				   i, st.spooled, st.spool_bytes / 1024, st.spool_oldest ? (long long)(time(NULL) - st.spool_oldest) : 0LL, st.replay_rate);
+		}
+	}
+
+	// and the current-value table's realtime flusher
+	if(!atlas_cvt_stats(&cst)) {
+		AMF_printf("realtime: %i/%i tags, %i changed since the last flush; %llu changes, %llu rows written in %llu flushes (last %lli ms) db %s%s\n",
+			   cst.slots, cst.size, cst.dirty, cst.changes, cst.written, cst.flushes, cst.flush_ms,
+			   cst.db_status == STATUS_READY ? "ready" : "not ready", cst.shared ? ", shared as " : "", cst.shared ? global_config.cvt_shm : "");
+	}
+
+	AMF_printf("%s EXEC OK\n\n",__func__);
+	return 0;
+}
+
+int mgmtcb_compression(char* cargs, int argcnt) {
+	ATLAS_TARGET* cur_target;
+	ATLAS_COMP* comp;
+
+	ATLS_DEBUG_LOGFUNC();
+
+	// Print each target's history compression ratio (and each tag's, for the target named by the first argument)
+	for(int tgi = 0; tgi < atx_targets; tgi++) {
+		cur_target = atx_tgdex[tgi];
+		if(argcnt && cargs && cargs[0] && strcmp(cargs, cur_target->sname)) continue;
+
+		AMF_printf("[%s] %llu values read, %llu written to history, ratio %.1f:1\n",cur_target->sname,
+			   cur_target->comp_in, cur_target->comp_out, cur_target->comp_out ? (double)cur_target->comp_in / cur_target->comp_out : 0.0);
+		if(!argcnt || !cargs || !cargs[0]) continue;
+
+		for(int i = 0; i < cur_target->cfg_tag_count; i++) {
+			comp = &cur_target->cfg_tags[i].comp;
+			AMF_printf("[%s] %-32s %-9s dev %g max %llis: %llu read, %llu written, ratio %.1f:1\n",cur_target->sname,
+				   cur_target->cfg_tags[i].tagname, comp->mode == COMP_DEADBAND ? "deadband" : comp->mode == COMP_SWINGDOOR ? "swingdoor" : "none",
+				   comp->dev, comp->max_ms / 1000, comp->in, comp->out, comp->out ? (double)comp->in / comp->out : 0.0);
+		}
+	}
+
+	AMF_printf("%s EXEC OK\n\n",__func__);
+	return 0;
+}
@@ -50,6 +50,9 @@ ATLAS_MGMT_CMD mgmt_cmddex[] = {
 	{"reload",			MGMTC_NORMAL,				&mgmtcb_reload },
 	{"tag_read",		MGMTC_NORMAL,				&mgmtcb_tag_read },
 	{"tag_add",			MGMTC_NORMAL,				&mgmtcb_tag_add },
+	{"mc_plan",			MGMTC_NORMAL,				&mgmtcb_mc_plan },
+	{"writers",			MGMTC_NOARGS,				&mgmtcb_writers },
+	{"compression",		MGMTC_NORMAL,				&mgmtcb_compression },
 	{NULL, 0, NULL}
 };
 